@@ -0,0 +1,715 @@
+#pragma once
+
+#include "data_types.h"
+#include "geometry_codec.h"
+#include "ktx2_file.h"
+#include "mesh_optimizer.h"
+#include "obj_parser.h"
+#include "progressive_mesh.h"
+#include "texture_compression.h"
+#include "texture_cubemap.h"
+#include "texture_decoder.h"
+#include "texture_mips.h"
+#include "texture_procedural.h"
+#include "vertex_weld.h"
+
+#include "includeLibs/stb_image.h"
+
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+/**
+ * Offline benchmarks of the asset pipeline, started with command line flags
+ * instead of the renderer (see main()). They don't need a window or a Vulkan
+ * device.
+ * */
+
+/// best wall clock time of runs calls to f in milliseconds
+template <typename F>
+static double
+benchmarkMilliseconds(int runs, F &&f)
+{
+    double best = 0.0;
+    for (int run = 0; run < runs; run++)
+    {
+        auto start = std::chrono::high_resolution_clock::now();
+        f();
+        double elapsed = std::chrono::duration<double, std::milli>(
+                             std::chrono::high_resolution_clock::now() - start)
+                             .count();
+        best = run == 0 ? elapsed : std::min(best, elapsed);
+    }
+    return best;
+}
+
+/**
+ * Triangulated latitude/longitude sphere like the ones exported from
+ * Blender: the poles and the seam share positions but have their own uvs.
+ * Roughly 2 * rings * segments triangles.
+ * */
+static void
+makeSyntheticSphereObj(uint32_t rings,
+                       uint32_t segments,
+                       tinyobj::attrib_t &attrib,
+                       std::vector<tinyobj::shape_t> &shapes)
+{
+    const float pi = 3.14159265358979f;
+    attrib = tinyobj::attrib_t();
+    shapes.assign(1, tinyobj::shape_t());
+
+    // position index of ring r (0 and rings are the poles) and segment s
+    auto positionIndex = [&](uint32_t r, uint32_t s) -> int {
+        if (r == 0)
+        {
+            return 0;
+        }
+        if (r == rings)
+        {
+            return 1;
+        }
+        return static_cast<int>(2 + (r - 1) * segments + s % segments);
+    };
+
+    attrib.vertices.insert(attrib.vertices.end(), {0.0f, 1.0f, 0.0f});
+    attrib.vertices.insert(attrib.vertices.end(), {0.0f, -1.0f, 0.0f});
+    for (uint32_t r = 1; r < rings; r++)
+    {
+        float theta = pi * r / rings;
+        for (uint32_t s = 0; s < segments; s++)
+        {
+            float phi = 2.0f * pi * s / segments;
+            attrib.vertices.insert(attrib.vertices.end(),
+                                   {std::sin(theta) * std::cos(phi),
+                                    std::cos(theta),
+                                    std::sin(theta) * std::sin(phi)});
+        }
+    }
+    for (uint32_t r = 0; r <= rings; r++)
+    {
+        for (uint32_t s = 0; s <= segments; s++)
+        {
+            attrib.texcoords.insert(
+                attrib.texcoords.end(),
+                {float(s) / segments, 1.0f - float(r) / rings});
+        }
+    }
+
+    auto corner = [&](uint32_t r, uint32_t s) {
+        tinyobj::index_t index;
+        index.vertex_index = positionIndex(r, s);
+        index.texcoord_index = static_cast<int>(r * (segments + 1) + s);
+        index.normal_index = -1;
+        return index;
+    };
+
+    auto &indices = shapes.front().mesh.indices;
+    indices.reserve(size_t(rings) * segments * 6);
+    for (uint32_t r = 0; r < rings; r++)
+    {
+        for (uint32_t s = 0; s < segments; s++)
+        {
+            indices.insert(
+                indices.end(),
+                {corner(r, s), corner(r + 1, s), corner(r + 1, s + 1)});
+            indices.insert(
+                indices.end(),
+                {corner(r, s), corner(r + 1, s + 1), corner(r, s + 1)});
+        }
+    }
+}
+
+static void
+benchmarkVertexWeldMesh(const std::string &name,
+                        const tinyobj::attrib_t &attrib,
+                        const std::vector<tinyobj::shape_t> &shapes)
+{
+    size_t cornerCount = 0;
+    for (const auto &shape : shapes)
+    {
+        cornerCount += shape.mesh.indices.size();
+    }
+    const int runs = cornerCount < 1000000 ? 5 : 1;
+
+    std::vector<Vertex> hashVertices, sortVertices;
+    std::vector<uint32_t> hashIndices, sortIndices;
+    double hashMs = benchmarkMilliseconds(runs, [&] {
+        hashVertices.clear();
+        hashIndices.clear();
+        weldVerticesHashMap(attrib, shapes, hashVertices, hashIndices);
+    });
+    double sortMs = benchmarkMilliseconds(runs, [&] {
+        weldVerticesSorted(attrib, shapes, sortVertices, sortIndices);
+    });
+
+    bool identical
+        = hashIndices == sortIndices
+          && hashVertices.size() == sortVertices.size()
+          && memcmp(hashVertices.data(),
+                    sortVertices.data(),
+                    hashVertices.size() * sizeof(Vertex))
+                 == 0;
+
+    std::cout << std::left << std::setw(24) << name << std::right
+              << std::setw(10) << cornerCount / 3 << " triangles "
+              << std::setw(10) << sortVertices.size() << " vertices"
+              << std::fixed << std::setprecision(1) << "  hash map "
+              << std::setw(8) << hashMs << " ms  radix sort " << std::setw(8)
+              << sortMs << " ms  " << std::setprecision(2) << hashMs / sortMs
+              << "x" << (identical ? "" : "  OUTPUT DIFFERS") << std::endl;
+}
+
+/**
+ * --bench-weld: unordered_map welding against weldVerticesSorted() on the
+ * planet models and a synthetic 5M triangle sphere
+ * */
+static int
+benchmarkVertexWeld()
+{
+    std::cout << "vertex welding, " << sharedThreadPool().threadCount()
+              << " threads" << std::endl;
+
+    for (Model model : {Model::Earth3Dv3, Model::Moon})
+    {
+        const std::string &modelPath = modelMap.at(model);
+        tinyobj::attrib_t attrib;
+        std::vector<tinyobj::shape_t> shapes;
+        std::string warn, err;
+        if (not loadObjParallel(
+                &attrib, &shapes, &warn, &err, modelPath.c_str()))
+        {
+            std::cerr << warn << err << std::endl;
+            return EXIT_FAILURE;
+        }
+        benchmarkVertexWeldMesh(modelPath, attrib, shapes);
+    }
+
+    tinyobj::attrib_t attrib;
+    std::vector<tinyobj::shape_t> shapes;
+    makeSyntheticSphereObj(1250, 2000, attrib, shapes);
+    benchmarkVertexWeldMesh("synthetic sphere", attrib, shapes);
+
+    return EXIT_SUCCESS;
+}
+
+/**
+ * --bench-optimize: vertex cache statistics of the welded planet models
+ * before and after optimizeMesh()
+ * */
+static int
+benchmarkMeshOptimizer()
+{
+    std::cout << "mesh optimizer, FIFO cache of " << VERTEX_CACHE_SIZE
+              << " vertices" << std::endl;
+
+    for (Model model : {Model::Earth3Dv3, Model::Moon})
+    {
+        const std::string &modelPath = modelMap.at(model);
+        tinyobj::attrib_t attrib;
+        std::vector<tinyobj::shape_t> shapes;
+        std::string warn, err;
+        if (not loadObjParallel(
+                &attrib, &shapes, &warn, &err, modelPath.c_str()))
+        {
+            std::cerr << warn << err << std::endl;
+            return EXIT_FAILURE;
+        }
+
+        std::vector<Vertex> meshVertices;
+        std::vector<uint32_t> meshIndices;
+        weldVerticesSorted(attrib, shapes, meshVertices, meshIndices);
+
+        VertexCacheStats before, after;
+        double optimizeMs = benchmarkMilliseconds(1, [&] {
+            optimizeMesh(meshVertices, meshIndices, before, after);
+        });
+
+        std::cout << std::left << std::setw(24) << modelPath << std::right
+                  << std::fixed << std::setprecision(3) << "  ACMR "
+                  << before.acmr << " -> " << after.acmr << "  ATVR "
+                  << before.atvr << " -> " << after.atvr
+                  << std::setprecision(1) << "  (" << optimizeMs << " ms)"
+                  << std::endl;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+/// decode throughput of coded in GB/s of decoded data, false on a mismatch
+static bool
+benchmarkGeometryDecode(const std::vector<uint8_t> &coded,
+                        const void *expected,
+                        size_t count,
+                        size_t elementSize,
+                        ThreadPool &pool,
+                        GeometryCodecPath path,
+                        double &gigabytesPerSecond)
+{
+    std::vector<uint8_t> decoded(count * elementSize);
+    bool valid = true;
+    double decodeMs = benchmarkMilliseconds(20, [&] {
+        valid = decodeGeometry(coded.data(),
+                               coded.size(),
+                               count,
+                               elementSize,
+                               decoded.data(),
+                               pool,
+                               path);
+    });
+    gigabytesPerSecond = decoded.size() / (decodeMs * 1e6);
+    return valid && memcmp(decoded.data(), expected, decoded.size()) == 0;
+}
+
+/**
+ * --bench-codec: compression ratio of geometry_codec.h on the cached meshes
+ * of the models and the decode throughput of every decoder the CPU supports,
+ * single threaded and on the thread pool
+ * */
+static int
+benchmarkGeometryCodec()
+{
+    std::cout << "geometry codec, best decoder "
+              << geometryCodecPathName(bestGeometryCodecPath()) << ", "
+              << sharedThreadPool().threadCount() << " threads" << std::endl;
+
+    ThreadPool singleThread(0);
+    std::vector<ThreadPool *> pools = {&singleThread};
+    if (sharedThreadPool().threadCount() > 1)
+    {
+        pools.push_back(&sharedThreadPool());
+    }
+    for (Model model : {Model::Earth3Dv3, Model::Moon, Model::VikingRoom})
+    {
+        const std::string &modelPath = modelMap.at(model);
+        tinyobj::attrib_t attrib;
+        std::vector<tinyobj::shape_t> shapes;
+        std::string warn, err;
+        if (not loadObjParallel(
+                &attrib, &shapes, &warn, &err, modelPath.c_str()))
+        {
+            std::cerr << warn << err << std::endl;
+            return EXIT_FAILURE;
+        }
+
+        // the same arrays as in the mesh cache
+        std::vector<Vertex> meshVertices;
+        std::vector<uint32_t> meshIndices;
+        weldVerticesSorted(attrib, shapes, meshVertices, meshIndices);
+        VertexCacheStats before, after;
+        optimizeMesh(meshVertices, meshIndices, before, after);
+        ProgressiveMesh mesh = buildProgressiveMesh(meshVertices.data(),
+                                                    meshVertices.size(),
+                                                    meshIndices.data(),
+                                                    meshIndices.size(),
+                                                    true);
+
+        std::vector<uint8_t> vertexData, indexData;
+        double encodeMs = benchmarkMilliseconds(1, [&] {
+            vertexData = encodeGeometry(
+                mesh.vertices.data(), mesh.vertices.size(), sizeof(Vertex));
+            indexData = encodeGeometry(
+                mesh.indices.data(), mesh.indices.size(), sizeof(uint32_t));
+        });
+        const size_t vertexBytes = mesh.vertices.size() * sizeof(Vertex);
+        const size_t indexBytes = mesh.indices.size() * sizeof(uint32_t);
+
+        std::cout << std::left << std::setw(24) << modelPath << std::right
+                  << std::fixed << std::setprecision(2) << "  vertices "
+                  << std::setw(8) << vertexBytes / 1024.0 << " KiB "
+                  << std::setw(5) << double(vertexBytes) / vertexData.size()
+                  << "x  indices " << std::setw(8) << indexBytes / 1024.0
+                  << " KiB " << std::setw(5)
+                  << double(indexBytes) / indexData.size() << "x  total "
+                  << double(vertexBytes + indexBytes)
+                         / (vertexData.size() + indexData.size())
+                  << "x" << std::setprecision(1) << "  (encode " << encodeMs
+                  << " ms)" << std::endl;
+
+        for (GeometryCodecPath path : {GeometryCodecPath::Scalar,
+                                       GeometryCodecPath::Ssse3,
+                                       GeometryCodecPath::Avx2})
+        {
+            if (not geometryCodecPathSupported(path))
+            {
+                continue;
+            }
+            for (ThreadPool *pool : pools)
+            {
+                double vertexRate, indexRate;
+                bool identical
+                    = benchmarkGeometryDecode(vertexData,
+                                              mesh.vertices.data(),
+                                              mesh.vertices.size(),
+                                              sizeof(Vertex),
+                                              *pool,
+                                              path,
+                                              vertexRate)
+                      && benchmarkGeometryDecode(indexData,
+                                                 mesh.indices.data(),
+                                                 mesh.indices.size(),
+                                                 sizeof(uint32_t),
+                                                 *pool,
+                                                 path,
+                                                 indexRate);
+
+                // a pool without workers decodes on the calling thread
+                const size_t threads = std::max<size_t>(1, pool->threadCount());
+                std::cout << "    " << std::left << std::setw(7)
+                          << geometryCodecPathName(path) << std::right
+                          << std::setw(3) << threads
+                          << " threads  decode vertices " << std::setw(6)
+                          << std::setprecision(2) << vertexRate
+                          << " GB/s  indices " << std::setw(6) << indexRate
+                          << " GB/s" << (identical ? "" : "  OUTPUT DIFFERS")
+                          << std::endl;
+            }
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
+
+/**
+ * --bench-mips: builds the mip chain of every texture in textureMap with the
+ * scalar and the SSE2 box filter and writes the mip caches, so the next start
+ * of the renderer finds them
+ * */
+static int
+benchmarkTextureMips()
+{
+    std::cout << "mip chains, " << sharedThreadPool().threadCount()
+              << " threads" << std::endl;
+
+    ThreadPool singleThread(0);
+    for (const auto &entry : textureMap)
+    {
+        const std::string &texturePath = entry.second;
+        if (isProceduralTexture(texturePath))
+        {
+            continue;
+        }
+        int width, height, channels;
+        stbi_uc *pixels = stbi_load(
+            texturePath.c_str(), &width, &height, &channels, STBI_rgb_alpha);
+        if (not pixels)
+        {
+            std::cout << std::left << std::setw(32) << texturePath
+                      << "  missing" << std::endl;
+            continue;
+        }
+
+        MipChain scalar, simd;
+        double scalarMs = benchmarkMilliseconds(3, [&] {
+            scalar = buildMipChain(pixels, width, height, singleThread, false);
+        });
+        double simdMs = benchmarkMilliseconds(3, [&] {
+            simd = buildMipChain(pixels, width, height, singleThread, true);
+        });
+        double poolMs = benchmarkMilliseconds(3, [&] {
+            simd = buildMipChain(pixels, width, height);
+        });
+        stbi_image_free(pixels);
+
+        // pavgw rounds up where the scalar filter rounds to nearest
+        int maxDifference = 0;
+        for (size_t i = 0; i < scalar.texels.size(); i++)
+        {
+            maxDifference = std::max(
+                maxDifference, std::abs(scalar.texels[i] - simd.texels[i]));
+        }
+        bool written = writeMipCache(texturePath, simd);
+
+        std::cout << std::left << std::setw(32) << texturePath << std::right
+                  << std::setw(6) << width << "x" << std::left << std::setw(6)
+                  << height << std::right << std::setw(3) << simd.levelCount
+                  << " levels" << std::fixed << std::setprecision(1)
+                  << "  scalar " << std::setw(7) << scalarMs << " ms  SSE2 "
+                  << std::setw(7) << simdMs << " ms  pool " << std::setw(7)
+                  << poolMs << " ms  max difference " << maxDifference
+                  << (written ? "" : "  CACHE NOT WRITTEN") << std::endl;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Block compression of every texture in textureMap with one thread and with
+ * the shared pool, in the format the renderer picks (BC1 for opaque, BC7
+ * otherwise). Leaves the KTX2 caches behind.
+ * */
+static int
+benchmarkTextureCompression()
+{
+    std::cout << "block compression, " << sharedThreadPool().threadCount()
+              << " threads" << std::endl;
+
+    ThreadPool singleThread(0);
+    for (const auto &entry : textureMap)
+    {
+        const std::string &texturePath = entry.second;
+        if (isProceduralTexture(texturePath))
+        {
+            continue;
+        }
+        int width, height, channels;
+        stbi_uc *pixels = stbi_load(
+            texturePath.c_str(), &width, &height, &channels, STBI_rgb_alpha);
+        if (not pixels)
+        {
+            std::cout << std::left << std::setw(32) << texturePath
+                      << "  missing" << std::endl;
+            continue;
+        }
+        MipChain chain = buildMipChain(pixels, width, height);
+        stbi_image_free(pixels);
+
+        VkFormat format = texelsOpaque(chain.texels.data(), width, height)
+                              ? VK_FORMAT_BC1_RGB_SRGB_BLOCK
+                              : VK_FORMAT_BC7_SRGB_BLOCK;
+        CompressedTexture texture;
+        double singleMs = benchmarkMilliseconds(1, [&] {
+            texture = compressMipChain(chain.texels.data(),
+                                       chain.width,
+                                       chain.height,
+                                       chain.levelCount,
+                                       format,
+                                       singleThread);
+        });
+        double poolMs = benchmarkMilliseconds(1, [&] {
+            texture = compressMipChain(chain.texels.data(),
+                                       chain.width,
+                                       chain.height,
+                                       chain.levelCount,
+                                       format);
+        });
+        bool written = writeKtx2Cache(texturePath, texture);
+
+        const char *formatName
+            = format == VK_FORMAT_BC1_RGB_SRGB_BLOCK ? " BC1 " : " BC7 ";
+        std::cout << std::left << std::setw(32) << texturePath << formatName
+                  << std::right << std::setw(6) << width << "x" << std::left
+                  << std::setw(6) << height << std::right << std::fixed
+                  << std::setprecision(1) << "  single " << std::setw(8)
+                  << singleMs << " ms  pool " << std::setw(8) << poolMs
+                  << " ms  " << std::setw(9) << chain.texels.size() / 1024
+                  << " -> " << texture.data.size() / 1024 << " KiB"
+                  << (written ? "" : "  CACHE NOT WRITTEN") << std::endl;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Decoding every texture in textureMap one after another with stbi_load and
+ * a copy into a preallocated buffer (standing in for the staging memory),
+ * each one on its own with decodeImage() (JPEGs with restart markers as
+ * strips) straight into that buffer and all of them at once with
+ * TextureDecoder.
+ * */
+static int
+benchmarkTextureDecode()
+{
+    std::cout << "texture decoding, " << sharedThreadPool().threadCount()
+              << " threads" << std::endl;
+
+    std::vector<std::string> paths;
+    for (const auto &entry : textureMap)
+    {
+        if (not isProceduralTexture(entry.second))
+        {
+            paths.push_back(entry.second);
+        }
+    }
+
+    double sequentialMs = 0.0, separateMs = 0.0;
+    for (const auto &path : paths)
+    {
+        uint32_t width, height;
+        if (not readImageExtent(path, width, height))
+        {
+            std::cout << std::left << std::setw(32) << path << "  missing"
+                      << std::endl;
+            continue;
+        }
+        std::vector<uint8_t> staging(size_t(width) * height * 4 + 1);
+
+        double stbMs = benchmarkMilliseconds(3, [&] {
+            int imageWidth, imageHeight, channels;
+            stbi_uc *pixels = stbi_load(path.c_str(),
+                                        &imageWidth,
+                                        &imageHeight,
+                                        &channels,
+                                        STBI_rgb_alpha);
+            memcpy(staging.data(), pixels, staging.size() - 1);
+            stbi_image_free(pixels);
+        });
+        DecodedImage image;
+        double decodeMs = benchmarkMilliseconds(3, [&] {
+            image = decodeImage(
+                path, sharedThreadPool(), staging.data(), staging.size());
+        });
+        sequentialMs += stbMs;
+        separateMs += decodeMs;
+
+        std::cout << std::left << std::setw(32) << path << std::right
+                  << std::setw(6) << width << "x" << std::left << std::setw(6)
+                  << height << std::right << std::fixed << std::setprecision(1)
+                  << "  stbi_load " << std::setw(7) << stbMs
+                  << " ms  decodeImage " << std::setw(7) << decodeMs << " ms  "
+                  << image.strips << " strips" << std::endl;
+    }
+
+    double batchMs = benchmarkMilliseconds(3, [&] {
+        TextureDecoder decoder;
+        for (const auto &path : paths)
+        {
+            decoder.decode(path);
+        }
+        DecodedImage image;
+        while (decoder.next(image))
+        {
+        }
+    });
+    std::cout << std::fixed << std::setprecision(1)
+              << "all textures: stbi_load " << sequentialMs
+              << " ms  decodeImage " << separateMs << " ms  TextureDecoder "
+              << batchMs << " ms" << std::endl;
+
+    return EXIT_SUCCESS;
+}
+
+/**
+ * --bench-cubemap: resamples the equirectangular texture of every sphere
+ * into a cubemap with the scalar and the SSE2 filter and compares the size
+ * of its RGBA8 mip chains with the one of the image
+ * */
+static int
+benchmarkTextureCubemap()
+{
+    std::cout << "cubemaps, " << sharedThreadPool().threadCount()
+              << " threads" << std::endl;
+
+    ThreadPool singleThread(0);
+    for (const auto &sphere : sphereMap)
+    {
+        const std::string &texturePath = textureMap.at(sphere.first);
+        if (isProceduralTexture(texturePath))
+        {
+            continue;
+        }
+        int width, height, channels;
+        stbi_uc *pixels = stbi_load(
+            texturePath.c_str(), &width, &height, &channels, STBI_rgb_alpha);
+        if (not pixels)
+        {
+            std::cout << std::left << std::setw(32) << texturePath
+                      << "  missing" << std::endl;
+            continue;
+        }
+
+        std::vector<MipChain> scalar, simd;
+        double scalarMs = benchmarkMilliseconds(1, [&] {
+            scalar
+                = resampleCubemap(pixels, width, height, singleThread, false);
+        });
+        double simdMs = benchmarkMilliseconds(1, [&] {
+            simd = resampleCubemap(pixels, width, height, singleThread, true);
+        });
+        double poolMs = benchmarkMilliseconds(1, [&] {
+            simd = resampleCubemap(pixels, width, height);
+        });
+        stbi_image_free(pixels);
+
+        // the filters round the same, only the mips may differ (pavgw)
+        int maxDifference = 0;
+        const size_t faceBytes = size_t(simd[0].width) * simd[0].height * 4;
+        for (uint32_t face = 0; face < CUBE_FACE_COUNT; face++)
+        {
+            for (size_t i = 0; i < faceBytes; i++)
+            {
+                maxDifference = std::max(maxDifference,
+                                         std::abs(scalar[face].texels[i]
+                                                  - simd[face].texels[i]));
+            }
+        }
+        const size_t equirectBytes
+            = mipLevelOffset(width, height, mipLevelCount(width, height));
+        const size_t cubemapBytes = CUBE_FACE_COUNT * simd[0].texels.size();
+
+        std::cout << std::left << std::setw(32) << texturePath << std::right
+                  << std::setw(6) << width << "x" << std::left << std::setw(6)
+                  << height << std::right << " faces " << std::setw(5)
+                  << simd[0].width << std::fixed << std::setprecision(1)
+                  << "  scalar " << std::setw(7) << scalarMs << " ms  SSE2 "
+                  << std::setw(7) << simdMs << " ms  pool " << std::setw(7)
+                  << poolMs << " ms  max difference " << maxDifference
+                  << "  memory " << std::setprecision(0)
+                  << 100.0 * cubemapBytes / equirectBytes << "%" << std::endl;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+/**
+ * --bench-surface: generates level 0 of every procedural texture in
+ * textureMap with the scalar and the SSE2 noise on one thread and on the
+ * pool, and the whole mip chain level by level
+ * */
+static int
+benchmarkProceduralSurface()
+{
+    std::cout << "procedural surfaces, " << sharedThreadPool().threadCount()
+              << " threads" << std::endl;
+
+    ThreadPool singleThread(0);
+    for (const auto &entry : textureMap)
+    {
+        const std::string &texturePath = entry.second;
+        if (not isProceduralTexture(texturePath))
+        {
+            continue;
+        }
+        const Surface surface = describeSurface(proceduralSeed(texturePath));
+
+        std::vector<uint8_t> scalar, simd;
+        double scalarMs = benchmarkMilliseconds(1, [&] {
+            scalar = generateSurfaceLevel(surface, 0, singleThread, false);
+        });
+        double simdMs = benchmarkMilliseconds(1, [&] {
+            simd = generateSurfaceLevel(surface, 0, singleThread, true);
+        });
+        double poolMs = benchmarkMilliseconds(
+            1, [&] { simd = generateSurfaceLevel(surface, 0); });
+        const uint32_t levelCount
+            = mipLevelCount(surface.width, surface.height);
+        double chainMs = benchmarkMilliseconds(1, [&] {
+            for (uint32_t level = 0; level < levelCount; level++)
+            {
+                generateSurfaceLevel(surface, level);
+            }
+        });
+
+        int maxDifference = 0;
+        for (size_t i = 0; i < scalar.size(); i++)
+        {
+            maxDifference
+                = std::max(maxDifference, std::abs(scalar[i] - simd[i]));
+        }
+
+        std::cout << std::left << std::setw(32) << texturePath << std::right
+                  << std::setw(6) << surface.width << "x" << std::left
+                  << std::setw(6) << surface.height << std::right
+                  << std::setw(4) << surface.craters.size() << " craters"
+                  << std::fixed << std::setprecision(1) << "  scalar "
+                  << std::setw(7) << scalarMs << " ms  SSE2 " << std::setw(7)
+                  << simdMs << " ms  pool " << std::setw(7) << poolMs
+                  << " ms  chain " << std::setw(7) << chainMs
+                  << " ms  max difference " << maxDifference << std::endl;
+    }
+
+    return EXIT_SUCCESS;
+}
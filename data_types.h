@@ -27,6 +27,8 @@ enum class Model {
     Earth3Dv3,
     Moon,
     VikingRoom,
+    Phobos,
+    Deimos,
 };
 
 static const std::map<Model, std::string> textureMap = {
@@ -35,6 +37,10 @@ static const std::map<Model, std::string> textureMap = {
     {Model::Earth3D, "textures/texture_earth2.jpg"},
     {Model::Earth3Dv3, "textures/texture_earth3.jpg"},
     {Model::Moon, "textures/MoonTexture.jpg"},
+    // no imagery, synthesized from the seed (their NAIF ids), see
+    // texture_procedural.h
+    {Model::Phobos, "procedural:401"},
+    {Model::Deimos, "procedural:402"},
 
 };
 
@@ -46,6 +52,34 @@ static const std::map<Model, std::string> modelMap
 
 };
 
+enum class SphereType { Icosphere, CubeSphere };
+
+/// how a Model flagged as a sphere gets generated, see sphere_generator.h
+struct SphereParams {
+    SphereType type;
+    uint32_t subdivisions;
+    float radius;
+    float texCoordOffset; /// u along the +z axis, lines the texture up with
+                          /// the one of the OBJ file
+};
+
+/// models generated by generateSphere() instead of loaded from their OBJ
+static const std::map<Model, SphereParams> sphereMap
+    = {{Model::Earth3Dv3,
+        {SphereType::CubeSphere, 5, 1.0f, 0.5f + 1.0f / 24.0f}},
+       {Model::Moon, {SphereType::Icosphere, 5, 58.7f, 0.0564f}},
+       {Model::Phobos, {SphereType::Icosphere, 4, 1.0f, 0.0f}},
+       {Model::Deimos, {SphereType::Icosphere, 4, 1.0f, 0.0f}}
+
+};
+
+/// the bodies --body picks the drawn model from
+static const std::map<std::string, Model> bodyMap
+    = {{"earth", Model::Earth3Dv3},
+       {"moon", Model::Moon},
+       {"phobos", Model::Phobos},
+       {"deimos", Model::Deimos}};
+
 const int MAX_FRAMES_IN_FLIGHT
     = 2; /// how many frames should be processed concurrently ?
 
@@ -73,6 +107,8 @@ struct QueueFamilyIndices {
     // graphicsFamily could have a value or not
     std::optional<uint32_t> graphicsFamily;
     std::optional<uint32_t> presentFamily;
+    // a family that only transfers, optional
+    std::optional<uint32_t> transferFamily;
 
     bool isComplete()
     {
@@ -163,6 +199,123 @@ struct Vertex {
     }
 };
 
+/**
+ * Vertex layout of the vertex buffer on the GPU. Models are always loaded,
+ * welded and cached as Vertex, the layout only decides how createVertexBuffer()
+ * packs them.
+ * */
+enum class VertexLayout {
+    Float32, /// Vertex as it is, 32 bytes
+    Compact, /// CompactVertex, 16 bytes
+};
+
+/**
+ * Quantized vertex, half the size of Vertex. The formats are converted by
+ * the vertex input stage, so shader.vert reads them unchanged:
+ * - pos: unorm16 relative to the bounds of all loaded meshes, the shader gets
+ *   [0, 1] and the dequantization is folded into the model matrix
+ * - normal: octahedral encoded unit normal (snorm16), arrives in the unused
+ *   color input at location 1
+ * - texCoord: unorm16 if all uvs are in [0, 1], snorm16 if they are in
+ *   [-1, 1], half float otherwise
+ * */
+struct CompactVertex {
+    uint16_t pos[4]; /// w is padding, there is no 3 x 16 bit vertex format
+                     /// every device supports
+    int16_t normal[2];
+    uint16_t texCoord[2];
+
+    static VkVertexInputBindingDescription getBindingDescription()
+    {
+        VkVertexInputBindingDescription bindingDescription{};
+        bindingDescription.binding = 0;
+        bindingDescription.stride = sizeof(CompactVertex);
+        bindingDescription.inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
+        return bindingDescription;
+    }
+
+    /// texCoordFormat: VK_FORMAT_R16G16_UNORM, _SNORM or _SFLOAT
+    static std::array<VkVertexInputAttributeDescription, 3>
+    getAttributeDescriptions(VkFormat texCoordFormat)
+    {
+        std::array<VkVertexInputAttributeDescription, 3>
+            attributeDescriptions{};
+        attributeDescriptions[0].binding = 0;
+        attributeDescriptions[0].location = 0;
+        attributeDescriptions[0].format = VK_FORMAT_R16G16B16A16_UNORM;
+        attributeDescriptions[0].offset = offsetof(CompactVertex, pos);
+
+        attributeDescriptions[1].binding = 0;
+        attributeDescriptions[1].location = 1;
+        attributeDescriptions[1].format = VK_FORMAT_R16G16_SNORM;
+        attributeDescriptions[1].offset = offsetof(CompactVertex, normal);
+
+        attributeDescriptions[2].binding = 0;
+        attributeDescriptions[2].location = 2;
+        attributeDescriptions[2].format = texCoordFormat;
+        attributeDescriptions[2].offset = offsetof(CompactVertex, texCoord);
+
+        return attributeDescriptions;
+    }
+};
+
+static_assert(sizeof(CompactVertex) == 16, "CompactVertex must stay packed");
+
+/**
+ * Culling bounds of a meshlet in model space, see meshlet.h. Laid out like
+ * MeshletBounds in shaders/meshlet_cull.comp (std430).
+ * */
+struct MeshletBounds {
+    glm::vec4 sphere; /// xyz center, w radius
+    glm::vec4 cone;   /// xyz average normal, w sine of the cone angle (1: no
+                      /// cone)
+};
+
+/// level of detail of a MeshDraw, level 0 is the full mesh
+struct MeshLod {
+    uint32_t firstIndex; /// relative to the first index of the mesh
+    uint32_t indexCount;
+    float error;           /// model space distance to the full mesh, at most
+    uint32_t firstMeshlet; /// into TriangleApp::meshletBounds
+    uint32_t meshletCount;
+    uint32_t vertexCount; /// uses the vertices [0, vertexCount) of the mesh
+};
+
+const uint32_t MAX_MESH_LODS = 6;
+
+/**
+ * One mesh inside the shared vertex and index buffers. The indices are local
+ * to the mesh, vertexOffset is added by vkCmdDrawIndexed(), so meshes with up
+ * to 65536 vertices can use 16 bit indices no matter where they are placed in
+ * the vertex buffer. The levels of detail (see mesh_lod.h) share the vertices
+ * and are drawn instead of each other. They are stored coarse to fine and
+ * streamed in that order, the finer ones become drawable as they arrive.
+ * */
+struct MeshDraw {
+    uint32_t indexCount;  /// all levels of detail, they follow each other
+    int32_t vertexOffset; /// first vertex of the mesh in the vertex buffer
+    uint32_t vertexCount;
+    VkIndexType indexType;          /// set by createIndexBuffer()
+    VkDeviceSize indexBufferOffset; /// byte offset, set by createIndexBuffer()
+    std::array<MeshLod, MAX_MESH_LODS> lods;
+    uint32_t lodCount;
+    uint32_t lod;           /// drawn level, picked every frame
+    glm::vec3 boundsCenter; /// model space bounding sphere
+    float boundsRadius;
+    uint32_t firstMeshlet; /// meshlets of all levels of detail
+    uint32_t meshletCount;
+    uint32_t streamedLevels; /// bit per level that is in the device buffers
+    uint32_t residentLod;    /// finest level that can be drawn
+    uint32_t textureIndex;   /// slot in the bindless array, see texture_table.h
+};
+
+/// how meshlets outside the view or facing away are skipped
+enum class CullingMode {
+    None, /// the whole level of detail is drawn
+    Cpu,  /// meshletVisible() before recording the draws
+    Gpu,  /// meshlet_cull.comp writes the indirect draws
+};
+
 //  needed bc we use a userdefined type (Vertex) as a
 // key in a map (uniqueVertices)
 namespace std {
@@ -0,0 +1,356 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+#include <vulkan/vulkan_core.h>
+
+/**
+ * Sub-allocation of device memory. A vkAllocateMemory per buffer and image
+ * is a round trip into the kernel, and drivers cap the number of
+ * allocations (maxMemoryAllocationCount, often 4096), which streaming
+ * thousands of tiles and mesh batches would run into. Instead the resources
+ * get ranges of large blocks, one list of blocks per memory type.
+ *
+ * Each block keeps its free ranges by offset, to merge a freed range with
+ * its neighbours, and by size, to pick the smallest range that fits
+ * (best fit) without walking all of them. Alignment padding goes back to
+ * the free ranges. A resource of half a block or more gets a dedicated
+ * allocation of its own, an emptied block is released unless it's the last
+ * one of its memory type.
+ *
+ * Linear resources (buffers) and optimally tiled images must not share a
+ * page of bufferImageGranularity, so they come from separate blocks unless
+ * the granularity is 1. Host visible blocks stay mapped for their lifetime
+ * (a VkDeviceMemory can only be mapped once), every allocation carries its
+ * pointer into that mapping. All callers ask for coherent host memory, no
+ * flushes are needed.
+ *
+ * The memory properties are queried once. Allocations come from the pool
+ * workers as well, the allocator is locked.
+ * */
+const VkDeviceSize MEMORY_BLOCK_SIZE = 64ull << 20;
+
+struct MemoryBlock;
+
+/// a range of a block, or a dedicated VkDeviceMemory of its own
+struct MemoryAllocation {
+    VkDeviceMemory memory = VK_NULL_HANDLE;
+    VkDeviceSize offset = 0;
+    VkDeviceSize size = 0;
+    uint8_t *mapped = nullptr;    /// at offset, if host visible
+    MemoryBlock *block = nullptr; /// null for a dedicated allocation
+};
+
+struct MemoryBlock {
+    VkDeviceMemory memory;
+    VkDeviceSize size;
+    uint8_t *mapped;
+    uint32_t pool; /// index into DeviceMemoryAllocator::m_pools
+    uint32_t allocationCount;
+    std::map<VkDeviceSize, VkDeviceSize> freeByOffset;    /// offset -> size
+    std::multimap<VkDeviceSize, VkDeviceSize> freeBySize; /// size -> offset
+};
+
+struct MemoryStats {
+    uint32_t deviceAllocations = 0; /// vkAllocateMemory calls alive
+    uint32_t maxDeviceAllocations = 0;
+    uint32_t blocks = 0;
+    uint64_t allocations = 0; /// ranges handed out, dedicated ones included
+    VkDeviceSize blockBytes = 0;
+    VkDeviceSize usedBlockBytes = 0;
+    VkDeviceSize dedicatedBytes = 0;
+};
+
+static inline VkDeviceSize
+alignMemoryOffset(VkDeviceSize offset, VkDeviceSize alignment)
+{
+    return (offset + alignment - 1) / alignment * alignment;
+}
+
+class DeviceMemoryAllocator {
+  public:
+    /// callbacks for the host memory of the Vulkan calls, may be null
+    void init(VkPhysicalDevice physicalDevice,
+              VkDevice device,
+              const VkAllocationCallbacks *callbacks)
+    {
+        m_device = device;
+        m_callbacks = callbacks;
+        vkGetPhysicalDeviceMemoryProperties(physicalDevice, &m_properties);
+        VkPhysicalDeviceProperties deviceProperties;
+        vkGetPhysicalDeviceProperties(physicalDevice, &deviceProperties);
+        m_granularity = deviceProperties.limits.bufferImageGranularity;
+        m_stats.maxDeviceAllocations
+            = deviceProperties.limits.maxMemoryAllocationCount;
+        m_pools.resize(2 * m_properties.memoryTypeCount);
+    }
+
+    const VkPhysicalDeviceMemoryProperties &properties() const
+    {
+        return m_properties;
+    }
+
+    /// first memory type out of typeFilter that has all properties
+    uint32_t findMemoryType(uint32_t typeFilter,
+                            VkMemoryPropertyFlags properties) const
+    {
+        for (uint32_t i = 0; i < m_properties.memoryTypeCount; i++)
+        {
+            if ((typeFilter & (1 << i))
+                && (m_properties.memoryTypes[i].propertyFlags & properties)
+                       == properties)
+            {
+                return i;
+            }
+        }
+        throw std::runtime_error("failed to find suitable memory type!");
+    }
+
+    /**
+     * Memory for a resource with the given requirements, linear for buffers
+     * and linearly tiled images. Bind it at allocation.offset.
+     * */
+    MemoryAllocation allocate(const VkMemoryRequirements &requirements,
+                              VkMemoryPropertyFlags properties,
+                              bool linear)
+    {
+        const uint32_t memoryType
+            = findMemoryType(requirements.memoryTypeBits, properties);
+        const bool mappable
+            = properties & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT;
+        const VkDeviceSize blockSize = this->blockSize(memoryType);
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        MemoryAllocation allocation;
+        if (requirements.size >= blockSize / 2)
+        {
+            allocation.memory = allocateDeviceMemory(requirements.size,
+                                                     memoryType,
+                                                     mappable,
+                                                     allocation.mapped);
+            allocation.size = requirements.size;
+            m_stats.dedicatedBytes += allocation.size;
+            m_stats.allocations++;
+            return allocation;
+        }
+
+        const uint32_t pool
+            = 2 * memoryType + (linear && m_granularity > 1 ? 1 : 0);
+        for (auto &block : m_pools[pool])
+        {
+            if (takeRange(*block, requirements, allocation))
+            {
+                return allocation;
+            }
+        }
+
+        auto block = std::make_unique<MemoryBlock>();
+        block->memory = allocateDeviceMemory(
+            blockSize, memoryType, mappable, block->mapped);
+        block->size = blockSize;
+        block->pool = pool;
+        block->allocationCount = 0;
+        block->freeByOffset[0] = blockSize;
+        block->freeBySize.emplace(blockSize, 0);
+        m_stats.blocks++;
+        m_stats.blockBytes += blockSize;
+        takeRange(*block, requirements, allocation);
+        m_pools[pool].push_back(std::move(block));
+        return allocation;
+    }
+
+    /// gives the range back, null allocations are ignored
+    void free(const MemoryAllocation &allocation)
+    {
+        if (allocation.memory == VK_NULL_HANDLE)
+        {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stats.allocations--;
+        MemoryBlock *block = allocation.block;
+        if (not block)
+        {
+            m_stats.dedicatedBytes -= allocation.size;
+            freeDeviceMemory(allocation.memory);
+            return;
+        }
+        m_stats.usedBlockBytes -= allocation.size;
+        block->allocationCount--;
+
+        // merged with the free ranges right before and after it
+        VkDeviceSize offset = allocation.offset;
+        VkDeviceSize size = allocation.size;
+        auto next = block->freeByOffset.lower_bound(offset);
+        if (next != block->freeByOffset.end() && next->first == offset + size)
+        {
+            size += next->second;
+            eraseFreeRange(*block, next);
+        }
+        auto previous = block->freeByOffset.lower_bound(offset);
+        if (previous != block->freeByOffset.begin())
+        {
+            previous--;
+            if (previous->first + previous->second == offset)
+            {
+                offset = previous->first;
+                size += previous->second;
+                eraseFreeRange(*block, previous);
+            }
+        }
+        block->freeByOffset[offset] = size;
+        block->freeBySize.emplace(size, offset);
+
+        auto &blocks = m_pools[block->pool];
+        if (block->allocationCount == 0 && blocks.size() > 1)
+        {
+            m_stats.blocks--;
+            m_stats.blockBytes -= block->size;
+            freeDeviceMemory(block->memory);
+            blocks.erase(std::find_if(
+                blocks.begin(),
+                blocks.end(),
+                [block](const std::unique_ptr<MemoryBlock> &candidate) {
+                    return candidate.get() == block;
+                }));
+        }
+    }
+
+    MemoryStats stats() const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_stats;
+    }
+
+    /// releases the blocks, all resources must be destroyed by now
+    void destroy()
+    {
+        for (auto &blocks : m_pools)
+        {
+            for (auto &block : blocks)
+            {
+                freeDeviceMemory(block->memory);
+            }
+            blocks.clear();
+        }
+    }
+
+  private:
+    /// a sixteenth of a small heap at most, not to hog it with free space
+    VkDeviceSize blockSize(uint32_t memoryType) const
+    {
+        const VkDeviceSize heapSize
+            = m_properties.memoryHeaps[m_properties.memoryTypes[memoryType]
+                                           .heapIndex]
+                  .size;
+        return std::min(MEMORY_BLOCK_SIZE,
+                        std::max<VkDeviceSize>(heapSize / 16, 1 << 20));
+    }
+
+    VkDeviceMemory allocateDeviceMemory(VkDeviceSize size,
+                                        uint32_t memoryType,
+                                        bool mappable,
+                                        uint8_t *&mapped)
+    {
+        VkMemoryAllocateInfo allocInfo{};
+        allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+        allocInfo.allocationSize = size;
+        allocInfo.memoryTypeIndex = memoryType;
+        VkDeviceMemory memory;
+        if (vkAllocateMemory(m_device, &allocInfo, m_callbacks, &memory)
+            != VK_SUCCESS)
+        {
+            throw std::runtime_error("failed to allocate device memory!");
+        }
+        m_stats.deviceAllocations++;
+
+        mapped = nullptr;
+        if (mappable)
+        {
+            void *data;
+            vkMapMemory(m_device, memory, 0, VK_WHOLE_SIZE, 0, &data);
+            mapped = static_cast<uint8_t *>(data);
+        }
+        return memory;
+    }
+
+    /// unmaps implicitly
+    void freeDeviceMemory(VkDeviceMemory memory)
+    {
+        vkFreeMemory(m_device, memory, m_callbacks);
+        m_stats.deviceAllocations--;
+    }
+
+    void eraseFreeRange(MemoryBlock &block,
+                        std::map<VkDeviceSize, VkDeviceSize>::iterator range)
+    {
+        auto sized = block.freeBySize.equal_range(range->second);
+        for (auto it = sized.first; it != sized.second; it++)
+        {
+            if (it->second == range->first)
+            {
+                block.freeBySize.erase(it);
+                break;
+            }
+        }
+        block.freeByOffset.erase(range);
+    }
+
+    /// the smallest free range of block that holds the aligned resource
+    bool takeRange(MemoryBlock &block,
+                   const VkMemoryRequirements &requirements,
+                   MemoryAllocation &allocation)
+    {
+        for (auto it = block.freeBySize.lower_bound(requirements.size);
+             it != block.freeBySize.end();
+             it++)
+        {
+            const VkDeviceSize rangeOffset = it->second;
+            const VkDeviceSize rangeSize = it->first;
+            const VkDeviceSize offset
+                = alignMemoryOffset(rangeOffset, requirements.alignment);
+            if (offset + requirements.size > rangeOffset + rangeSize)
+            {
+                continue;
+            }
+
+            eraseFreeRange(block, block.freeByOffset.find(rangeOffset));
+            if (offset > rangeOffset)
+            {
+                block.freeByOffset[rangeOffset] = offset - rangeOffset;
+                block.freeBySize.emplace(offset - rangeOffset, rangeOffset);
+            }
+            const VkDeviceSize end = offset + requirements.size;
+            if (end < rangeOffset + rangeSize)
+            {
+                block.freeByOffset[end] = rangeOffset + rangeSize - end;
+                block.freeBySize.emplace(rangeOffset + rangeSize - end, end);
+            }
+
+            block.allocationCount++;
+            allocation.memory = block.memory;
+            allocation.offset = offset;
+            allocation.size = requirements.size;
+            allocation.mapped = block.mapped ? block.mapped + offset : nullptr;
+            allocation.block = &block;
+            m_stats.usedBlockBytes += requirements.size;
+            m_stats.allocations++;
+            return true;
+        }
+        return false;
+    }
+
+    VkDevice m_device = VK_NULL_HANDLE;
+    const VkAllocationCallbacks *m_callbacks = nullptr;
+    VkPhysicalDeviceMemoryProperties m_properties{};
+    VkDeviceSize m_granularity = 1;
+    /// blocks per memory type, the optimal images and the linear resources
+    std::vector<std::vector<std::unique_ptr<MemoryBlock>>> m_pools;
+    MemoryStats m_stats;
+    mutable std::mutex m_mutex;
+};
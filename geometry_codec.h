@@ -0,0 +1,604 @@
+#pragma once
+
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define GEOMETRY_CODEC_X86
+#include <immintrin.h>
+/// the build has no -m flags, the SIMD decoders are compiled for their
+/// instruction set on their own and picked at runtime
+#define GEOMETRY_CODEC_TARGET(isa) __attribute__((target(isa)))
+#endif
+
+/**
+ * Lossless codec for the vertex and index arrays of the mesh cache. An array
+ * of elements (Vertex, uint32_t index, ...) is split into 32 bit words and
+ * every word of the element becomes a stream of its own (all pos.x, all
+ * pos.y, ...). A stream stores the difference to the previous element,
+ * zigzag mapped so small negative steps stay small, and codes it with Stream
+ * VByte: 1 to 4 bytes per value, the lengths of four values in one control
+ * byte in front of the data. After the vertex cache optimization and the
+ * coarse to fine reordering neighbouring indices are close together, most of
+ * them take a single byte, as do the constant vertex colors.
+ *
+ * The byte oriented code decodes with a table driven shuffle per four values
+ * (SSSE3) or per eight values (AVX2), which is what makes it several GB/s per
+ * core, a bitwise entropy coder would not. The elements are coded in blocks
+ * of GEOMETRY_CODEC_BLOCK_SIZE that decode independently on the thread pool.
+ * The decoder only writes the output front to back, it can go straight into
+ * mapped staging memory.
+ *
+ * Layout: uint32_t blockOffsets[blockCount + 1] | blocks | padding
+ *   block: uint32_t streamOffsets[words] | streams (relative to the block)
+ *   stream: control bytes[(n + 3) / 4] | data bytes
+ * */
+
+const uint32_t GEOMETRY_CODEC_BLOCK_SIZE = 8192; /// elements per block
+
+/// zero bytes at the end, the SIMD decoders load 16 or 32 bytes at once
+const uint32_t GEOMETRY_CODEC_PADDING = 32;
+
+/// elements decoded per stream before they are interleaved, small enough
+/// that all streams of a Vertex stay in the L1 cache
+const uint32_t GEOMETRY_CODEC_CHUNK_SIZE = 256;
+
+enum class GeometryCodecPath {
+    Scalar,
+    Ssse3,
+    Avx2,
+};
+
+static const char *
+geometryCodecPathName(GeometryCodecPath path)
+{
+    switch (path)
+    {
+    case GeometryCodecPath::Ssse3:
+        return "SSSE3";
+    case GeometryCodecPath::Avx2:
+        return "AVX2";
+    default:
+        return "scalar";
+    }
+}
+
+static bool
+geometryCodecPathSupported(GeometryCodecPath path)
+{
+#ifdef GEOMETRY_CODEC_X86
+    switch (path)
+    {
+    case GeometryCodecPath::Ssse3:
+        return __builtin_cpu_supports("ssse3");
+    case GeometryCodecPath::Avx2:
+        return __builtin_cpu_supports("avx2");
+    default:
+        return true;
+    }
+#else
+    return path == GeometryCodecPath::Scalar;
+#endif
+}
+
+/// fastest decoder the CPU supports
+static GeometryCodecPath
+bestGeometryCodecPath()
+{
+    static const GeometryCodecPath path = [] {
+        for (GeometryCodecPath path :
+             {GeometryCodecPath::Avx2, GeometryCodecPath::Ssse3})
+        {
+            if (geometryCodecPathSupported(path))
+            {
+                return path;
+            }
+        }
+        return GeometryCodecPath::Scalar;
+    }();
+    return path;
+}
+
+static inline uint32_t
+zigzagEncode(uint32_t delta)
+{
+    const uint32_t sign
+        = static_cast<uint32_t>(static_cast<int32_t>(delta) >> 31);
+    return (delta << 1) ^ sign;
+}
+
+static inline uint32_t
+zigzagDecode(uint32_t value)
+{
+    return (value >> 1) ^ (0u - (value & 1));
+}
+
+/**
+ * Data length and the pshufb mask that spreads the data bytes of four values
+ * into four 32 bit lanes, for every control byte
+ * */
+struct StreamVByteTables {
+    uint8_t lengths[256];
+    alignas(16) uint8_t shuffles[256][16];
+};
+
+static const StreamVByteTables &
+streamVByteTables()
+{
+    static const StreamVByteTables tables = [] {
+        StreamVByteTables tables;
+        for (uint32_t control = 0; control < 256; control++)
+        {
+            uint8_t offset = 0;
+            for (uint32_t lane = 0; lane < 4; lane++)
+            {
+                uint32_t length = ((control >> (2 * lane)) & 3) + 1;
+                for (uint32_t byte = 0; byte < 4; byte++)
+                {
+                    // 0x80 makes pshufb write a zero
+                    tables.shuffles[control][4 * lane + byte]
+                        = byte < length ? static_cast<uint8_t>(offset + byte)
+                                        : 0x80;
+                }
+                offset = static_cast<uint8_t>(offset + length);
+            }
+            tables.lengths[control] = offset;
+        }
+        return tables;
+    }();
+    return tables;
+}
+
+/// appends the stream of word of count elements, stride words apart
+static void
+encodeGeometryStream(const uint32_t *words,
+                     size_t count,
+                     size_t stride,
+                     std::vector<uint8_t> &out)
+{
+    size_t control = out.size();
+    out.resize(out.size() + (count + 3) / 4, 0);
+
+    uint32_t previous = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        uint32_t value = words[i * stride];
+        uint32_t coded = zigzagEncode(value - previous);
+        previous = value;
+
+        uint32_t length = coded < (1u << 8)    ? 1
+                          : coded < (1u << 16) ? 2
+                          : coded < (1u << 24) ? 3
+                                               : 4;
+        out[control + i / 4] |= static_cast<uint8_t>((length - 1)
+                                                     << (2 * (i % 4)));
+        for (uint32_t byte = 0; byte < length; byte++)
+        {
+            out.push_back(static_cast<uint8_t>(coded >> (8 * byte)));
+        }
+    }
+}
+
+/**
+ * Codes count elements of elementSize bytes (a multiple of 4), see the layout
+ * at the top of the file
+ * */
+static std::vector<uint8_t>
+encodeGeometry(const void *elements, size_t count, size_t elementSize)
+{
+    const size_t words = elementSize / 4;
+    const size_t blockCount
+        = (count + GEOMETRY_CODEC_BLOCK_SIZE - 1) / GEOMETRY_CODEC_BLOCK_SIZE;
+    const uint32_t *input = static_cast<const uint32_t *>(elements);
+
+    std::vector<uint8_t> out((blockCount + 1) * sizeof(uint32_t));
+    std::vector<uint32_t> blockOffsets(blockCount + 1);
+    for (size_t block = 0; block < blockCount; block++)
+    {
+        const size_t first = block * GEOMETRY_CODEC_BLOCK_SIZE;
+        const size_t blockElements
+            = std::min<size_t>(GEOMETRY_CODEC_BLOCK_SIZE, count - first);
+        const size_t blockStart = out.size();
+        blockOffsets[block] = static_cast<uint32_t>(blockStart);
+
+        std::vector<uint32_t> streamOffsets(words);
+        out.resize(out.size() + words * sizeof(uint32_t));
+        for (size_t word = 0; word < words; word++)
+        {
+            streamOffsets[word]
+                = static_cast<uint32_t>(out.size() - blockStart);
+            encodeGeometryStream(
+                input + first * words + word, blockElements, words, out);
+        }
+        memcpy(out.data() + blockStart,
+               streamOffsets.data(),
+               words * sizeof(uint32_t));
+    }
+    blockOffsets[blockCount] = static_cast<uint32_t>(out.size());
+    memcpy(out.data(), blockOffsets.data(), blockOffsets.size() * 4);
+
+    out.resize(out.size() + GEOMETRY_CODEC_PADDING, 0);
+    return out;
+}
+
+/// read position in one stream of a block
+struct GeometryStreamCursor {
+    const uint8_t *control;
+    const uint8_t *data;
+    uint32_t previous;
+};
+
+/**
+ * Decodes the next count values of a stream. count is a multiple of 4 except
+ * for the last call on a stream. Returns false if the data would run past
+ * limit.
+ * */
+static bool
+decodeGeometryRunScalar(GeometryStreamCursor &cursor,
+                        size_t count,
+                        uint32_t *out,
+                        const uint8_t *limit)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        uint32_t length = ((cursor.control[i / 4] >> (2 * (i % 4))) & 3) + 1;
+        if (cursor.data + length > limit)
+        {
+            return false;
+        }
+        uint32_t coded = 0;
+        for (uint32_t byte = 0; byte < length; byte++)
+        {
+            coded |= uint32_t(cursor.data[byte]) << (8 * byte);
+        }
+        cursor.data += length;
+        cursor.previous += zigzagDecode(coded);
+        out[i] = cursor.previous;
+    }
+    cursor.control += (count + 3) / 4;
+    return true;
+}
+
+#ifdef GEOMETRY_CODEC_X86
+/// four values per control byte: shuffle the data bytes into the lanes,
+/// undo the zigzag mapping and add up the differences
+GEOMETRY_CODEC_TARGET("ssse3")
+static bool
+decodeGeometryRunSsse3(GeometryStreamCursor &cursor,
+                       size_t count,
+                       uint32_t *out,
+                       const uint8_t *limit)
+{
+    const StreamVByteTables &tables = streamVByteTables();
+    const __m128i one = _mm_set1_epi32(1);
+    const __m128i zero = _mm_setzero_si128();
+    __m128i previous = _mm_set1_epi32(static_cast<int>(cursor.previous));
+    const uint8_t *data = cursor.data;
+
+    const size_t groups = count / 4;
+    size_t group = 0;
+    for (; group < groups && data + 16 <= limit; group++)
+    {
+        const uint8_t control = cursor.control[group];
+        __m128i value = _mm_shuffle_epi8(
+            _mm_loadu_si128(reinterpret_cast<const __m128i *>(data)),
+            _mm_load_si128(
+                reinterpret_cast<const __m128i *>(tables.shuffles[control])));
+        data += tables.lengths[control];
+
+        value = _mm_xor_si128(_mm_srli_epi32(value, 1),
+                              _mm_sub_epi32(zero, _mm_and_si128(value, one)));
+        value = _mm_add_epi32(value, _mm_slli_si128(value, 4));
+        value = _mm_add_epi32(value, _mm_slli_si128(value, 8));
+        value = _mm_add_epi32(value, previous);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out + 4 * group), value);
+        previous = _mm_shuffle_epi32(value, 0xFF);
+    }
+
+    cursor.control += group;
+    cursor.data = data;
+    cursor.previous = static_cast<uint32_t>(_mm_cvtsi128_si32(previous));
+    return decodeGeometryRunScalar(
+        cursor, count - 4 * group, out + 4 * group, limit);
+}
+
+/// two control bytes per step, one in each 128 bit lane, the prefix sum of
+/// the low lane is carried into the high one
+GEOMETRY_CODEC_TARGET("avx2")
+static bool
+decodeGeometryRunAvx2(GeometryStreamCursor &cursor,
+                      size_t count,
+                      uint32_t *out,
+                      const uint8_t *limit)
+{
+    const StreamVByteTables &tables = streamVByteTables();
+    const __m256i one = _mm256_set1_epi32(1);
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i lastOfLow = _mm256_set1_epi32(3);
+    const __m256i last = _mm256_set1_epi32(7);
+    __m256i previous = _mm256_set1_epi32(static_cast<int>(cursor.previous));
+    const uint8_t *data = cursor.data;
+
+    const size_t groups = count / 4;
+    size_t group = 0;
+    for (; group + 2 <= groups && data + 32 <= limit; group += 2)
+    {
+        const uint8_t low = cursor.control[group];
+        const uint8_t high = cursor.control[group + 1];
+        const uint8_t *highData = data + tables.lengths[low];
+
+        __m256i bytes = _mm256_inserti128_si256(
+            _mm256_castsi128_si256(
+                _mm_loadu_si128(reinterpret_cast<const __m128i *>(data))),
+            _mm_loadu_si128(reinterpret_cast<const __m128i *>(highData)),
+            1);
+        __m256i shuffle = _mm256_inserti128_si256(
+            _mm256_castsi128_si256(_mm_load_si128(
+                reinterpret_cast<const __m128i *>(tables.shuffles[low]))),
+            _mm_load_si128(
+                reinterpret_cast<const __m128i *>(tables.shuffles[high])),
+            1);
+        data = highData + tables.lengths[high];
+
+        __m256i value = _mm256_shuffle_epi8(bytes, shuffle);
+        value = _mm256_xor_si256(
+            _mm256_srli_epi32(value, 1),
+            _mm256_sub_epi32(zero, _mm256_and_si256(value, one)));
+        value = _mm256_add_epi32(value, _mm256_slli_si256(value, 4));
+        value = _mm256_add_epi32(value, _mm256_slli_si256(value, 8));
+        value = _mm256_add_epi32(
+            value,
+            _mm256_blend_epi32(
+                zero, _mm256_permutevar8x32_epi32(value, lastOfLow), 0xF0));
+        value = _mm256_add_epi32(value, previous);
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + 4 * group),
+                            value);
+        previous = _mm256_permutevar8x32_epi32(value, last);
+    }
+
+    cursor.control += group;
+    cursor.data = data;
+    cursor.previous = static_cast<uint32_t>(
+        _mm_cvtsi128_si32(_mm256_castsi256_si128(previous)));
+    return decodeGeometryRunSsse3(
+        cursor, count - 4 * group, out + 4 * group, limit);
+}
+#endif
+
+static inline bool
+decodeGeometryRun(GeometryCodecPath path,
+                  GeometryStreamCursor &cursor,
+                  size_t count,
+                  uint32_t *out,
+                  const uint8_t *limit)
+{
+#ifdef GEOMETRY_CODEC_X86
+    if (path == GeometryCodecPath::Avx2)
+    {
+        return decodeGeometryRunAvx2(cursor, count, out, limit);
+    }
+    if (path == GeometryCodecPath::Ssse3)
+    {
+        return decodeGeometryRunSsse3(cursor, count, out, limit);
+    }
+#endif
+    return decodeGeometryRunScalar(cursor, count, out, limit);
+}
+
+/// element i of the chunk takes value i of every stream in scratch
+static void
+interleaveGeometryChunkScalar(const uint32_t *scratch,
+                              size_t first,
+                              size_t count,
+                              size_t words,
+                              uint32_t *out)
+{
+    for (size_t i = first; i < count; i++)
+    {
+        for (size_t word = 0; word < words; word++)
+        {
+            out[i * words + word]
+                = scratch[word * GEOMETRY_CODEC_CHUNK_SIZE + i];
+        }
+    }
+}
+
+#ifdef GEOMETRY_CODEC_X86
+/// 4x4 transposes of four elements and four streams at a time
+GEOMETRY_CODEC_TARGET("sse2")
+static void
+interleaveGeometryChunkSse2(const uint32_t *scratch,
+                            size_t count,
+                            size_t words,
+                            uint32_t *out)
+{
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        for (size_t word = 0; word < words; word += 4)
+        {
+            const float *rows = reinterpret_cast<const float *>(
+                scratch + word * GEOMETRY_CODEC_CHUNK_SIZE + i);
+            __m128 row0 = _mm_loadu_ps(rows);
+            __m128 row1 = _mm_loadu_ps(rows + GEOMETRY_CODEC_CHUNK_SIZE);
+            __m128 row2 = _mm_loadu_ps(rows + 2 * GEOMETRY_CODEC_CHUNK_SIZE);
+            __m128 row3 = _mm_loadu_ps(rows + 3 * GEOMETRY_CODEC_CHUNK_SIZE);
+            _MM_TRANSPOSE4_PS(row0, row1, row2, row3);
+
+            float *element = reinterpret_cast<float *>(out + i * words + word);
+            _mm_storeu_ps(element, row0);
+            _mm_storeu_ps(element + words, row1);
+            _mm_storeu_ps(element + 2 * words, row2);
+            _mm_storeu_ps(element + 3 * words, row3);
+        }
+    }
+    interleaveGeometryChunkScalar(scratch, i, count, words, out);
+}
+#endif
+
+static inline void
+interleaveGeometryChunk(GeometryCodecPath path,
+                        const uint32_t *scratch,
+                        size_t count,
+                        size_t words,
+                        uint32_t *out)
+{
+#ifdef GEOMETRY_CODEC_X86
+    if (path != GeometryCodecPath::Scalar && words % 4 == 0)
+    {
+        interleaveGeometryChunkSse2(scratch, count, words, out);
+        return;
+    }
+#endif
+    interleaveGeometryChunkScalar(scratch, 0, count, words, out);
+}
+
+/// decodes block of the coded data, see decodeGeometry()
+static bool
+decodeGeometryBlock(const uint8_t *encoded,
+                    size_t encodedSize,
+                    size_t block,
+                    size_t count,
+                    size_t words,
+                    uint32_t *out,
+                    GeometryCodecPath path)
+{
+    uint32_t blockStart, blockEnd;
+    memcpy(&blockStart, encoded + block * 4, 4);
+    memcpy(&blockEnd, encoded + block * 4 + 4, 4);
+
+    const size_t first = block * GEOMETRY_CODEC_BLOCK_SIZE;
+    const size_t blockElements
+        = std::min<size_t>(GEOMETRY_CODEC_BLOCK_SIZE, count - first);
+    const size_t minStreamSize = (blockElements + 3) / 4 + blockElements;
+    if (blockStart > blockEnd || blockEnd > encodedSize - GEOMETRY_CODEC_PADDING
+        || blockEnd - blockStart < words * (4 + minStreamSize))
+    {
+        return false;
+    }
+
+    // every stream starts after the controls and ends where the next one
+    // starts, the last one at the end of the block
+    const uint8_t *blockData = encoded + blockStart;
+    std::array<GeometryStreamCursor, 64> cursors;
+    std::array<const uint8_t *, 64> streamEnds;
+    if (words > cursors.size())
+    {
+        return false;
+    }
+    for (size_t word = 0; word < words; word++)
+    {
+        uint32_t start, end = blockEnd - blockStart;
+        memcpy(&start, blockData + word * 4, 4);
+        if (word + 1 < words)
+        {
+            memcpy(&end, blockData + word * 4 + 4, 4);
+        }
+        if (start < words * 4 || start > end || end - start < minStreamSize)
+        {
+            return false;
+        }
+        cursors[word] = {blockData + start,
+                         blockData + start + (blockElements + 3) / 4,
+                         0};
+        streamEnds[word] = blockData + end;
+    }
+
+    const uint8_t *limit = encoded + encodedSize;
+    uint32_t *blockOut = out + first * words;
+    if (words == 1)
+    {
+        if (not decodeGeometryRun(
+                path, cursors[0], blockElements, blockOut, limit))
+        {
+            return false;
+        }
+    } else
+    {
+        // a chunk of every stream goes into scratch first and is interleaved
+        // from there into the elements
+        std::vector<uint32_t> scratch(words * GEOMETRY_CODEC_CHUNK_SIZE);
+        for (size_t chunk = 0; chunk < blockElements;
+             chunk += GEOMETRY_CODEC_CHUNK_SIZE)
+        {
+            const size_t chunkElements = std::min<size_t>(
+                GEOMETRY_CODEC_CHUNK_SIZE, blockElements - chunk);
+            for (size_t word = 0; word < words; word++)
+            {
+                if (not decodeGeometryRun(
+                        path,
+                        cursors[word],
+                        chunkElements,
+                        scratch.data() + word * GEOMETRY_CODEC_CHUNK_SIZE,
+                        limit))
+                {
+                    return false;
+                }
+            }
+            interleaveGeometryChunk(path,
+                                    scratch.data(),
+                                    chunkElements,
+                                    words,
+                                    blockOut + chunk * words);
+        }
+    }
+
+    for (size_t word = 0; word < words; word++)
+    {
+        if (cursors[word].data != streamEnds[word])
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Decodes count elements of elementSize bytes into out, the blocks are spread
+ * over the thread pool. Returns false if the data is corrupt, out is then
+ * partly written.
+ * */
+static bool
+decodeGeometry(const uint8_t *encoded,
+               size_t encodedSize,
+               size_t count,
+               size_t elementSize,
+               void *out,
+               ThreadPool &pool = sharedThreadPool(),
+               GeometryCodecPath path = bestGeometryCodecPath())
+{
+    const size_t words = elementSize / 4;
+    const size_t blockCount
+        = (count + GEOMETRY_CODEC_BLOCK_SIZE - 1) / GEOMETRY_CODEC_BLOCK_SIZE;
+    if (words == 0 || elementSize % 4 != 0
+        || encodedSize < (blockCount + 1) * 4 + GEOMETRY_CODEC_PADDING)
+    {
+        return false;
+    }
+    if (not geometryCodecPathSupported(path))
+    {
+        path = GeometryCodecPath::Scalar;
+    }
+
+    std::atomic<bool> valid{true};
+    pool.parallelFor(blockCount, [&](size_t block) {
+        if (not decodeGeometryBlock(encoded,
+                                    encodedSize,
+                                    block,
+                                    count,
+                                    words,
+                                    static_cast<uint32_t *>(out),
+                                    path))
+        {
+            valid = false;
+        }
+    });
+    return valid;
+}
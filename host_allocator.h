@@ -0,0 +1,336 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vulkan/vulkan_core.h>
+
+/**
+ * Host memory the loader and the driver allocate for our Vulkan objects,
+ * counted through the VkAllocationCallbacks every create and destroy call
+ * is given (callbacks() is null with the tracking off, the driver uses its
+ * own allocator then). The bytes and allocations alive, their high-water
+ * marks and the allocations ever made are counted per
+ * VkSystemAllocationScope, next to what the driver only reports through
+ * the internal notifications (executable memory of the pipelines).
+ *
+ * Allocations of the command scope only live until the Vulkan command that
+ * made them returns. With the arena on they are bumped off one block that
+ * is rewound every frame instead of going through malloc, one that doesn't
+ * fit falls back to malloc. The pool workers may be inside a command while
+ * a frame begins, the block is only rewound when none of its allocations
+ * is alive.
+ *
+ * Every allocation has a header right in front of it with its size, scope
+ * and where it came from, frees and reallocations need no lookup. The
+ * callbacks come from any thread, the counters are locked.
+ * */
+const size_t HOST_ARENA_SIZE = 256 << 10;
+
+const uint32_t HOST_SCOPE_COUNT = VK_SYSTEM_ALLOCATION_SCOPE_INSTANCE + 1;
+
+static inline const char *
+hostScopeName(uint32_t scope)
+{
+    static const char *names[HOST_SCOPE_COUNT]
+        = {"command", "object", "cache", "device", "instance"};
+    return scope < HOST_SCOPE_COUNT ? names[scope] : "unknown";
+}
+
+struct HostScopeStats {
+    uint64_t bytes = 0;       /// alive
+    uint64_t peakBytes = 0;   /// most alive at once
+    uint64_t allocations = 0; /// alive
+    uint64_t peakAllocations = 0;
+    uint64_t totalAllocations = 0; /// ever, reallocations included
+
+    void add(size_t size)
+    {
+        bytes += size;
+        allocations++;
+        totalAllocations++;
+        peakBytes = std::max(peakBytes, bytes);
+        peakAllocations = std::max(peakAllocations, allocations);
+    }
+
+    void remove(size_t size)
+    {
+        bytes -= size;
+        allocations--;
+    }
+};
+
+struct HostAllocationStats {
+    std::array<HostScopeStats, HOST_SCOPE_COUNT> scopes; /// by scope
+    HostScopeStats internal; /// the driver's own, all scopes
+    uint64_t arenaBytes = 0;       /// 0 without the arena
+    uint64_t arenaPeakBytes = 0;   /// most used in one frame
+    uint64_t arenaAllocations = 0; /// ever
+    uint64_t arenaFallbacks = 0;   /// command allocations that didn't fit
+
+    /// alive over all scopes, the internal ones not included
+    uint64_t bytes() const
+    {
+        uint64_t bytes = 0;
+        for (const auto &scope : scopes)
+        {
+            bytes += scope.bytes;
+        }
+        return bytes;
+    }
+
+    uint64_t allocations() const
+    {
+        uint64_t allocations = 0;
+        for (const auto &scope : scopes)
+        {
+            allocations += scope.allocations;
+        }
+        return allocations;
+    }
+};
+
+class HostAllocator {
+  public:
+    HostAllocator() = default;
+    HostAllocator(const HostAllocator &) = delete;
+    HostAllocator &operator=(const HostAllocator &) = delete;
+
+    /// arenaSize 0 serves the command scope from malloc like the others
+    void init(size_t arenaSize)
+    {
+        m_callbacks.pUserData = this;
+        m_callbacks.pfnAllocation = &allocationCallback;
+        m_callbacks.pfnReallocation = &reallocationCallback;
+        m_callbacks.pfnFree = &freeCallback;
+        m_callbacks.pfnInternalAllocation = &internalAllocationCallback;
+        m_callbacks.pfnInternalFree = &internalFreeCallback;
+        if (arenaSize > 0)
+        {
+            m_arena.reset(new uint8_t[arenaSize]);
+            m_stats.arenaBytes = arenaSize;
+        }
+    }
+
+    /// for the pAllocator of the Vulkan calls, null before init()
+    const VkAllocationCallbacks *callbacks() const
+    {
+        return m_callbacks.pfnAllocation ? &m_callbacks : nullptr;
+    }
+
+    /// rewinds the arena unless a command still holds some of it
+    void beginFrame()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_arenaAlive == 0)
+        {
+            m_arenaHead = 0;
+        }
+    }
+
+    HostAllocationStats stats() const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_stats;
+    }
+
+    /// the stats as JSON, false if path can't be written
+    bool writeJson(const std::string &path) const
+    {
+        const HostAllocationStats stats = this->stats();
+        std::ofstream file(path, std::ios::trunc);
+        if (not file.is_open())
+        {
+            std::cerr << "failed to write host allocations " << path
+                      << std::endl;
+            return false;
+        }
+
+        file << "{\n  \"scopes\": {\n";
+        for (uint32_t scope = 0; scope < HOST_SCOPE_COUNT; scope++)
+        {
+            file << "    \"" << hostScopeName(scope)
+                 << "\": " << scopeJson(stats.scopes[scope])
+                 << (scope + 1 < HOST_SCOPE_COUNT ? ",\n" : "\n");
+        }
+        file << "  },\n  \"internal\": " << scopeJson(stats.internal)
+             << ",\n  \"arena\": {\"bytes\": " << stats.arenaBytes
+             << ", \"peakBytes\": " << stats.arenaPeakBytes
+             << ", \"allocations\": " << stats.arenaAllocations
+             << ", \"fallbacks\": " << stats.arenaFallbacks << "}\n}\n";
+        return file.good();
+    }
+
+  private:
+    struct Header {
+        void *base; /// what malloc returned, null in the arena
+        size_t size;
+        uint32_t scope;
+    };
+
+    static std::string scopeJson(const HostScopeStats &scope)
+    {
+        return "{\"bytes\": " + std::to_string(scope.bytes)
+               + ", \"peakBytes\": " + std::to_string(scope.peakBytes)
+               + ", \"allocations\": " + std::to_string(scope.allocations)
+               + ", \"peakAllocations\": "
+               + std::to_string(scope.peakAllocations)
+               + ", \"totalAllocations\": "
+               + std::to_string(scope.totalAllocations) + "}";
+    }
+
+    static void *VKAPI_PTR allocationCallback(void *userData,
+                                              size_t size,
+                                              size_t alignment,
+                                              VkSystemAllocationScope scope)
+    {
+        return static_cast<HostAllocator *>(userData)->allocate(
+            size, alignment, scope);
+    }
+
+    static void *VKAPI_PTR reallocationCallback(void *userData,
+                                                void *original,
+                                                size_t size,
+                                                size_t alignment,
+                                                VkSystemAllocationScope scope)
+    {
+        return static_cast<HostAllocator *>(userData)->reallocate(
+            original, size, alignment, scope);
+    }
+
+    static void VKAPI_PTR freeCallback(void *userData, void *memory)
+    {
+        static_cast<HostAllocator *>(userData)->free(memory);
+    }
+
+    static void VKAPI_PTR
+    internalAllocationCallback(void *userData,
+                               size_t size,
+                               VkInternalAllocationType,
+                               VkSystemAllocationScope)
+    {
+        auto *allocator = static_cast<HostAllocator *>(userData);
+        std::lock_guard<std::mutex> lock(allocator->m_mutex);
+        allocator->m_stats.internal.add(size);
+    }
+
+    static void VKAPI_PTR internalFreeCallback(void *userData,
+                                               size_t size,
+                                               VkInternalAllocationType,
+                                               VkSystemAllocationScope)
+    {
+        auto *allocator = static_cast<HostAllocator *>(userData);
+        std::lock_guard<std::mutex> lock(allocator->m_mutex);
+        allocator->m_stats.internal.remove(size);
+    }
+
+    void *allocate(size_t size, size_t alignment, VkSystemAllocationScope scope)
+    {
+        // room for the header in front of the aligned allocation
+        alignment = std::max(alignment, alignof(Header));
+        const size_t bytes = sizeof(Header) + alignment - 1 + size;
+
+        uint8_t *base = nullptr;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (scope == VK_SYSTEM_ALLOCATION_SCOPE_COMMAND && m_arena)
+            {
+                if (m_arenaHead + bytes <= m_stats.arenaBytes)
+                {
+                    base = m_arena.get() + m_arenaHead;
+                    m_arenaHead += bytes;
+                    m_arenaAlive++;
+                    m_stats.arenaAllocations++;
+                    m_stats.arenaPeakBytes
+                        = std::max<uint64_t>(m_stats.arenaPeakBytes,
+                                             m_arenaHead);
+                } else
+                {
+                    m_stats.arenaFallbacks++;
+                }
+            }
+        }
+        const bool inArena = base != nullptr;
+        if (not inArena)
+        {
+            base = static_cast<uint8_t *>(std::malloc(bytes));
+            if (not base)
+            {
+                return nullptr;
+            }
+        }
+
+        const uintptr_t start
+            = reinterpret_cast<uintptr_t>(base) + sizeof(Header);
+        uint8_t *memory = reinterpret_cast<uint8_t *>(
+            (start + alignment - 1) / alignment * alignment);
+        Header *header = reinterpret_cast<Header *>(memory) - 1;
+        header->base = inArena ? nullptr : base;
+        header->size = size;
+        header->scope = scope;
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stats.scopes[scope].add(size);
+        return memory;
+    }
+
+    /// a new allocation the contents are copied to, the alignment of the
+    /// original may differ
+    void *reallocate(void *original,
+                     size_t size,
+                     size_t alignment,
+                     VkSystemAllocationScope scope)
+    {
+        if (size == 0)
+        {
+            free(original);
+            return nullptr;
+        }
+        if (not original)
+        {
+            return allocate(size, alignment, scope);
+        }
+        void *memory = allocate(size, alignment, scope);
+        if (not memory)
+        {
+            return nullptr; /// the original stays valid
+        }
+        const Header *header = static_cast<const Header *>(original) - 1;
+        std::memcpy(memory, original, std::min(header->size, size));
+        free(original);
+        return memory;
+    }
+
+    void free(void *memory)
+    {
+        if (not memory)
+        {
+            return;
+        }
+        const Header header = *(static_cast<const Header *>(memory) - 1);
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stats.scopes[header.scope].remove(header.size);
+            if (not header.base)
+            {
+                m_arenaAlive--;
+            }
+        }
+        std::free(header.base);
+    }
+
+    VkAllocationCallbacks m_callbacks{};
+    std::unique_ptr<uint8_t[]> m_arena;
+    size_t m_arenaHead = 0;    /// end of the allocations of this frame
+    uint64_t m_arenaAlive = 0; /// allocations in the arena not freed yet
+    HostAllocationStats m_stats;
+    mutable std::mutex m_mutex;
+};
@@ -0,0 +1,446 @@
+#pragma once
+
+#include "mapped_file.h"
+#include "source_stamp.h"
+#include "texture_compression.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <system_error>
+#include <vector>
+#include <vulkan/vulkan_core.h>
+
+/**
+ * KTX 2.0 container (Khronos texture format) for the block compressed mip
+ * chains, written next to the image (textures/x.jpg -> textures/x.jpg.ktx2).
+ * Only what we write is read back: one 2D image or one cubemap
+ * (textures/x.jpg.cube.ktx2, see texture_cubemap.h) without layers or
+ * supercompression, with the basic data format descriptor of BC1, BC7 or
+ * RGBA8. RGBA8 is only written for cubemaps, the 2D chains have the mip cache.
+ * The level data is already in the layout vkCmdCopyBufferToImage takes, so
+ * the upload copies it from the mapping into the staging buffer in one piece.
+ *
+ * The source stamp of the image lives in the key/value data under
+ * KTX2_SOURCE_KEY, other tools ignore it.
+ *
+ * Layout: Ktx2Header | Ktx2Level[levelCount] | data format descriptor
+ *         | key/value data | levels, smallest first
+ * */
+const uint8_t KTX2_IDENTIFIER[12] = {
+    0xAB, 0x4B, 0x54, 0x58, 0x20, 0x32, 0x30, 0xBB, 0x0D, 0x0A, 0x1A, 0x0A};
+const char KTX2_SOURCE_KEY[] = "Earth3DSource";
+const uint32_t KTX2_CACHE_VERSION = 1; /// bump when the encoders change
+
+struct Ktx2Header {
+    uint8_t identifier[12];
+    uint32_t vkFormat;
+    uint32_t typeSize;
+    uint32_t pixelWidth;
+    uint32_t pixelHeight;
+    uint32_t pixelDepth;
+    uint32_t layerCount;
+    uint32_t faceCount;
+    uint32_t levelCount;
+    uint32_t supercompressionScheme;
+    uint32_t dfdByteOffset;
+    uint32_t dfdByteLength;
+    uint32_t kvdByteOffset;
+    uint32_t kvdByteLength;
+    uint64_t sgdByteOffset;
+    uint64_t sgdByteLength;
+};
+
+struct Ktx2Level {
+    uint64_t byteOffset;
+    uint64_t byteLength;
+    uint64_t uncompressedByteLength;
+};
+
+/// value of KTX2_SOURCE_KEY
+struct Ktx2SourceValue {
+    uint32_t version;
+    uint32_t padding;
+    uint64_t sourceSize;
+    int64_t sourceMtime;
+    uint64_t sourceHash;
+};
+
+static_assert(sizeof(Ktx2Header) == 80, "KTX2 header is 80 bytes");
+static_assert(sizeof(Ktx2Level) == 24, "KTX2 level index entry is 24 bytes");
+
+static std::string
+ktx2CachePath(const std::string &texturePath, uint32_t faceCount = 1)
+{
+    return texturePath + (faceCount == 6 ? ".cube.ktx2" : ".ktx2");
+}
+
+/// levels start at a multiple of the block or texel size and of 4
+static uint64_t
+ktx2LevelAlignment(VkFormat format)
+{
+    return blockBytes(format) != 0 ? blockBytes(format) : MIP_BYTES_PER_TEXEL;
+}
+
+/// basic data format descriptor (Khronos Data Format 1.3) of RGBA8 sRGB, one
+/// sample per channel, alpha is linear
+static std::vector<uint32_t>
+ktx2Rgba8DataFormatDescriptor()
+{
+    const uint32_t colorModel = 1; // KHR_DF_MODEL_RGBSDA
+    const uint32_t primaries = 1;  // KHR_DF_PRIMARIES_BT709
+    const uint32_t transfer = 2;   // KHR_DF_TRANSFER_SRGB
+    const uint32_t blockSize = 24 + 4 * 16;
+
+    std::vector<uint32_t> dfd = {4 + blockSize,
+                                 0,
+                                 2 | (blockSize << 16),
+                                 colorModel | (primaries << 8)
+                                     | (transfer << 16),
+                                 0, // 1x1x1x1 texels per block
+                                 MIP_BYTES_PER_TEXEL,
+                                 0};
+    const uint32_t channels[4] = {0, 1, 2, 15 | 0x10}; // R, G, B, linear A
+    for (uint32_t c = 0; c < 4; c++)
+    {
+        dfd.insert(dfd.end(),
+                   {(8 * c) | (7 << 16) | (channels[c] << 24), 0, 0, 255});
+    }
+    return dfd;
+}
+
+/// basic data format descriptor (Khronos Data Format 1.3) of a BC format or
+/// RGBA8
+static std::vector<uint32_t>
+ktx2DataFormatDescriptor(VkFormat format)
+{
+    if (blockBytes(format) == 0)
+    {
+        return ktx2Rgba8DataFormatDescriptor();
+    }
+    const bool bc7 = blockBytes(format) == 16;
+    const uint32_t colorModel = bc7 ? 134 : 128; // KHR_DF_MODEL_BC7 / BC1A
+    const uint32_t primaries = 1;                // KHR_DF_PRIMARIES_BT709
+    const uint32_t transfer = 2;                 // KHR_DF_TRANSFER_SRGB
+    const uint32_t blockSize = 24 + 16;          // one sample
+
+    return {4 + blockSize,
+            0, // vendor Khronos, basic descriptor type
+            2 | (blockSize << 16),
+            colorModel | (primaries << 8) | (transfer << 16),
+            3 | (3 << 8), // 4x4x1x1 texels per block
+            blockBytes(format),
+            0,
+            // the single sample covers the whole block, channel 0 is the
+            // color (BC1) or the data (BC7)
+            ((blockBytes(format) * 8 - 1) << 16),
+            0,
+            0,
+            0xFFFFFFFF};
+}
+
+/**
+ * A validated, memory-mapped KTX2 cache of texturePath. data() points at the
+ * first (smallest) level, the regions of copyRegions() are relative to it.
+ * */
+class Ktx2Cache {
+  public:
+    /// returns false if there is no cache, if it is stale or holds something
+    /// we don't write. faceCount 6 opens the cubemap of texturePath.
+    bool open(const std::string &texturePath, uint32_t faceCount = 1)
+    {
+        SourceFileStamp current;
+        if (not statSourceFile(texturePath, current))
+        {
+            return false;
+        }
+        if (not m_file.open(ktx2CachePath(texturePath, faceCount))
+            || m_file.size() < sizeof(Ktx2Header))
+        {
+            m_file.close();
+            return false;
+        }
+
+        m_header = reinterpret_cast<const Ktx2Header *>(m_file.data());
+        const VkFormat format = static_cast<VkFormat>(m_header->vkFormat);
+        if (memcmp(m_header->identifier, KTX2_IDENTIFIER, 12) != 0
+            || (format != VK_FORMAT_BC1_RGB_SRGB_BLOCK
+                && format != VK_FORMAT_BC7_SRGB_BLOCK
+                && format != VK_FORMAT_R8G8B8A8_SRGB)
+            || m_header->pixelWidth == 0 || m_header->pixelHeight == 0
+            || m_header->pixelDepth != 0 || m_header->layerCount != 0
+            || m_header->faceCount != faceCount
+            || (faceCount == 6
+                && m_header->pixelWidth != m_header->pixelHeight)
+            || m_header->levelCount
+                   != mipLevelCount(m_header->pixelWidth,
+                                    m_header->pixelHeight)
+            || m_header->supercompressionScheme != 0
+            || m_file.size() < sizeof(Ktx2Header)
+                                   + m_header->levelCount * sizeof(Ktx2Level)
+            || not validLevels() || not validSource(current))
+        {
+            invalidate();
+            return false;
+        }
+
+        if (not hashSourceFile(texturePath, current)
+            || m_source.sourceHash != current.hash)
+        {
+            invalidate();
+            return false;
+        }
+        return true;
+    }
+
+    VkFormat format() const
+    {
+        return static_cast<VkFormat>(m_header->vkFormat);
+    }
+    uint32_t width() const { return m_header->pixelWidth; }
+    uint32_t height() const { return m_header->pixelHeight; }
+    uint32_t levelCount() const { return m_header->levelCount; }
+    uint32_t faceCount() const { return m_header->faceCount; }
+
+    const uint8_t *data() const
+    {
+        return reinterpret_cast<const uint8_t *>(m_file.data()) + m_dataStart;
+    }
+
+    /// bytes from the smallest level to the end of level 0
+    size_t dataSize() const { return m_file.size() - m_dataStart; }
+
+    /// one region per level and face, the faces are the array layers
+    std::vector<VkBufferImageCopy> copyRegions() const
+    {
+        CompressedTexture layout;
+        layout.format = format();
+        layout.width = width();
+        layout.height = height();
+        layout.levelCount = levelCount();
+        layout.faceCount = faceCount();
+        for (uint32_t level = 0; level < levelCount(); level++)
+        {
+            layout.levelOffsets.push_back(levels()[level].byteOffset
+                                          - m_dataStart);
+        }
+        return textureCopyRegions(layout);
+    }
+
+  private:
+    const Ktx2Level *levels() const
+    {
+        return reinterpret_cast<const Ktx2Level *>(m_file.data()
+                                                   + sizeof(Ktx2Header));
+    }
+
+    /// every level has the size of its faces, is aligned to the block size
+    /// and lies inside the file
+    bool validLevels()
+    {
+        m_dataStart = m_file.size();
+        for (uint32_t level = 0; level < levelCount(); level++)
+        {
+            const Ktx2Level &entry = levels()[level];
+            if (entry.byteLength
+                    != textureLevelSize(format(), width(), height(), level)
+                           * faceCount()
+                || entry.byteOffset % ktx2LevelAlignment(format()) != 0
+                || entry.byteOffset > m_file.size()
+                || entry.byteLength > m_file.size() - entry.byteOffset)
+            {
+                return false;
+            }
+            m_dataStart = std::min<size_t>(m_dataStart, entry.byteOffset);
+        }
+        return true;
+    }
+
+    /// finds KTX2_SOURCE_KEY in the key/value data and compares it with the
+    /// size and mtime of the image
+    bool validSource(const SourceFileStamp &current)
+    {
+        const uint64_t kvdEnd
+            = uint64_t(m_header->kvdByteOffset) + m_header->kvdByteLength;
+        if (kvdEnd > m_file.size())
+        {
+            return false;
+        }
+
+        const char *entry = m_file.data() + m_header->kvdByteOffset;
+        const char *end = m_file.data() + kvdEnd;
+        while (entry + 4 <= end)
+        {
+            uint32_t length;
+            memcpy(&length, entry, 4);
+            const char *key = entry + 4;
+            if (length > size_t(end - key))
+            {
+                return false;
+            }
+            if (length == sizeof(KTX2_SOURCE_KEY) + sizeof(Ktx2SourceValue)
+                && memcmp(key, KTX2_SOURCE_KEY, sizeof(KTX2_SOURCE_KEY)) == 0)
+            {
+                memcpy(&m_source,
+                       key + sizeof(KTX2_SOURCE_KEY),
+                       sizeof(m_source));
+                return m_source.version == KTX2_CACHE_VERSION
+                       && m_source.sourceSize == current.size
+                       && m_source.sourceMtime == current.mtime;
+            }
+            entry = key + ((length + 3) & ~3u);
+        }
+        return false;
+    }
+
+    void invalidate()
+    {
+        m_file.close();
+        m_header = nullptr;
+    }
+
+    MappedFile m_file;
+    const Ktx2Header *m_header = nullptr;
+    Ktx2SourceValue m_source{};
+    size_t m_dataStart = 0;
+};
+
+/**
+ * Writes the compressed chain as the KTX2 cache of texturePath through a
+ * temporary file like writeMeshCache(), failing is not fatal
+ * */
+static bool
+writeKtx2Cache(const std::string &texturePath, const CompressedTexture &texture)
+{
+    SourceFileStamp stamp;
+    if (not statSourceFile(texturePath, stamp)
+        || not hashSourceFile(texturePath, stamp))
+    {
+        return false;
+    }
+
+    const std::vector<uint32_t> dfd = ktx2DataFormatDescriptor(texture.format);
+    Ktx2SourceValue source{};
+    source.version = KTX2_CACHE_VERSION;
+    source.sourceSize = stamp.size;
+    source.sourceMtime = stamp.mtime;
+    source.sourceHash = stamp.hash;
+
+    std::vector<uint8_t> kvd(4);
+    const uint32_t kvLength = sizeof(KTX2_SOURCE_KEY) + sizeof(source);
+    memcpy(kvd.data(), &kvLength, 4);
+    kvd.insert(kvd.end(),
+               KTX2_SOURCE_KEY,
+               KTX2_SOURCE_KEY + sizeof(KTX2_SOURCE_KEY));
+    kvd.insert(kvd.end(),
+               reinterpret_cast<const uint8_t *>(&source),
+               reinterpret_cast<const uint8_t *>(&source) + sizeof(source));
+    kvd.resize((kvd.size() + 3) & ~size_t(3), 0);
+
+    Ktx2Header header{};
+    memcpy(header.identifier, KTX2_IDENTIFIER, 12);
+    header.vkFormat = texture.format;
+    header.typeSize = 1; // block compressed formats and bytes
+    header.pixelWidth = texture.width;
+    header.pixelHeight = texture.height;
+    header.faceCount = texture.faceCount;
+    header.levelCount = texture.levelCount;
+    header.dfdByteOffset = static_cast<uint32_t>(
+        sizeof(Ktx2Header) + texture.levelCount * sizeof(Ktx2Level));
+    header.dfdByteLength = static_cast<uint32_t>(dfd.size() * 4);
+    header.kvdByteOffset = header.dfdByteOffset + header.dfdByteLength;
+    header.kvdByteLength = static_cast<uint32_t>(kvd.size());
+
+    // the levels go from the smallest to level 0, each aligned to the block
+    // size (lcm of the block size and 4)
+    const uint64_t alignment = ktx2LevelAlignment(texture.format);
+    std::vector<Ktx2Level> levels(texture.levelCount);
+    uint64_t offset = header.kvdByteOffset + header.kvdByteLength;
+    for (uint32_t level = texture.levelCount; level-- > 0;)
+    {
+        const size_t next = level + 1 < texture.levelCount
+                                ? texture.levelOffsets[level + 1]
+                                : texture.data.size();
+        offset = (offset + alignment - 1) / alignment * alignment;
+        levels[level].byteOffset = offset;
+        levels[level].byteLength = next - texture.levelOffsets[level];
+        levels[level].uncompressedByteLength = levels[level].byteLength;
+        offset += levels[level].byteLength;
+    }
+
+    const std::string cachePath
+        = ktx2CachePath(texturePath, texture.faceCount);
+    const std::string tmpPath = cachePath + ".tmp";
+    {
+        std::ofstream file(tmpPath, std::ios::binary | std::ios::trunc);
+        if (not file.is_open())
+        {
+            std::cerr << "failed to write texture cache " << cachePath
+                      << std::endl;
+            return false;
+        }
+
+        file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        file.write(reinterpret_cast<const char *>(levels.data()),
+                   levels.size() * sizeof(Ktx2Level));
+        file.write(reinterpret_cast<const char *>(dfd.data()), dfd.size() * 4);
+        file.write(reinterpret_cast<const char *>(kvd.data()), kvd.size());
+        uint64_t written = header.kvdByteOffset + header.kvdByteLength;
+        for (uint32_t level = texture.levelCount; level-- > 0;)
+        {
+            const char zeros[16] = {};
+            file.write(zeros, levels[level].byteOffset - written);
+            file.write(reinterpret_cast<const char *>(
+                           texture.data.data() + texture.levelOffsets[level]),
+                       levels[level].byteLength);
+            written = levels[level].byteOffset + levels[level].byteLength;
+        }
+
+        if (not file.good())
+        {
+            file.close();
+            std::remove(tmpPath.c_str());
+            std::cerr << "failed to write texture cache " << cachePath
+                      << std::endl;
+            return false;
+        }
+    }
+
+    std::error_code ec;
+    std::filesystem::rename(tmpPath, cachePath, ec);
+    if (ec)
+    {
+        std::remove(tmpPath.c_str());
+        std::cerr << "failed to write texture cache " << cachePath << ": "
+                  << ec.message() << std::endl;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * One texture ready for the staging buffer: every level packed in format,
+ * with the regions that copy them into the image. data points into
+ * whichever of the caches or buffers below it was prepared from.
+ * */
+struct TextureUpload {
+    VkFormat format = VK_FORMAT_R8G8B8A8_SRGB;
+    uint32_t width = 0;
+    uint32_t height = 0;
+    uint32_t levelCount = 0;
+    uint32_t layerCount = 1; /// 6 for a cubemap
+    const uint8_t *data = nullptr;
+    VkDeviceSize size = 0;
+    std::vector<VkBufferImageCopy> regions;
+    const char *source = "";
+    uint8_t *staging = nullptr; /// mapped, if the chain was decoded into it
+
+    Ktx2Cache ktx2Cache;
+    MipCache mipCache;
+    MipChain mipChain;
+    CompressedTexture compressed;
+};
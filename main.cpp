@@ -1,5 +1,34 @@
 #include "data_types.h"
+#include "device_memory.h"
 #include "helper_utilities.h"
+#include "host_allocator.h"
+#include "mesh_cache.h"
+#include "obj_parser.h"
+#include "vertex_weld.h"
+#include "mesh_lod.h"
+#include "mesh_optimizer.h"
+#include "meshlet.h"
+#include "progressive_mesh.h"
+#include "sphere_generator.h"
+#include "staging_ring.h"
+#include "ktx2_file.h"
+#include "texture_compression.h"
+#include "texture_cubemap.h"
+#include "texture_data.h"
+#include "texture_decoder.h"
+#include "texture_mips.h"
+#include "texture_procedural.h"
+#include "texture_residency.h"
+#include "texture_table.h"
+#include "tile_streaming.h"
+#include "upload_batch.h"
+#include "vertex_compression.h"
+#include "benchmarks.h"
+// stb_image allocates through the hooks of texture_decoder.h, so it can
+// decode straight into staging memory
+#define STBI_MALLOC(size) stbiMalloc(size)
+#define STBI_REALLOC(pointer, size) stbiRealloc(pointer, size)
+#define STBI_FREE(pointer) stbiFree(pointer)
 #define STB_IMAGE_IMPLEMENTATION
 #include "includeLibs/stb_image.h"
 
@@ -16,10 +45,12 @@
 #include <cstring>
 // #include <format> only available in C++20 with gcc>11
 #include <fstream>
+#include <future>
 #include <ios>
 #include <iostream>
 #include <limits>
 #include <map>
+#include <mutex>
 #include <optional>
 #include <set>
 #include <stdexcept>
@@ -81,6 +112,90 @@ class TriangleApp {
         cleanup();
     }
 
+    /// run the mesh optimizer on models that are loaded from OBJ files
+    void setOptimizeMeshes(bool optimize) { m_optimizeMeshes = optimize; }
+
+    void setVertexLayout(VertexLayout layout) { m_vertexLayout = layout; }
+
+    /// load the models in sphereMap from their OBJ files instead
+    void setGenerateSpheres(bool generate) { m_generateSpheres = generate; }
+
+    /// mesh density of a generated sphere, overrides the one in sphereMap
+    void setSphereSubdivisions(Model model, uint32_t subdivisions)
+    {
+        m_sphereSubdivisions[model] = subdivisions;
+    }
+
+    /// build levels of detail for the loaded meshes, see mesh_lod.h
+    void setGenerateLods(bool generate) { m_generateLods = generate; }
+
+    /// screen space error in pixels the drawn level of detail may have
+    void setLodPixelError(float pixels) { m_lodPixelError = pixels; }
+
+    /// skip meshlets outside the view or facing away, see meshlet.h
+    void setCullingMode(CullingMode mode) { m_cullingMode = mode; }
+
+    /// the body that is drawn, see bodyMap
+    void setBody(Model model) { sceneModels = {model}; }
+
+    /// upload the finer levels of detail in the background, see
+    /// streamMeshes()
+    void setStreamMeshes(bool stream) { m_streamMeshes = stream; }
+
+    /// upload textures block compressed (BC1/BC7) where the device supports
+    /// it, see texture_compression.h
+    void setCompressTextures(bool compress) { m_compressTextures = compress; }
+
+    /// resample the equirectangular texture of a sphere into a cubemap and
+    /// sample it by direction, see texture_cubemap.h
+    void setCubemapTextures(bool cubemap) { m_cubemapTextures = cubemap; }
+
+    /// sample the textures of all scene models from one descriptor array,
+    /// see texture_table.h
+    void setBindlessTextures(bool bindless) { m_bindlessTextures = bindless; }
+
+    /// copy the texture stream-ins on a transfer only queue if the device
+    /// has one, see chooseAsyncTransfers()
+    void setAsyncTransfers(bool async) { m_asyncTransfers = async; }
+
+    /// count the host memory of the Vulkan objects, see host_allocator.h
+    void setHostTracking(bool tracking) { m_hostTracking = tracking; }
+
+    /// serve the command scope host allocations from an arena rewound
+    /// every frame, needs the host tracking
+    void setHostArena(bool arena) { m_hostArena = arena; }
+
+    /// write the host allocation stats to path at exit (and with the
+    /// button of the ImGui window)
+    void setHostStatsJson(const std::string &path)
+    {
+        m_hostStatsPath = path;
+        m_hostStatsAtExit = true;
+    }
+
+    /// device memory the mip levels of the textures may take, see
+    /// texture_residency.h
+    void setTextureBudget(uint64_t megabytes)
+    {
+        m_textureBudgetMegabytes = megabytes;
+    }
+
+    /// draw the first scene model with the imagery of a local tile pyramid
+    /// instead of its texture, see tile_streaming.h
+    void setTileDirectory(const std::string &directory)
+    {
+        m_tileDirectory = directory;
+    }
+
+    /// device memory of the tile cache
+    void setTileCacheSize(uint32_t megabytes)
+    {
+        m_tileCacheMegabytes = megabytes;
+    }
+
+    /// pixels a tile texel may cover before the finer tile is requested
+    void setTileTexelPixels(float pixels) { m_tileTexelPixels = pixels; }
+
   private:
     bool checkValidationLayerSupport()
     {
@@ -178,25 +293,41 @@ class TriangleApp {
 
     void initVulkan()
     {
+        if (m_hostTracking)
+        {
+            m_hostAllocator.init(m_hostArena ? HOST_ARENA_SIZE : 0);
+        }
         createInstance();
         setupDebugMessenger();
         setupWindowSurface();
         pickPhysicalDevice();
         createLogicalDevice();
+        m_memory.init(physicalDevice, device, allocator());
+        createUploadQueues();
         createSwapChain();
         createImageViews();
         createRenderPass();
         createDescriptorSetLayout();
+        // the vertex format of the pipeline depends on the loaded meshes
+        loadModels();
+        chooseVertexFormat();
+        openTilePyramid();
         createGraphicsPipeline();
+        createCullingPipeline();
         createCommandPool();
         createDepthRessources();
         createFrameBuffers();
         createTextureImage();
         createTextureImageView();
         createTextureSampler();
-        loadModels();
+        createTileCache();
         createVertexBuffer();
         createIndexBuffer();
+        streamMeshes();
+        createMeshletBuffers();
+        // the uploads above went into one batch, the frames come after it
+        m_initUploadStart = std::chrono::high_resolution_clock::now();
+        m_initUploads = m_uploads.submit();
         createUniformBuffers();
         createDescriptorPool();
         createDescriptorSets();
@@ -204,6 +335,35 @@ class TriangleApp {
         createSyncObjects();
     }
 
+    /**
+     * The staging ring, the upload batches of the graphics queue and, with
+     * a transfer queue, the ones of the stream-in copies on it
+     * */
+    void createUploadQueues()
+    {
+        std::vector<uint32_t> queueFamilies = {graphicsQueueFamily};
+        m_uploads.init(
+            device, graphicsQueue, graphicsQueueFamily, allocator());
+        if (m_asyncTransfers)
+        {
+            queueFamilies.push_back(transferQueueFamily);
+            m_transfers.init(
+                device, transferQueue, transferQueueFamily, allocator());
+        }
+        m_staging.init(device,
+                       m_memory,
+                       readableStagingProperties(),
+                       queueFamilies,
+                       allocator());
+    }
+
+    /// pAllocator of every Vulkan create and destroy call, null without
+    /// the host tracking
+    const VkAllocationCallbacks *allocator() const
+    {
+        return m_hostAllocator.callbacks();
+    }
+
     VkCommandBuffer BeginSingleTimeCommands(VkDevice device,
                                             VkCommandPool commandPool)
     {
@@ -256,6 +416,26 @@ class TriangleApp {
     float m_fieldOfView{45.0f};
     float m_zNear{0.1f};
     float m_zFar{10.0f};
+    bool m_optimizeMeshes{true};
+    VertexLayout m_vertexLayout{VertexLayout::Compact};
+    bool m_generateSpheres{true};
+    std::map<Model, uint32_t> m_sphereSubdivisions;
+    bool m_generateLods{true};
+    float m_lodPixelError{LOD_PIXEL_ERROR};
+    CullingMode m_cullingMode{CullingMode::Gpu};
+    bool m_streamMeshes{true};
+    bool m_compressTextures{true};
+    bool m_cubemapTextures{false};
+    bool m_bindlessTextures{true};
+    bool m_asyncTransfers{true};
+    bool m_hostTracking{true};
+    bool m_hostArena{false};
+    std::string m_hostStatsPath{"host_allocations.json"};
+    bool m_hostStatsAtExit{false};
+    uint64_t m_textureBudgetMegabytes{TEXTURE_BUDGET_MEGABYTES};
+    std::string m_tileDirectory;
+    uint32_t m_tileCacheMegabytes{256};
+    float m_tileTexelPixels{TILE_TEXEL_PIXELS};
 
     void setEyeVector(float x, float y, float z)
     {
@@ -462,6 +642,119 @@ class TriangleApp {
                             io.Framerate);
                 ImGui::Text("StartTime rotating earth: %s ",
                             time_point_to_string(startTime).c_str());
+
+                // counted while recording the last frame, the GPU culled
+                // meshlets aren't read back
+                ImGui::Text("Triangles drawn: %u%s",
+                            m_drawnTriangles,
+                            m_cullingMode == CullingMode::Gpu
+                                ? " (before GPU culling)"
+                                : "");
+                int cullingMode = static_cast<int>(m_cullingMode);
+                ImGui::RadioButton("No culling", &cullingMode, 0);
+                ImGui::SameLine();
+                ImGui::RadioButton("CPU culling", &cullingMode, 1);
+                if (not culledDrawBuffers.empty())
+                {
+                    ImGui::SameLine();
+                    ImGui::RadioButton("GPU culling", &cullingMode, 2);
+                }
+                m_cullingMode = static_cast<CullingMode>(cullingMode);
+                if (not m_streamTasks.empty())
+                {
+                    ImGui::Text("Streaming levels of detail: %zu left",
+                                m_streamTasks.size());
+                }
+                ImGui::SetNextItemWidth(80.0f);
+                ImGui::SliderFloat(
+                    "LOD error (pixels)", &m_lodPixelError, 0.1f, 16.0f);
+                if (m_bindlessTextures)
+                {
+                    ImGui::Text("Bindless textures: %u of %u slots",
+                                m_textureTable.size(),
+                                m_textureArraySize);
+                }
+                const ResidencyStats residency = m_textureResidency.stats();
+                ImGui::Text("Texture levels resident: %u of %u (wanted %u), "
+                            "%.1f of %.0f MB",
+                            textureMipLevels,
+                            textureLevelCount,
+                            textureLevelCount
+                                - m_textureResidency.wantedLevel(
+                                    m_residentTexture),
+                            residency.residentBytes / 1048576.0,
+                            residency.budgetBytes / 1048576.0);
+                if (m_surface.width != 0)
+                {
+                    ImGui::Text("Procedural surface: seed %u, %.1f MB of "
+                                "levels cached, %llu hits, %llu generated",
+                                m_surface.seed,
+                                m_surfaceCache.bytes() / 1048576.0,
+                                static_cast<unsigned long long>(
+                                    m_surfaceCache.hits()),
+                                static_cast<unsigned long long>(
+                                    m_surfaceCache.misses()));
+                }
+                ImGui::Text(
+                    "Mip evictions: %llu (%.0f/s), stream-ins: %llu, "
+                    "latency %.1f ms (%.1f ms average)",
+                    static_cast<unsigned long long>(residency.evictions),
+                    residency.evictionsPerSecond,
+                    static_cast<unsigned long long>(residency.streamIns),
+                    residency.lastLatency,
+                    residency.averageLatency);
+                if (m_tileStreaming)
+                {
+                    ImGui::Text("Tiles resident: %u of %u, loading: %zu, "
+                                "waiting: %zu",
+                                m_tileCache.residentCount(),
+                                m_tileCache.layerCount(),
+                                m_tileTasks.size(),
+                                m_tileSelection.requests.size());
+                    ImGui::Text("Tile patches drawn: %zu",
+                                m_tileSelection.patches.size());
+                    ImGui::SetNextItemWidth(80.0f);
+                    ImGui::SliderFloat("Tile texel size (pixels)",
+                                       &m_tileTexelPixels,
+                                       0.25f,
+                                       8.0f);
+                }
+                const MemoryStats memory = m_memory.stats();
+                ImGui::Text("Device memory: %u allocations (of %u), "
+                            "%.1f of %.0f MB used in %u blocks, %.1f MB "
+                            "dedicated",
+                            memory.deviceAllocations,
+                            memory.maxDeviceAllocations,
+                            memory.usedBlockBytes / 1048576.0,
+                            memory.blockBytes / 1048576.0,
+                            memory.blocks,
+                            memory.dedicatedBytes / 1048576.0);
+                const StagingStats staging = m_staging.stats();
+                ImGui::Text("Staging ring: %.1f of %.0f MB in use (peak "
+                            "%.1f), %llu uploads overflowed",
+                            staging.usedBytes / 1048576.0,
+                            staging.ringBytes / 1048576.0,
+                            staging.peakBytes / 1048576.0,
+                            static_cast<unsigned long long>(
+                                staging.overflows));
+                if (m_asyncTransfers)
+                {
+                    ImGui::Text("Transfer queue: %llu stream-ins copied, "
+                                "last %.1f ms, frames %.2f ms while copying, "
+                                "%.2f ms otherwise",
+                                static_cast<unsigned long long>(
+                                    m_transferOverlap.transfers),
+                                m_transferOverlap.lastTransfer,
+                                m_transferOverlap.frameTime(true),
+                                m_transferOverlap.frameTime(false));
+                } else
+                {
+                    ImGui::Text("Uploads on the graphics queue");
+                }
+                if (m_hostTracking)
+                {
+                    drawHostAllocationStats();
+                }
             }
             ImGui::End();
         }
@@ -470,6 +763,52 @@ class TriangleApp {
         ImGui::Render();
     }
 
+    /// counted by m_hostAllocator, see host_allocator.h
+    void drawHostAllocationStats()
+    {
+        const HostAllocationStats host = m_hostAllocator.stats();
+        ImGui::Text("Host memory: %.1f KB in %llu allocations, %.1f KB "
+                    "internal",
+                    host.bytes() / 1024.0,
+                    static_cast<unsigned long long>(host.allocations()),
+                    host.internal.bytes / 1024.0);
+        if (ImGui::TreeNode("Host allocations per scope"))
+        {
+            for (uint32_t scope = 0; scope < HOST_SCOPE_COUNT; scope++)
+            {
+                const HostScopeStats &stats = host.scopes[scope];
+                ImGui::Text("%-8s %8.1f KB (peak %.1f), %llu alive (peak "
+                            "%llu), %llu made",
+                            hostScopeName(scope),
+                            stats.bytes / 1024.0,
+                            stats.peakBytes / 1024.0,
+                            static_cast<unsigned long long>(stats.allocations),
+                            static_cast<unsigned long long>(
+                                stats.peakAllocations),
+                            static_cast<unsigned long long>(
+                                stats.totalAllocations));
+            }
+            if (host.arenaBytes != 0)
+            {
+                ImGui::Text("Command arena: %.1f of %.0f KB at most in a "
+                            "frame, %llu allocations, %llu didn't fit",
+                            host.arenaPeakBytes / 1024.0,
+                            host.arenaBytes / 1024.0,
+                            static_cast<unsigned long long>(
+                                host.arenaAllocations),
+                            static_cast<unsigned long long>(
+                                host.arenaFallbacks));
+            }
+            if (ImGui::Button("Write JSON"))
+            {
+                m_hostAllocator.writeJson(m_hostStatsPath);
+            }
+            ImGui::SameLine();
+            ImGui::Text("%s", m_hostStatsPath.c_str());
+            ImGui::TreePop();
+        }
+    }
+
     void initImGui()
     {
         // Setup Dear ImGui context
@@ -503,7 +842,7 @@ class TriangleApp {
         init_info.MinImageCount = 2;
         init_info.ImageCount = MAX_FRAMES_IN_FLIGHT;
         init_info.MSAASamples = VK_SAMPLE_COUNT_1_BIT;
-        init_info.Allocator = nullptr;
+        init_info.Allocator = allocator();
         init_info.CheckVkResultFn = check_vk_result;
         ImGui_ImplVulkan_Init(&init_info);
 
@@ -647,7 +986,41 @@ class TriangleApp {
                                                  m_rotationSpeed,
                                                  rotatingTime);
 
-        updateUniformBuffer(currentFrame, finalModelMatrix);
+        // the uploads the last use of this frame in flight copied are done
+        m_staging.reclaim();
+        m_hostAllocator.beginFrame();
+        const auto frameStart = std::chrono::high_resolution_clock::now();
+        if (m_asyncTransfers
+            && m_lastFrameStart.time_since_epoch().count() != 0)
+        {
+            m_transferOverlap.addFrame(
+                std::chrono::duration<double>(frameStart - m_lastFrameStart)
+                    .count(),
+                not m_transferringTextureSwaps.empty());
+        }
+        m_lastFrameStart = frameStart;
+        if (m_initUploads != 0 && m_uploads.done(m_initUploads))
+        {
+            std::cout << "Initial uploads done "
+                      << std::chrono::duration<float, std::milli>(
+                             std::chrono::high_resolution_clock::now()
+                             - m_initUploadStart)
+                             .count()
+                      << " ms after their submit" << std::endl;
+            m_initUploads = 0;
+        }
+        collectMeshBatches();
+        selectMeshLods(finalModelMatrix);
+        updateCullConstants(finalModelMatrix);
+        collectTileBatches();
+        selectTilePatches(finalModelMatrix);
+        updateTextureResidency();
+        writeTextureDescriptors(currentFrame);
+
+        // compact positions are in [0, 1] of the mesh bounds, scale them back
+        // before the model transformation
+        updateUniformBuffer(currentFrame,
+                            finalModelMatrix * m_positionDequantization);
 
         // only reset the fence if we are submitting work
         vkResetFences(device, 1, &inFlightFences[currentFrame]);
@@ -662,15 +1035,24 @@ class TriangleApp {
         VkSubmitInfo submitInfo{};
         submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
 
-        VkSemaphore waitSemaphores[] = {imageAvailableSemaphores[currentFrame]};
-        VkPipelineStageFlags waitStages[]
+        std::vector<VkSemaphore> waitSemaphores
+            = {imageAvailableSemaphores[currentFrame]};
+        std::vector<VkPipelineStageFlags> waitStages
             = {VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT};
+        // the copies of the transfer queue the texture swaps acquire
+        for (VkSemaphore transferred : m_transferWaits)
+        {
+            waitSemaphores.push_back(transferred);
+            waitStages.push_back(VK_PIPELINE_STAGE_TRANSFER_BIT);
+        }
+        m_transferWaits.clear();
         // for details see Tutorial: submitting the command buffer
         // which semaphore to wait on before the execution begins & in which
         // stages the pipeline to wait
-        submitInfo.waitSemaphoreCount = 1;
-        submitInfo.pWaitSemaphores = waitSemaphores;
-        submitInfo.pWaitDstStageMask = waitStages;
+        submitInfo.waitSemaphoreCount
+            = static_cast<uint32_t>(waitSemaphores.size());
+        submitInfo.pWaitSemaphores = waitSemaphores.data();
+        submitInfo.pWaitDstStageMask = waitStages.data();
         // which command buffer to submit for execution
         submitInfo.commandBufferCount = 1;
         submitInfo.pCommandBuffers = &commandBuffers[currentFrame];
@@ -789,7 +1171,13 @@ class TriangleApp {
          * position and up axis as parameters.
          * */
         ubo.view = glm::lookAt(eyeVec, centerVec, upVec);
+        ubo.proj = projectionMatrix();
+
+        memcpy(uniformBuffersMapped[currentImage], &ubo, sizeof(ubo));
+    }
 
+    glm::mat4 projectionMatrix()
+    {
         /**
          * Perspective projection with a 45 degree vertical field-of-view. The
          * other parameters are the aspect ratio, near and far view planes. It
@@ -797,74 +1185,190 @@ class TriangleApp {
          * aspect ratio to take into account the new width and height of the
          * window after a resize.
          * */
-        ubo.proj = glm::perspective(glm::radians(m_fieldOfView),
-                                    swapChainExtent.width
-                                        / (float)swapChainExtent.height,
-                                    m_zNear,
-                                    m_zFar);
+        glm::mat4 proj = glm::perspective(glm::radians(m_fieldOfView),
+                                          swapChainExtent.width
+                                              / (float)swapChainExtent.height,
+                                          m_zNear,
+                                          m_zFar);
         // GLM was originally designed for OpenGL, where the Y coordinate of the
         // clip coordinates is inverted. The easiest way to compensate for that
         // is to flip the sign on the scaling factor of the Y axis in the
         // projection matrix. If you don’t do this, then the image will be
         // rendered upside down
-        ubo.proj[1][1] *= -1;
+        proj[1][1] *= -1;
+        return proj;
+    }
 
-        memcpy(uniformBuffersMapped[currentImage], &ubo, sizeof(ubo));
+    /// the meshlet bounds are in model space, the frustum and the camera are
+    /// moved there instead of moving every meshlet into view space
+    void updateCullConstants(const glm::mat4 &modelMatrix)
+    {
+        glm::mat4 view = glm::lookAt(eyeVec, centerVec, upVec);
+        m_cullConstants.frustum
+            = frustumPlanes(projectionMatrix() * view * modelMatrix);
+        m_cullConstants.eye
+            = glm::inverse(modelMatrix) * glm::vec4(eyeVec, 1.0f);
     }
 
     void cleanup()
     {
         cleanUpSwapChain();
 
-        vkDestroySampler(device, textureSampler, nullptr);
-        vkDestroyImageView(device, textureImageView, nullptr);
-        vkDestroyImage(device, textureImage, nullptr);
-        vkFreeMemory(device, textureImageMemory, nullptr);
+        // the workers still write the staging regions of unfinished batches
+        for (auto &task : m_streamTasks)
+        {
+            task.wait();
+        }
+        for (auto *batches : {&m_streamedBatches, &m_pendingBatches})
+        {
+            for (const auto &batch : *batches)
+            {
+                m_staging.release(batch.staging, VK_NULL_HANDLE);
+            }
+        }
+
+        // the workers still decode into the staging regions of their tiles
+        for (auto &task : m_tileTasks)
+        {
+            task.wait();
+        }
+        for (auto *batches : {&m_streamedTiles, &m_pendingTiles})
+        {
+            for (const auto &batch : *batches)
+            {
+                m_staging.release(batch.staging, VK_NULL_HANDLE);
+            }
+        }
+        vkDestroyDescriptorPool(device, tileDescriptorPool, allocator());
+        vkDestroyPipeline(device, tilePipeline, allocator());
+        vkDestroyPipelineLayout(device, tilePipelineLayout, allocator());
+        vkDestroyDescriptorSetLayout(
+            device, tileDescriptorSetLayout, allocator());
+        vkDestroyBuffer(device, tileIndexBuffer, allocator());
+        m_memory.free(tileIndexBufferMemory);
+        vkDestroySampler(device, tileSampler, allocator());
+        vkDestroyImageView(device, tileImageView, allocator());
+        vkDestroyImage(device, tileImage, allocator());
+        m_memory.free(tileImageMemory);
+
+        // the worker may still fill the staging region of a stream-in
+        if (m_textureStream.valid())
+        {
+            m_textureStream.wait();
+            try
+            {
+                destroyTextureSwap(m_textureStream.get());
+            } catch (const std::exception &)
+            {
+            }
+        }
+        for (auto *swaps : {&m_pendingTextureSwaps, &m_copiedTextureSwaps})
+        {
+            for (const auto &swap : *swaps)
+            {
+                destroyTextureSwap(swap);
+            }
+        }
+        // not swapped in yet, their images are no textureImage
+        for (const auto &swap : m_transferringTextureSwaps)
+        {
+            destroyTextureSwap(swap);
+            vkDestroyImage(device, swap.image, allocator());
+            m_memory.free(swap.imageMemory);
+        }
+        vkDestroySampler(device, textureSampler, allocator());
+        vkDestroyImageView(device, textureImageView, allocator());
+        vkDestroyImage(device, textureImage, allocator());
+        m_memory.free(textureImageMemory);
+        for (const auto &texture : m_sceneTextures)
+        {
+            vkDestroyImageView(device, texture.view, allocator());
+            vkDestroyImage(device, texture.image, allocator());
+            m_memory.free(texture.memory);
+        }
 
         for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++)
         {
-            vkDestroyBuffer(device, uniformBuffers[i], nullptr);
-            vkFreeMemory(device, uniformBuffersMemory[i], nullptr);
+            vkDestroyBuffer(device, uniformBuffers[i], allocator());
+            m_memory.free(uniformBuffersMemory[i]);
         }
 
-        vkDestroyDescriptorPool(
-            device, descriptorPool, nullptr); // also cleans up DescriptorSets
-        vkDestroyDescriptorSetLayout(device, descriptorSetLayout, nullptr);
+        vkDestroyDescriptorPool(device,
+                                descriptorPool,
+                                allocator()); // also cleans up DescriptorSets
+        vkDestroyDescriptorSetLayout(device, descriptorSetLayout, allocator());
 
-        vkDestroyBuffer(device, indexBuffer, nullptr);
-        vkFreeMemory(device, indexBufferMemory, nullptr);
+        vkDestroyBuffer(device, indexBuffer, allocator());
+        m_memory.free(indexBufferMemory);
+
+        // null handles are ignored, they are left when culling on the CPU
+        for (size_t i = 0; i < culledDrawBuffers.size(); i++)
+        {
+            vkDestroyBuffer(device, culledDrawBuffers[i], allocator());
+            m_memory.free(culledDrawBuffersMemory[i]);
+            vkDestroyBuffer(device, cullCounterBuffers[i], allocator());
+            m_memory.free(cullCounterBuffersMemory[i]);
+        }
+        vkDestroyBuffer(device, meshletDrawBuffer, allocator());
+        m_memory.free(meshletDrawBufferMemory);
+        vkDestroyBuffer(device, meshletBoundsBuffer, allocator());
+        m_memory.free(meshletBoundsBufferMemory);
+        vkDestroyDescriptorPool(device, cullDescriptorPool, allocator());
+        vkDestroyPipeline(device, cullPipeline, allocator());
+        vkDestroyPipelineLayout(device, cullPipelineLayout, allocator());
+        vkDestroyDescriptorSetLayout(
+            device, cullDescriptorSetLayout, allocator());
 
-        vkDestroyBuffer(device, vertexBuffer, nullptr);
-        vkFreeMemory(device, vertexBufferMemory, nullptr);
+        vkDestroyBuffer(device, vertexBuffer, allocator());
+        m_memory.free(vertexBufferMemory);
 
-        vkDestroyPipeline(device, graphicsPipeline, nullptr);
-        vkDestroyPipelineLayout(device, pipelineLayout, nullptr);
+        vkDestroyPipeline(device, graphicsPipeline, allocator());
+        vkDestroyPipelineLayout(device, pipelineLayout, allocator());
 
-        vkDestroyRenderPass(device, renderPass, nullptr);
+        vkDestroyRenderPass(device, renderPass, allocator());
 
         for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++)
         {
-            vkDestroySemaphore(device, imageAvailableSemaphores[i], nullptr);
-            vkDestroySemaphore(device, renderFinishedSemaphores[i], nullptr);
-            vkDestroyFence(device, inFlightFences[i], nullptr);
+            vkDestroySemaphore(
+                device, imageAvailableSemaphores[i], allocator());
+            vkDestroySemaphore(
+                device, renderFinishedSemaphores[i], allocator());
+            vkDestroyFence(device, inFlightFences[i], allocator());
         }
 
-        vkDestroyCommandPool(device, commandPool, nullptr);
+        vkDestroyCommandPool(device, commandPool, allocator());
+
+        vkDestroyImageView(device, depthImageView, allocator());
+        vkDestroyImage(device, depthImage, allocator());
+        m_memory.free(depthImageMemory);
+        m_uploads.destroy();
+        if (m_asyncTransfers)
+        {
+            m_transfers.destroy();
+        }
+        m_staging.destroy();
+        m_memory.destroy();
 
         // destroy the instance right before the window
-        vkDestroyDevice(device, nullptr);
+        vkDestroyDevice(device, allocator());
         // must be destroyed before the instance -> to validate all code after
         // this we can use a separate debug utils messenger
         if (enableValidationLayers)
         {
-            DestroyDebugUtilsMessengerEXT(instance, debugMesseger, nullptr);
+            DestroyDebugUtilsMessengerEXT(instance, debugMesseger, allocator());
         }
 
         vkDestroySurfaceKHR(instance,
                             surface,
-                            nullptr); /// surface need to be destroyed before
-                                      /// the instance destruction !
-        vkDestroyInstance(instance, nullptr);
+                            allocator()); /// surface need to be destroyed
+                                          /// before the instance destruction !
+        vkDestroyInstance(instance, allocator());
+        // what is still alive now was leaked
+        if (m_hostStatsAtExit && m_hostAllocator.writeJson(m_hostStatsPath))
+        {
+            std::cout << "Host allocations written to " << m_hostStatsPath
+                      << std::endl;
+        }
 
         glfwDestroyWindow(window);
         std::cout << "Cleanup!" << std::endl;
@@ -875,15 +1379,15 @@ class TriangleApp {
     {
         for (auto framebuffer : swapChainFramebuffers)
         {
-            vkDestroyFramebuffer(device, framebuffer, nullptr);
+            vkDestroyFramebuffer(device, framebuffer, allocator());
         }
 
         for (auto imageView : swapChainImageViews)
         {
-            vkDestroyImageView(device, imageView, nullptr);
+            vkDestroyImageView(device, imageView, allocator());
         }
 
-        vkDestroySwapchainKHR(device, swapChain, nullptr);
+        vkDestroySwapchainKHR(device, swapChain, allocator());
     }
     /**
      * There is no global state in Vulkan and all per-application state is
@@ -907,7 +1411,21 @@ class TriangleApp {
         appInfo.applicationVersion = VK_MAKE_VERSION(1, 0, 0);
         appInfo.pEngineName = "No Engine";
         appInfo.engineVersion = VK_MAKE_VERSION(1, 0, 0);
-        appInfo.apiVersion = VK_API_VERSION_1_0;
+        // 1.2 for the descriptor indexing of bindless textures if the loader
+        // has it, a 1.0 loader refuses any higher version and doesn't export
+        // vkEnumerateInstanceVersion. The device may still be 1.0, see
+        // chooseBindlessTextures()
+        m_instanceApiVersion = VK_API_VERSION_1_0;
+        auto enumerateInstanceVersion
+            = reinterpret_cast<PFN_vkEnumerateInstanceVersion>(
+                vkGetInstanceProcAddr(nullptr, "vkEnumerateInstanceVersion"));
+        if (enumerateInstanceVersion)
+        {
+            enumerateInstanceVersion(&m_instanceApiVersion);
+        }
+        m_instanceApiVersion
+            = std::min<uint32_t>(m_instanceApiVersion, VK_API_VERSION_1_2);
+        appInfo.apiVersion = m_instanceApiVersion;
 
         // 2. another nonoptional struct to fill for the instance
         VkInstanceCreateInfo createInfo{};
@@ -940,7 +1458,7 @@ class TriangleApp {
         // ...
         //
         // 3. finally create the instance and check result
-        if (vkCreateInstance(&createInfo, nullptr, &instance) != VK_SUCCESS)
+        if (vkCreateInstance(&createInfo, allocator(), &instance) != VK_SUCCESS)
         {
             throw std::runtime_error("failed to create instance");
         }
@@ -997,7 +1515,8 @@ class TriangleApp {
         createInfo.hwnd = glfwGetWin32Window(window);
         createInfo.hinstance = GetModuleHandle(nullptr);
 
-        if (vkCreateWin32SurfaceKHR(instance, &createInfo, nullptr, &surface)
+        if (vkCreateWin32SurfaceKHR(
+                instance, &createInfo, allocator(), &surface)
             != VK_SUCCESS)
         {
             throw std::runtime_error("failed to create window surface!");
@@ -1005,7 +1524,7 @@ class TriangleApp {
 #endif
 
 #ifdef __linux__
-        if (glfwCreateWindowSurface(instance, window, nullptr, &surface)
+        if (glfwCreateWindowSurface(instance, window, allocator(), &surface)
             != VK_SUCCESS)
         {
             throw std::runtime_error("failed to create window!");
@@ -1064,6 +1583,19 @@ class TriangleApp {
             }
             ++i;
         }
+
+        // the copy engine of discrete GPUs, it transfers while the graphics
+        // queue draws
+        for (uint32_t family = 0; family < queueFamilyCount; family++)
+        {
+            const VkQueueFlags flags = queueFamilies[family].queueFlags;
+            if ((flags & VK_QUEUE_TRANSFER_BIT)
+                && not(flags & (VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT)))
+            {
+                indices.transferFamily = family;
+                break;
+            }
+        }
         return indices;
     }
 
@@ -1314,15 +1846,95 @@ class TriangleApp {
                && supportedFeatures.samplerAnisotropy;
     }
 
+    /**
+     * Bindless textures need descriptor indexing (Vulkan 1.2) for a partly
+     * written sampler array that is indexed per draw, firstInstance in the
+     * indirect draws for the index and their shaders. Without, the first
+     * scene model's texture stays the only one, in binding 1.
+     * */
+    void chooseBindlessTextures()
+    {
+        if (not m_bindlessTextures)
+        {
+            return;
+        }
+
+        VkPhysicalDeviceProperties properties{};
+        vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+        VkPhysicalDeviceDescriptorIndexingFeatures indexingFeatures{};
+        indexingFeatures.sType
+            = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_INDEXING_FEATURES;
+        VkPhysicalDeviceFeatures2 features{};
+        features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+        features.pNext = &indexingFeatures;
+        const char *fallbackReason = nullptr;
+        if (m_cubemapTextures)
+        {
+            fallbackReason = "cubemap textures are sampled by direction";
+        } else if (m_instanceApiVersion < VK_API_VERSION_1_2)
+        {
+            fallbackReason = "no Vulkan 1.2 loader";
+        } else if (properties.apiVersion < VK_API_VERSION_1_2)
+        {
+            fallbackReason = "no Vulkan 1.2";
+        } else
+        {
+            vkGetPhysicalDeviceFeatures2(physicalDevice, &features);
+            if (not indexingFeatures.runtimeDescriptorArray
+                || not indexingFeatures.descriptorBindingPartiallyBound
+                || not indexingFeatures
+                           .shaderSampledImageArrayNonUniformIndexing)
+            {
+                fallbackReason = "no descriptor indexing";
+            } else if (not features.features.drawIndirectFirstInstance)
+            {
+                fallbackReason = "no drawIndirectFirstInstance";
+            }
+        }
+        if (not fallbackReason)
+        {
+            try
+            {
+                readFile("shaders/bindless_vert.spv");
+                readFile("shaders/bindless_frag.spv");
+            } catch (const std::exception &)
+            {
+                fallbackReason = "shaders/bindless_vert.spv is missing, build "
+                                 "the shaders target or run "
+                                 "shaders/compile.sh";
+            }
+        }
+        if (fallbackReason)
+        {
+            std::cout << "Bindless textures unavailable (" << fallbackReason
+                      << "), sampling the first scene model's texture"
+                      << std::endl;
+            m_bindlessTextures = false;
+            return;
+        }
+
+        // binding 1 is a sampler of the fragment shader as well
+        const VkPhysicalDeviceLimits &limits = properties.limits;
+        m_textureArraySize
+            = std::min({BINDLESS_TEXTURE_CAPACITY,
+                        limits.maxPerStageDescriptorSamplers - 1,
+                        limits.maxPerStageDescriptorSampledImages - 1});
+    }
+
     // TODO: proceed to check
     void createLogicalDevice()
     {
         // 1. specifying details in structs
         QueueFamilyIndices indices = findQueueFamilies(physicalDevice);
+        chooseAsyncTransfers(indices);
 
         std::vector<VkDeviceQueueCreateInfo> queueCreateInfos;
         std::set<uint32_t> uniqueQueueFamilies
             = {indices.graphicsFamily.value(), indices.presentFamily.value()};
+        if (m_asyncTransfers)
+        {
+            uniqueQueueFamilies.insert(indices.transferFamily.value());
+        }
 
         // influence scheduling of command buffer execution from 0.0 .. 1.0
         float queuePriority = 1.0f;
@@ -1330,7 +1942,7 @@ class TriangleApp {
         {
             VkDeviceQueueCreateInfo queueCreateInfo{};
             queueCreateInfo.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
-            queueCreateInfo.queueFamilyIndex = indices.graphicsFamily.value();
+            queueCreateInfo.queueFamilyIndex = queueFamily;
             queueCreateInfo.queueCount = 1;
             queueCreateInfo.pQueuePriorities = &queuePriority;
             queueCreateInfos.push_back(queueCreateInfo);
@@ -1341,12 +1953,25 @@ class TriangleApp {
             = VK_TRUE; /// optional feature, we need explicitly request it
         vkGetPhysicalDeviceFeatures(physicalDevice, &deviceFeatures);
 
+        // descriptor indexing for the bindless texture array
+        chooseBindlessTextures();
+        VkPhysicalDeviceDescriptorIndexingFeatures indexingFeatures{};
+        indexingFeatures.sType
+            = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_INDEXING_FEATURES;
+        indexingFeatures.shaderSampledImageArrayNonUniformIndexing = VK_TRUE;
+        indexingFeatures.descriptorBindingPartiallyBound = VK_TRUE;
+        indexingFeatures.runtimeDescriptorArray = VK_TRUE;
+
         VkDeviceCreateInfo createInfo{};
         createInfo.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
         createInfo.pQueueCreateInfos = queueCreateInfos.data();
         createInfo.queueCreateInfoCount
             = static_cast<uint32_t>(queueCreateInfos.size());
         createInfo.pEnabledFeatures = &deviceFeatures;
+        if (m_bindlessTextures)
+        {
+            createInfo.pNext = &indexingFeatures;
+        }
         // using the swapchain : enabling the VK_KHR_swapchain
         createInfo.enabledExtensionCount
             = static_cast<uint32_t>(deviceExtensions.size());
@@ -1368,7 +1993,7 @@ class TriangleApp {
             createInfo.enabledLayerCount = 0;
         }
 
-        if (vkCreateDevice(physicalDevice, &createInfo, nullptr, &device)
+        if (vkCreateDevice(physicalDevice, &createInfo, allocator(), &device)
             != VK_SUCCESS)
         {
             throw std::runtime_error("failed to create logical device!");
@@ -1383,6 +2008,36 @@ class TriangleApp {
         // index retrieve the  queue handle
         vkGetDeviceQueue(device, presentQueueFamily, 0, &presentQueue);
         vkGetDeviceQueue(device, graphicsQueueFamily, 0, &graphicsQueue);
+        if (m_asyncTransfers)
+        {
+            transferQueueFamily = indices.transferFamily.value();
+            vkGetDeviceQueue(device, transferQueueFamily, 0, &transferQueue);
+        }
+    }
+
+    /**
+     * The staged levels of texture stream-ins are copied on a queue of a
+     * transfer only family when the device has one, so the copy overlaps
+     * with the frames instead of taking time from them. Whole mip levels are
+     * copied, which meets any minImageTransferGranularity. Without such a
+     * family every upload stays on the graphics queue.
+     * */
+    void chooseAsyncTransfers(const QueueFamilyIndices &indices)
+    {
+        if (not m_asyncTransfers)
+        {
+            return;
+        }
+        if (not indices.transferFamily.has_value())
+        {
+            std::cout << "Transfer queue unavailable (no transfer only queue "
+                         "family), uploading on the graphics queue"
+                      << std::endl;
+            m_asyncTransfers = false;
+            return;
+        }
+        std::cout << "Transfer queue: family " << indices.transferFamily.value()
+                  << std::endl;
     }
 
     void createSwapChain()
@@ -1473,7 +2128,7 @@ class TriangleApp {
         // more on this later for now: its null
         createInfo.oldSwapchain = VK_NULL_HANDLE;
 
-        if (vkCreateSwapchainKHR(device, &createInfo, nullptr, &swapChain))
+        if (vkCreateSwapchainKHR(device, &createInfo, allocator(), &swapChain))
         {
             throw std::runtime_error("failed to create swap chain!");
         }
@@ -1488,35 +2143,38 @@ class TriangleApp {
 
     VkImageView createImageView(VkImage image,
                                 VkFormat format,
-                                VkImageAspectFlags aspectFlags)
+                                VkImageAspectFlags aspectFlags,
+                                uint32_t mipLevels = 1,
+                                VkImageViewType viewType
+                                    = VK_IMAGE_VIEW_TYPE_2D,
+                                uint32_t layerCount = 1,
+                                VkComponentMapping components = {})
     {
         VkImageViewCreateInfo createInfo{};
         createInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
         createInfo.image = image;
-        createInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
+        createInfo.viewType = viewType;
         createInfo.format = format;
         // allow to swizzle the  color  channels around , e.g. map all
-        // channels to the red channel for a monochrome texture: here we
-        // stick to the default The swizzle can rearrange the components of
-        // the texel, or substitute zero or one for any components. It is
-        // defined as follows for each color component:
-        createInfo.components.r = VK_COMPONENT_SWIZZLE_IDENTITY;
-        createInfo.components.g = VK_COMPONENT_SWIZZLE_IDENTITY;
-        createInfo.components.b = VK_COMPONENT_SWIZZLE_IDENTITY;
-        createInfo.components.a = VK_COMPONENT_SWIZZLE_IDENTITY;
+        // channels to the red channel for a monochrome texture: the default
+        // (all VK_COMPONENT_SWIZZLE_IDENTITY) sticks to the channels of the
+        // format, the data textures of texture_data.h show one channel as
+        // gray. The swizzle can rearrange the components of the texel, or
+        // substitute zero or one for any components.
+        createInfo.components = components;
         // describes the purpose of the image and which part of the image
         // should be accessed here our images are color targets without
         // mipmapping levels or multiple layers
         createInfo.subresourceRange.aspectMask = aspectFlags;
         createInfo.subresourceRange.baseMipLevel = 0;
-        createInfo.subresourceRange.levelCount = 1;
+        createInfo.subresourceRange.levelCount = mipLevels;
         createInfo.subresourceRange.baseArrayLayer = 0;
         createInfo.subresourceRange.layerCount
-            = 1; /// working with a stereographic 3D app, a swap chain with
-                 /// multiple layers is needed (VR?)
+            = layerCount; /// working with a stereographic 3D app, a swap
+                          /// chain with multiple layers is needed (VR?)
 
         VkImageView imageView;
-        if (vkCreateImageView(device, &createInfo, nullptr, &imageView)
+        if (vkCreateImageView(device, &createInfo, allocator(), &imageView)
             != VK_SUCCESS)
         { /// manual creation process demands a manual destroy !
             throw std::runtime_error("failed to create image views!");
@@ -1647,7 +2305,8 @@ class TriangleApp {
         renderPassInfo.dependencyCount = 1;
         renderPassInfo.pDependencies = &dependency;
 
-        if (vkCreateRenderPass(device, &renderPassInfo, nullptr, &renderPass)
+        if (vkCreateRenderPass(
+                device, &renderPassInfo, allocator(), &renderPass)
             != VK_SUCCESS)
         {
             throw std::runtime_error("failed to create render pass!");
@@ -1682,16 +2341,37 @@ class TriangleApp {
                                             // the combined image sampler
                                             // descripter in the fragment shader
 
-        std::array<VkDescriptorSetLayoutBinding, 2> bindings
+        std::vector<VkDescriptorSetLayoutBinding> bindings
             = {uboLayoutBinding, samplerLayoutBinding};
 
+        // the bindless texture array, only the slots in use are written
+        VkDescriptorSetLayoutBinding textureArrayBinding{};
+        textureArrayBinding.binding = 2;
+        textureArrayBinding.descriptorCount = m_textureArraySize;
+        textureArrayBinding.descriptorType
+            = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+        textureArrayBinding.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
+        std::vector<VkDescriptorBindingFlags> bindingFlags
+            = {0, 0, VK_DESCRIPTOR_BINDING_PARTIALLY_BOUND_BIT};
+        VkDescriptorSetLayoutBindingFlagsCreateInfo bindingFlagsInfo{};
+        bindingFlagsInfo.sType
+            = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_BINDING_FLAGS_CREATE_INFO;
+        bindingFlagsInfo.bindingCount
+            = static_cast<uint32_t>(bindingFlags.size());
+        bindingFlagsInfo.pBindingFlags = bindingFlags.data();
+
         VkDescriptorSetLayoutCreateInfo layoutInfo{};
         layoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+        if (m_bindlessTextures)
+        {
+            bindings.push_back(textureArrayBinding);
+            layoutInfo.pNext = &bindingFlagsInfo;
+        }
         layoutInfo.bindingCount = static_cast<uint32_t>(bindings.size());
         layoutInfo.pBindings = bindings.data();
 
         if (vkCreateDescriptorSetLayout(
-                device, &layoutInfo, nullptr, &descriptorSetLayout)
+                device, &layoutInfo, allocator(), &descriptorSetLayout)
             != VK_SUCCESS)
         {
             throw std::runtime_error("failed to create descriptor set layout!");
@@ -1714,6 +2394,7 @@ class TriangleApp {
     {
         auto vertShaderCode = readFile("shaders/vert.spv");
         auto fragShaderCode = readFile("shaders/frag.spv");
+        chooseTextureShaders(vertShaderCode, fragShaderCode);
 
         // compilation & linking from SPIR-V bytecode to machinecode will not
         // happen until the graphic pipeline is created so we need local
@@ -1754,9 +2435,15 @@ class TriangleApp {
             = static_cast<uint32_t>(dynamicStates.size());
         dynamicState.pDynamicStates = dynamicStates.data();
 
-        // with commit 019 we introduce vertex shader data
-        auto bindingDescription = Vertex::getBindingDescription();
-        auto attributeDescriptions = Vertex::getAttributeDescriptions();
+        // with commit 019 we introduce vertex shader data, the description
+        // depends on the layout chosen in chooseVertexFormat()
+        auto bindingDescription = m_vertexLayout == VertexLayout::Compact
+                                      ? CompactVertex::getBindingDescription()
+                                      : Vertex::getBindingDescription();
+        auto attributeDescriptions
+            = m_vertexLayout == VertexLayout::Compact
+                  ? CompactVertex::getAttributeDescriptions(m_texCoordFormat)
+                  : Vertex::getAttributeDescriptions();
 
         VkPipelineVertexInputStateCreateInfo vertexInputInfo{};
         vertexInputInfo.sType
@@ -1917,7 +2604,7 @@ class TriangleApp {
                        // shaders
 
         if (vkCreatePipelineLayout(
-                device, &pipelineLayoutInfo, nullptr, &pipelineLayout)
+                device, &pipelineLayoutInfo, allocator(), &pipelineLayout)
             != VK_SUCCESS)
         {
             throw std::runtime_error("failed to create pipeline layout!");
@@ -1971,88 +2658,425 @@ class TriangleApp {
                                       VK_NULL_HANDLE,
                                       1,
                                       &pipelineInfo,
-                                      nullptr,
+                                      allocator(),
                                       &graphicsPipeline)
             != VK_SUCCESS)
         {
             throw std::runtime_error("failed to create graphics pipeline!");
         }
 
+        // the tile patches only differ in their shaders and inputs
+        createTilePipeline(pipelineInfo);
+
         //.. and need to cleanup the shaderModules here ...
-        vkDestroyShaderModule(device, fragShaderModule, nullptr);
-        vkDestroyShaderModule(device, vertShaderModule, nullptr);
+        vkDestroyShaderModule(device, fragShaderModule, allocator());
+        vkDestroyShaderModule(device, vertShaderModule, allocator());
     }
 
     /**
-     * A Framebuffer object references all VkImageView objetcs that represent
-     * attachments
-     * We only have atm a colorAttachment
-     * the image which is used depends on which image the swap chain returns
-     * when we retrieve one for representation We have to create a framebuffer
-     * for all the images in the swap chain and use the one that corresponds to
-     * the retrieved image at drawing time.
-     */
-    void createFrameBuffers()
+     * Compute pipeline of shaders/meshlet_cull.comp. It only needs Vulkan 1.0:
+     * the culled draws are drawn with one vkCmdDrawIndexedIndirect per mesh
+     * instead of an indirect count, which needs multiDrawIndirect. Without it,
+     * without compute on the graphics queue or without the compiled shader
+     * the meshlets are culled on the CPU.
+     * */
+    void createCullingPipeline()
     {
-        // size it to the hold imageViews
-        swapChainFramebuffers.resize(swapChainImageViews.size());
-
-        for (size_t i = 0; i < swapChainImageViews.size(); i++)
+        if (m_cullingMode != CullingMode::Gpu)
         {
-            std::array<VkImageView, 2> attachments
-                = {swapChainImageViews[i], depthImageView};
-            VkFramebufferCreateInfo framebufferInfo{};
-            framebufferInfo.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
-            // specifiy which renderpass the framebuffer needs to be compatible
-            // with they need to use the same number and types of attachments
-            framebufferInfo.renderPass = renderPass;
-            // specify the VkImageView objects
-            framebufferInfo.attachmentCount
-                = static_cast<uint32_t>(attachments.size());
-            framebufferInfo.pAttachments = attachments.data();
-            framebufferInfo.width = swapChainExtent.width;
-            framebufferInfo.height = swapChainExtent.height;
-            framebufferInfo.layers = 1;
+            return;
+        }
 
-            if (vkCreateFramebuffer(device,
-                                    &framebufferInfo,
-                                    nullptr,
-                                    &swapChainFramebuffers[i])
-                != VK_SUCCESS)
+        VkPhysicalDeviceFeatures supportedFeatures;
+        vkGetPhysicalDeviceFeatures(physicalDevice, &supportedFeatures);
+        uint32_t queueFamilyCount = 0;
+        vkGetPhysicalDeviceQueueFamilyProperties(
+            physicalDevice, &queueFamilyCount, nullptr);
+        std::vector<VkQueueFamilyProperties> queueFamilies(queueFamilyCount);
+        vkGetPhysicalDeviceQueueFamilyProperties(
+            physicalDevice, &queueFamilyCount, queueFamilies.data());
+
+        std::vector<char> cullShaderCode;
+        const char *fallbackReason = nullptr;
+        if (not supportedFeatures.multiDrawIndirect)
+        {
+            fallbackReason = "no multiDrawIndirect";
+        } else if (not(queueFamilies[graphicsQueueFamily].queueFlags
+                       & VK_QUEUE_COMPUTE_BIT))
+        {
+            fallbackReason = "no compute on the graphics queue";
+        } else
+        {
+            try
             {
-                throw std::runtime_error("failed tp create framebuffer");
+                cullShaderCode = readFile("shaders/cull.spv");
+            } catch (const std::exception &)
+            {
+                fallbackReason = "shaders/cull.spv is missing, build the "
+                                 "shaders target or run shaders/compile.sh";
             }
         }
-    }
+        if (fallbackReason)
+        {
+            std::cout << "GPU meshlet culling unavailable (" << fallbackReason
+                      << "), culling on the CPU" << std::endl;
+            m_cullingMode = CullingMode::Cpu;
+            return;
+        }
 
-    /**
-     * Command pools are opaque objects that command buffer memory is allocated
-     * from, and which allow the implementation to amortize the cost of resource
-     * creation across multiple command buffers.
-     * */
-    void createCommandPool()
-    {
-        QueueFamilyIndices queueFamilyIndices
-            = findQueueFamilies(physicalDevice);
+        VkPhysicalDeviceProperties properties{};
+        vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+        m_maxDrawIndirectCount = properties.limits.maxDrawIndirectCount;
 
-        VkCommandPoolCreateInfo poolInfo{};
-        poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
-        poolInfo.flags
-            = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT; /// allow command
-                                                               /// buffers to be
-                                                               /// rerecorded
-                                                               /// individually,
-                                                               /// without they
-                                                               /// have to be
-                                                               /// reset
-                                                               /// together
-        // command buffers are executed by submitting them on one of the device
-        // queues each command can only allocate command buffers that are
+        // bounds, draw templates, culled draws, one counter per mesh
+        std::array<VkDescriptorSetLayoutBinding, 4> bindings{};
+        for (uint32_t i = 0; i < bindings.size(); i++)
+        {
+            bindings[i].binding = i;
+            bindings[i].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+            bindings[i].descriptorCount = 1;
+            bindings[i].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+        }
+
+        VkDescriptorSetLayoutCreateInfo layoutInfo{};
+        layoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+        layoutInfo.bindingCount = static_cast<uint32_t>(bindings.size());
+        layoutInfo.pBindings = bindings.data();
+        if (vkCreateDescriptorSetLayout(
+                device, &layoutInfo, allocator(), &cullDescriptorSetLayout)
+            != VK_SUCCESS)
+        {
+            throw std::runtime_error(
+                "failed to create culling descriptor set layout!");
+        }
+
+        VkPushConstantRange pushConstantRange{};
+        pushConstantRange.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+        pushConstantRange.offset = 0;
+        pushConstantRange.size = sizeof(CullPushConstants);
+
+        VkPipelineLayoutCreateInfo pipelineLayoutInfo{};
+        pipelineLayoutInfo.sType
+            = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+        pipelineLayoutInfo.setLayoutCount = 1;
+        pipelineLayoutInfo.pSetLayouts = &cullDescriptorSetLayout;
+        pipelineLayoutInfo.pushConstantRangeCount = 1;
+        pipelineLayoutInfo.pPushConstantRanges = &pushConstantRange;
+        if (vkCreatePipelineLayout(
+                device, &pipelineLayoutInfo, allocator(), &cullPipelineLayout)
+            != VK_SUCCESS)
+        {
+            throw std::runtime_error("failed to create culling pipeline "
+                                     "layout!");
+        }
+
+        VkShaderModule cullShaderModule = createShaderModule(cullShaderCode);
+
+        VkComputePipelineCreateInfo pipelineInfo{};
+        pipelineInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+        pipelineInfo.stage.sType
+            = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+        pipelineInfo.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+        pipelineInfo.stage.module = cullShaderModule;
+        pipelineInfo.stage.pName = "main";
+        pipelineInfo.layout = cullPipelineLayout;
+
+        if (vkCreateComputePipelines(device,
+                                     VK_NULL_HANDLE,
+                                     1,
+                                     &pipelineInfo,
+                                     allocator(),
+                                     &cullPipeline)
+            != VK_SUCCESS)
+        {
+            throw std::runtime_error("failed to create culling pipeline!");
+        }
+
+        vkDestroyShaderModule(device, cullShaderModule, allocator());
+    }
+
+    /**
+     * Swaps in the shaders that index the bindless texture array
+     * (shaders/shader_bindless.vert and .frag), or the ones that sample the
+     * texture as a cubemap (shaders/shader_cube.vert and .frag) if cubemap
+     * textures are on. Only the texture of a sphere is equirectangular, any
+     * other model and missing shaders keep the 2D texture.
+     * */
+    void chooseTextureShaders(std::vector<char> &vertShaderCode,
+                              std::vector<char> &fragShaderCode)
+    {
+        // chooseBindlessTextures() made sure they are there
+        if (m_bindlessTextures)
+        {
+            std::vector<char> bindlessVertShaderCode
+                = readFile("shaders/bindless_vert.spv");
+            std::vector<char> bindlessFragShaderCode
+                = readFile("shaders/bindless_frag.spv");
+            vertShaderCode.swap(bindlessVertShaderCode);
+            fragShaderCode.swap(bindlessFragShaderCode);
+            return;
+        }
+        if (not m_cubemapTextures)
+        {
+            return;
+        }
+        const std::string &texturePath = textureMap.at(sceneModels.front());
+        if (sphereMap.count(sceneModels.front()) == 0
+            || isProceduralTexture(texturePath) || isDataImage(texturePath))
+        {
+            std::cout << "Cubemap textures only apply to the color images of "
+                         "spheres, sampling "
+                      << textureMap.at(sceneModels.front()) << " as it is"
+                      << std::endl;
+            m_cubemapTextures = false;
+            return;
+        }
+
+        try
+        {
+            std::vector<char> cubeVertShaderCode
+                = readFile("shaders/cube_vert.spv");
+            std::vector<char> cubeFragShaderCode
+                = readFile("shaders/cube_frag.spv");
+            vertShaderCode.swap(cubeVertShaderCode);
+            fragShaderCode.swap(cubeFragShaderCode);
+        } catch (const std::exception &)
+        {
+            std::cout << "Cubemap textures unavailable (shaders/cube_vert.spv "
+                         "is missing, build the shaders target or run "
+                         "shaders/compile.sh), sampling the equirectangular "
+                         "texture"
+                      << std::endl;
+            m_cubemapTextures = false;
+        }
+    }
+
+    /**
+     * Scans the tile directory, tile streaming is on once
+     * createTilePipeline() has its shaders as well. Without a usable pyramid
+     * the first scene model keeps its texture.
+     * */
+    void openTilePyramid()
+    {
+        if (m_tileDirectory.empty())
+        {
+            return;
+        }
+        auto scanStart = std::chrono::high_resolution_clock::now();
+
+        VkPhysicalDeviceProperties properties{};
+        vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+        const char *fallbackReason = nullptr;
+        if (sphereMap.count(sceneModels.front()) == 0)
+        {
+            fallbackReason = "the first scene model isn't a sphere";
+        } else if (not scanTilePyramid(m_tileDirectory, m_tilePyramid))
+        {
+            fallbackReason = "no complete z/x/y tile pyramid";
+        } else if (std::max(m_tilePyramid.tileWidth, m_tilePyramid.tileHeight)
+                   > properties.limits.maxImageDimension2D)
+        {
+            fallbackReason = "the tiles are too large";
+        } else if (m_tilePyramid.rootColumns * m_tilePyramid.rootRows
+                       + TILE_MAX_REQUESTS
+                   > properties.limits.maxImageArrayLayers)
+        {
+            fallbackReason = "too many root tiles";
+        }
+        if (fallbackReason)
+        {
+            std::cout << "Tile streaming from " << m_tileDirectory
+                      << " unavailable (" << fallbackReason
+                      << "), drawing the texture" << std::endl;
+            return;
+        }
+
+        m_tileStreaming = true;
+        std::cout << "Found " << m_tilePyramid.tiles.size() << " tiles of "
+                  << m_tilePyramid.tileWidth << "x" << m_tilePyramid.tileHeight
+                  << " texels, levels " << m_tilePyramid.firstLevel << " to "
+                  << m_tilePyramid.lastLevel << ", in " << m_tileDirectory
+                  << " in "
+                  << std::chrono::duration<float, std::milli>(
+                         std::chrono::high_resolution_clock::now() - scanStart)
+                         .count()
+                  << " ms" << std::endl;
+    }
+
+    /**
+     * Pipeline of the tile patches (shaders/tile.vert and tile.frag): the
+     * fixed function state of the mesh pipeline, no vertex input as the
+     * patch grid is generated from the vertex index, the tile cache as the
+     * only descriptor and the patch in push constants
+     * */
+    void
+    createTilePipeline(const VkGraphicsPipelineCreateInfo &meshPipelineInfo)
+    {
+        if (not m_tileStreaming)
+        {
+            return;
+        }
+
+        std::vector<char> vertShaderCode, fragShaderCode;
+        try
+        {
+            vertShaderCode = readFile("shaders/tile_vert.spv");
+            fragShaderCode = readFile("shaders/tile_frag.spv");
+        } catch (const std::exception &)
+        {
+            std::cout << "Tile streaming unavailable (shaders/tile_vert.spv "
+                         "is missing, build the shaders target or run "
+                         "shaders/compile.sh), drawing the texture"
+                      << std::endl;
+            m_tileStreaming = false;
+            return;
+        }
+
+        VkDescriptorSetLayoutBinding samplerLayoutBinding{};
+        samplerLayoutBinding.binding = 0;
+        samplerLayoutBinding.descriptorCount = 1;
+        samplerLayoutBinding.descriptorType
+            = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+        samplerLayoutBinding.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
+
+        VkDescriptorSetLayoutCreateInfo layoutInfo{};
+        layoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+        layoutInfo.bindingCount = 1;
+        layoutInfo.pBindings = &samplerLayoutBinding;
+        if (vkCreateDescriptorSetLayout(
+                device, &layoutInfo, allocator(), &tileDescriptorSetLayout)
+            != VK_SUCCESS)
+        {
+            throw std::runtime_error(
+                "failed to create tile descriptor set layout!");
+        }
+
+        VkPushConstantRange pushConstantRange{};
+        pushConstantRange.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
+        pushConstantRange.offset = 0;
+        pushConstantRange.size = sizeof(TilePushConstants);
+
+        VkPipelineLayoutCreateInfo pipelineLayoutInfo{};
+        pipelineLayoutInfo.sType
+            = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+        pipelineLayoutInfo.setLayoutCount = 1;
+        pipelineLayoutInfo.pSetLayouts = &tileDescriptorSetLayout;
+        pipelineLayoutInfo.pushConstantRangeCount = 1;
+        pipelineLayoutInfo.pPushConstantRanges = &pushConstantRange;
+        if (vkCreatePipelineLayout(
+                device, &pipelineLayoutInfo, allocator(), &tilePipelineLayout)
+            != VK_SUCCESS)
+        {
+            throw std::runtime_error("failed to create tile pipeline layout!");
+        }
+
+        VkShaderModule vertShaderModule = createShaderModule(vertShaderCode);
+        VkShaderModule fragShaderModule = createShaderModule(fragShaderCode);
+        std::array<VkPipelineShaderStageCreateInfo, 2> shaderStages{};
+        for (auto &stage : shaderStages)
+        {
+            stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+            stage.pName = "main";
+        }
+        shaderStages[0].stage = VK_SHADER_STAGE_VERTEX_BIT;
+        shaderStages[0].module = vertShaderModule;
+        shaderStages[1].stage = VK_SHADER_STAGE_FRAGMENT_BIT;
+        shaderStages[1].module = fragShaderModule;
+
+        VkPipelineVertexInputStateCreateInfo vertexInputInfo{};
+        vertexInputInfo.sType
+            = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
+
+        VkGraphicsPipelineCreateInfo pipelineInfo = meshPipelineInfo;
+        pipelineInfo.stageCount = static_cast<uint32_t>(shaderStages.size());
+        pipelineInfo.pStages = shaderStages.data();
+        pipelineInfo.pVertexInputState = &vertexInputInfo;
+        pipelineInfo.layout = tilePipelineLayout;
+        if (vkCreateGraphicsPipelines(device,
+                                      VK_NULL_HANDLE,
+                                      1,
+                                      &pipelineInfo,
+                                      allocator(),
+                                      &tilePipeline)
+            != VK_SUCCESS)
+        {
+            throw std::runtime_error("failed to create tile pipeline!");
+        }
+
+        vkDestroyShaderModule(device, fragShaderModule, allocator());
+        vkDestroyShaderModule(device, vertShaderModule, allocator());
+    }
+
+    /**
+     * A Framebuffer object references all VkImageView objetcs that represent
+     * attachments
+     * We only have atm a colorAttachment
+     * the image which is used depends on which image the swap chain returns
+     * when we retrieve one for representation We have to create a framebuffer
+     * for all the images in the swap chain and use the one that corresponds to
+     * the retrieved image at drawing time.
+     */
+    void createFrameBuffers()
+    {
+        // size it to the hold imageViews
+        swapChainFramebuffers.resize(swapChainImageViews.size());
+
+        for (size_t i = 0; i < swapChainImageViews.size(); i++)
+        {
+            std::array<VkImageView, 2> attachments
+                = {swapChainImageViews[i], depthImageView};
+            VkFramebufferCreateInfo framebufferInfo{};
+            framebufferInfo.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
+            // specifiy which renderpass the framebuffer needs to be compatible
+            // with they need to use the same number and types of attachments
+            framebufferInfo.renderPass = renderPass;
+            // specify the VkImageView objects
+            framebufferInfo.attachmentCount
+                = static_cast<uint32_t>(attachments.size());
+            framebufferInfo.pAttachments = attachments.data();
+            framebufferInfo.width = swapChainExtent.width;
+            framebufferInfo.height = swapChainExtent.height;
+            framebufferInfo.layers = 1;
+
+            if (vkCreateFramebuffer(device,
+                                    &framebufferInfo,
+                                    allocator(),
+                                    &swapChainFramebuffers[i])
+                != VK_SUCCESS)
+            {
+                throw std::runtime_error("failed tp create framebuffer");
+            }
+        }
+    }
+
+    /**
+     * Command pools are opaque objects that command buffer memory is allocated
+     * from, and which allow the implementation to amortize the cost of resource
+     * creation across multiple command buffers.
+     * */
+    void createCommandPool()
+    {
+        QueueFamilyIndices queueFamilyIndices
+            = findQueueFamilies(physicalDevice);
+
+        VkCommandPoolCreateInfo poolInfo{};
+        poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+        poolInfo.flags
+            = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT; /// allow command
+                                                               /// buffers to be
+                                                               /// rerecorded
+                                                               /// individually,
+                                                               /// without they
+                                                               /// have to be
+                                                               /// reset
+                                                               /// together
+        // command buffers are executed by submitting them on one of the device
+        // queues each command can only allocate command buffers that are
         // submitted on a single type of queue we chose commands for drawing so
         // graphics queue family is chosen
         poolInfo.queueFamilyIndex = queueFamilyIndices.graphicsFamily.value();
 
-        if (vkCreateCommandPool(device, &poolInfo, nullptr, &commandPool)
+        if (vkCreateCommandPool(device, &poolInfo, allocator(), &commandPool)
             != VK_SUCCESS)
         {
             throw std::runtime_error("failed to create command pool!");
@@ -2127,6 +3151,7 @@ class TriangleApp {
 
         createImage(swapChainExtent.width,
                     swapChainExtent.height,
+                    1,
                     depthFormat,
                     VK_IMAGE_TILING_OPTIMAL,
                     VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT,
@@ -2144,111 +3169,741 @@ class TriangleApp {
                                       */
     }
 
+    /// format to upload a mip chain with the given alpha in, the block
+    /// compressed one if the device can sample it
+    VkFormat chooseTextureFormat(bool opaque)
+    {
+        if (not m_compressTextures)
+        {
+            return VK_FORMAT_R8G8B8A8_SRGB;
+        }
+        return findSupportedFormat(
+            {opaque ? VK_FORMAT_BC1_RGB_SRGB_BLOCK : VK_FORMAT_BC7_SRGB_BLOCK,
+             VK_FORMAT_R8G8B8A8_SRGB},
+            VK_IMAGE_TILING_OPTIMAL,
+            VK_FORMAT_FEATURE_SAMPLED_IMAGE_BIT
+                | VK_FORMAT_FEATURE_SAMPLED_IMAGE_FILTER_LINEAR_BIT);
+    }
+
     /**
-     * Although we could set up the shader to access the pixel values in the
-     * buffer, it’s better to use image objects in Vulkan for this purpose.
-     * Image objects will make it easier and faster to retrieve colors by
-     * allowing us to use 2D coordinates, for one. Pixels within an image object
-     * are known as texels
+     * Turns the RGBA8 mip chain in upload into the format it's uploaded in,
+     * block compressed (and cached as KTX2) if the device supports it
      * */
-    void createTextureImage()
+    void finishTextureUpload(const std::string &texturePath,
+                             TextureUpload &upload)
     {
-        int texWidth, texHeight, texChannels;
-        stbi_uc *pixels = stbi_load(
-            textureMap.at(Model::Earth3Dv3).c_str(),
-            // textureMap.at(Model::VikingRoom).c_str(),
-            // stbi_uc *pixels =
-            // stbi_load(textureMap.at(Model::TestRectangle).c_str(),
-            &texWidth,
-            &texHeight,
-            &texChannels,
-            STBI_rgb_alpha);
-        VkDeviceSize imageSize = texWidth * texHeight * 4;
-
-        if (!pixels)
-        {
-            throw std::runtime_error("failed to load texture image!");
-        }
-
-        VkBuffer stagingBuffer;
-        VkDeviceMemory stagingBufferMemory;
-
-        createBuffer(imageSize,
-                     VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-                     VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT
-                         | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-                     stagingBuffer,
-                     stagingBufferMemory);
-
-        // we directly copy the pixel values from the image loading library to
-        // the buffer
-        void *data;
-        vkMapMemory(device, stagingBufferMemory, 0, imageSize, 0, &data);
-        memcpy(data, pixels, static_cast<size_t>(imageSize));
-        vkUnmapMemory(device, stagingBufferMemory);
-
-        // clean up original pixel array
-        stbi_image_free(pixels);
-
-        createImage(texWidth,
-                    texHeight,
-                    VK_FORMAT_R8G8B8A8_SRGB,
-                    VK_IMAGE_TILING_OPTIMAL,
-                    VK_IMAGE_USAGE_TRANSFER_DST_BIT
-                        | VK_IMAGE_USAGE_SAMPLED_BIT,
-                    VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
-                    textureImage,
-                    textureImageMemory);
-        // to copy the staging buffer to the texture image two steps are needed
-        // 1. Transition the texture image to
-        //    VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL
-        // 2. Execute the buffer to image
-        //    copy operation
-        transitionImageLayout(textureImage,
-                              VK_FORMAT_R8G8B8A8_SRGB,
-                              VK_IMAGE_LAYOUT_UNDEFINED,
-                              VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
+        upload.format = chooseTextureFormat(
+            texelsOpaque(upload.data, upload.width, upload.height));
+        upload.regions
+            = mipCopyRegions(upload.width, upload.height, upload.levelCount);
+        if (upload.format == VK_FORMAT_R8G8B8A8_SRGB)
+        {
+            upload.size = mipLevelOffset(
+                upload.width, upload.height, upload.levelCount);
+            return;
+        }
 
-        copyBufferToImage(stagingBuffer,
-                          textureImage,
-                          static_cast<uint32_t>(texWidth),
-                          static_cast<uint32_t>(texHeight));
+        upload.compressed = compressMipChain(upload.data,
+                                             upload.width,
+                                             upload.height,
+                                             upload.levelCount,
+                                             upload.format);
+        writeKtx2Cache(texturePath, upload.compressed);
+        upload.data = upload.compressed.data.data();
+        upload.size = upload.compressed.data.size();
+        for (uint32_t level = 0; level < upload.levelCount; level++)
+        {
+            upload.regions[level].bufferOffset
+                = upload.compressed.levelOffsets[level];
+        }
+    }
 
-        // prepare it for shader access
-        transitionImageLayout(textureImage,
-                              VK_FORMAT_R8G8B8A8_SRGB,
-                              VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-                              VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+    /// prepares the upload from the KTX2 or the mip cache of a previous run
+    bool openCachedTexture(const std::string &texturePath,
+                           TextureUpload &upload)
+    {
+        Ktx2Cache &ktx2Cache = upload.ktx2Cache;
+        if (m_compressTextures && ktx2Cache.open(texturePath)
+            && chooseTextureFormat(ktx2Cache.format()
+                                   == VK_FORMAT_BC1_RGB_SRGB_BLOCK)
+                   == ktx2Cache.format())
+        {
+            upload.format = ktx2Cache.format();
+            upload.width = ktx2Cache.width();
+            upload.height = ktx2Cache.height();
+            upload.levelCount = ktx2Cache.levelCount();
+            upload.data = ktx2Cache.data();
+            upload.size = ktx2Cache.dataSize();
+            upload.regions = ktx2Cache.copyRegions();
+            upload.source = "KTX2 cache";
+            return true;
+        }
 
-        vkDestroyBuffer(device, stagingBuffer, nullptr);
-        vkFreeMemory(device, stagingBufferMemory, nullptr);
+        if (not upload.mipCache.open(texturePath))
+        {
+            return false;
+        }
+        upload.width = upload.mipCache.width();
+        upload.height = upload.mipCache.height();
+        upload.levelCount = upload.mipCache.levelCount();
+        upload.data = upload.mipCache.texels();
+        upload.source = "mip cache";
+        finishTextureUpload(texturePath, upload);
+        return true;
     }
 
-    // as more images wwill be created we abstract the image creation
-    void createImage(uint32_t textureWidth,
-                     uint32_t textureHeight,
-                     VkFormat format,
-                     VkImageTiling tiling,
-                     VkImageUsageFlags usage,
-                     VkMemoryPropertyFlags properties,
-                     VkImage &image,
-                     VkDeviceMemory &imageMemory)
+    /**
+     * Prepares the upload of a procedural surface, see texture_procedural.h.
+     * A streamed one has no data, stageTextureLevels() generates the levels
+     * the residency manager asks for. Otherwise all levels are generated now
+     * into the mip chain.
+     * */
+    void prepareProceduralTexture(const Surface &surface,
+                                  TextureUpload &upload,
+                                  bool streamed)
     {
+        upload.format = VK_FORMAT_R8G8B8A8_SRGB;
+        upload.width = surface.width;
+        upload.height = surface.height;
+        upload.levelCount = mipLevelCount(surface.width, surface.height);
+        upload.regions
+            = mipCopyRegions(upload.width, upload.height, upload.levelCount);
+        upload.size
+            = mipLevelOffset(upload.width, upload.height, upload.levelCount);
+        upload.source = "procedural surface";
+        if (streamed)
+        {
+            return;
+        }
 
-        VkImageCreateInfo imageInfo{};
-        imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
-        imageInfo.imageType
-            = VK_IMAGE_TYPE_2D; /// tells vulkan which kind of coordinate system
-                                /// the texels in the image are going to use
-        imageInfo.extent.width
-            = textureWidth; /// specifies the dimensions of the immage
-        imageInfo.extent.height = textureHeight;
-        imageInfo.extent.depth = 1; /// how many texels are on each axis
-        imageInfo.mipLevels = 1;
-        imageInfo.arrayLayers = 1;
-        imageInfo.format = format; /// should use the same format for the
-                                   /// texels as the pixels in the buffer,
-                                   /// otherwise the copy operation will
+        upload.mipChain.width = upload.width;
+        upload.mipChain.height = upload.height;
+        upload.mipChain.levelCount = upload.levelCount;
+        for (uint32_t level = 0; level < upload.levelCount; level++)
+        {
+            std::shared_ptr<const std::vector<uint8_t>> texels
+                = m_surfaceCache.level(surface, level);
+            upload.mipChain.texels.insert(
+                upload.mipChain.texels.end(), texels->begin(), texels->end());
+        }
+        upload.data = upload.mipChain.texels.data();
+    }
+
+    /**
+     * Prepares the upload of a 16 bit or float image at its own precision
+     * and channel count, see texture_data.h. False if it can't be decoded or
+     * the device can't sample any of its formats.
+     * */
+    bool importDataTexture(const std::string &texturePath,
+                           TextureUpload &upload)
+    {
+        DataImage image;
+        if (not decodeDataImage(texturePath, image))
+        {
+            std::cerr << "failed to load texture " << texturePath << std::endl;
+            return false;
+        }
+        VkFormat format;
+        try
+        {
+            format = findSupportedFormat(
+                dataTextureFormats(image),
+                VK_IMAGE_TILING_OPTIMAL,
+                VK_FORMAT_FEATURE_SAMPLED_IMAGE_BIT
+                    | VK_FORMAT_FEATURE_SAMPLED_IMAGE_FILTER_LINEAR_BIT);
+        } catch (const std::exception &)
+        {
+            std::cerr << "failed to find a format for texture " << texturePath
+                      << std::endl;
+            return false;
+        }
+
+        upload.compressed = buildDataTexture(image, format);
+        upload.format = format;
+        upload.width = image.width;
+        upload.height = image.height;
+        upload.levelCount = upload.compressed.levelCount;
+        upload.data = upload.compressed.data.data();
+        upload.size = upload.compressed.data.size();
+        upload.regions = textureCopyRegions(upload.compressed);
+        upload.source = image.unorm16 ? "16 bit data" : "float data";
+        return true;
+    }
+
+    /// points upload at the faces of a packed cubemap
+    void setCubemapUpload(const CompressedTexture &cubemap,
+                          TextureUpload &upload)
+    {
+        upload.format = cubemap.format;
+        upload.width = cubemap.width;
+        upload.height = cubemap.height;
+        upload.levelCount = cubemap.levelCount;
+        upload.layerCount = cubemap.faceCount;
+        upload.data = cubemap.data.data();
+        upload.size = cubemap.data.size();
+        upload.regions = textureCopyRegions(cubemap);
+    }
+
+    /**
+     * Prepares the upload from the cubemap KTX2 cache of a previous run, if
+     * it is in the format the faces would be uploaded in now
+     * */
+    bool openCachedCubemap(const std::string &texturePath,
+                           TextureUpload &upload)
+    {
+        Ktx2Cache &ktx2Cache = upload.ktx2Cache;
+        if (not ktx2Cache.open(texturePath, CUBE_FACE_COUNT))
+        {
+            return false;
+        }
+        const VkFormat format = ktx2Cache.format();
+        if (format == VK_FORMAT_R8G8B8A8_SRGB
+                ? chooseTextureFormat(true) != format
+                      || chooseTextureFormat(false) != format
+                : chooseTextureFormat(format == VK_FORMAT_BC1_RGB_SRGB_BLOCK)
+                      != format)
+        {
+            return false;
+        }
+
+        upload.format = format;
+        upload.width = ktx2Cache.width();
+        upload.height = ktx2Cache.height();
+        upload.levelCount = ktx2Cache.levelCount();
+        upload.layerCount = CUBE_FACE_COUNT;
+        upload.data = ktx2Cache.data();
+        upload.size = ktx2Cache.dataSize();
+        upload.regions = ktx2Cache.copyRegions();
+        upload.source = "cubemap cache";
+        return true;
+    }
+
+    /**
+     * Staging memory the CPU reads back as well: the mips are built in it
+     * and the mip cache is written from it, and reads from uncached (write
+     * combined) memory are very slow
+     * */
+    VkMemoryPropertyFlags readableStagingProperties()
+    {
+        const VkMemoryPropertyFlags cached
+            = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT
+              | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT
+              | VK_MEMORY_PROPERTY_HOST_CACHED_BIT;
+        const VkPhysicalDeviceMemoryProperties &memProperties
+            = m_memory.properties();
+        for (uint32_t i = 0; i < memProperties.memoryTypeCount; i++)
+        {
+            if ((memProperties.memoryTypes[i].propertyFlags & cached)
+                == cached)
+            {
+                return cached;
+            }
+        }
+        return VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT
+               | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+    }
+
+    /**
+     * Starts decoding the image at texturePath, sized in upload with
+     * readImageExtent(), into the memory its mip chain is built in: the
+     * staging memory if upload has some, upload.mipChain otherwise
+     * */
+    void decodeTexture(TextureDecoder &decoder,
+                       const std::string &texturePath,
+                       TextureUpload &upload)
+    {
+        upload.levelCount = mipLevelCount(upload.width, upload.height);
+        size_t size
+            = mipLevelOffset(upload.width, upload.height, upload.levelCount);
+        uint8_t *chain = upload.staging;
+        if (not chain)
+        {
+            upload.mipChain.width = upload.width;
+            upload.mipChain.height = upload.height;
+            upload.mipChain.levelCount = upload.levelCount;
+            upload.mipChain.texels.resize(size);
+            chain = upload.mipChain.texels.data();
+        }
+        decoder.decode(texturePath, chain, size);
+    }
+
+    /**
+     * Builds the mip levels of a decoded image in place (see
+     * decodeTexture()), caches them and prepares the upload
+     * */
+    void buildTexture(const DecodedImage &image, TextureUpload &upload)
+    {
+        buildMipLevels(image.texels, image.width, image.height);
+        writeMipCache(image.path, image.width, image.height, image.texels);
+
+        upload.data = image.texels;
+        upload.source = "image";
+        finishTextureUpload(image.path, upload);
+    }
+
+    /**
+     * Resamples a decoded equirectangular image into the faces of a
+     * cubemap, packs them in the format they're uploaded in and caches them
+     * */
+    void buildCubemapTexture(const DecodedImage &image, TextureUpload &upload)
+    {
+        auto start = std::chrono::high_resolution_clock::now();
+        const std::vector<MipChain> faces
+            = resampleCubemap(image.texels, image.width, image.height);
+        upload.compressed = packCubemap(
+            faces,
+            chooseTextureFormat(
+                texelsOpaque(image.texels, image.width, image.height)));
+        writeKtx2Cache(image.path, upload.compressed);
+        setCubemapUpload(upload.compressed, upload);
+        upload.source = "image";
+
+        std::cout << "Resampled texture " << image.path << " into 6 faces of "
+                  << upload.width << "x" << upload.height << " in "
+                  << std::chrono::duration<float, std::milli>(
+                         std::chrono::high_resolution_clock::now() - start)
+                         .count()
+                  << " ms" << std::endl;
+    }
+
+    /// one draw of the patch grid for every patch selectTilePatches() picked
+    void drawTilePatches(VkCommandBuffer commandBuffer)
+    {
+        if (not m_tileStreaming)
+        {
+            return;
+        }
+        vkCmdBindPipeline(
+            commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, tilePipeline);
+        vkCmdBindIndexBuffer(
+            commandBuffer, tileIndexBuffer, 0, VK_INDEX_TYPE_UINT16);
+        vkCmdBindDescriptorSets(commandBuffer,
+                                VK_PIPELINE_BIND_POINT_GRAPHICS,
+                                tilePipelineLayout,
+                                0,
+                                1,
+                                &tileDescriptorSet,
+                                0,
+                                nullptr);
+
+        const uint32_t indexCount = TILE_PATCH_QUADS * TILE_PATCH_QUADS * 6;
+        TilePushConstants constants{};
+        constants.modelViewProjection = m_tileModelViewProjection;
+        for (const auto &patch : m_tileSelection.patches)
+        {
+            constants.bounds = patch.bounds;
+            constants.tileRect = patch.tileRect;
+            constants.layer = patch.layer;
+            vkCmdPushConstants(commandBuffer,
+                               tilePipelineLayout,
+                               VK_SHADER_STAGE_VERTEX_BIT,
+                               0,
+                               sizeof(constants),
+                               &constants);
+            vkCmdDrawIndexed(commandBuffer, indexCount, 1, 0, 0, 0);
+            m_drawnTriangles += indexCount / 3;
+        }
+    }
+
+    /**
+     * Although we could set up the shader to access the pixel values in the
+     * buffer, it’s better to use image objects in Vulkan for this purpose.
+     * Image objects will make it easier and faster to retrieve colors by
+     * allowing us to use 2D coordinates, for one. Pixels within an image object
+     * are known as texels
+     * */
+    void createTextureImage()
+    {
+        // the first scene model's texture is the one that gets sampled (or
+        // streamed, with bindless textures the others are uploaded whole)
+        const std::string &texturePath = textureMap.at(sceneModels.front());
+        m_textureSlot = m_textureTable.add(texturePath);
+        auto loadStart = std::chrono::high_resolution_clock::now();
+
+        // the upload is a packed chain of all levels in textureFormat: the
+        // KTX2 cache of a previous run, or the RGBA8 mip chain (cached or
+        // built from the decoded image, see texture_mips.h) which is block
+        // compressed now if the device supports it
+        // with cubemap textures it holds the six faces resampled from the
+        // image instead (or their cache, see texture_cubemap.h). It stays
+        // around for the levels that are streamed in later.
+        TextureUpload &upload = m_textureSource;
+        TextureDecoder decoder;
+        StagingRegion staging;
+        if (isProceduralTexture(texturePath))
+        {
+            m_surface = describeSurface(proceduralSeed(texturePath));
+            prepareProceduralTexture(m_surface, upload, true);
+        } else if (isDataImage(texturePath))
+        {
+            if (not importDataTexture(texturePath, upload))
+            {
+                throw std::runtime_error("failed to load texture image!");
+            }
+        } else if (m_cubemapTextures
+                       ? not openCachedCubemap(texturePath, upload)
+                       : not openCachedTexture(texturePath, upload))
+        {
+            if (not readImageExtent(texturePath, upload.width, upload.height))
+            {
+                throw std::runtime_error("failed to load texture image!");
+            }
+            // an RGBA8 upload is decoded and mipmapped right in the mapped
+            // staging region, without a malloced image and a copy of it
+            if (not m_cubemapTextures
+                && chooseTextureFormat(true) == VK_FORMAT_R8G8B8A8_SRGB
+                && chooseTextureFormat(false) == VK_FORMAT_R8G8B8A8_SRGB)
+            {
+                VkDeviceSize chainSize = mipLevelOffset(
+                    upload.width,
+                    upload.height,
+                    mipLevelCount(upload.width, upload.height));
+                staging = m_staging.reserve(
+                    chainSize, copyAlignment(VK_FORMAT_R8G8B8A8_SRGB));
+                upload.staging = staging.mapped;
+            }
+            decodeTexture(decoder, texturePath, upload);
+        }
+        // the textures of the other scene models are decoded at the same
+        // time, so their caches are ready when they are needed
+        std::map<std::string, TextureUpload> others;
+        for (Model model : sceneModels)
+        {
+            const std::string &path = textureMap.at(model);
+            MipCache mipCache;
+            if (path == texturePath || others.count(path) != 0
+                || mipCache.open(path))
+            {
+                continue;
+            }
+            TextureUpload &other = others[path];
+            if (isProceduralTexture(path))
+            {
+                if (m_bindlessTextures)
+                {
+                    prepareProceduralTexture(
+                        describeSurface(proceduralSeed(path)), other, false);
+                } else
+                {
+                    others.erase(path);
+                }
+            } else if (isDataImage(path))
+            {
+                // nothing to cache, only the bindless array samples it
+                if (not m_bindlessTextures
+                    || not importDataTexture(path, other))
+                {
+                    others.erase(path);
+                }
+            } else if (readImageExtent(path, other.width, other.height))
+            {
+                decodeTexture(decoder, path, other);
+            } else
+            {
+                std::cerr << "failed to load texture " << path << std::endl;
+                others.erase(path);
+            }
+        }
+
+        // build the mips of each image as soon as it's decoded
+        DecodedImage image;
+        while (decoder.next(image))
+        {
+            if (not image.texels)
+            {
+                if (image.path == texturePath)
+                {
+                    throw std::runtime_error("failed to load texture image!");
+                }
+                std::cerr << "failed to load texture " << image.path
+                          << std::endl;
+                others.erase(image.path);
+                continue;
+            }
+            std::cout << "Decoded texture " << image.path << " in "
+                      << image.milliseconds << " ms";
+            if (image.strips > 1)
+            {
+                std::cout << " as " << image.strips << " strips";
+            }
+            std::cout << std::endl;
+
+            if (image.path == texturePath && m_cubemapTextures)
+            {
+                buildCubemapTexture(image, upload);
+            } else if (image.path == texturePath)
+            {
+                buildTexture(image, upload);
+            } else
+            {
+                buildTexture(image, others.at(image.path));
+                if (not m_bindlessTextures)
+                {
+                    others.erase(image.path);
+                }
+            }
+        }
+
+        textureFormat = upload.format;
+        textureLevelCount = upload.levelCount;
+        textureArrayLayers = upload.layerCount;
+        VkDeviceSize imageSize = upload.size;
+        if (upload.data != upload.mipChain.texels.data())
+        {
+            upload.mipChain = MipChain(); // compressed
+        }
+
+        // only the small levels are uploaded now, the residency manager
+        // streams in the finer ones the first frames need
+        std::vector<uint64_t> levelBytes;
+        for (uint32_t level = 0; level < textureLevelCount; level++)
+        {
+            levelBytes.push_back(
+                textureLevelSize(
+                    textureFormat, upload.width, upload.height, level)
+                * textureArrayLayers);
+        }
+        m_textureResidency.setBudget(m_textureBudgetMegabytes << 20);
+        m_residentTexture = m_textureResidency.add(
+            levelBytes,
+            residencyTailLevel(
+                upload.width, upload.height, textureLevelCount));
+        textureBaseLevel = m_textureResidency.residentLevel(m_residentTexture);
+        textureMipLevels = textureLevelCount - textureBaseLevel;
+
+        // all levels are packed in the buffer, they go into the image with
+        // one copy. A procedural texture only has the resident ones, packed
+        // like the levels of a stream-in.
+        std::vector<VkBufferImageCopy> regions = levelRegions(upload.regions,
+                                                              textureBaseLevel,
+                                                              textureLevelCount,
+                                                              textureBaseLevel);
+        if (m_surface.width != 0)
+        {
+            TextureSwap staged
+                = stageTextureLevels(textureBaseLevel, textureLevelCount);
+            staging = staged.staging;
+            regions = staged.regions;
+        } else
+        {
+            if (not upload.staging)
+            {
+                staging = m_staging.reserve(imageSize,
+                                            copyAlignment(textureFormat));
+                memcpy(staging.mapped,
+                       upload.data,
+                       static_cast<size_t>(imageSize));
+            } else if (upload.mipCache.open(texturePath))
+            {
+                // the staging memory goes away, the levels are streamed in
+                // from the mip cache just written
+                upload.data = upload.mipCache.texels();
+                upload.staging = nullptr;
+            } else
+            {
+                upload.mipChain.texels.assign(upload.staging,
+                                              upload.staging + imageSize);
+                upload.data = upload.mipChain.texels.data();
+                upload.staging = nullptr;
+            }
+            for (auto &region : regions)
+            {
+                region.bufferOffset += staging.offset;
+            }
+        }
+
+        createResidentTextureImage(
+            textureBaseLevel, textureImage, textureImageMemory);
+        // to copy the staging buffer to the texture image two steps are needed
+        // 1. Transition the texture image to
+        //    VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL
+        // 2. Execute the buffer to image
+        //    copy operation
+        transitionImageLayout(textureImage,
+                              textureFormat,
+                              VK_IMAGE_LAYOUT_UNDEFINED,
+                              VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                              textureMipLevels,
+                              textureArrayLayers);
+
+        copyBufferToImage(staging.buffer, textureImage, regions);
+
+        // prepare it for shader access
+        transitionImageLayout(textureImage,
+                              textureFormat,
+                              VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                              VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+                              textureMipLevels,
+                              textureArrayLayers);
+
+        m_staging.release(staging, m_uploads.fence());
+
+        std::cout << "Loaded texture " << texturePath << " with "
+                  << textureLevelCount << " mip levels (" << textureMipLevels
+                  << " resident) as " << textureFormatName(textureFormat)
+                  << (textureArrayLayers == CUBE_FACE_COUNT ? " cubemap" : "")
+                  << " from " << upload.source << " in "
+                  << std::chrono::duration<float, std::milli>(
+                         std::chrono::high_resolution_clock::now() - loadStart)
+                         .count()
+                  << " ms" << std::endl;
+
+        createSceneTextures(others);
+    }
+
+    /**
+     * Fills the bindless texture array with the textures of the other scene
+     * models (decoded just now, or from their caches) and points the draws
+     * of every model at the slot of its texture. The models share textureImage
+     * without bindless textures, and whenever their texture didn't load or
+     * the array is full.
+     * */
+    void createSceneTextures(std::map<std::string, TextureUpload> &decoded)
+    {
+        for (size_t i = 0; i < sceneModels.size(); i++)
+        {
+            const std::string &path = textureMap.at(sceneModels[i]);
+            uint32_t slot = m_textureSlot;
+            if (m_bindlessTextures && not m_textureTable.find(path, slot)
+                && m_textureTable.size() < m_textureArraySize)
+            {
+                auto it = decoded.find(path);
+                TextureUpload cached;
+                TextureUpload *upload
+                    = it != decoded.end() ? &it->second
+                      : openCachedTexture(path, cached) ? &cached
+                                                        : nullptr;
+                if (upload)
+                {
+                    slot = m_textureTable.add(path);
+                    m_sceneTextures.push_back(uploadSceneTexture(*upload));
+                    m_textureTable.setView(slot, m_sceneTextures.back().view);
+                } else
+                {
+                    slot = m_textureSlot;
+                }
+            }
+            setMeshTexture(meshDraws[i], slot);
+        }
+
+        if (m_bindlessTextures)
+        {
+            std::cout << "Bindless texture array: " << m_textureTable.size()
+                      << " of " << m_textureArraySize << " slots in use"
+                      << std::endl;
+        }
+    }
+
+    /// device local image with all levels of upload
+    SceneTexture uploadSceneTexture(const TextureUpload &upload)
+    {
+        StagingRegion staging
+            = m_staging.reserve(upload.size, copyAlignment(upload.format));
+        memcpy(staging.mapped, upload.data, static_cast<size_t>(upload.size));
+        std::vector<VkBufferImageCopy> regions = upload.regions;
+        for (auto &region : regions)
+        {
+            region.bufferOffset += staging.offset;
+        }
+
+        SceneTexture texture{};
+        createImage(upload.width,
+                    upload.height,
+                    upload.levelCount,
+                    upload.format,
+                    VK_IMAGE_TILING_OPTIMAL,
+                    VK_IMAGE_USAGE_TRANSFER_DST_BIT
+                        | VK_IMAGE_USAGE_SAMPLED_BIT,
+                    VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                    texture.image,
+                    texture.memory);
+        transitionImageLayout(texture.image,
+                              upload.format,
+                              VK_IMAGE_LAYOUT_UNDEFINED,
+                              VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                              upload.levelCount);
+        copyBufferToImage(staging.buffer, texture.image, regions);
+        transitionImageLayout(texture.image,
+                              upload.format,
+                              VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                              VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+                              upload.levelCount);
+        m_staging.release(staging, m_uploads.fence());
+
+        texture.view = createImageView(texture.image,
+                                       upload.format,
+                                       VK_IMAGE_ASPECT_COLOR_BIT,
+                                       upload.levelCount,
+                                       VK_IMAGE_VIEW_TYPE_2D,
+                                       1,
+                                       dataTextureComponents(upload.format));
+        return texture;
+    }
+
+    /// the draws of mesh sample the texture in slot of the bindless array,
+    /// it goes in as their firstInstance
+    void setMeshTexture(MeshDraw &mesh, uint32_t slot)
+    {
+        mesh.textureIndex = m_bindlessTextures ? slot : 0;
+        for (uint32_t m = mesh.firstMeshlet;
+             m < mesh.firstMeshlet + mesh.meshletCount;
+             m++)
+        {
+            meshletDraws[m].firstInstance = mesh.textureIndex;
+        }
+    }
+
+    /// image for the levels of the texture from baseLevel on, a copy source
+    /// as well for the next change of them
+    void createResidentTextureImage(uint32_t baseLevel,
+                                    VkImage &image,
+                                    MemoryAllocation &imageMemory)
+    {
+        createImage(mipExtent(m_textureSource.width, baseLevel),
+                    mipExtent(m_textureSource.height, baseLevel),
+                    textureLevelCount - baseLevel,
+                    textureFormat,
+                    VK_IMAGE_TILING_OPTIMAL,
+                    VK_IMAGE_USAGE_TRANSFER_DST_BIT
+                        | VK_IMAGE_USAGE_TRANSFER_SRC_BIT
+                        | VK_IMAGE_USAGE_SAMPLED_BIT,
+                    VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                    image,
+                    imageMemory,
+                    textureArrayLayers,
+                    textureArrayLayers == CUBE_FACE_COUNT
+                        ? VK_IMAGE_CREATE_CUBE_COMPATIBLE_BIT
+                        : 0);
+    }
+
+    // as more images wwill be created we abstract the image creation
+    void createImage(uint32_t textureWidth,
+                     uint32_t textureHeight,
+                     uint32_t mipLevels,
+                     VkFormat format,
+                     VkImageTiling tiling,
+                     VkImageUsageFlags usage,
+                     VkMemoryPropertyFlags properties,
+                     VkImage &image,
+                     MemoryAllocation &imageMemory,
+                     uint32_t arrayLayers = 1,
+                     VkImageCreateFlags flags = 0)
+    {
+
+        VkImageCreateInfo imageInfo{};
+        imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+        imageInfo.imageType
+            = VK_IMAGE_TYPE_2D; /// tells vulkan which kind of coordinate system
+                                /// the texels in the image are going to use
+        imageInfo.extent.width
+            = textureWidth; /// specifies the dimensions of the immage
+        imageInfo.extent.height = textureHeight;
+        imageInfo.extent.depth = 1; /// how many texels are on each axis
+        imageInfo.mipLevels = mipLevels;
+        imageInfo.arrayLayers = arrayLayers;
+        imageInfo.format = format; /// should use the same format for the
+                                   /// texels as the pixels in the buffer,
+                                   /// otherwise the copy operation will
                                    /// fail.
         imageInfo.tiling = tiling; /// tiling mode can't be
                                    /// changed at a later time
@@ -2262,32 +3917,25 @@ class TriangleApp {
         /// the mesh
         imageInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
         imageInfo.samples = VK_SAMPLE_COUNT_1_BIT;
-        imageInfo.flags = 0; /// Optional, multisampling related
+        imageInfo.flags = flags; /// e.g. a cubemap needs cube compatibility
 
-        if (vkCreateImage(device, &imageInfo, nullptr, &image) != VK_SUCCESS)
+        if (vkCreateImage(device, &imageInfo, allocator(), &image)
+            != VK_SUCCESS)
         {
             throw std::runtime_error("failed to create image!");
         }
 
         // allocating memory for an image works exactly the same way as
         // allocation memory for a buffer, allthough requirements and
-        // bind-methods differ
+        // bind-methods differ. The range comes out of a larger block, see
+        // device_memory.h
         VkMemoryRequirements memRequirements;
         vkGetImageMemoryRequirements(device, image, &memRequirements);
+        imageMemory = m_memory.allocate(
+            memRequirements, properties, tiling == VK_IMAGE_TILING_LINEAR);
 
-        VkMemoryAllocateInfo allocInfo{};
-        allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-        allocInfo.allocationSize = memRequirements.size;
-        allocInfo.memoryTypeIndex
-            = findMemoryType(memRequirements.memoryTypeBits, properties);
-
-        if (vkAllocateMemory(device, &allocInfo, nullptr, &imageMemory)
-            != VK_SUCCESS)
-        {
-            throw std::runtime_error("failed to allocate image memory!");
-        }
-
-        vkBindImageMemory(device, image, imageMemory, 0);
+        vkBindImageMemory(
+            device, image, imageMemory.memory, imageMemory.offset);
     }
 
     /**
@@ -2297,19 +3945,77 @@ class TriangleApp {
     {
         // almmost the same as createImageViews() except format and image
         textureImageView = createImageView(
-            textureImage, VK_FORMAT_R8G8B8A8_SRGB, VK_IMAGE_ASPECT_COLOR_BIT);
+            textureImage,
+            textureFormat,
+            VK_IMAGE_ASPECT_COLOR_BIT,
+            textureMipLevels,
+            textureArrayLayers == CUBE_FACE_COUNT ? VK_IMAGE_VIEW_TYPE_CUBE
+                                                  : VK_IMAGE_VIEW_TYPE_2D,
+            textureArrayLayers,
+            dataTextureComponents(textureFormat));
+        m_textureTable.setView(m_textureSlot, textureImageView);
     }
 
     void loadModels()
     {
-        std::vector<Model> models = {Model::Earth3Dv3}; //, Model::Moon};
-
-        for (const auto &model : models)
+        for (const auto &model : sceneModels)
         {
             loadModel(model);
         }
     }
 
+    /**
+     * Picks the formats of the compact vertex layout for the loaded meshes,
+     * falls back to the float layout if the device can't read them from a
+     * vertex buffer (all of them are required by the spec, but better safe).
+     * The uv range and the bounds come with every mesh (and its cache), no
+     * vertex is looked at here.
+     * */
+    void chooseVertexFormat()
+    {
+        m_positionDequantization = glm::mat4(1.0f);
+        if (m_vertexLayout != VertexLayout::Compact)
+        {
+            return;
+        }
+
+        m_texCoordFormat = VK_FORMAT_R16G16_UNORM;
+        for (const auto &source : m_meshSources)
+        {
+            m_texCoordFormat = combineTexCoordFormats(
+                m_texCoordFormat, source.mesh.texCoordFormat);
+        }
+        for (VkFormat format : {VK_FORMAT_R16G16B16A16_UNORM,
+                                VK_FORMAT_R16G16_SNORM,
+                                m_texCoordFormat})
+        {
+            VkFormatProperties properties;
+            vkGetPhysicalDeviceFormatProperties(
+                physicalDevice, format, &properties);
+            if (not(properties.bufferFeatures
+                    & VK_FORMAT_FEATURE_VERTEX_BUFFER_BIT))
+            {
+                std::cerr << "vertex format " << format
+                          << " not supported, using float vertices"
+                          << std::endl;
+                m_vertexLayout = VertexLayout::Float32;
+                return;
+            }
+        }
+
+        // all meshes share one vertex buffer and one dequantization
+        for (size_t i = 0; i < m_meshSources.size(); i++)
+        {
+            const QuantizationBounds &bounds
+                = m_meshSources[i].mesh.quantizationBounds;
+            m_quantizationBounds
+                = i == 0 ? bounds
+                         : combineQuantizationBounds(m_quantizationBounds,
+                                                     bounds);
+        }
+        m_positionDequantization = dequantizationMatrix(m_quantizationBounds);
+    }
+
     /*validation layer: Validation Error: [
      * VUID-VkDescriptorSetAllocateInfo-descriptorSetCount-00306 ] Object 0:
      * handle = 0x2f000000002f, type = VK_OBJECT_TYPE_DESCRIPTOR_POOL; |
@@ -2324,6 +4030,40 @@ class TriangleApp {
      * */
     void loadModel(Model model)
     {
+        // bodies without an OBJ file are always generated
+        auto sphere = sphereMap.find(model);
+        if (sphere != sphereMap.end()
+            && (m_generateSpheres || modelMap.count(model) == 0))
+        {
+            generateSphereModel(model, sphere->second);
+            return;
+        }
+
+        const std::string &modelPath = modelMap.at(model);
+        auto loadStart = std::chrono::high_resolution_clock::now();
+
+        // warm start: a previous run already parsed, welded and simplified
+        // this model. Only the coarsest level is decoded here, the finer
+        // ones are decoded by the workers that stream them in.
+        const uint32_t cacheFlags
+            = (m_optimizeMeshes ? MESH_CACHE_FLAG_OPTIMIZED : 0)
+              | (m_generateLods ? MESH_CACHE_FLAG_LODS : 0);
+        MeshSource cached;
+        cached.cache = std::make_unique<MeshCache>();
+        if (cached.cache->open(modelPath, cacheFlags)
+            && cached.cache->coarsestMesh(cached.mesh))
+        {
+            appendMesh(std::move(cached));
+
+            std::cout << "Loaded model " << modelPath << " from cache in "
+                      << std::chrono::duration<float, std::milli>(
+                             std::chrono::high_resolution_clock::now()
+                             - loadStart)
+                             .count()
+                      << " ms" << std::endl;
+            logMeshSize(meshDraws.back());
+            return;
+        }
 
         // An OBJ file consists of positions, normals, texture coordinates and
         // faces. Faces consist of an arbitrary amount of vertices, where each
@@ -2332,80 +4072,192 @@ class TriangleApp {
         // also individual attributes. Hold in the attrib containers
         tinyobj::attrib_t attrib;
         std::vector<tinyobj::shape_t> shapes;
-        std::vector<tinyobj::material_t> materials;
         std::string warn, err;
 
-        // our app can only render triangles, LoadObj has an optional paramet
-        // which is set by default to triangulate faces
-        if (not tinyobj::LoadObj(&attrib,
-                                 &shapes,
-                                 &materials,
-                                 &warn,
-                                 &err,
-                                 // modelMap.at(Model::VikingRoom).c_str()))
-                                 modelMap.at(model).c_str()))
+        // our app can only render triangles, the parser triangulates the
+        // faces the same way tinyobj::LoadObj does, but splits the file across
+        // the thread pool (see obj_parser.h)
+        if (not loadObjParallel(&attrib,
+                                &shapes,
+                                &warn,
+                                &err,
+                                modelPath.c_str()))
         {
             throw std::runtime_error(warn + err);
         }
 
-        // there are many duplicated verticies in the model
-        std::unordered_map<Vertex, uint32_t> uniqueVertices{};
-
-        // combine all faces in the file into a single model
-        for (const auto &shape : shapes)
-        {
-            // bc of triangulation feature just iterate and dump them straight
-            // into vertices vector
-            for (const auto &index : shape.mesh.indices)
-            {
-                Vertex vertex{};
-
-                // For simplicity, we will assume that every vertex is unique
-                // for now, hence the simple auto-increment indices. The index
-                // variable is of type tinyobj::index_t, which contains the
-                // vertex_index, normal_index and texcoord_index members. We
-                // need to use these indices to look up the actual vertex
-                // attributes in the attrib arrays:
-                vertex.pos = {
-                    attrib.vertices[3 * index.vertex_index
-                                    + 0], // attrib.vertices is an array of
-                                          // float instead of glm::vec3 so
-                                          // multiplied by 3
-                    attrib
-                        .vertices[3 * index.vertex_index + 1], // 0=x, 1=y, 2=z
-                    attrib.vertices[3 * index.vertex_index + 2]};
-
-                // The OBJ format assumes a coordinate system where a vertical
-                // coordinate of 0 means the bottom of the image, however we’ve
-                // uploaded our image into Vulkan in a top to bottom orientation
-                // where 0 means the top of the image
-                vertex.texCoord = {
-                    attrib.texcoords[2 * index.texcoord_index
-                                     + 0], // two texture coordinates
-                    1.0f
-                        - attrib.texcoords[2 * index.texcoord_index
-                                           + 1] // 0=u, 1=v, flip vertical
-                                                // comp with 1.0f - ....
-
-                };
-                vertex.color = {1.0f, 1.0f, 1.0f};
-
-                if (uniqueVertices.count(vertex) == 0)
-                {
-                    uniqueVertices[vertex]
-                        = static_cast<uint32_t>(vertices.size());
-                    vertices.push_back(vertex);
-                }
+        // cold start: the whole chain of levels is built here before the
+        // first frame, only the uploads of the finer levels are streamed.
+        // The mesh is welded with model local indices, that is what goes
+        // into the cache.
+        std::vector<Vertex> meshVertices;
+        std::vector<uint32_t> meshIndices;
 
-                indices.push_back(uniqueVertices[vertex]);
-            }
+        // there are many duplicated verticies in the model, combine all faces
+        // in the file into a single model and share equal vertices
+        weldVerticesSorted(attrib, shapes, meshVertices, meshIndices);
+
+        // reorder triangles and vertices for the post-transform cache, less
+        // overdraw and vertex fetch locality, see mesh_optimizer.h
+        if (m_optimizeMeshes)
+        {
+            VertexCacheStats before, after;
+            optimizeMesh(meshVertices, meshIndices, before, after);
+            std::cout << "Optimized model " << modelPath
+                      << ": ACMR " << before.acmr << " -> " << after.acmr
+                      << ", ATVR " << before.atvr << " -> " << after.atvr
+                      << std::endl;
         }
-        std::cout << "Loaded model with: " << vertices.size() << " vertices"
+
+        ProgressiveMesh progressiveMesh
+            = buildProgressiveMesh(meshVertices.data(),
+                                   meshVertices.size(),
+                                   meshIndices.data(),
+                                   meshIndices.size(),
+                                   m_generateLods);
+        writeMeshCache(modelPath, progressiveMesh, cacheFlags);
+        appendMesh({std::move(progressiveMesh), nullptr});
+
+        std::cout << "Loaded model " << modelPath << " from OBJ in "
+                  << std::chrono::duration<float, std::milli>(
+                         std::chrono::high_resolution_clock::now() - loadStart)
+                         .count()
+                  << " ms" << std::endl;
+        logMeshSize(meshDraws.back());
+    }
+
+    static void logMeshSize(const MeshDraw &mesh)
+    {
+        std::cout << "Loaded model with: " << mesh.vertexCount << " vertices"
                   << std::endl;
-        std::cout << "Loaded model with: " << indices.size() << " indices"
+        std::cout << "Loaded model with: " << mesh.indexCount << " indices"
                   << std::endl;
     }
 
+    /**
+     * Generates a model flagged in sphereMap instead of reading its OBJ file,
+     * there is nothing to parse or weld and it isn't worth caching
+     * */
+    void generateSphereModel(Model model, SphereParams params)
+    {
+        auto generateStart = std::chrono::high_resolution_clock::now();
+
+        auto subdivisions = m_sphereSubdivisions.find(model);
+        if (subdivisions != m_sphereSubdivisions.end())
+        {
+            params.subdivisions = subdivisions->second;
+        }
+
+        std::vector<Vertex> meshVertices;
+        std::vector<uint32_t> meshIndices;
+        generateSphere(params, meshVertices, meshIndices);
+
+        if (m_optimizeMeshes)
+        {
+            VertexCacheStats before, after;
+            optimizeMesh(meshVertices, meshIndices, before, after);
+            std::cout << "Optimized sphere: ACMR " << before.acmr << " -> "
+                      << after.acmr << ", ATVR " << before.atvr << " -> "
+                      << after.atvr << std::endl;
+        }
+
+        appendMesh({buildProgressiveMesh(meshVertices.data(),
+                                         meshVertices.size(),
+                                         meshIndices.data(),
+                                         meshIndices.size(),
+                                         m_generateLods),
+                    nullptr});
+
+        std::cout << "Generated "
+                  << (params.type == SphereType::Icosphere ? "icosphere"
+                                                           : "cube-sphere")
+                  << " with " << params.subdivisions << " subdivisions for "
+                  << modelMap.at(model) << " in "
+                  << std::chrono::duration<float, std::milli>(
+                         std::chrono::high_resolution_clock::now()
+                         - generateStart)
+                         .count()
+                  << " ms" << std::endl;
+        logMeshSize(meshDraws.back());
+    }
+
+    /**
+     * Places a mesh with model local indices behind the ones before it in
+     * the vertex and index buffer, all models share one vertex and one index
+     * buffer and are drawn as one MeshDraw each. The levels stay with the
+     * source until streamMeshes() has packed them into their batches.
+     * */
+    void appendMesh(MeshSource source)
+    {
+        const ProgressiveMesh &progressiveMesh = source.mesh;
+        MeshDraw mesh{};
+        // behind the meshes before, the indices stay local to the mesh and
+        // vertexOffset rebases them at draw time
+        for (const auto &other : meshDraws)
+        {
+            mesh.vertexOffset += static_cast<int32_t>(other.vertexCount);
+        }
+        mesh.vertexCount = progressiveVertexCount(progressiveMesh);
+        mesh.indexCount = progressiveIndexCount(progressiveMesh);
+        mesh.lods = progressiveMesh.lods;
+        mesh.lodCount = progressiveMesh.lodCount;
+        mesh.boundsCenter = progressiveMesh.boundsCenter;
+        mesh.boundsRadius = progressiveMesh.boundsRadius;
+
+        // the meshlet draws point into the index range of their level like
+        // the levels do
+        mesh.firstMeshlet = static_cast<uint32_t>(meshletBounds.size());
+        for (uint32_t i = 0; i < mesh.lodCount; i++)
+        {
+            MeshLod &lod = mesh.lods[i];
+            for (uint32_t m = lod.firstMeshlet;
+                 m < lod.firstMeshlet + lod.meshletCount;
+                 m++)
+            {
+                const Meshlet &meshlet = progressiveMesh.meshlets[m];
+                meshletBounds.push_back(meshlet.bounds);
+                meshletDraws.push_back(
+                    {meshlet.indexCount,
+                     1,
+                     lod.firstIndex + meshlet.firstIndex,
+                     mesh.vertexOffset,
+                     0});
+            }
+            lod.firstMeshlet += mesh.firstMeshlet;
+        }
+        mesh.meshletCount
+            = static_cast<uint32_t>(progressiveMesh.meshlets.size());
+        meshDraws.push_back(mesh);
+
+        std::cout << "Levels of detail:";
+        for (uint32_t i = 0; i < mesh.lodCount; i++)
+        {
+            std::cout << " " << mesh.lods[i].indexCount / 3;
+        }
+        std::cout << " triangles, " << mesh.meshletCount << " meshlets"
+                  << std::endl;
+        m_meshSources.push_back(std::move(source));
+    }
+
+    /**
+     * Picks the level of detail of every mesh for this frame from its
+     * projected size, the drawn levels stay below m_lodPixelError pixels of
+     * error unless the finer ones aren't streamed in yet
+     * */
+    void selectMeshLods(const glm::mat4 &modelMatrix)
+    {
+        for (auto &mesh : meshDraws)
+        {
+            mesh.lod = selectMeshLod(mesh,
+                                     modelMatrix,
+                                     eyeVec,
+                                     m_fieldOfView,
+                                     static_cast<float>(swapChainExtent.height),
+                                     m_lodPixelError);
+            mesh.lod = std::max(mesh.lod, mesh.residentLod);
+        }
+    }
+
     /**
      * Textures are usually accessed through samplers, which will apply
      * filtering and transformations to compute the final color that is
@@ -2452,15 +4304,200 @@ class TriangleApp {
         samplerInfo.mipmapMode = VK_SAMPLER_MIPMAP_MODE_LINEAR;
         samplerInfo.mipLodBias = 0.0f;
         samplerInfo.minLod = 0.0f;
-        samplerInfo.maxLod = 0.0f;
+        // shared by the textures of the bindless array, each of them is
+        // clamped to its own levels
+        samplerInfo.maxLod = VK_LOD_CLAMP_NONE;
 
-        if (vkCreateSampler(device, &samplerInfo, nullptr, &textureSampler)
+        if (vkCreateSampler(device, &samplerInfo, allocator(), &textureSampler)
             != VK_SUCCESS)
         {
             throw std::runtime_error("failed to create texture sampler!");
         }
     }
 
+    /**
+     * The tile cache: a texture array with as many layers as tiles with all
+     * their mips fit into the tile cache size, its sampler and descriptor
+     * set, the index buffer of the patch grid, and the root tiles, which are
+     * uploaded right away and stay resident
+     * */
+    void createTileCache()
+    {
+        if (not m_tileStreaming)
+        {
+            return;
+        }
+        auto loadStart = std::chrono::high_resolution_clock::now();
+
+        const uint32_t tileWidth = m_tilePyramid.tileWidth;
+        const uint32_t tileHeight = m_tilePyramid.tileHeight;
+        const uint32_t rootCount
+            = m_tilePyramid.rootColumns * m_tilePyramid.rootRows;
+        tileMipLevels = mipLevelCount(tileWidth, tileHeight);
+        const VkDeviceSize layerSize
+            = mipLevelOffset(tileWidth, tileHeight, tileMipLevels);
+        VkPhysicalDeviceProperties properties{};
+        vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+        // the pinned root tiles don't count, something has to be streamed
+        uint32_t layerCount = static_cast<uint32_t>(std::min<VkDeviceSize>(
+            VkDeviceSize(m_tileCacheMegabytes) * 1024 * 1024 / layerSize,
+            properties.limits.maxImageArrayLayers));
+        layerCount = std::max(layerCount, rootCount + TILE_MAX_REQUESTS);
+        m_tileCache.reset(layerCount);
+
+        createImage(tileWidth,
+                    tileHeight,
+                    tileMipLevels,
+                    VK_FORMAT_R8G8B8A8_SRGB,
+                    VK_IMAGE_TILING_OPTIMAL,
+                    VK_IMAGE_USAGE_TRANSFER_DST_BIT
+                        | VK_IMAGE_USAGE_SAMPLED_BIT,
+                    VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                    tileImage,
+                    tileImageMemory,
+                    layerCount);
+        tileImageView = createImageView(tileImage,
+                                        VK_FORMAT_R8G8B8A8_SRGB,
+                                        VK_IMAGE_ASPECT_COLOR_BIT,
+                                        tileMipLevels,
+                                        VK_IMAGE_VIEW_TYPE_2D_ARRAY,
+                                        layerCount);
+
+        // a patch samples its part of a tile, clamped so the filter doesn't
+        // wrap around to the other side of it
+        VkSamplerCreateInfo samplerInfo{};
+        samplerInfo.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
+        samplerInfo.magFilter = VK_FILTER_LINEAR;
+        samplerInfo.minFilter = VK_FILTER_LINEAR;
+        samplerInfo.addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+        samplerInfo.addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+        samplerInfo.addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+        samplerInfo.anisotropyEnable = VK_FALSE;
+        samplerInfo.maxAnisotropy = 1.0f;
+        samplerInfo.borderColor = VK_BORDER_COLOR_INT_OPAQUE_BLACK;
+        samplerInfo.unnormalizedCoordinates = VK_FALSE;
+        samplerInfo.compareEnable = VK_FALSE;
+        samplerInfo.compareOp = VK_COMPARE_OP_ALWAYS;
+        samplerInfo.mipmapMode = VK_SAMPLER_MIPMAP_MODE_LINEAR;
+        samplerInfo.minLod = 0.0f;
+        samplerInfo.maxLod = static_cast<float>(tileMipLevels);
+        if (vkCreateSampler(device, &samplerInfo, allocator(), &tileSampler)
+            != VK_SUCCESS)
+        {
+            throw std::runtime_error("failed to create tile sampler!");
+        }
+
+        // one set for all frames in flight, the array is only written by
+        // copies
+        VkDescriptorPoolSize poolSize{};
+        poolSize.type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+        poolSize.descriptorCount = 1;
+        VkDescriptorPoolCreateInfo poolInfo{};
+        poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+        poolInfo.poolSizeCount = 1;
+        poolInfo.pPoolSizes = &poolSize;
+        poolInfo.maxSets = 1;
+        if (vkCreateDescriptorPool(
+                device, &poolInfo, allocator(), &tileDescriptorPool)
+            != VK_SUCCESS)
+        {
+            throw std::runtime_error("failed to create tile descriptor pool!");
+        }
+        VkDescriptorSetAllocateInfo allocInfo{};
+        allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+        allocInfo.descriptorPool = tileDescriptorPool;
+        allocInfo.descriptorSetCount = 1;
+        allocInfo.pSetLayouts = &tileDescriptorSetLayout;
+        if (vkAllocateDescriptorSets(device, &allocInfo, &tileDescriptorSet)
+            != VK_SUCCESS)
+        {
+            throw std::runtime_error("failed to allocate tile descriptor set!");
+        }
+        VkDescriptorImageInfo imageInfo{};
+        imageInfo.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+        imageInfo.imageView = tileImageView;
+        imageInfo.sampler = tileSampler;
+        VkWriteDescriptorSet descriptorWrite{};
+        descriptorWrite.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        descriptorWrite.dstSet = tileDescriptorSet;
+        descriptorWrite.dstBinding = 0;
+        descriptorWrite.descriptorType
+            = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+        descriptorWrite.descriptorCount = 1;
+        descriptorWrite.pImageInfo = &imageInfo;
+        vkUpdateDescriptorSets(device, 1, &descriptorWrite, 0, nullptr);
+
+        const std::vector<uint16_t> patchIndices = tilePatchIndices();
+        createDeviceLocalBuffer(patchIndices.data(),
+                                patchIndices.size() * sizeof(uint16_t),
+                                VK_BUFFER_USAGE_INDEX_BUFFER_BIT,
+                                tileIndexBuffer,
+                                tileIndexBufferMemory);
+
+        // the root tiles are decoded on the pool, the whole array goes to
+        // shader reading with them so the layers that were never written
+        // are in the layout of the descriptor as well
+        std::vector<TileBatch> batches(rootCount);
+        std::vector<std::future<void>> tasks;
+        for (uint32_t i = 0; i < rootCount; i++)
+        {
+            const TileId tile{m_tilePyramid.firstLevel,
+                              i % m_tilePyramid.rootColumns,
+                              i / m_tilePyramid.rootColumns};
+            const uint64_t key = tileKey(tile);
+            const uint32_t layer
+                = static_cast<uint32_t>(m_tileCache.reserve(key, 0, true));
+            const std::string path = m_tilePyramid.tiles.at(key);
+            tasks.push_back(sharedThreadPool().submit(
+                [this, &batches, i, tile, layer, path] {
+                    batches[i] = prepareTileBatch(tile, layer, path);
+                }));
+        }
+        for (auto &task : tasks)
+        {
+            task.get();
+        }
+        for (const auto &batch : batches)
+        {
+            if (batch.staging.buffer == VK_NULL_HANDLE)
+            {
+                throw std::runtime_error(
+                    "failed to load tile "
+                    + m_tilePyramid.tiles.at(tileKey(batch.tile)));
+            }
+        }
+
+        transitionImageLayout(tileImage,
+                              VK_FORMAT_R8G8B8A8_SRGB,
+                              VK_IMAGE_LAYOUT_UNDEFINED,
+                              VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                              tileMipLevels,
+                              layerCount);
+        for (const auto &batch : batches)
+        {
+            recordTileBatchCopy(m_uploads.commands(), batch);
+        }
+        transitionImageLayout(tileImage,
+                              VK_FORMAT_R8G8B8A8_SRGB,
+                              VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                              VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+                              tileMipLevels,
+                              layerCount);
+
+        for (const auto &batch : batches)
+        {
+            m_tileCache.markResident(tileKey(batch.tile));
+            m_staging.release(batch.staging, m_uploads.fence());
+        }
+        std::cout << "Loaded " << rootCount << " root tiles into a tile cache "
+                  << "of " << layerCount << " layers ("
+                  << layerCount * layerSize / (1024 * 1024) << " MB) in "
+                  << std::chrono::duration<float, std::milli>(
+                         std::chrono::high_resolution_clock::now() - loadStart)
+                         .count()
+                  << " ms" << std::endl;
+    }
+
     void createCommandBuffers()
     {
         commandBuffers.resize(MAX_FRAMES_IN_FLIGHT);
@@ -2503,16 +4540,16 @@ class TriangleApp {
         {
             if (vkCreateSemaphore(device,
                                   &semaphoreInfo,
-                                  nullptr,
+                                  allocator(),
                                   &imageAvailableSemaphores[i])
                     != VK_SUCCESS
                 || vkCreateSemaphore(device,
                                      &semaphoreInfo,
-                                     nullptr,
+                                     allocator(),
                                      &renderFinishedSemaphores[i])
                        != VK_SUCCESS
                 || vkCreateFence(
-                       device, &fenceInfo, nullptr, &inFlightFences[i])
+                       device, &fenceInfo, allocator(), &inFlightFences[i])
                        != VK_SUCCESS)
             {
                 throw std::runtime_error(
@@ -2591,6 +4628,15 @@ class TriangleApp {
         renderPassInfo.pClearValues
             = clearValues.data(); /// for VK_ATTACHMENT_LOAD_OP_CLEAR
 
+        // transfers and compute work can't be recorded inside a render pass
+        recordMeshBatchCopies(commandBuffer);
+        recordTileBatchCopies(commandBuffer);
+        recordTextureSwaps(commandBuffer);
+        if (m_cullingMode == CullingMode::Gpu)
+        {
+            recordMeshletCulling(commandBuffer);
+        }
+
         vkCmdBeginRenderPass(
             commandBuffer,
             &renderPassInfo,
@@ -2608,11 +4654,6 @@ class TriangleApp {
                                1,
                                vertexBuffers,
                                offsets); /// bind vertex buffers to bindings
-        // only possible to have  a single index buffer
-        // not possible to use different indices for each vertex attribute (if
-        // one attribute varies we still have to duplicate vertex data)
-        vkCmdBindIndexBuffer(
-            commandBuffer, indexBuffer, 0, VK_INDEX_TYPE_UINT32);
 
         // as viewport and scissor state is dynamic we need to set them in
         // cmmand buffer before drawing
@@ -2650,166 +4691,1355 @@ class TriangleApp {
         //    commandBuffer, static_cast<uint32_t>(vertices.size()), 1, 0, 0);
 
         // when using an indexbuffer this is the method to draw stuff
-        vkCmdDrawIndexed(
-            commandBuffer, static_cast<uint32_t>(indices.size()), 1, 0, 0, 0);
+        // only possible to have  a single index buffer
+        // not possible to use different indices for each vertex attribute (if
+        // one attribute varies we still have to duplicate vertex data)
+        // every mesh binds its own range of it, as the index type can differ,
+        // and draws the level of detail picked for this frame
+        m_drawnTriangles = 0;
+        for (const auto &mesh : meshDraws)
+        {
+            // the first scene model is drawn as tile patches instead
+            if (m_tileStreaming && &mesh == &meshDraws.front())
+            {
+                continue;
+            }
+            const MeshLod &lod = mesh.lods[mesh.lod];
+            vkCmdBindIndexBuffer(commandBuffer,
+                                 indexBuffer,
+                                 mesh.indexBufferOffset,
+                                 mesh.indexType);
+            if (m_cullingMode == CullingMode::Gpu)
+            {
+                // the culled draws are packed to the front of the range of
+                // the level, the zeroed rest draws nothing
+                const VkDeviceSize stride
+                    = sizeof(VkDrawIndexedIndirectCommand);
+                for (uint32_t first = 0; first < lod.meshletCount;
+                     first += m_maxDrawIndirectCount)
+                {
+                    vkCmdDrawIndexedIndirect(
+                        commandBuffer,
+                        culledDrawBuffers[currentFrame],
+                        (lod.firstMeshlet + first) * stride,
+                        std::min(lod.meshletCount - first,
+                                 m_maxDrawIndirectCount),
+                        static_cast<uint32_t>(stride));
+                }
+                m_drawnTriangles += lod.indexCount / 3;
+            } else if (m_cullingMode == CullingMode::Cpu)
+            {
+                drawVisibleMeshlets(commandBuffer, mesh, lod);
+            } else
+            {
+                vkCmdDrawIndexed(commandBuffer,
+                                 lod.indexCount,
+                                 1,
+                                 lod.firstIndex,
+                                 mesh.vertexOffset,
+                                 mesh.textureIndex);
+                m_drawnTriangles += lod.indexCount / 3;
+            }
+        }
+        drawTilePatches(commandBuffer);
 
         ImGui_ImplVulkan_RenderDrawData(ImGui::GetDrawData(), commandBuffer);
 
         vkCmdEndRenderPass(commandBuffer);
 
-        if (vkEndCommandBuffer(commandBuffer) != VK_SUCCESS)
+        if (vkEndCommandBuffer(commandBuffer) != VK_SUCCESS)
+        {
+            throw std::runtime_error("failed to record command buffer");
+        }
+    }
+
+    /**
+     * Clears the culled draws of this frame and lets meshlet_cull.comp copy
+     * the visible meshlets of every drawn level into them, one dispatch per
+     * mesh with its own counter
+     * */
+    void recordMeshletCulling(VkCommandBuffer commandBuffer)
+    {
+        vkCmdFillBuffer(commandBuffer,
+                        culledDrawBuffers[currentFrame],
+                        0,
+                        VK_WHOLE_SIZE,
+                        0);
+        vkCmdFillBuffer(commandBuffer,
+                        cullCounterBuffers[currentFrame],
+                        0,
+                        VK_WHOLE_SIZE,
+                        0);
+
+        VkMemoryBarrier clearBarrier{};
+        clearBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+        clearBarrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        clearBarrier.dstAccessMask
+            = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+        vkCmdPipelineBarrier(commandBuffer,
+                             VK_PIPELINE_STAGE_TRANSFER_BIT,
+                             VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                             0,
+                             1,
+                             &clearBarrier,
+                             0,
+                             nullptr,
+                             0,
+                             nullptr);
+
+        vkCmdBindPipeline(
+            commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, cullPipeline);
+        vkCmdBindDescriptorSets(commandBuffer,
+                                VK_PIPELINE_BIND_POINT_COMPUTE,
+                                cullPipelineLayout,
+                                0,
+                                1,
+                                &cullDescriptorSets[currentFrame],
+                                0,
+                                nullptr);
+
+        CullPushConstants constants = m_cullConstants;
+        for (uint32_t i = 0; i < meshDraws.size(); i++)
+        {
+            const MeshLod &lod = meshDraws[i].lods[meshDraws[i].lod];
+            if (lod.meshletCount == 0)
+            {
+                continue;
+            }
+            constants.firstMeshlet = lod.firstMeshlet;
+            constants.meshletCount = lod.meshletCount;
+            constants.counter = i;
+            vkCmdPushConstants(commandBuffer,
+                               cullPipelineLayout,
+                               VK_SHADER_STAGE_COMPUTE_BIT,
+                               0,
+                               sizeof(constants),
+                               &constants);
+            vkCmdDispatch(commandBuffer, (lod.meshletCount + 63) / 64, 1, 1);
+        }
+
+        VkMemoryBarrier cullBarrier{};
+        cullBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+        cullBarrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+        cullBarrier.dstAccessMask = VK_ACCESS_INDIRECT_COMMAND_READ_BIT;
+        vkCmdPipelineBarrier(commandBuffer,
+                             VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                             VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT,
+                             0,
+                             1,
+                             &cullBarrier,
+                             0,
+                             nullptr,
+                             0,
+                             nullptr);
+    }
+
+    /**
+     * Draws the meshlets of a level that pass meshletVisible(). The meshlets
+     * follow each other in the index buffer, so runs of visible ones are
+     * merged into one draw.
+     * */
+    void drawVisibleMeshlets(VkCommandBuffer commandBuffer,
+                             const MeshDraw &mesh,
+                             const MeshLod &lod)
+    {
+        const glm::vec3 eye(m_cullConstants.eye);
+        uint32_t runFirstIndex = 0;
+        uint32_t runIndexCount = 0;
+        for (uint32_t m = lod.firstMeshlet;
+             m < lod.firstMeshlet + lod.meshletCount;
+             m++)
+        {
+            if (not meshletVisible(
+                    meshletBounds[m], m_cullConstants.frustum, eye))
+            {
+                continue;
+            }
+            const VkDrawIndexedIndirectCommand &draw = meshletDraws[m];
+            m_drawnTriangles += draw.indexCount / 3;
+            if (runIndexCount > 0
+                && runFirstIndex + runIndexCount == draw.firstIndex)
+            {
+                runIndexCount += draw.indexCount;
+                continue;
+            }
+            if (runIndexCount > 0)
+            {
+                vkCmdDrawIndexed(commandBuffer,
+                                 runIndexCount,
+                                 1,
+                                 runFirstIndex,
+                                 mesh.vertexOffset,
+                                 mesh.textureIndex);
+            }
+            runFirstIndex = draw.firstIndex;
+            runIndexCount = draw.indexCount;
+        }
+        if (runIndexCount > 0)
+        {
+            vkCmdDrawIndexed(commandBuffer,
+                             runIndexCount,
+                             1,
+                             runFirstIndex,
+                             mesh.vertexOffset,
+                             mesh.textureIndex);
+        }
+    }
+
+    void createBuffer(VkDeviceSize size,
+                      VkBufferUsageFlags usage,
+                      VkMemoryPropertyFlags properties,
+                      VkBuffer &buffer,
+                      MemoryAllocation &bufferMemory)
+    {
+
+        // buffers in Vulkan are regions of memory used for storing arbitrary
+        // data that can be read by the GPU. They can be used to store vertex
+        // data. buffers do not automatically allocate memory
+        VkBufferCreateInfo bufferInfo{};
+        bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+        bufferInfo.size = size;
+        bufferInfo.usage = usage;
+        bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+
+        if (vkCreateBuffer(device, &bufferInfo, allocator(), &buffer)
+            != VK_SUCCESS)
+        {
+            throw std::runtime_error("failed to create vertex buffer");
+        }
+
+        // buffer created but no memory allocated for it
+        VkMemoryRequirements memRequirements;
+        vkGetBufferMemoryRequirements(device, buffer, &memRequirements);
+
+        // a vkAllocateMemory per buffer would run into the limit of
+        // "maxMemoryAllocationCount", the buffer gets a range of a larger
+        // block instead, see device_memory.h
+        bufferMemory = m_memory.allocate(memRequirements, properties, true);
+        vkBindBufferMemory(device,
+                           buffer,
+                           bufferMemory.memory,
+                           bufferMemory.offset); /// offset within the block,
+                                                 /// a multiple of
+                                                 /// memRequirements.alignment
+
+        // TODO: check if to use a BufferView ?
+    }
+
+    /**
+     * Vulkan API puts the programmer in control of almost everything, also
+     * memory menagement we need to handle this if the vertex data is managed by
+     * our app and not by the shader itself (which is not good)
+     * The buffer is only created here, the levels of detail are copied into it
+     * as they are streamed in, see streamMeshes().
+     * */
+    void createVertexBuffer()
+    {
+        // the compact layout is packed per batch, everything before works on
+        // the float vertices
+        VkDeviceSize bufferSize = 0;
+        for (const auto &mesh : meshDraws)
+        {
+            bufferSize += vertexStride() * mesh.vertexCount;
+        }
+        std::cout << "vertex buffer: " << bufferSize << " bytes ("
+                  << (m_vertexLayout == VertexLayout::Compact ? "compact"
+                                                              : "float")
+                  << " layout)" << std::endl;
+
+        // memory is allocated from a memory type that is device local (not able
+        // to use vkMapMemory)
+        createBuffer(
+            bufferSize,
+            VK_BUFFER_USAGE_TRANSFER_DST_BIT /// can be used as a destination
+                                             /// in
+                                             /// a memory operation
+                | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
+            VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+            vertexBuffer,
+            vertexBufferMemory);
+    }
+
+    VkDeviceSize vertexStride() const
+    {
+        return m_vertexLayout == VertexLayout::Compact ? sizeof(CompactVertex)
+                                                       : sizeof(Vertex);
+    }
+
+    /**
+     * Almost the same as VertexBuffer creation, but size is sizeof(indices) and
+     * we're using the VK_BUFFER_USAGE_INDEX_BUFFER_BIT flag to create the
+     * buffer.
+     * Every mesh gets the smallest index type that can address its vertices,
+     * the meshes are packed back to back with 4 byte aligned offsets.
+     * */
+    void createIndexBuffer()
+    {
+        VkDeviceSize bufferSize = 0;
+        for (auto &mesh : meshDraws)
+        {
+            mesh.indexType = fitsUint16Indices(mesh.vertexCount)
+                                 ? VK_INDEX_TYPE_UINT16
+                                 : VK_INDEX_TYPE_UINT32;
+            mesh.indexBufferOffset = (bufferSize + 3) & ~VkDeviceSize(3);
+            bufferSize = mesh.indexBufferOffset
+                         + mesh.indexCount * indexSize(mesh.indexType);
+        }
+        std::cout << "index buffer: " << bufferSize << " bytes" << std::endl;
+
+        createBuffer(bufferSize,
+                     VK_BUFFER_USAGE_TRANSFER_DST_BIT
+                         | VK_BUFFER_USAGE_INDEX_BUFFER_BIT,
+                     VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                     indexBuffer,
+                     indexBufferMemory);
+    }
+
+    static VkDeviceSize indexSize(VkIndexType indexType)
+    {
+        return indexType == VK_INDEX_TYPE_UINT16 ? sizeof(uint16_t)
+                                                 : sizeof(uint32_t);
+    }
+
+    /**
+     * Uploads the coarsest level of every mesh right away, so the first frame
+     * doesn't wait for the full meshes, and queues the finer levels coarse to
+     * fine on the thread pool. Each of them becomes drawable with the first
+     * frame after its batch is done, see collectMeshBatches(). The workers
+     * decode the levels of cached meshes, a mesh that was built at this start
+     * is already complete in memory and only its upload is streamed.
+     * */
+    void streamMeshes()
+    {
+        auto streamStart = std::chrono::high_resolution_clock::now();
+
+        std::vector<MeshBatch> batches;
+        for (uint32_t i = 0; i < meshDraws.size(); i++)
+        {
+            // without streaming every level is uploaded here
+            const uint32_t coarsest = meshDraws[i].lodCount - 1;
+            const uint32_t finest = m_streamMeshes ? coarsest : 0;
+            for (uint32_t level = finest; level <= coarsest; level++)
+            {
+                MeshBatch batch;
+                if (prepareMeshBatch(i, level, batch))
+                {
+                    batches.push_back(batch);
+                }
+            }
+        }
+
+        for (const auto &batch : batches)
+        {
+            recordMeshBatchCopy(m_uploads.commands(), batch);
+        }
+
+        for (const auto &batch : batches)
+        {
+            MeshDraw &mesh = meshDraws[batch.mesh];
+            mesh.streamedLevels |= 1u << batch.level;
+            mesh.residentLod
+                = residentLevel(mesh.streamedLevels, mesh.lodCount);
+            m_staging.release(batch.staging, m_uploads.fence());
+        }
+        std::cout << "Uploaded " << batches.size() << " mesh batches in "
+                  << std::chrono::duration<float, std::milli>(
+                         std::chrono::high_resolution_clock::now()
+                         - streamStart)
+                         .count()
+                  << " ms" << std::endl;
+
+        if (not m_streamMeshes)
+        {
+            m_meshSources.clear();
+            return;
+        }
+        // level by level over all meshes, the pool works its queue in order
+        for (uint32_t level = MAX_MESH_LODS - 1; level-- > 0;)
+        {
+            for (uint32_t i = 0; i < meshDraws.size(); i++)
+            {
+                if (level + 1 >= meshDraws[i].lodCount)
+                {
+                    continue;
+                }
+                m_streamTasks.push_back(
+                    sharedThreadPool().submit([this, i, level] {
+                        MeshBatch batch;
+                        if (prepareMeshBatch(i, level, batch))
+                        {
+                            std::lock_guard<std::mutex> lock(m_streamMutex);
+                            m_streamedBatches.push_back(batch);
+                        }
+                    }));
+            }
+        }
+    }
+
+    /**
+     * Packs the vertices a level adds and its indices into a staging region,
+     * in the formats of the vertex and index buffer. Runs on the pool
+     * workers, it only reads what stays untouched after loading. Returns
+     * false if the cached level is corrupt, the mesh then stays at the
+     * coarser levels.
+     * */
+    bool prepareMeshBatch(uint32_t meshIndex, uint32_t level, MeshBatch &batch)
+    {
+        const MeshDraw &mesh = meshDraws[meshIndex];
+        const MeshLod &lod = mesh.lods[level];
+        uint32_t firstVertex, endVertex;
+        levelVertexRange(mesh, level, firstVertex, endVertex);
+
+        const bool compact = m_vertexLayout == VertexLayout::Compact;
+        MeshLevel levelData;
+        if (not readMeshLevel(
+                m_meshSources[meshIndex], level, compact, levelData))
+        {
+            std::cerr << "level " << level << " of mesh " << meshIndex
+                      << " is corrupt, the mesh stays at the coarser levels"
+                      << std::endl;
+            return false;
+        }
+
+        const VkDeviceSize stride = vertexStride();
+        const VkDeviceSize indexBytes = indexSize(mesh.indexType);
+        const VkDeviceSize vertexDataSize = (endVertex - firstVertex) * stride;
+        const VkDeviceSize indexDataOffset
+            = (vertexDataSize + 3) & ~VkDeviceSize(3);
+        const VkDeviceSize bufferSize
+            = indexDataOffset + lod.indexCount * indexBytes;
+
+        batch = {};
+        batch.mesh = meshIndex;
+        batch.level = level;
+        batch.staging = m_staging.reserve(bufferSize, sizeof(float));
+        batch.vertexCopy.srcOffset = batch.staging.offset;
+        batch.vertexCopy.dstOffset
+            = (mesh.vertexOffset + firstVertex) * stride;
+        batch.vertexCopy.size = vertexDataSize;
+        batch.indexCopy.srcOffset = batch.staging.offset + indexDataOffset;
+        batch.indexCopy.dstOffset
+            = mesh.indexBufferOffset + lod.firstIndex * indexBytes;
+        batch.indexCopy.size = lod.indexCount * indexBytes;
+
+        void *data = batch.staging.mapped;
+        if (compact)
+        {
+            packCompactVertices(levelData.vertices.data(),
+                                levelData.normals.data(),
+                                levelData.vertices.size(),
+                                m_quantizationBounds,
+                                m_texCoordFormat,
+                                static_cast<CompactVertex *>(data));
+        } else
+        {
+            memcpy(data,
+                   levelData.vertices.data(),
+                   static_cast<size_t>(vertexDataSize));
+        }
+
+        char *dst = static_cast<char *>(data) + indexDataOffset;
+        const uint32_t *src = levelData.indices.data();
+        if (mesh.indexType == VK_INDEX_TYPE_UINT16)
+        {
+            uint16_t *dst16 = reinterpret_cast<uint16_t *>(dst);
+            for (uint32_t i = 0; i < lod.indexCount; i++)
+            {
+                dst16[i] = static_cast<uint16_t>(src[i]);
+            }
+        } else
+        {
+            memcpy(dst, src, lod.indexCount * sizeof(uint32_t));
+        }
+        return true;
+    }
+
+    void recordMeshBatchCopy(VkCommandBuffer commandBuffer,
+                             const MeshBatch &batch)
+    {
+        if (batch.vertexCopy.size > 0)
+        {
+            vkCmdCopyBuffer(commandBuffer,
+                            batch.staging.buffer,
+                            vertexBuffer,
+                            1,
+                            &batch.vertexCopy);
+        }
+        vkCmdCopyBuffer(commandBuffer,
+                        batch.staging.buffer,
+                        indexBuffer,
+                        1,
+                        &batch.indexCopy);
+    }
+
+    /**
+     * Takes over the batches the workers finished since the last frame.
+     * Their levels count as resident right away, the copies are recorded in
+     * front of the draws of this frame (recordMeshBatchCopies()).
+     * */
+    void collectMeshBatches()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_streamMutex);
+            m_pendingBatches.insert(m_pendingBatches.end(),
+                                    m_streamedBatches.begin(),
+                                    m_streamedBatches.end());
+            m_streamedBatches.clear();
+        }
+        for (const auto &batch : m_pendingBatches)
+        {
+            MeshDraw &mesh = meshDraws[batch.mesh];
+            mesh.streamedLevels |= 1u << batch.level;
+            mesh.residentLod
+                = residentLevel(mesh.streamedLevels, mesh.lodCount);
+        }
+
+        // get() passes on what a worker threw
+        for (auto it = m_streamTasks.begin(); it != m_streamTasks.end();)
+        {
+            if (it->wait_for(std::chrono::seconds(0))
+                == std::future_status::ready)
+            {
+                it->get();
+                it = m_streamTasks.erase(it);
+            } else
+            {
+                it++;
+            }
+        }
+        // every level is packed, the decoded arrays and the mappings can go
+        if (m_streamTasks.empty())
+        {
+            m_meshSources.clear();
+        }
+    }
+
+    void recordMeshBatchCopies(VkCommandBuffer commandBuffer)
+    {
+        if (m_pendingBatches.empty())
+        {
+            return;
+        }
+        for (const auto &batch : m_pendingBatches)
+        {
+            recordMeshBatchCopy(commandBuffer, batch);
+            m_staging.release(batch.staging, inFlightFences[currentFrame]);
+        }
+        m_pendingBatches.clear();
+
+        // the regions were never drawn before, only the draws of this frame
+        // have to wait for the copies
+        VkMemoryBarrier barrier{};
+        barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+        barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        barrier.dstAccessMask
+            = VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT | VK_ACCESS_INDEX_READ_BIT;
+        vkCmdPipelineBarrier(commandBuffer,
+                             VK_PIPELINE_STAGE_TRANSFER_BIT,
+                             VK_PIPELINE_STAGE_VERTEX_INPUT_BIT,
+                             0,
+                             1,
+                             &barrier,
+                             0,
+                             nullptr,
+                             0,
+                             nullptr);
+    }
+
+    /**
+     * Decodes a tile straight into a staging region and builds its mips in
+     * there. Runs on the pool workers, a tile that fails to decode or
+     * doesn't have the size of the others comes back without a region.
+     * */
+    TileBatch prepareTileBatch(const TileId &tile,
+                               uint32_t layer,
+                               const std::string &path)
+    {
+        const uint32_t tileWidth = m_tilePyramid.tileWidth;
+        const uint32_t tileHeight = m_tilePyramid.tileHeight;
+        const VkDeviceSize size
+            = mipLevelOffset(tileWidth, tileHeight, tileMipLevels);
+
+        TileBatch batch{};
+        batch.tile = tile;
+        batch.layer = layer;
+        batch.staging
+            = m_staging.reserve(size, copyAlignment(VK_FORMAT_R8G8B8A8_SRGB));
+        uint8_t *chain = batch.staging.mapped;
+        DecodedImage image = decodeImage(
+            path, sharedThreadPool(), chain, static_cast<size_t>(size));
+        const bool decoded = image.texels && image.width == tileWidth
+                             && image.height == tileHeight;
+        if (decoded)
+        {
+            buildMipLevels(chain, tileWidth, tileHeight);
+        }
+
+        if (not decoded)
+        {
+            m_staging.release(batch.staging, VK_NULL_HANDLE);
+            batch.staging = StagingRegion();
+        }
+        return batch;
+    }
+
+    void recordTileBatchCopy(VkCommandBuffer commandBuffer,
+                             const TileBatch &batch)
+    {
+        std::vector<VkBufferImageCopy> regions = mipCopyRegions(
+            m_tilePyramid.tileWidth, m_tilePyramid.tileHeight, tileMipLevels);
+        for (auto &region : regions)
+        {
+            region.bufferOffset += batch.staging.offset;
+            region.imageSubresource.baseArrayLayer = batch.layer;
+        }
+        vkCmdCopyBufferToImage(commandBuffer,
+                               batch.staging.buffer,
+                               tileImage,
+                               VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                               static_cast<uint32_t>(regions.size()),
+                               regions.data());
+    }
+
+    /**
+     * Like collectMeshBatches(): takes over the tiles the workers decoded
+     * since the last frame, they are resident from this frame on. A tile
+     * that failed is dropped from the pyramid, so it isn't requested again.
+     * */
+    void collectTileBatches()
+    {
+        if (not m_tileStreaming)
+        {
+            return;
+        }
+        std::vector<TileBatch> streamed;
+        {
+            std::lock_guard<std::mutex> lock(m_tileMutex);
+            streamed.swap(m_streamedTiles);
+        }
+        for (const auto &batch : streamed)
+        {
+            const uint64_t key = tileKey(batch.tile);
+            if (batch.staging.buffer == VK_NULL_HANDLE)
+            {
+                std::cerr << "failed to load tile "
+                          << m_tilePyramid.tiles.at(key) << std::endl;
+                m_tileCache.release(key);
+                m_tilePyramid.tiles.erase(key);
+                continue;
+            }
+            m_tileCache.markResident(key);
+            m_pendingTiles.push_back(batch);
+        }
+
+        // get() passes on what a worker threw
+        for (auto it = m_tileTasks.begin(); it != m_tileTasks.end();)
+        {
+            if (it->wait_for(std::chrono::seconds(0))
+                == std::future_status::ready)
+            {
+                it->get();
+                it = m_tileTasks.erase(it);
+            } else
+            {
+                it++;
+            }
+        }
+    }
+
+    /**
+     * Picks the patches of this frame and starts decoding the missing tiles
+     * they asked for, coarse to fine and at most TILE_MAX_REQUESTS at a time
+     * */
+    void selectTilePatches(const glm::mat4 &modelMatrix)
+    {
+        if (not m_tileStreaming)
+        {
+            return;
+        }
+        // the unit sphere turned and scaled like generateSphere() does it
+        const SphereParams &params = sphereMap.at(sceneModels.front());
+        const float pi = 3.14159265358979f;
+        const glm::mat4 sphereMatrix = glm::scale(
+            glm::rotate(modelMatrix,
+                        2.0f * pi * (0.5f - params.texCoordOffset),
+                        glm::vec3(0.0f, 1.0f, 0.0f)),
+            glm::vec3(params.radius));
+        m_tileModelViewProjection = projectionMatrix()
+                                    * glm::lookAt(eyeVec, centerVec, upVec)
+                                    * sphereMatrix;
+
+        TileView view;
+        view.frustum = frustumPlanes(m_tileModelViewProjection);
+        view.eye
+            = glm::vec3(glm::inverse(sphereMatrix) * glm::vec4(eyeVec, 1.0f));
+        view.pixelsPerUnit
+            = swapChainExtent.height
+              / (2.0f * std::tan(glm::radians(m_fieldOfView) * 0.5f));
+        view.texelPixels = m_tileTexelPixels;
+        view.frame = ++m_tileFrame;
+        selectTiles(m_tilePyramid, m_tileCache, view, m_tileSelection);
+
+        // the ones left are requested again next frame if still needed
+        auto &requests = m_tileSelection.requests;
+        auto request = requests.begin();
+        for (; request != requests.end()
+               && m_tileTasks.size() < TILE_MAX_REQUESTS;
+             request++)
+        {
+            const TileId tile = *request;
+            const uint64_t key = tileKey(tile);
+            const int32_t layer = m_tileCache.reserve(key, view.frame);
+            if (layer < 0)
+            {
+                break; // every layer is drawn this frame
+            }
+            const std::string path = m_tilePyramid.tiles.at(key);
+            m_tileTasks.push_back(
+                sharedThreadPool().submit([this, tile, layer, path] {
+                    TileBatch batch = prepareTileBatch(
+                        tile, static_cast<uint32_t>(layer), path);
+                    std::lock_guard<std::mutex> lock(m_tileMutex);
+                    m_streamedTiles.push_back(batch);
+                }));
+        }
+        requests.erase(requests.begin(), request);
+    }
+
+    /**
+     * Copies the tiles taken over this frame into their layers. A layer may
+     * have held another tile the frames before, the barrier in front lets
+     * the copy wait for the fragment shaders that sampled it.
+     * */
+    void recordTileBatchCopies(VkCommandBuffer commandBuffer)
+    {
+        if (m_pendingTiles.empty())
+        {
+            return;
+        }
+        std::vector<VkImageMemoryBarrier> barriers(m_pendingTiles.size());
+        for (size_t i = 0; i < barriers.size(); i++)
+        {
+            VkImageMemoryBarrier &barrier = barriers[i];
+            barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+            barrier.srcAccessMask = 0;
+            barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+            barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+            barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+            barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+            barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+            barrier.image = tileImage;
+            barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+            barrier.subresourceRange.baseMipLevel = 0;
+            barrier.subresourceRange.levelCount = tileMipLevels;
+            barrier.subresourceRange.baseArrayLayer = m_pendingTiles[i].layer;
+            barrier.subresourceRange.layerCount = 1;
+        }
+        vkCmdPipelineBarrier(commandBuffer,
+                             VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+                             VK_PIPELINE_STAGE_TRANSFER_BIT,
+                             0,
+                             0,
+                             nullptr,
+                             0,
+                             nullptr,
+                             static_cast<uint32_t>(barriers.size()),
+                             barriers.data());
+
+        for (const auto &batch : m_pendingTiles)
+        {
+            recordTileBatchCopy(commandBuffer, batch);
+            m_staging.release(batch.staging, inFlightFences[currentFrame]);
+        }
+        m_pendingTiles.clear();
+
+        for (auto &barrier : barriers)
+        {
+            barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+            barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+            barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+            barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+        }
+        vkCmdPipelineBarrier(commandBuffer,
+                             VK_PIPELINE_STAGE_TRANSFER_BIT,
+                             VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+                             0,
+                             0,
+                             nullptr,
+                             0,
+                             nullptr,
+                             static_cast<uint32_t>(barriers.size()),
+                             barriers.data());
+    }
+
+    /**
+     * Asks the residency manager for the level of the sampled texture the
+     * first scene model needs at its size on screen and carries out what it
+     * decides: a stream-in stages the missing levels on a pool worker and
+     * swaps the image once they are ready, an eviction swaps it right away.
+     * Runs after the fence of this frame in flight.
+     * */
+    void updateTextureResidency()
+    {
+        // the images replaced the last time this frame was in flight
+        auto retired = std::partition(m_copiedTextureSwaps.begin(),
+                                      m_copiedTextureSwaps.end(),
+                                      [this](const TextureSwap &swap) {
+                                          return swap.frame != currentFrame;
+                                      });
+        for (auto it = retired; it != m_copiedTextureSwaps.end(); it++)
+        {
+            destroyTextureSwap(*it);
+        }
+        m_copiedTextureSwaps.erase(retired, m_copiedTextureSwaps.end());
+
+        const double seconds = std::chrono::duration<double>(
+                                   std::chrono::high_resolution_clock::now()
+                                   - startTime)
+                                   .count();
+        // get() passes on what the worker threw
+        if (m_textureStream.valid()
+            && m_textureStream.wait_for(std::chrono::seconds(0))
+                   == std::future_status::ready)
+        {
+            TextureSwap swap = m_textureStream.get();
+            if (m_asyncTransfers)
+            {
+                transferTextureSwap(swap, seconds);
+            } else
+            {
+                m_textureResidency.finishStreamIn(m_residentTexture, seconds);
+                beginTextureSwap(swap);
+            }
+        }
+        // the stream-in is resident once its copy is done
+        auto transferred = std::partition(
+            m_transferringTextureSwaps.begin(),
+            m_transferringTextureSwaps.end(),
+            [this](const TextureSwap &swap) {
+                return not m_transfers.done(swap.transferBatch);
+            });
+        for (auto it = transferred; it != m_transferringTextureSwaps.end();
+             it++)
+        {
+            m_transferOverlap.transfers++;
+            m_transferOverlap.lastTransfer
+                = static_cast<float>((seconds - it->transferStart) * 1000.0);
+            m_textureResidency.finishStreamIn(m_residentTexture, seconds);
+            beginTextureSwap(*it);
+        }
+        m_transferringTextureSwaps.erase(transferred,
+                                         m_transferringTextureSwaps.end());
+
+        const MeshDraw &mesh = meshDraws.front();
+        const float coverage = screenCoverage(
+            mesh.boundsCenter,
+            mesh.boundsRadius,
+            m_cullConstants.frustum,
+            glm::vec3(m_cullConstants.eye),
+            m_fieldOfView,
+            static_cast<float>(swapChainExtent.height));
+        const uint64_t frame = ++m_residencyFrame;
+        if (coverage > 0.0f)
+        {
+            // the four side faces of a cubemap go around the sphere
+            const uint32_t texelsAround = textureArrayLayers == CUBE_FACE_COUNT
+                                              ? 4 * m_textureSource.width
+                                              : m_textureSource.width;
+            m_textureResidency.request(
+                m_residentTexture,
+                wantedMipLevel(coverage, texelsAround, textureLevelCount),
+                frame);
+        }
+
+        for (const auto &change : m_textureResidency.update(frame, seconds))
+        {
+            if (change.baseLevel < change.previousLevel)
+            {
+                const uint32_t baseLevel = change.baseLevel;
+                const uint32_t endLevel = change.previousLevel;
+                m_textureStream
+                    = sharedThreadPool().submit([this, baseLevel, endLevel] {
+                          return stageTextureLevels(baseLevel, endLevel);
+                      });
+            } else
+            {
+                TextureSwap swap;
+                swap.baseLevel = change.baseLevel;
+                beginTextureSwap(swap);
+            }
+        }
+    }
+
+    /**
+     * Copies the levels [baseLevel, endLevel) of the sampled texture from
+     * m_textureSource into a staging region, a procedural texture's are
+     * generated now (or taken from m_surfaceCache). Runs on a pool worker.
+     * */
+    TextureSwap stageTextureLevels(uint32_t baseLevel, uint32_t endLevel)
+    {
+        TextureSwap swap;
+        swap.baseLevel = baseLevel;
+        swap.regions = levelRegions(
+            m_textureSource.regions, baseLevel, endLevel, baseLevel);
+        // packed one after the other, each at an offset a copy can start at
+        const VkDeviceSize alignment = copyAlignment(textureFormat);
+        std::vector<size_t> sizes;
+        VkDeviceSize size = 0;
+        for (const auto &region : swap.regions)
+        {
+            sizes.push_back(
+                textureLevelSize(textureFormat,
+                                 m_textureSource.width,
+                                 m_textureSource.height,
+                                 baseLevel + region.imageSubresource.mipLevel));
+            size += (sizes.back() + alignment - 1) / alignment * alignment;
+        }
+
+        swap.staging = m_staging.reserve(size, alignment);
+        void *data = swap.staging.mapped;
+        VkDeviceSize offset = 0;
+        for (size_t i = 0; i < swap.regions.size(); i++)
+        {
+            VkBufferImageCopy &region = swap.regions[i];
+            std::shared_ptr<const std::vector<uint8_t>> generated;
+            const uint8_t *texels;
+            if (m_surface.width != 0)
+            {
+                generated = m_surfaceCache.level(
+                    m_surface, baseLevel + region.imageSubresource.mipLevel);
+                texels = generated->data();
+            } else
+            {
+                texels = m_textureSource.data + region.bufferOffset;
+            }
+            memcpy(static_cast<uint8_t *>(data) + offset, texels, sizes[i]);
+            region.bufferOffset = swap.staging.offset + offset;
+            offset += (sizes[i] + alignment - 1) / alignment * alignment;
+        }
+        return swap;
+    }
+
+    /**
+     * Makes a new image for the levels from swap.baseLevel on the sampled
+     * texture (unless transferTextureSwap() made it already),
+     * recordTextureSwaps() fills it before anything samples it
+     * */
+    void beginTextureSwap(TextureSwap swap)
+    {
+        swap.oldImage = textureImage;
+        swap.oldImageMemory = textureImageMemory;
+        swap.oldImageView = textureImageView;
+        swap.oldBaseLevel = textureBaseLevel;
+
+        if (swap.image == VK_NULL_HANDLE)
+        {
+            createResidentTextureImage(
+                swap.baseLevel, swap.image, swap.imageMemory);
+        }
+        textureImage = swap.image;
+        textureImageMemory = swap.imageMemory;
+        textureBaseLevel = swap.baseLevel;
+        textureMipLevels = textureLevelCount - textureBaseLevel;
+        createTextureImageView();
+        m_pendingTextureSwaps.push_back(swap);
+    }
+
+    /**
+     * Copies the staged levels of a stream-in into its new image on the
+     * transfer queue, while the frames go on sampling the old one. The copy
+     * releases the image to the graphics queue family, the frame that swaps
+     * it in waits for swap.transferred and acquires it (recordTextureSwaps()).
+     * */
+    void transferTextureSwap(TextureSwap swap, double seconds)
+    {
+        createResidentTextureImage(
+            swap.baseLevel, swap.image, swap.imageMemory);
+        VkCommandBuffer commandBuffer = m_transfers.commands();
+
+        VkImageMemoryBarrier barrier{};
+        barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+        barrier.srcAccessMask = 0;
+        barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+        barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+        barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        barrier.image = swap.image;
+        barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+        barrier.subresourceRange.baseMipLevel = 0;
+        barrier.subresourceRange.levelCount = VK_REMAINING_MIP_LEVELS;
+        barrier.subresourceRange.baseArrayLayer = 0;
+        barrier.subresourceRange.layerCount = textureArrayLayers;
+        vkCmdPipelineBarrier(commandBuffer,
+                             VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+                             VK_PIPELINE_STAGE_TRANSFER_BIT,
+                             0,
+                             0,
+                             nullptr,
+                             0,
+                             nullptr,
+                             1,
+                             &barrier);
+        vkCmdCopyBufferToImage(commandBuffer,
+                               swap.staging.buffer,
+                               swap.image,
+                               VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                               static_cast<uint32_t>(swap.regions.size()),
+                               swap.regions.data());
+
+        // the release half of the ownership transfer, the layout stays
+        barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        barrier.dstAccessMask = 0;
+        barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+        barrier.srcQueueFamilyIndex = transferQueueFamily;
+        barrier.dstQueueFamilyIndex = graphicsQueueFamily;
+        vkCmdPipelineBarrier(commandBuffer,
+                             VK_PIPELINE_STAGE_TRANSFER_BIT,
+                             VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+                             0,
+                             0,
+                             nullptr,
+                             0,
+                             nullptr,
+                             1,
+                             &barrier);
+
+        m_staging.release(swap.staging, m_transfers.fence());
+        swap.staging = StagingRegion();
+        VkSemaphoreCreateInfo semaphoreInfo{};
+        semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+        if (vkCreateSemaphore(
+                device, &semaphoreInfo, allocator(), &swap.transferred)
+            != VK_SUCCESS)
         {
-            throw std::runtime_error("failed to record command buffer");
+            throw std::runtime_error("failed to create transfer semaphore!");
         }
+        swap.transferStart = seconds;
+        swap.transferBatch = m_transfers.submit(swap.transferred);
+        m_transferringTextureSwaps.push_back(swap);
     }
 
-    void createBuffer(VkDeviceSize size,
-                      VkBufferUsageFlags usage,
-                      VkMemoryPropertyFlags properties,
-                      VkBuffer &buffer,
-                      VkDeviceMemory &bufferMemory)
+    void destroyTextureSwap(const TextureSwap &swap)
     {
+        m_staging.release(swap.staging, VK_NULL_HANDLE);
+        vkDestroySemaphore(device, swap.transferred, allocator());
+        vkDestroyImageView(device, swap.oldImageView, allocator());
+        vkDestroyImage(device, swap.oldImage, allocator());
+        m_memory.free(swap.oldImageMemory);
+    }
 
-        // buffers in Vulkan are regions of memory used for storing arbitrary
-        // data that can be read by the GPU. They can be used to store vertex
-        // data. buffers do not automatically allocate memory
-        VkBufferCreateInfo bufferInfo{};
-        bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
-        bufferInfo.size = size;
-        bufferInfo.usage = usage;
-        bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
-
-        if (vkCreateBuffer(device, &bufferInfo, nullptr, &buffer) != VK_SUCCESS)
+    /**
+     * Writes the texture slots whose image view changed since the descriptor
+     * set of frame was written last: their element of the bindless array,
+     * and binding 1 for textureImage. Only while frame isn't in flight.
+     * */
+    void writeTextureDescriptors(uint32_t frame)
+    {
+        const std::vector<uint32_t> slots
+            = m_textureTable.takeStaleSlots(frame);
+        std::vector<VkDescriptorImageInfo> imageInfos(slots.size());
+        std::vector<VkWriteDescriptorSet> descriptorWrites;
+        for (size_t i = 0; i < slots.size(); i++)
         {
-            throw std::runtime_error("failed to create vertex buffer");
+            imageInfos[i].imageLayout
+                = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+            imageInfos[i].imageView = m_textureTable.view(slots[i]);
+            imageInfos[i].sampler = textureSampler;
+
+            VkWriteDescriptorSet descriptorWrite{};
+            descriptorWrite.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+            descriptorWrite.dstSet = descriptorSets[frame];
+            descriptorWrite.descriptorType
+                = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+            descriptorWrite.descriptorCount = 1;
+            descriptorWrite.pImageInfo = &imageInfos[i];
+            if (m_bindlessTextures)
+            {
+                descriptorWrite.dstBinding = 2;
+                descriptorWrite.dstArrayElement = slots[i];
+                descriptorWrites.push_back(descriptorWrite);
+            }
+            if (slots[i] == m_textureSlot)
+            {
+                descriptorWrite.dstBinding = 1;
+                descriptorWrite.dstArrayElement = 0;
+                descriptorWrites.push_back(descriptorWrite);
+            }
         }
-
-        // buffer created but no memory allocated for it
-        VkMemoryRequirements memRequirements;
-        vkGetBufferMemoryRequirements(device, buffer, &memRequirements);
-
-        VkMemoryAllocateInfo allocInfo{};
-        allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-        allocInfo.allocationSize = memRequirements.size;
-        allocInfo.memoryTypeIndex = findMemoryType(
-            memRequirements
-                .memoryTypeBits, // VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
-            properties);
-
-        // for a large number of allocations (or a real
-        // world app) its good practice to create a
-        // custom memory allocator or use:
-        // https://github.com/GPUOpen-LibrariesAndSDKs/VulkanMemoryAllocator
-        // the maximum number of allocation is also
-        // limited ba "maxMemoryAllocationCount"
-        if (vkAllocateMemory(device, &allocInfo, nullptr, &bufferMemory)
-            != VK_SUCCESS)
+        if (not descriptorWrites.empty())
         {
-            throw std::runtime_error(
-                "failed to allocate vertex buffer memory!");
+            vkUpdateDescriptorSets(
+                device,
+                static_cast<uint32_t>(descriptorWrites.size()),
+                descriptorWrites.data(),
+                0,
+                nullptr);
         }
-        // if memory allocation was succesful then we can associate the memory
-        vkBindBufferMemory(device,
-                           buffer,
-                           bufferMemory,
-                           0); /// last parameter defines a offset within the
-                               /// region of memory, if
-                               /// !=0 it is required to be devisible by
-                               /// memRequirements.alignment
-
-        // TODO: check if to use a BufferView ?
     }
 
     /**
-     * Vulkan API puts the programmer in control of almost everything, also
-     * memory menagement we need to handle this if the vertex data is managed by
-     * our app and not by the shader itself (which is not good)
+     * Fills the images of the swaps begun this frame: the levels the old
+     * image has as well are copied over on the device, the streamed in ones
+     * come from the staging region. The frame before may still sample the
+     * old image, the barrier in front waits for its fragment shaders. A
+     * stream-in copied on the transfer queue is acquired from it instead,
+     * the frame waits for its semaphore (m_transferWaits).
      * */
-    void createVertexBuffer()
+    void recordTextureSwaps(VkCommandBuffer commandBuffer)
     {
-        VkDeviceSize bufferSize = sizeof(vertices[0]) * vertices.size();
-
-        VkBuffer stagingBuffer;
-        VkDeviceMemory stagingBufferMemory;
-
-        createBuffer(
-            bufferSize,
-            VK_BUFFER_USAGE_TRANSFER_SRC_BIT,   /// can be used as a source
-                                                /// in a memory transfer
-                                                /// operation
-            VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT /// Use a memory heap that is
-                                                /// host coherent,
-                | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-            stagingBuffer,
-            stagingBufferMemory);
-        // copy the vertex data to the buffer by mapping the buffermemory into
-        // CPU accessible memor
-        void *data;
-        vkMapMemory(device, stagingBufferMemory, 0, bufferSize, 0, &data);
-        memcpy(data,
-               vertices.data(),
-               (size_t)
-                   bufferSize); /// Unfortunately the driver may not immediately
-                                /// copy the data into the buffer memory, for
-                                /// example because of caching. It is also
-                                /// possible that writes to the buffer are not
-                                /// visible in the mapped memory yet. There are
-                                /// two ways to deal with that problem:
-        vkUnmapMemory(device, stagingBufferMemory);
+        for (auto &swap : m_pendingTextureSwaps)
+        {
+            std::array<VkImageMemoryBarrier, 2> barriers{};
+            for (auto &barrier : barriers)
+            {
+                barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+                barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+                barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+                barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+                barrier.subresourceRange.baseMipLevel = 0;
+                barrier.subresourceRange.levelCount = VK_REMAINING_MIP_LEVELS;
+                barrier.subresourceRange.baseArrayLayer = 0;
+                barrier.subresourceRange.layerCount = textureArrayLayers;
+            }
+            barriers[0].srcAccessMask = 0;
+            barriers[0].dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+            barriers[0].oldLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+            barriers[0].newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+            barriers[0].image = swap.oldImage;
+            barriers[1].srcAccessMask = 0;
+            barriers[1].dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+            barriers[1].oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+            barriers[1].newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+            barriers[1].image = swap.image;
+            uint32_t barrierCount = static_cast<uint32_t>(barriers.size());
+            if (swap.transferred != VK_NULL_HANDLE)
+            {
+                // the acquire half of the transfer queue's release, the
+                // staged levels are in the image already. Its first scope
+                // is the stage the frame waits for swap.transferred at, which
+                // chains it to the release
+                barriers[1].oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+                barriers[1].srcQueueFamilyIndex = transferQueueFamily;
+                barriers[1].dstQueueFamilyIndex = graphicsQueueFamily;
+                vkCmdPipelineBarrier(commandBuffer,
+                                     VK_PIPELINE_STAGE_TRANSFER_BIT,
+                                     VK_PIPELINE_STAGE_TRANSFER_BIT,
+                                     0,
+                                     0,
+                                     nullptr,
+                                     0,
+                                     nullptr,
+                                     1,
+                                     &barriers[1]);
+                m_transferWaits.push_back(swap.transferred);
+                barrierCount = 1;
+            }
+            vkCmdPipelineBarrier(commandBuffer,
+                                 VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+                                 VK_PIPELINE_STAGE_TRANSFER_BIT,
+                                 0,
+                                 0,
+                                 nullptr,
+                                 0,
+                                 nullptr,
+                                 barrierCount,
+                                 barriers.data());
+
+            std::vector<VkImageCopy> copies;
+            for (uint32_t level = std::max(swap.baseLevel, swap.oldBaseLevel);
+                 level < textureLevelCount;
+                 level++)
+            {
+                VkImageCopy copy{};
+                copy.srcSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+                copy.srcSubresource.mipLevel = level - swap.oldBaseLevel;
+                copy.srcSubresource.baseArrayLayer = 0;
+                copy.srcSubresource.layerCount = textureArrayLayers;
+                copy.dstSubresource = copy.srcSubresource;
+                copy.dstSubresource.mipLevel = level - swap.baseLevel;
+                copy.extent = {mipExtent(m_textureSource.width, level),
+                               mipExtent(m_textureSource.height, level),
+                               1};
+                copies.push_back(copy);
+            }
+            vkCmdCopyImage(commandBuffer,
+                           swap.oldImage,
+                           VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+                           swap.image,
+                           VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                           static_cast<uint32_t>(copies.size()),
+                           copies.data());
+            if (swap.staging.buffer != VK_NULL_HANDLE)
+            {
+                vkCmdCopyBufferToImage(
+                    commandBuffer,
+                    swap.staging.buffer,
+                    swap.image,
+                    VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                    static_cast<uint32_t>(swap.regions.size()),
+                    swap.regions.data());
+            }
+            m_staging.release(swap.staging, inFlightFences[currentFrame]);
+            swap.staging = StagingRegion();
+
+            barriers[1].srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+            barriers[1].dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+            barriers[1].oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+            barriers[1].newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+            vkCmdPipelineBarrier(commandBuffer,
+                                 VK_PIPELINE_STAGE_TRANSFER_BIT,
+                                 VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+                                 0,
+                                 0,
+                                 nullptr,
+                                 0,
+                                 nullptr,
+                                 1,
+                                 &barriers[1]);
+            swap.frame = currentFrame;
+        }
+        m_copiedTextureSwaps.insert(m_copiedTextureSwaps.end(),
+                                    m_pendingTextureSwaps.begin(),
+                                    m_pendingTextureSwaps.end());
+        m_pendingTextureSwaps.clear();
+    }
 
-        // memory is allocated from a memory type that is device local (not able
-        // to use vkMapMemory)
-        createBuffer(
-            bufferSize,
-            VK_BUFFER_USAGE_TRANSFER_DST_BIT /// can be used as a destination
-                                             /// in
-                                             /// a memory operation
-                | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
-            VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
-            vertexBuffer,
-            vertexBufferMemory);
+    /// device local buffer with the given content, through the staging ring
+    void createDeviceLocalBuffer(const void *content,
+                                 VkDeviceSize bufferSize,
+                                 VkBufferUsageFlags usage,
+                                 VkBuffer &buffer,
+                                 MemoryAllocation &bufferMemory)
+    {
+        StagingRegion staging = m_staging.reserve(bufferSize, sizeof(float));
+        memcpy(staging.mapped, content, static_cast<size_t>(bufferSize));
 
-        copyBuffer(stagingBuffer, vertexBuffer, bufferSize);
+        createBuffer(bufferSize,
+                     VK_BUFFER_USAGE_TRANSFER_DST_BIT | usage,
+                     VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                     buffer,
+                     bufferMemory);
 
-        // clean staging buffer
-        vkDestroyBuffer(device, stagingBuffer, nullptr);
-        vkFreeMemory(device, stagingBufferMemory, nullptr);
+        copyBuffer(staging.buffer, staging.offset, buffer, bufferSize);
+        m_staging.release(staging, m_uploads.fence());
     }
 
     /**
-     * Almost the same as VertexBuffer creation, but size is sizeof(indices) and
-     * we're using the VK_BUFFER_USAGE_INDEX_BUFFER_BIT flag to create the
-     * buffer
+     * Buffers of the GPU meshlet culling: the bounds and draws of all
+     * meshlets, and per frame in flight the culled draws and the counters
+     * meshlet_cull.comp compacts them with, plus their descriptor sets
      * */
-    void createIndexBuffer()
+    void createMeshletBuffers()
     {
-        VkDeviceSize bufferSize = sizeof(indices[0]) * indices.size();
+        if (cullPipeline == VK_NULL_HANDLE)
+        {
+            return;
+        }
+        if (meshletDraws.empty())
+        {
+            m_cullingMode = CullingMode::Cpu;
+            return;
+        }
 
-        VkBuffer stagingBuffer;
-        VkDeviceMemory stagingBufferMemory;
-        createBuffer(bufferSize,
-                     VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-                     VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT
-                         | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-                     stagingBuffer,
-                     stagingBufferMemory);
+        createDeviceLocalBuffer(meshletBounds.data(),
+                                sizeof(MeshletBounds) * meshletBounds.size(),
+                                VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                                meshletBoundsBuffer,
+                                meshletBoundsBufferMemory);
+        VkDeviceSize drawsSize
+            = sizeof(VkDrawIndexedIndirectCommand) * meshletDraws.size();
+        createDeviceLocalBuffer(meshletDraws.data(),
+                                drawsSize,
+                                VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                                meshletDrawBuffer,
+                                meshletDrawBufferMemory);
+
+        VkDeviceSize countersSize = sizeof(uint32_t) * meshDraws.size();
+        culledDrawBuffers.resize(MAX_FRAMES_IN_FLIGHT);
+        culledDrawBuffersMemory.resize(MAX_FRAMES_IN_FLIGHT);
+        cullCounterBuffers.resize(MAX_FRAMES_IN_FLIGHT);
+        cullCounterBuffersMemory.resize(MAX_FRAMES_IN_FLIGHT);
+        for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++)
+        {
+            // cleared with vkCmdFillBuffer every frame
+            createBuffer(drawsSize,
+                         VK_BUFFER_USAGE_STORAGE_BUFFER_BIT
+                             | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT
+                             | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                         VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                         culledDrawBuffers[i],
+                         culledDrawBuffersMemory[i]);
+            createBuffer(countersSize,
+                         VK_BUFFER_USAGE_STORAGE_BUFFER_BIT
+                             | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                         VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                         cullCounterBuffers[i],
+                         cullCounterBuffersMemory[i]);
+        }
 
-        void *data;
-        vkMapMemory(device, stagingBufferMemory, 0, bufferSize, 0, &data);
-        memcpy(data, indices.data(), (size_t)bufferSize);
-        vkUnmapMemory(device, stagingBufferMemory);
+        VkDescriptorPoolSize poolSize{};
+        poolSize.type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+        poolSize.descriptorCount
+            = static_cast<uint32_t>(4 * MAX_FRAMES_IN_FLIGHT);
 
-        createBuffer(bufferSize,
-                     VK_BUFFER_USAGE_TRANSFER_DST_BIT
-                         | VK_BUFFER_USAGE_INDEX_BUFFER_BIT,
-                     VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
-                     indexBuffer,
-                     indexBufferMemory);
+        VkDescriptorPoolCreateInfo poolInfo{};
+        poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+        poolInfo.poolSizeCount = 1;
+        poolInfo.pPoolSizes = &poolSize;
+        poolInfo.maxSets = static_cast<uint32_t>(MAX_FRAMES_IN_FLIGHT);
+        if (vkCreateDescriptorPool(
+                device, &poolInfo, allocator(), &cullDescriptorPool)
+            != VK_SUCCESS)
+        {
+            throw std::runtime_error("failed to create culling descriptor "
+                                     "pool!");
+        }
 
-        copyBuffer(stagingBuffer, indexBuffer, bufferSize);
+        std::vector<VkDescriptorSetLayout> layouts(MAX_FRAMES_IN_FLIGHT,
+                                                   cullDescriptorSetLayout);
+        VkDescriptorSetAllocateInfo allocInfo{};
+        allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+        allocInfo.descriptorPool = cullDescriptorPool;
+        allocInfo.descriptorSetCount
+            = static_cast<uint32_t>(MAX_FRAMES_IN_FLIGHT);
+        allocInfo.pSetLayouts = layouts.data();
+        cullDescriptorSets.resize(MAX_FRAMES_IN_FLIGHT);
+        if (vkAllocateDescriptorSets(
+                device, &allocInfo, cullDescriptorSets.data())
+            != VK_SUCCESS)
+        {
+            throw std::runtime_error("failed to allocate culling descriptor "
+                                     "sets!");
+        }
 
-        vkDestroyBuffer(device, stagingBuffer, nullptr);
-        vkFreeMemory(device, stagingBufferMemory, nullptr);
+        for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++)
+        {
+            std::array<VkDescriptorBufferInfo, 4> bufferInfos{};
+            bufferInfos[0] = {meshletBoundsBuffer, 0, VK_WHOLE_SIZE};
+            bufferInfos[1] = {meshletDrawBuffer, 0, VK_WHOLE_SIZE};
+            bufferInfos[2] = {culledDrawBuffers[i], 0, VK_WHOLE_SIZE};
+            bufferInfos[3] = {cullCounterBuffers[i], 0, VK_WHOLE_SIZE};
+
+            std::array<VkWriteDescriptorSet, 4> descriptorWrites{};
+            for (uint32_t b = 0; b < descriptorWrites.size(); b++)
+            {
+                descriptorWrites[b].sType
+                    = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+                descriptorWrites[b].dstSet = cullDescriptorSets[i];
+                descriptorWrites[b].dstBinding = b;
+                descriptorWrites[b].descriptorType
+                    = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+                descriptorWrites[b].descriptorCount = 1;
+                descriptorWrites[b].pBufferInfo = &bufferInfos[b];
+            }
+            vkUpdateDescriptorSets(
+                device,
+                static_cast<uint32_t>(descriptorWrites.size()),
+                descriptorWrites.data(),
+                0,
+                nullptr);
+        }
     }
 
     void createUniformBuffers()
@@ -2828,18 +6058,14 @@ class TriangleApp {
                              | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
                          uniformBuffers[i],
                          uniformBuffersMemory[i]);
-            // We map the buffer right after creation using vkMapMemory to get a
-            // pointer to which we can write the data later on. The buffer stays
-            // mapped to this pointer for the application’s whole lifetime. This
-            // technique is called "persistent mapping" and works on all Vulkan
-            // implementations. Not having to map the buffer every time we need
-            // to update it increases performances, as mapping is not free.
-            vkMapMemory(device,
-                        uniformBuffersMemory[i],
-                        0,
-                        bufferSize,
-                        0,
-                        &uniformBuffersMapped[i]);
+            // The allocator maps host visible memory right after creation, we
+            // keep the pointer to which we can write the data later on. The
+            // buffer stays mapped to this pointer for the application’s whole
+            // lifetime. This technique is called "persistent mapping" and
+            // works on all Vulkan implementations. Not having to map the
+            // buffer every time we need to update it increases performances,
+            // as mapping is not free.
+            uniformBuffersMapped[i] = uniformBuffersMemory[i].mapped;
         }
     }
 
@@ -2855,8 +6081,9 @@ class TriangleApp {
         poolSizes[0].descriptorCount
             = static_cast<uint32_t>(MAX_FRAMES_IN_FLIGHT);
         poolSizes[1].type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
-        poolSizes[1].descriptorCount
-            = static_cast<uint32_t>(MAX_FRAMES_IN_FLIGHT);
+        poolSizes[1].descriptorCount = static_cast<uint32_t>(
+            MAX_FRAMES_IN_FLIGHT
+            * (1 + (m_bindlessTextures ? m_textureArraySize : 0)));
         // We will allocate one of these descriptors for every frame.
 
         VkDescriptorPoolCreateInfo poolInfo{};
@@ -2865,7 +6092,8 @@ class TriangleApp {
         poolInfo.pPoolSizes = poolSizes.data();
         poolInfo.maxSets = static_cast<uint32_t>(MAX_FRAMES_IN_FLIGHT);
 
-        if (vkCreateDescriptorPool(device, &poolInfo, nullptr, &descriptorPool)
+        if (vkCreateDescriptorPool(
+                device, &poolInfo, allocator(), &descriptorPool)
             != VK_SUCCESS)
         {
             throw std::runtime_error("failed to create descriptor pool!");
@@ -2946,83 +6174,36 @@ class TriangleApp {
 
     /**
      * Memory tranfer operations are executed using command buffers (like
-     * drawing commands)
+     * drawing commands), recorded into the open upload batch
+     * (upload_batch.h) that initVulkan() submits
      * */
-    void copyBuffer(VkBuffer srcBuffer, VkBuffer dstBuffer, VkDeviceSize size)
+    void copyBuffer(VkBuffer srcBuffer,
+                    VkDeviceSize srcOffset,
+                    VkBuffer dstBuffer,
+                    VkDeviceSize size)
     {
-        VkCommandBuffer commandBuffer = beginSingleTimeCommands();
-
         VkBufferCopy copyRegion{};
+        copyRegion.srcOffset = srcOffset;
         copyRegion.size = size;
-        vkCmdCopyBuffer(commandBuffer, srcBuffer, dstBuffer, 1, &copyRegion);
-
-        endSingleTimeCommands(commandBuffer);
+        vkCmdCopyBuffer(
+            m_uploads.commands(), srcBuffer, dstBuffer, 1, &copyRegion);
     }
 
+    /// regions says which part of the buffer goes to which part of the
+    /// image, one per mip level (see mipCopyRegions())
     void copyBufferToImage(VkBuffer buffer,
                            VkImage image,
-                           uint32_t width,
-                           uint32_t height)
-    {
-        VkCommandBuffer commandBuffer = beginSingleTimeCommands();
-        // specify which part of the buffer is going to be copied to which part
-        // of the image
-        VkBufferImageCopy region{};
-        region.bufferOffset
-            = 0; /// byteoffset in buffer at which the pixel values start
-        region.bufferRowLength
-            = 0; ///  specify how the pixels are laid out in memory.
-        region.bufferImageHeight = 0;
-        // to which part we want to copy the pixels
-        region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-        region.imageSubresource.mipLevel = 0;
-        region.imageSubresource.baseArrayLayer = 0;
-        region.imageSubresource.layerCount = 1;
-
-        region.imageOffset = {0, 0, 0};
-        region.imageExtent = {width, height, 1};
-
+                           const std::vector<VkBufferImageCopy> &regions)
+    {
         vkCmdCopyBufferToImage(
-            commandBuffer,
+            m_uploads.commands(),
             buffer,
             image,
             VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, /// which layout the image is
                                                   /// currently using
-            1,
-            &region);
-
-        endSingleTimeCommands(commandBuffer);
-    }
-    /**
-     * Helper function to find correct memory type on graphic card for
-     * allocation Each type of mem varies in terms of allowed operation &
-     * performance characteristica
-     *
-     * @param typeFilter  specify the bit field of memory types that are
-     * suitable.
-     * @param properties  define special features of the memory, like being
-     * able to map it so we can write to it from the CPU
-     * */
-    uint32_t findMemoryType(uint32_t typeFilter,
-                            VkMemoryPropertyFlags properties)
-    {
-        // query  infos about abeilable types of memory
-        VkPhysicalDeviceMemoryProperties memProperties;
-        vkGetPhysicalDeviceMemoryProperties(physicalDevice, &memProperties);
-
-        for (uint32_t i = 0; i < memProperties.memoryTypeCount; i++)
-        {
-            if ((typeFilter & (1 << i))
-                && (memProperties.memoryTypes[i].propertyFlags & properties)
-                       == properties)
-            {
-                return i;
-            }
-        }
-
-        throw std::runtime_error("failed to find suitable memory type!");
+            static_cast<uint32_t>(regions.size()),
+            regions.data());
     }
-
     /*
     ** Helper function to wrap a shaderBuffer to a VkShaderModule object
     */
@@ -3034,7 +6215,8 @@ class TriangleApp {
         createInfo.pCode = reinterpret_cast<const uint32_t *>(code.data());
 
         VkShaderModule shaderModule;
-        if (vkCreateShaderModule(device, &createInfo, nullptr, &shaderModule)
+        if (vkCreateShaderModule(
+                device, &createInfo, allocator(), &shaderModule)
             != VK_SUCCESS)
         {
             throw std::runtime_error("failed to create shader module!");
@@ -3066,14 +6248,16 @@ class TriangleApp {
 
     /**
      * Handles layout transitions, as vkCmmdCopyBufferToImage requires the
-     * image to be in the right layout first
+     * image to be in the right layout first. Recorded into the open upload
+     * batch like the copies.
      * */
     void transitionImageLayout(VkImage image,
                                VkFormat format,
                                VkImageLayout oldLayout,
-                               VkImageLayout newLayout)
+                               VkImageLayout newLayout,
+                               uint32_t mipLevels = 1,
+                               uint32_t layerCount = 1)
     {
-        VkCommandBuffer commandBuffer = beginSingleTimeCommands();
         // One of the most common ways to perform layout transitions is using an
         // image memory barrier.
         // a barrier is commonly used to sync access to resources (e.g.
@@ -3107,10 +6291,11 @@ class TriangleApp {
 
         // barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
 
+        // all levels (and layers) at once, they are written by one copy
         barrier.subresourceRange.baseMipLevel = 0;
-        barrier.subresourceRange.levelCount = 1;
+        barrier.subresourceRange.levelCount = mipLevels;
         barrier.subresourceRange.baseArrayLayer = 0;
-        barrier.subresourceRange.layerCount = 1;
+        barrier.subresourceRange.layerCount = layerCount;
 
         VkPipelineStageFlags sourceStage;
         VkPipelineStageFlags destinationStage;
@@ -3158,7 +6343,7 @@ class TriangleApp {
             throw std::invalid_argument("unsupported layout transition!");
         }
 
-        vkCmdPipelineBarrier(commandBuffer,
+        vkCmdPipelineBarrier(m_uploads.commands(),
                              sourceStage,
                              destinationStage,
                              0,
@@ -3168,46 +6353,6 @@ class TriangleApp {
                              nullptr,
                              1,
                              &barrier);
-
-        endSingleTimeCommands(commandBuffer);
-    }
-
-    /**
-     * Helper function to fill commandBuffer
-     * */
-    VkCommandBuffer beginSingleTimeCommands()
-    {
-        VkCommandBufferAllocateInfo allocInfo{};
-        allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
-        allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-        allocInfo.commandPool = commandPool;
-        allocInfo.commandBufferCount = 1;
-
-        VkCommandBuffer commandBuffer;
-        vkAllocateCommandBuffers(device, &allocInfo, &commandBuffer);
-
-        VkCommandBufferBeginInfo beginInfo{};
-        beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-        beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
-
-        vkBeginCommandBuffer(commandBuffer, &beginInfo);
-
-        return commandBuffer;
-    }
-
-    void endSingleTimeCommands(VkCommandBuffer commandBuffer)
-    {
-        vkEndCommandBuffer(commandBuffer);
-
-        VkSubmitInfo submitInfo{};
-        submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-        submitInfo.commandBufferCount = 1;
-        submitInfo.pCommandBuffers = &commandBuffer;
-
-        vkQueueSubmit(graphicsQueue, 1, &submitInfo, VK_NULL_HANDLE);
-        vkQueueWaitIdle(graphicsQueue);
-
-        vkFreeCommandBuffers(device, commandPool, 1, &commandBuffer);
     }
 
     void setupDebugMessenger()
@@ -3221,7 +6366,7 @@ class TriangleApp {
         // requires a valid instance have been created -> to validate all
         // code before this we can use a sepatare debug utils messenger
         if (CreateDebugUtilsMessengerEXT(
-                instance, &createInfo, nullptr, &debugMesseger)
+                instance, &createInfo, allocator(), &debugMesseger)
             != VK_SUCCESS)
         {
             throw std::runtime_error("failed to set up debug messenger!");
@@ -3233,6 +6378,14 @@ class TriangleApp {
     // could setup more logical device from one physical device for
     // different requirements
     VkDevice device;
+    HostAllocator m_hostAllocator; /// with m_hostTracking
+    DeviceMemoryAllocator m_memory; /// all buffers and images, see
+                                    /// device_memory.h
+    StagingRing m_staging; /// of every upload, see staging_ring.h
+    UploadBatch m_uploads; /// copies outside of the frames
+    UploadBatch m_transfers; /// on transferQueue, with m_asyncTransfers
+    uint64_t m_initUploads = 0; /// batch of initVulkan(), 0 once it's done
+    std::chrono::high_resolution_clock::time_point m_initUploadStart;
     // queues are automatically created with the logical device but we need
     // a handle to interface with, the are implicitly cleaned up with the
     // device
@@ -3241,6 +6394,8 @@ class TriangleApp {
     VkQueue presentQueue;
     uint32_t presentQueueFamily;
     uint32_t graphicsQueueFamily;
+    VkQueue transferQueue{VK_NULL_HANDLE}; /// with m_asyncTransfers
+    uint32_t transferQueueFamily{0};
     VkSwapchainKHR swapChain;
     std::vector<VkImage> swapChainImages;
     VkFormat swapChainImageFormat;
@@ -3265,6 +6420,7 @@ class TriangleApp {
     VkDebugUtilsMessengerEXT debugMesseger;
     GLFWwindow *window;
     VkInstance instance;
+    uint32_t m_instanceApiVersion{VK_API_VERSION_1_0}; /// at most 1.2
     // synchronization
     std::vector<VkSemaphore> imageAvailableSemaphores;
     std::vector<VkSemaphore> renderFinishedSemaphores;
@@ -3275,13 +6431,47 @@ class TriangleApp {
     bool framebufferResized = false;
     bool timedRotation = true;
 
-    // vertices and indices for the loaded 3D-model
-    std::vector<Vertex> vertices;
-    std::vector<uint32_t> indices;
+    // the loaded 3D-models, their levels stay with m_meshSources until
+    // streamMeshes() packed all of them
+    std::vector<MeshDraw> meshDraws;
+    std::vector<MeshSource> m_meshSources; /// parallel to meshDraws
+    VkFormat m_texCoordFormat{VK_FORMAT_R16G16_UNORM};
+    QuantizationBounds m_quantizationBounds;
+    glm::mat4 m_positionDequantization{1.0f};
+
+    // levels of detail on their way into the vertex and index buffer: done
+    // by a worker and waiting for their copy to be recorded, see
+    // streamMeshes()
+    std::vector<std::future<void>> m_streamTasks;
+    std::mutex m_streamMutex; /// guards m_streamedBatches
+    std::vector<MeshBatch> m_streamedBatches;
+    std::vector<MeshBatch> m_pendingBatches;
     VkBuffer vertexBuffer;
-    VkDeviceMemory vertexBufferMemory;
+    MemoryAllocation vertexBufferMemory;
     VkBuffer indexBuffer;
-    VkDeviceMemory indexBufferMemory;
+    MemoryAllocation indexBufferMemory;
+
+    // meshlets of all meshes and levels of detail, see appendMesh(), and the
+    // buffers meshlet_cull.comp works on. The handles stay null without GPU
+    // culling.
+    std::vector<MeshletBounds> meshletBounds;
+    std::vector<VkDrawIndexedIndirectCommand> meshletDraws;
+    CullPushConstants m_cullConstants{};
+    uint32_t m_drawnTriangles{0};
+    uint32_t m_maxDrawIndirectCount{1};
+    VkBuffer meshletBoundsBuffer{VK_NULL_HANDLE};
+    MemoryAllocation meshletBoundsBufferMemory;
+    VkBuffer meshletDrawBuffer{VK_NULL_HANDLE};
+    MemoryAllocation meshletDrawBufferMemory;
+    std::vector<VkBuffer> culledDrawBuffers;
+    std::vector<MemoryAllocation> culledDrawBuffersMemory;
+    std::vector<VkBuffer> cullCounterBuffers;
+    std::vector<MemoryAllocation> cullCounterBuffersMemory;
+    VkDescriptorSetLayout cullDescriptorSetLayout{VK_NULL_HANDLE};
+    VkPipelineLayout cullPipelineLayout{VK_NULL_HANDLE};
+    VkPipeline cullPipeline{VK_NULL_HANDLE};
+    VkDescriptorPool cullDescriptorPool{VK_NULL_HANDLE};
+    std::vector<VkDescriptorSet> cullDescriptorSets;
 
     // We should have multiple buffers, because multiple frames may be in
     // flight at the same time and we don’t want to update the buffer in
@@ -3290,27 +6480,220 @@ class TriangleApp {
     // frames in flight, and write to a uniform buffer that is not currently
     // being read by the GPU.
     std::vector<VkBuffer> uniformBuffers;
-    std::vector<VkDeviceMemory> uniformBuffersMemory;
+    std::vector<MemoryAllocation> uniformBuffersMemory;
     std::vector<void *> uniformBuffersMapped;
 
     VkDescriptorPool descriptorPool;
     std::vector<VkDescriptorSet> descriptorSets;
 
+    /// models loaded by loadModels(), the first one's texture is sampled
+    std::vector<Model> sceneModels = {Model::Earth3Dv3}; //, Model::Moon};
+
     VkImage textureImage;
-    VkDeviceMemory textureImageMemory;
+    MemoryAllocation textureImageMemory;
+    uint32_t textureMipLevels = 1;   /// in textureImage
+    uint32_t textureArrayLayers = 1; /// 6 for a cubemap
+    uint32_t textureLevelCount = 1;  /// of the whole texture
+    uint32_t textureBaseLevel = 0;   /// of the texture in textureImage level 0
+    VkFormat textureFormat = VK_FORMAT_R8G8B8A8_SRGB;
     VkImageView textureImageView;
     VkSampler textureSampler;
 
+    // imagery of the first scene model from a local tile pyramid, see
+    // tile_streaming.h. m_tileStreaming is only set with the pyramid and the
+    // tile shaders there, the handles stay null otherwise. The tiles go
+    // through the same stages as the streamed mesh batches.
+    bool m_tileStreaming{false};
+    TilePyramid m_tilePyramid;
+    TileCache m_tileCache;
+    TileSelection m_tileSelection;
+    glm::mat4 m_tileModelViewProjection{1.0f};
+    uint64_t m_tileFrame{0};
+    std::vector<std::future<void>> m_tileTasks;
+    std::mutex m_tileMutex; /// guards m_streamedTiles
+    std::vector<TileBatch> m_streamedTiles;
+    std::vector<TileBatch> m_pendingTiles;
+    VkImage tileImage{VK_NULL_HANDLE}; /// a layer per tile
+    MemoryAllocation tileImageMemory;
+    VkImageView tileImageView{VK_NULL_HANDLE};
+    VkSampler tileSampler{VK_NULL_HANDLE};
+    uint32_t tileMipLevels = 1;
+    VkBuffer tileIndexBuffer{VK_NULL_HANDLE}; /// of the patch grid
+    MemoryAllocation tileIndexBufferMemory;
+    VkDescriptorSetLayout tileDescriptorSetLayout{VK_NULL_HANDLE};
+    VkDescriptorPool tileDescriptorPool{VK_NULL_HANDLE};
+    VkDescriptorSet tileDescriptorSet{VK_NULL_HANDLE};
+    VkPipelineLayout tilePipelineLayout{VK_NULL_HANDLE};
+    VkPipeline tilePipeline{VK_NULL_HANDLE};
+
+    // mip levels of the sampled texture, see updateTextureResidency()
+    TextureUpload m_textureSource; /// all levels, streamed in from here
+    TextureResidency m_textureResidency;
+    uint32_t m_residentTexture{0};
+    uint64_t m_residencyFrame{0};
+    std::future<TextureSwap> m_textureStream;
+    std::vector<TextureSwap> m_transferringTextureSwaps;
+    std::vector<TextureSwap> m_pendingTextureSwaps;
+    std::vector<TextureSwap> m_copiedTextureSwaps;
+    // copies on the transfer queue the frame being recorded has to wait for
+    std::vector<VkSemaphore> m_transferWaits;
+    TransferOverlap m_transferOverlap;
+    std::chrono::high_resolution_clock::time_point m_lastFrameStart;
+    Surface m_surface; /// of a procedural texture, width 0 otherwise
+    SurfaceCache m_surfaceCache;
+
+    // the textures of the scene models, see texture_table.h
+    TextureTable m_textureTable{MAX_FRAMES_IN_FLIGHT};
+    uint32_t m_textureSlot{0}; /// of textureImage
+    uint32_t m_textureArraySize{0};
+    std::vector<SceneTexture> m_sceneTextures;
+
     VkImage depthImage;
-    VkDeviceMemory depthImageMemory;
+    MemoryAllocation depthImageMemory;
     VkImageView depthImageView;
 };
 
 int
-main()
+main(int argc, char **argv)
 {
+    // offline benchmarks, see benchmarks.h
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--bench-weld") == 0)
+        {
+            return benchmarkVertexWeld();
+        }
+        if (strcmp(argv[i], "--bench-optimize") == 0)
+        {
+            return benchmarkMeshOptimizer();
+        }
+        if (strcmp(argv[i], "--bench-codec") == 0)
+        {
+            return benchmarkGeometryCodec();
+        }
+        if (strcmp(argv[i], "--bench-mips") == 0)
+        {
+            return benchmarkTextureMips();
+        }
+        if (strcmp(argv[i], "--bench-bc") == 0)
+        {
+            return benchmarkTextureCompression();
+        }
+        if (strcmp(argv[i], "--bench-decode") == 0)
+        {
+            return benchmarkTextureDecode();
+        }
+        if (strcmp(argv[i], "--bench-cubemap") == 0)
+        {
+            return benchmarkTextureCubemap();
+        }
+        if (strcmp(argv[i], "--bench-surface") == 0)
+        {
+            return benchmarkProceduralSurface();
+        }
+    }
 
     TriangleApp app;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--body") == 0 && i + 1 < argc)
+        {
+            auto body = bodyMap.find(argv[++i]);
+            if (body != bodyMap.end())
+            {
+                app.setBody(body->second);
+            } else
+            {
+                std::cerr << "unknown body " << argv[i] << std::endl;
+            }
+        }
+        if (strcmp(argv[i], "--no-mesh-optimize") == 0)
+        {
+            app.setOptimizeMeshes(false);
+        }
+        if (strcmp(argv[i], "--float-vertices") == 0)
+        {
+            app.setVertexLayout(VertexLayout::Float32);
+        }
+        if (strcmp(argv[i], "--no-lods") == 0)
+        {
+            app.setGenerateLods(false);
+        }
+        if (strcmp(argv[i], "--lod-error") == 0 && i + 1 < argc)
+        {
+            app.setLodPixelError(strtof(argv[++i], nullptr));
+        }
+        if (strcmp(argv[i], "--no-streaming") == 0)
+        {
+            app.setStreamMeshes(false);
+        }
+        if (strcmp(argv[i], "--no-texture-compression") == 0)
+        {
+            app.setCompressTextures(false);
+        }
+        if (strcmp(argv[i], "--cubemap-textures") == 0)
+        {
+            app.setCubemapTextures(true);
+        }
+        if (strcmp(argv[i], "--no-bindless-textures") == 0)
+        {
+            app.setBindlessTextures(false);
+        }
+        if (strcmp(argv[i], "--no-transfer-queue") == 0)
+        {
+            app.setAsyncTransfers(false);
+        }
+        if (strcmp(argv[i], "--no-host-tracking") == 0)
+        {
+            app.setHostTracking(false);
+        }
+        if (strcmp(argv[i], "--host-arena") == 0)
+        {
+            app.setHostArena(true);
+        }
+        if (strcmp(argv[i], "--host-stats-json") == 0 && i + 1 < argc)
+        {
+            app.setHostStatsJson(argv[++i]);
+        }
+        if (strcmp(argv[i], "--texture-budget-mb") == 0 && i + 1 < argc)
+        {
+            app.setTextureBudget(strtoull(argv[++i], nullptr, 10));
+        }
+        if (strcmp(argv[i], "--tiles") == 0 && i + 1 < argc)
+        {
+            app.setTileDirectory(argv[++i]);
+        }
+        if (strcmp(argv[i], "--tile-cache-mb") == 0 && i + 1 < argc)
+        {
+            app.setTileCacheSize(
+                static_cast<uint32_t>(strtoul(argv[++i], nullptr, 10)));
+        }
+        if (strcmp(argv[i], "--tile-texel-pixels") == 0 && i + 1 < argc)
+        {
+            app.setTileTexelPixels(strtof(argv[++i], nullptr));
+        }
+        if (strcmp(argv[i], "--no-culling") == 0)
+        {
+            app.setCullingMode(CullingMode::None);
+        }
+        if (strcmp(argv[i], "--cpu-culling") == 0)
+        {
+            app.setCullingMode(CullingMode::Cpu);
+        }
+        if (strcmp(argv[i], "--obj-spheres") == 0)
+        {
+            app.setGenerateSpheres(false);
+        }
+        if (strcmp(argv[i], "--sphere-subdivisions") == 0 && i + 1 < argc)
+        {
+            uint32_t subdivisions
+                = static_cast<uint32_t>(strtoul(argv[++i], nullptr, 10));
+            for (const auto &sphere : sphereMap)
+            {
+                app.setSphereSubdivisions(sphere.first, subdivisions);
+            }
+        }
+    }
     try
     {
         app.run();
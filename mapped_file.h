@@ -0,0 +1,129 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+/**
+ * Read-only view of a whole file. On linux the file is memory-mapped, so
+ * nothing is copied until the pages are actually touched, on other platforms
+ * we fall back to reading the file into a heap buffer once.
+ * */
+class MappedFile {
+  public:
+    MappedFile() = default;
+    explicit MappedFile(const std::string &filename) { open(filename); }
+    ~MappedFile() { close(); }
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    MappedFile(MappedFile &&other) noexcept { *this = std::move(other); }
+    MappedFile &operator=(MappedFile &&other) noexcept
+    {
+        if (this != &other)
+        {
+            close();
+            m_data = other.m_data;
+            m_size = other.m_size;
+            m_mapped = other.m_mapped;
+            m_open = other.m_open;
+            m_buffer = std::move(other.m_buffer);
+            other.m_data = nullptr;
+            other.m_size = 0;
+            other.m_mapped = false;
+            other.m_open = false;
+        }
+        return *this;
+    }
+
+    /// returns false if the file does not exist or can't be read
+    bool open(const std::string &filename)
+    {
+        close();
+#ifdef __linux__
+        int fd = ::open(filename.c_str(), O_RDONLY);
+        if (fd < 0)
+        {
+            return false;
+        }
+
+        struct stat fileStat {};
+        if (fstat(fd, &fileStat) != 0)
+        {
+            ::close(fd);
+            return false;
+        }
+        m_size = static_cast<size_t>(fileStat.st_size);
+
+        if (m_size > 0)
+        {
+            void *addr = mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (addr == MAP_FAILED)
+            {
+                ::close(fd);
+                m_size = 0;
+                return false;
+            }
+            // we walk the files front to back, tell the kernel to read ahead
+            madvise(addr, m_size, MADV_SEQUENTIAL);
+            m_data = static_cast<const char *>(addr);
+            m_mapped = true;
+        }
+        // the mapping stays valid after closing the descriptor
+        ::close(fd);
+        m_open = true;
+        return true;
+#else
+        std::ifstream file(filename, std::ios::ate | std::ios::binary);
+        if (not file.is_open())
+        {
+            return false;
+        }
+        m_size = static_cast<size_t>(file.tellg());
+        m_buffer.resize(m_size);
+        file.seekg(0);
+        file.read(m_buffer.data(), m_size);
+        m_data = m_buffer.data();
+        m_open = true;
+        return true;
+#endif
+    }
+
+    void close()
+    {
+#ifdef __linux__
+        if (m_mapped)
+        {
+            munmap(const_cast<char *>(m_data), m_size);
+        }
+#endif
+        m_buffer.clear();
+        m_data = nullptr;
+        m_size = 0;
+        m_mapped = false;
+        m_open = false;
+    }
+
+    const char *data() const { return m_data; }
+    size_t size() const { return m_size; }
+    bool isOpen() const { return m_open; }
+
+  private:
+    const char *m_data = nullptr;
+    size_t m_size = 0;
+    bool m_mapped = false;
+    bool m_open = false;
+    std::vector<char> m_buffer; /// only used without mmap support
+};
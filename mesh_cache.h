@@ -0,0 +1,396 @@
+#pragma once
+
+#include "data_types.h"
+#include "geometry_codec.h"
+#include "mapped_file.h"
+#include "progressive_mesh.h"
+#include "source_stamp.h"
+
+#include <array>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <system_error>
+#include <type_traits>
+#include <vector>
+
+/**
+ * Binary cache of a welded mesh with its levels of detail and meshlets in the
+ * coarse to fine layout of progressive_mesh.h, written next to the OBJ file it
+ * was built from (e.g. models/moon.obj -> models/moon.obj.meshcache). On a
+ * warm start the cache is memory-mapped and only the coarsest level is
+ * decoded from it, the finer ones are decoded by the workers that prepare
+ * their batches (see MeshCache::decodeLevel()). Neither the OBJ parser, the
+ * vertex deduplication, the simplifier nor the normals have to run. Every
+ * level is stored on its own with geometry_codec.h: the vertices it adds,
+ * their normals and its indices. The meshlets are stored as they are.
+ *
+ * Layout: MeshCacheHeader | Meshlet[meshletCount]
+ *         | per level, coarsest first: coded vertices | coded normals
+ *                                      | coded indices
+ *
+ * The cache is only used if the source file still has the same size, mtime
+ * and content hash, if it was written with the same Vertex layout and if the
+ * mesh went through the same processing (flags). Bump
+ * MESH_CACHE_VERSION whenever the welding or the file layout changes.
+ * */
+const uint32_t MESH_CACHE_MAGIC = 0x4D443353; /// "S3DM"
+const uint32_t MESH_CACHE_VERSION = 4;
+
+/// MeshCacheHeader::flags, how the cached mesh was processed after welding
+const uint32_t MESH_CACHE_FLAG_OPTIMIZED = 1 << 0; /// see mesh_optimizer.h
+const uint32_t MESH_CACHE_FLAG_LODS = 1 << 1;      /// see mesh_lod.h
+
+/// where the coded arrays of a level are, offset from the end of the meshlets
+struct MeshCacheLevel {
+    uint64_t offset;
+    uint64_t vertexDataSize;
+    uint64_t normalDataSize;
+    uint64_t indexDataSize;
+};
+
+struct MeshCacheHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t vertexStride; /// sizeof(Vertex) of the writer
+    uint32_t vertexCount;
+    uint32_t indexCount;
+    uint32_t flags; /// MESH_CACHE_FLAG_*
+    uint64_t sourceSize;
+    int64_t sourceMtime;
+    uint64_t sourceHash;
+    uint32_t meshletStride; /// sizeof(Meshlet) of the writer
+    uint32_t meshletCount;
+    uint32_t lodCount;
+    uint32_t padding;
+    glm::vec4 bounds; /// xyz center, w radius
+    std::array<MeshLod, MAX_MESH_LODS> lods;
+    glm::vec3 quantizationMin;
+    uint32_t texCoordFormat; /// VkFormat
+    glm::vec3 quantizationExtent;
+    uint32_t padding2;
+    std::array<MeshCacheLevel, MAX_MESH_LODS> levels; /// indexed like lods
+    uint64_t dataSize; /// bytes of the coded levels
+    uint64_t padding3;
+};
+
+static_assert(sizeof(MeshCacheHeader) % 16 == 0,
+              "meshlet data must start 16 byte aligned");
+static_assert(std::is_trivially_copyable<Vertex>::value
+                  && sizeof(Vertex) % 4 == 0 && sizeof(glm::vec3) % 4 == 0,
+              "Vertex and its normal are coded as raw 32 bit words");
+static_assert(std::is_trivially_copyable<Meshlet>::value,
+              "Meshlet is written to the cache as raw bytes");
+
+static std::string
+meshCachePath(const std::string &modelPath)
+{
+    return modelPath + ".meshcache";
+}
+
+/**
+ * A validated, memory-mapped mesh cache. The meshlets and the coded arrays
+ * point directly into the mapping and stay valid as long as the object lives.
+ * The levels can be decoded from several threads at once.
+ * */
+class MeshCache {
+  public:
+    /// returns false if there is no cache or if it is stale
+    bool open(const std::string &modelPath, uint32_t flags = 0)
+    {
+        SourceFileStamp current;
+        if (not statSourceFile(modelPath, current))
+        {
+            return false;
+        }
+
+        if (not m_file.open(meshCachePath(modelPath))
+            || m_file.size() < sizeof(MeshCacheHeader))
+        {
+            m_file.close();
+            return false;
+        }
+
+        m_header = reinterpret_cast<const MeshCacheHeader *>(m_file.data());
+
+        uint64_t expectedSize
+            = sizeof(MeshCacheHeader)
+              + uint64_t(m_header->meshletCount) * sizeof(Meshlet)
+              + m_header->dataSize;
+
+        if (m_header->magic != MESH_CACHE_MAGIC
+            || m_header->version != MESH_CACHE_VERSION
+            || m_header->vertexStride != sizeof(Vertex)
+            || m_header->meshletStride != sizeof(Meshlet)
+            || m_header->lodCount == 0
+            || m_header->lodCount > MAX_MESH_LODS
+            || m_header->flags != flags
+            || m_file.size() != expectedSize
+            || not levelsInside()
+            || m_header->sourceSize != current.size
+            || m_header->sourceMtime != current.mtime)
+        {
+            invalidate();
+            return false;
+        }
+
+        // size and mtime match, the content hash catches files that were
+        // replaced by a copy with a preserved timestamp
+        if (not hashSourceFile(modelPath, current)
+            || m_header->sourceHash != current.hash)
+        {
+            invalidate();
+            return false;
+        }
+
+        return true;
+    }
+
+    const Meshlet *meshlets() const
+    {
+        return reinterpret_cast<const Meshlet *>(m_file.data()
+                                                 + sizeof(MeshCacheHeader));
+    }
+
+    /// the coded levels
+    const uint8_t *levelData() const
+    {
+        return reinterpret_cast<const uint8_t *>(
+            m_file.data() + sizeof(MeshCacheHeader)
+            + size_t(m_header->meshletCount) * sizeof(Meshlet));
+    }
+
+    uint32_t vertexCount() const { return m_header->vertexCount; }
+    uint32_t indexCount() const { return m_header->indexCount; }
+    uint32_t meshletCount() const { return m_header->meshletCount; }
+    uint32_t lodCount() const { return m_header->lodCount; }
+
+    /**
+     * Everything of the cached mesh but its arrays, which only hold the
+     * coarsest level. Returns false if that level is corrupt.
+     * */
+    bool coarsestMesh(ProgressiveMesh &mesh) const
+    {
+        mesh.meshlets.assign(meshlets(), meshlets() + meshletCount());
+        mesh.lods = m_header->lods;
+        mesh.lodCount = m_header->lodCount;
+        mesh.boundsCenter = glm::vec3(m_header->bounds.x,
+                                      m_header->bounds.y,
+                                      m_header->bounds.z);
+        mesh.boundsRadius = m_header->bounds.w;
+        mesh.quantizationBounds.min = m_header->quantizationMin;
+        mesh.quantizationBounds.extent = m_header->quantizationExtent;
+        mesh.texCoordFormat = static_cast<VkFormat>(m_header->texCoordFormat);
+
+        // the coarsest level starts the vertices and the indices
+        MeshLevel level;
+        if (not decodeLevel(mesh.lodCount - 1, true, level))
+        {
+            return false;
+        }
+        mesh.vertices.swap(level.vertices);
+        mesh.normals.swap(level.normals);
+        mesh.indices.swap(level.indices);
+        return true;
+    }
+
+    /// decodes the vertices a level adds, their normals (unless withNormals
+    /// is false) and its indices, returns false if they are corrupt
+    bool decodeLevel(uint32_t level, bool withNormals, MeshLevel &out) const
+    {
+        uint32_t first, end;
+        levelVertexRange(
+            m_header->lods, m_header->lodCount, level, first, end);
+        const MeshLod &lod = m_header->lods[level];
+        const MeshCacheLevel &coded = m_header->levels[level];
+        const uint8_t *data = levelData() + coded.offset;
+
+        out.vertices.resize(end - first);
+        out.normals.resize(withNormals ? end - first : 0);
+        out.indices.resize(lod.indexCount);
+        return decodeGeometry(data,
+                              coded.vertexDataSize,
+                              out.vertices.size(),
+                              sizeof(Vertex),
+                              out.vertices.data())
+               && (not withNormals
+                   || decodeGeometry(data + coded.vertexDataSize,
+                                     coded.normalDataSize,
+                                     out.normals.size(),
+                                     sizeof(glm::vec3),
+                                     out.normals.data()))
+               && decodeGeometry(data + coded.vertexDataSize
+                                     + coded.normalDataSize,
+                                 coded.indexDataSize,
+                                 out.indices.size(),
+                                 sizeof(uint32_t),
+                                 out.indices.data());
+    }
+
+  private:
+    /// the ranges of the levels stay inside the coded data
+    bool levelsInside() const
+    {
+        for (uint32_t i = 0; i < m_header->lodCount; i++)
+        {
+            const MeshLod &lod = m_header->lods[i];
+            const MeshCacheLevel &level = m_header->levels[i];
+            if (lod.vertexCount > m_header->vertexCount
+                || uint64_t(lod.firstIndex) + lod.indexCount
+                       > m_header->indexCount
+                || level.offset > m_header->dataSize
+                || level.vertexDataSize + level.normalDataSize
+                           + level.indexDataSize
+                       > m_header->dataSize - level.offset)
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void invalidate()
+    {
+        m_file.close();
+        m_header = nullptr;
+    }
+
+    MappedFile m_file;
+    const MeshCacheHeader *m_header = nullptr;
+};
+
+/**
+ * The levels of a loaded mesh until all of them are streamed in. A mesh that
+ * was just built keeps its arrays, one from the cache only its coarsest level
+ * and the mapping the finer levels are decoded from.
+ * */
+struct MeshSource {
+    ProgressiveMesh mesh;
+    std::unique_ptr<MeshCache> cache; /// null if mesh holds every level
+};
+
+/// a level out of the arrays or decoded from the cache, false if it is corrupt
+static bool
+readMeshLevel(const MeshSource &source,
+              uint32_t level,
+              bool withNormals,
+              MeshLevel &out)
+{
+    if (copyMeshLevel(source.mesh, level, withNormals, out))
+    {
+        return true;
+    }
+    return source.cache && source.cache->decodeLevel(level, withNormals, out);
+}
+
+/**
+ * Writes the processed mesh of modelPath to its cache file. The data is written
+ * to a temporary file first and renamed afterwards, so a crash while writing
+ * never leaves a truncated cache behind. Failing to write the cache is not
+ * fatal, the next start simply parses the OBJ file again.
+ * */
+static bool
+writeMeshCache(const std::string &modelPath,
+               const ProgressiveMesh &mesh,
+               uint32_t flags = 0)
+{
+    SourceFileStamp stamp;
+    if (not statSourceFile(modelPath, stamp)
+        || not hashSourceFile(modelPath, stamp))
+    {
+        return false;
+    }
+
+    MeshCacheHeader header{};
+    header.magic = MESH_CACHE_MAGIC;
+    header.version = MESH_CACHE_VERSION;
+    header.vertexStride = sizeof(Vertex);
+    header.vertexCount = static_cast<uint32_t>(mesh.vertices.size());
+    header.indexCount = static_cast<uint32_t>(mesh.indices.size());
+    header.flags = flags;
+    header.sourceSize = stamp.size;
+    header.sourceMtime = stamp.mtime;
+    header.sourceHash = stamp.hash;
+    header.meshletStride = sizeof(Meshlet);
+    header.meshletCount = static_cast<uint32_t>(mesh.meshlets.size());
+    header.lodCount = mesh.lodCount;
+    header.bounds = glm::vec4(mesh.boundsCenter.x,
+                              mesh.boundsCenter.y,
+                              mesh.boundsCenter.z,
+                              mesh.boundsRadius);
+    header.lods = mesh.lods;
+    header.quantizationMin = mesh.quantizationBounds.min;
+    header.quantizationExtent = mesh.quantizationBounds.extent;
+    header.texCoordFormat = static_cast<uint32_t>(mesh.texCoordFormat);
+
+    // coarsest level first, the order the levels are streamed in
+    std::vector<uint8_t> levelData;
+    for (uint32_t i = mesh.lodCount; i-- > 0;)
+    {
+        uint32_t first, end;
+        levelVertexRange(mesh.lods, mesh.lodCount, i, first, end);
+        const MeshLod &lod = mesh.lods[i];
+        const std::vector<uint8_t> vertexData = encodeGeometry(
+            mesh.vertices.data() + first, end - first, sizeof(Vertex));
+        const std::vector<uint8_t> normalData = encodeGeometry(
+            mesh.normals.data() + first, end - first, sizeof(glm::vec3));
+        const std::vector<uint8_t> indexData
+            = encodeGeometry(mesh.indices.data() + lod.firstIndex,
+                             lod.indexCount,
+                             sizeof(uint32_t));
+
+        MeshCacheLevel &level = header.levels[i];
+        level.offset = levelData.size();
+        level.vertexDataSize = vertexData.size();
+        level.normalDataSize = normalData.size();
+        level.indexDataSize = indexData.size();
+        for (const auto *data : {&vertexData, &normalData, &indexData})
+        {
+            levelData.insert(levelData.end(), data->begin(), data->end());
+        }
+    }
+    header.dataSize = levelData.size();
+
+    const std::string cachePath = meshCachePath(modelPath);
+    const std::string tmpPath = cachePath + ".tmp";
+    {
+        std::ofstream file(tmpPath, std::ios::binary | std::ios::trunc);
+        if (not file.is_open())
+        {
+            std::cerr << "failed to write mesh cache " << cachePath
+                      << std::endl;
+            return false;
+        }
+
+        file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        file.write(reinterpret_cast<const char *>(mesh.meshlets.data()),
+                   mesh.meshlets.size() * sizeof(Meshlet));
+        file.write(reinterpret_cast<const char *>(levelData.data()),
+                   levelData.size());
+
+        if (not file.good())
+        {
+            file.close();
+            std::remove(tmpPath.c_str());
+            std::cerr << "failed to write mesh cache " << cachePath
+                      << std::endl;
+            return false;
+        }
+    }
+
+    std::error_code ec;
+    std::filesystem::rename(tmpPath, cachePath, ec);
+    if (ec)
+    {
+        std::remove(tmpPath.c_str());
+        std::cerr << "failed to write mesh cache " << cachePath << ": "
+                  << ec.message() << std::endl;
+        return false;
+    }
+    return true;
+}
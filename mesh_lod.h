@@ -0,0 +1,661 @@
+#pragma once
+
+#include "data_types.h"
+#include "mesh_optimizer.h"
+#include "vertex_weld.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <numeric>
+#include <vector>
+
+/**
+ * Levels of detail for the loaded meshes and the per frame choice between
+ * them.
+ *
+ * The simplifier collapses edges into one of their vertices (half edge
+ * collapse) in the order of the quadric error metric (Garland & Heckbert
+ * 1997, "Surface Simplification Using Quadric Error Metrics"). Vertices never
+ * move, so every level reuses the vertices of the full mesh and only needs
+ * its own indices. Vertices on a uv seam or an open border only slide along
+ * it, the uv charts stay intact and the seams don't tear open.
+ * */
+
+/// every level has about this fraction of the triangles of the previous one
+const float LOD_TRIANGLE_RATIO = 0.25f;
+
+/// no level of detail gets below this many triangles
+const size_t MIN_LOD_TRIANGLES = 64;
+
+/// levels of detail off by more than this fraction of the bounding sphere
+/// radius are useless, the mesh only has locked vertices left to collapse
+const float MAX_LOD_RELATIVE_ERROR = 0.25f;
+
+/// weight of the planes that keep seams and borders in place, relative to
+/// the triangle planes
+const double LOD_EDGE_WEIGHT = 10.0;
+
+/// default of the screen space error a level of detail may have, in pixels
+const float LOD_PIXEL_ERROR = 1.0f;
+
+/// sum of squared distances to a set of weighted planes
+struct Quadric {
+    double a00 = 0.0, a01 = 0.0, a02 = 0.0, a11 = 0.0, a12 = 0.0, a22 = 0.0;
+    double b0 = 0.0, b1 = 0.0, b2 = 0.0;
+    double c = 0.0;
+    double weight = 0.0;
+
+    /// plane n * p + d = 0, n has to be normalized
+    void addPlane(const glm::vec3 &n, float d, double planeWeight)
+    {
+        a00 += planeWeight * n.x * n.x;
+        a01 += planeWeight * n.x * n.y;
+        a02 += planeWeight * n.x * n.z;
+        a11 += planeWeight * n.y * n.y;
+        a12 += planeWeight * n.y * n.z;
+        a22 += planeWeight * n.z * n.z;
+        b0 += planeWeight * n.x * d;
+        b1 += planeWeight * n.y * d;
+        b2 += planeWeight * n.z * d;
+        c += planeWeight * d * d;
+        weight += planeWeight;
+    }
+
+    Quadric &operator+=(const Quadric &other)
+    {
+        a00 += other.a00;
+        a01 += other.a01;
+        a02 += other.a02;
+        a11 += other.a11;
+        a12 += other.a12;
+        a22 += other.a22;
+        b0 += other.b0;
+        b1 += other.b1;
+        b2 += other.b2;
+        c += other.c;
+        weight += other.weight;
+        return *this;
+    }
+
+    /// weighted mean of the squared plane distances of p
+    double error(const glm::vec3 &p) const
+    {
+        double x = p.x, y = p.y, z = p.z;
+        double sum = a00 * x * x + a11 * y * y + a22 * z * z
+                     + 2.0 * (a01 * x * y + a02 * x * z + a12 * y * z)
+                     + 2.0 * (b0 * x + b1 * y + b2 * z) + c;
+        return weight > 0.0 ? std::max(sum, 0.0) / weight : 0.0;
+    }
+};
+
+/// whether one of the triangles of a has the edge a -> b
+static bool
+hasTriangleEdge(const VertexTriangleAdjacency &adjacency,
+                const std::vector<uint32_t> &indices,
+                uint32_t a,
+                uint32_t b)
+{
+    for (uint32_t k = adjacency.offsets[a]; k < adjacency.offsets[a + 1]; k++)
+    {
+        const uint32_t *triangle = &indices[3 * adjacency.triangles[k]];
+        if ((triangle[0] == a && triangle[1] == b)
+            || (triangle[1] == a && triangle[2] == b)
+            || (triangle[2] == a && triangle[0] == b))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+static std::vector<uint32_t>
+mapIndices(const std::vector<uint32_t> &indices,
+           const std::vector<uint32_t> &remap)
+{
+    std::vector<uint32_t> mapped(indices.size());
+    for (size_t i = 0; i < indices.size(); i++)
+    {
+        mapped[i] = remap[indices[i]];
+    }
+    return mapped;
+}
+
+enum class LodVertexKind : uint8_t {
+    Manifold, /// inside a uv chart, can collapse into any neighbour
+    Border,   /// on an open edge of the mesh, slides along it
+    Seam,     /// one of the two vertices of a uv seam, they slide together
+    Locked,   /// anything else (poles, corners, seams meeting borders)
+};
+
+/**
+ * Kind of every vertex of the current triangles. A vertex is on a seam or a
+ * border if it has exactly one open edge in and out, edges are open if the
+ * neighbouring triangle doesn't share the same vertices. If the position has
+ * a second vertex and the edges are closed between the positions it is a uv
+ * seam, otherwise the mesh itself ends there.
+ * */
+struct LodVertexClasses {
+    std::vector<LodVertexKind> kinds;
+    std::vector<uint32_t> openNext;  /// vertex at the end of the open edge out
+    std::vector<uint32_t> openPrev;  /// vertex at the start of the open edge in
+    std::vector<uint32_t> nextWedge; /// other vertex with the same position
+    std::vector<uint32_t> positionIndices; /// indices mapped to positionIds
+    VertexTriangleAdjacency positionTriangles;
+
+    LodVertexClasses(const std::vector<uint32_t> &indices,
+                     const std::vector<uint32_t> &positionIds,
+                     size_t positionCount)
+        : kinds(positionIds.size(), LodVertexKind::Locked),
+          openNext(positionIds.size()), openPrev(positionIds.size()),
+          nextWedge(positionIds.size()),
+          positionIndices(mapIndices(indices, positionIds)),
+          positionTriangles(positionIndices, positionCount)
+    {
+        const size_t vertexCount = positionIds.size();
+        VertexTriangleAdjacency vertexTriangles(indices, vertexCount);
+
+        // the vertices of a position that are still in use form a ring
+        std::vector<bool> used(vertexCount, false);
+        for (uint32_t index : indices)
+        {
+            used[index] = true;
+        }
+        const uint32_t none = ~0u;
+        std::vector<uint32_t> wedgeCount(positionCount, 0);
+        std::vector<uint32_t> firstWedge(positionCount, none);
+        std::vector<uint32_t> lastWedge(positionCount, none);
+        for (uint32_t v = 0; v < vertexCount; v++)
+        {
+            if (not used[v])
+            {
+                continue;
+            }
+            uint32_t p = positionIds[v];
+            wedgeCount[p]++;
+            if (firstWedge[p] == none)
+            {
+                firstWedge[p] = v;
+            } else
+            {
+                nextWedge[lastWedge[p]] = v;
+            }
+            lastWedge[p] = v;
+        }
+        for (uint32_t p = 0; p < positionCount; p++)
+        {
+            if (firstWedge[p] != none)
+            {
+                nextWedge[lastWedge[p]] = firstWedge[p];
+            }
+        }
+
+        std::vector<uint8_t> openOut(vertexCount, 0), openIn(vertexCount, 0);
+        std::vector<bool> positionOpen(positionCount, false);
+        for (size_t i = 0; i < indices.size(); i += 3)
+        {
+            for (size_t e = 0; e < 3; e++)
+            {
+                uint32_t a = indices[i + e];
+                uint32_t b = indices[i + (e + 1) % 3];
+                if (not hasTriangleEdge(vertexTriangles, indices, b, a))
+                {
+                    openOut[a] = std::min(openOut[a] + 1, 2);
+                    openIn[b] = std::min(openIn[b] + 1, 2);
+                    openNext[a] = b;
+                    openPrev[b] = a;
+                }
+                uint32_t pa = positionIds[a], pb = positionIds[b];
+                if (not hasTriangleEdge(
+                        positionTriangles, positionIndices, pb, pa))
+                {
+                    positionOpen[pa] = true;
+                    positionOpen[pb] = true;
+                }
+            }
+        }
+
+        for (uint32_t v = 0; v < vertexCount; v++)
+        {
+            if (not used[v])
+            {
+                continue;
+            }
+            uint32_t p = positionIds[v];
+            if (openOut[v] == 0 && openIn[v] == 0)
+            {
+                if (wedgeCount[p] == 1)
+                {
+                    kinds[v] = LodVertexKind::Manifold;
+                }
+            } else if (openOut[v] == 1 && openIn[v] == 1)
+            {
+                if (wedgeCount[p] == 1 && positionOpen[p])
+                {
+                    kinds[v] = LodVertexKind::Border;
+                } else if (wedgeCount[p] == 2 && not positionOpen[p])
+                {
+                    kinds[v] = LodVertexKind::Seam;
+                }
+            }
+        }
+        // both sides of a seam have to be able to move
+        for (uint32_t v = 0; v < vertexCount; v++)
+        {
+            if (kinds[v] == LodVertexKind::Seam
+                && kinds[nextWedge[v]] != LodVertexKind::Seam)
+            {
+                kinds[v] = LodVertexKind::Locked;
+            }
+        }
+    }
+};
+
+/**
+ * Simplifies the triangles in indices towards targetTriangleCount, stops
+ * earlier if nothing can collapse anymore. Every pass collapses the cheaper
+ * half of the best collapse per position, a position takes part in one
+ * collapse per pass. Returns the largest error of a collapse as a model space
+ * distance.
+ * */
+static float
+simplifyMesh(const Vertex *meshVertices,
+             const std::vector<uint32_t> &positionIds,
+             std::vector<uint32_t> &indices,
+             size_t targetTriangleCount)
+{
+    const size_t vertexCount = positionIds.size();
+    const size_t positionCount
+        = vertexCount == 0
+              ? 0
+              : *std::max_element(positionIds.begin(), positionIds.end()) + 1;
+    std::vector<glm::vec3> positions(positionCount);
+    for (size_t v = 0; v < vertexCount; v++)
+    {
+        positions[positionIds[v]] = meshVertices[v].pos;
+    }
+
+    // planes of the triangles, plus planes through the seam and border edges
+    // perpendicular to their triangle
+    std::vector<Quadric> quadrics(positionCount);
+    {
+        VertexTriangleAdjacency vertexTriangles(indices, vertexCount);
+        for (size_t i = 0; i < indices.size(); i += 3)
+        {
+            const uint32_t corners[3] = {positionIds[indices[i]],
+                                         positionIds[indices[i + 1]],
+                                         positionIds[indices[i + 2]]};
+            const glm::vec3 &p0 = positions[corners[0]];
+            glm::vec3 normal = glm::cross(positions[corners[1]] - p0,
+                                          positions[corners[2]] - p0);
+            float length = glm::length(normal);
+            if (length == 0.0f)
+            {
+                continue;
+            }
+            normal /= length;
+            for (uint32_t corner : corners)
+            {
+                quadrics[corner].addPlane(
+                    normal, -glm::dot(normal, p0), 0.5 * length);
+            }
+
+            for (size_t e = 0; e < 3; e++)
+            {
+                if (hasTriangleEdge(vertexTriangles,
+                                    indices,
+                                    indices[i + (e + 1) % 3],
+                                    indices[i + e]))
+                {
+                    continue;
+                }
+                const glm::vec3 &pa = positions[corners[e]];
+                glm::vec3 edge = positions[corners[(e + 1) % 3]] - pa;
+                glm::vec3 edgeNormal = glm::cross(edge, normal);
+                float edgeLength = glm::length(edgeNormal);
+                if (edgeLength == 0.0f)
+                {
+                    continue;
+                }
+                edgeNormal /= edgeLength;
+                double weight = LOD_EDGE_WEIGHT * edgeLength * edgeLength;
+                for (uint32_t corner : {corners[e], corners[(e + 1) % 3]})
+                {
+                    quadrics[corner].addPlane(
+                        edgeNormal, -glm::dot(edgeNormal, pa), weight);
+                }
+            }
+        }
+    }
+
+    const uint32_t none = ~0u;
+    double maxError = 0.0;
+    size_t triangleCount = indices.size() / 3;
+
+    while (triangleCount > targetTriangleCount)
+    {
+        LodVertexClasses classes(indices, positionIds, positionCount);
+
+        // cheapest collapse of every position, seams and borders only along
+        // their open edges
+        std::vector<double> bestError(positionCount, 0.0);
+        std::vector<uint32_t> bestSource(positionCount, none);
+        std::vector<uint32_t> bestTarget(positionCount, none);
+        auto consider = [&](uint32_t source, uint32_t target) {
+            LodVertexKind kind = classes.kinds[source];
+            if (kind == LodVertexKind::Locked)
+            {
+                return;
+            }
+            if (kind != LodVertexKind::Manifold
+                && (classes.kinds[target] != kind
+                    || (classes.openNext[source] != target
+                        && classes.openPrev[source] != target)))
+            {
+                return;
+            }
+            uint32_t p = positionIds[source];
+            uint32_t q = positionIds[target];
+            Quadric merged = quadrics[p];
+            merged += quadrics[q];
+            double error = merged.error(positions[q]);
+            if (bestSource[p] == none || error < bestError[p])
+            {
+                bestError[p] = error;
+                bestSource[p] = source;
+                bestTarget[p] = target;
+            }
+        };
+        for (size_t i = 0; i < indices.size(); i += 3)
+        {
+            for (size_t e = 0; e < 3; e++)
+            {
+                uint32_t a = indices[i + e];
+                uint32_t b = indices[i + (e + 1) % 3];
+                consider(a, b);
+                consider(b, a);
+            }
+        }
+
+        std::vector<uint32_t> candidates;
+        for (uint32_t p = 0; p < positionCount; p++)
+        {
+            if (bestSource[p] != none)
+            {
+                candidates.push_back(p);
+            }
+        }
+        if (candidates.empty())
+        {
+            break;
+        }
+        std::sort(candidates.begin(),
+                  candidates.end(),
+                  [&](uint32_t a, uint32_t b) {
+                      return bestError[a] < bestError[b];
+                  });
+
+        // most collapses of a pass get blocked by their neighbours, so the
+        // error may go a bit above the one of the last collapse needed
+        const size_t goal = triangleCount - targetTriangleCount;
+        const size_t goalCollapse = goal / 2;
+        const double errorLimit
+            = goalCollapse < candidates.size()
+                  ? 1.5 * bestError[candidates[goalCollapse]]
+                  : std::numeric_limits<double>::max();
+
+        const std::vector<uint32_t> &positionIndices = classes.positionIndices;
+        const VertexTriangleAdjacency &adjacency = classes.positionTriangles;
+
+        std::vector<uint32_t> remap(vertexCount);
+        std::iota(remap.begin(), remap.end(), 0u);
+        std::vector<uint32_t> positionRemap(positionCount);
+        std::iota(positionRemap.begin(), positionRemap.end(), 0u);
+        std::vector<bool> touched(positionCount, false);
+
+        // the triangles around p must not flip (or get close to it) when p
+        // moves onto q, checked against the collapses done in this pass
+        auto flips = [&](uint32_t p, uint32_t q) {
+            for (uint32_t k = adjacency.offsets[p];
+                 k < adjacency.offsets[p + 1];
+                 k++)
+            {
+                const uint32_t *triangle
+                    = &positionIndices[3 * adjacency.triangles[k]];
+                uint32_t corners[3];
+                bool collapses = false;
+                for (int c = 0; c < 3; c++)
+                {
+                    corners[c] = positionRemap[triangle[c]];
+                    collapses = collapses || corners[c] == q;
+                }
+                if (collapses)
+                {
+                    continue;
+                }
+                glm::vec3 before[3], after[3];
+                for (int c = 0; c < 3; c++)
+                {
+                    before[c] = positions[corners[c]];
+                    after[c] = corners[c] == p ? positions[q] : before[c];
+                }
+                glm::vec3 n0 = glm::cross(before[1] - before[0],
+                                          before[2] - before[0]);
+                glm::vec3 n1
+                    = glm::cross(after[1] - after[0], after[2] - after[0]);
+                if (glm::dot(n0, n1)
+                    <= 0.25f * glm::length(n0) * glm::length(n1))
+                {
+                    return true;
+                }
+            }
+            return false;
+        };
+
+        size_t collapsed = 0;
+        for (uint32_t p : candidates)
+        {
+            if (collapsed >= goal || bestError[p] > errorLimit)
+            {
+                break;
+            }
+            uint32_t source = bestSource[p];
+            uint32_t target = bestTarget[p];
+            uint32_t q = positionIds[target];
+            if (touched[p] || touched[q])
+            {
+                continue;
+            }
+
+            // the other side of a seam collapses along its own open edge
+            uint32_t sibling = none, siblingTarget = none;
+            if (classes.kinds[source] == LodVertexKind::Seam)
+            {
+                sibling = classes.nextWedge[source];
+                if (positionIds[classes.openNext[sibling]] == q)
+                {
+                    siblingTarget = classes.openNext[sibling];
+                } else if (positionIds[classes.openPrev[sibling]] == q)
+                {
+                    siblingTarget = classes.openPrev[sibling];
+                } else
+                {
+                    continue;
+                }
+            }
+            if (flips(p, q))
+            {
+                continue;
+            }
+
+            remap[source] = target;
+            if (sibling != none)
+            {
+                remap[sibling] = siblingTarget;
+            }
+            positionRemap[p] = q;
+            quadrics[q] += quadrics[p];
+            touched[p] = touched[q] = true;
+            maxError = std::max(maxError, bestError[p]);
+            collapsed += classes.kinds[source] == LodVertexKind::Border ? 1 : 2;
+        }
+        if (collapsed == 0)
+        {
+            break;
+        }
+
+        // drop the triangles that lost their area
+        size_t write = 0;
+        for (size_t i = 0; i < indices.size(); i += 3)
+        {
+            uint32_t a = remap[indices[i]];
+            uint32_t b = remap[indices[i + 1]];
+            uint32_t c = remap[indices[i + 2]];
+            uint32_t pa = positionIds[a], pb = positionIds[b],
+                     pc = positionIds[c];
+            if (pa == pb || pb == pc || pc == pa)
+            {
+                continue;
+            }
+            indices[write++] = a;
+            indices[write++] = b;
+            indices[write++] = c;
+        }
+        indices.resize(write);
+        triangleCount = write / 3;
+    }
+
+    return static_cast<float>(std::sqrt(maxError));
+}
+
+/// center of the bounding box and the farthest vertex from it
+static void
+computeBoundingSphere(const Vertex *meshVertices,
+                      size_t vertexCount,
+                      glm::vec3 &center,
+                      float &radius)
+{
+    center = glm::vec3(0.0f);
+    radius = 0.0f;
+    if (vertexCount == 0)
+    {
+        return;
+    }
+
+    glm::vec3 minPos = meshVertices[0].pos;
+    glm::vec3 maxPos = meshVertices[0].pos;
+    for (size_t i = 1; i < vertexCount; i++)
+    {
+        minPos = glm::min(minPos, meshVertices[i].pos);
+        maxPos = glm::max(maxPos, meshVertices[i].pos);
+    }
+    center = 0.5f * (minPos + maxPos);
+    for (size_t i = 0; i < vertexCount; i++)
+    {
+        radius = std::max(radius, glm::length(meshVertices[i].pos - center));
+    }
+}
+
+/**
+ * Appends the levels of detail to the full mesh in indices and fills in the
+ * lods of mesh, each level has LOD_TRIANGLE_RATIO of the triangles of the
+ * previous one until MIN_LOD_TRIANGLES or MAX_MESH_LODS is reached. Every
+ * level is simplified from the previous one, its error is the sum of the
+ * errors along the way, so it overestimates a little. The bounding sphere of
+ * mesh has to be set already.
+ * */
+static void
+buildMeshLods(const Vertex *meshVertices,
+              size_t vertexCount,
+              std::vector<uint32_t> &indices,
+              MeshDraw &mesh)
+{
+    mesh.lods[0] = {0, static_cast<uint32_t>(indices.size()), 0.0f};
+    mesh.lodCount = 1;
+
+    std::vector<float> positions(vertexCount * 3);
+    for (size_t i = 0; i < vertexCount; i++)
+    {
+        positions[3 * i + 0] = meshVertices[i].pos.x;
+        positions[3 * i + 1] = meshVertices[i].pos.y;
+        positions[3 * i + 2] = meshVertices[i].pos.z;
+    }
+    std::vector<uint32_t> positionIds = equalValueIds(
+        positions.data(), vertexCount, 3, sharedThreadPool());
+
+    std::vector<uint32_t> lodIndices = indices;
+    float error = 0.0f;
+    while (mesh.lodCount < MAX_MESH_LODS)
+    {
+        size_t triangleCount = lodIndices.size() / 3;
+        size_t target = static_cast<size_t>(triangleCount * LOD_TRIANGLE_RATIO);
+        if (target < MIN_LOD_TRIANGLES)
+        {
+            break;
+        }
+        error += simplifyMesh(meshVertices, positionIds, lodIndices, target);
+        // locked vertices can keep the mesh from getting any simpler
+        if (lodIndices.size() / 3 > triangleCount * 3 / 4
+            || error > MAX_LOD_RELATIVE_ERROR * mesh.boundsRadius)
+        {
+            break;
+        }
+
+        std::vector<uint32_t> clusterStarts;
+        optimizeVertexCache(lodIndices, vertexCount, clusterStarts);
+
+        mesh.lods[mesh.lodCount++] = {static_cast<uint32_t>(indices.size()),
+                                      static_cast<uint32_t>(lodIndices.size()),
+                                      error};
+        indices.insert(indices.end(), lodIndices.begin(), lodIndices.end());
+    }
+}
+
+/**
+ * Coarsest level of detail whose error stays below maxPixelError on screen.
+ * The error is projected at the point of the bounding sphere closest to the
+ * eye, with the vertical field of view (in degrees) over viewportHeight
+ * pixels.
+ * */
+static uint32_t
+selectMeshLod(const MeshDraw &mesh,
+              const glm::mat4 &modelMatrix,
+              const glm::vec3 &eye,
+              float fieldOfView,
+              float viewportHeight,
+              float maxPixelError)
+{
+    glm::vec4 center = modelMatrix * glm::vec4(mesh.boundsCenter, 1.0f);
+    float scale = std::max(
+        {glm::length(glm::vec3(modelMatrix[0][0],
+                               modelMatrix[0][1],
+                               modelMatrix[0][2])),
+         glm::length(glm::vec3(modelMatrix[1][0],
+                               modelMatrix[1][1],
+                               modelMatrix[1][2])),
+         glm::length(glm::vec3(modelMatrix[2][0],
+                               modelMatrix[2][1],
+                               modelMatrix[2][2]))});
+
+    float distance
+        = glm::length(glm::vec3(center.x, center.y, center.z) - eye)
+          - mesh.boundsRadius * scale;
+    if (distance <= 0.0f)
+    {
+        return 0;
+    }
+
+    float pixelsPerUnit
+        = viewportHeight
+          / (2.0f * std::tan(glm::radians(fieldOfView) * 0.5f) * distance);
+    uint32_t lod = 0;
+    for (uint32_t i = 1; i < mesh.lodCount; i++)
+    {
+        if (mesh.lods[i].error * scale * pixelsPerUnit <= maxPixelError)
+        {
+            lod = i;
+        }
+    }
+    return lod;
+}
@@ -0,0 +1,409 @@
+#pragma once
+
+#include "data_types.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <numeric>
+#include <vector>
+
+/**
+ * Post-load reordering of a welded mesh for the GPU:
+ *  1. triangle order for the post-transform vertex cache (Tipsify, Sander et
+ *     al. 2007, "Fast Triangle Reordering for Vertex Locality and Reduced
+ *     Overdraw")
+ *  2. the Tipsify clusters reordered front to back from the outside for less
+ *     overdraw (same paper, view independent cluster sort)
+ *  3. vertices renumbered in first use order for vertex fetch locality
+ *
+ * The index buffer still draws the same triangles with the same winding, only
+ * the order of triangles and vertices changes.
+ * */
+
+/// post-transform cache size the optimizer and the statistics assume
+const uint32_t VERTEX_CACHE_SIZE = 16;
+
+struct VertexCacheStats {
+    float acmr = 0.0f; /// average cache miss ratio, transformed vertices per
+                       /// triangle (0.5 is the optimum for big meshes)
+    float atvr = 0.0f; /// average transformed vertex ratio, transformed per
+                       /// unique vertex (1.0 is the optimum)
+};
+
+/// simulates a FIFO post-transform cache of cacheSize entries
+static VertexCacheStats
+analyzeVertexCache(const std::vector<uint32_t> &indices,
+                   size_t vertexCount,
+                   uint32_t cacheSize = VERTEX_CACHE_SIZE)
+{
+    VertexCacheStats stats;
+    if (indices.empty() || vertexCount == 0)
+    {
+        return stats;
+    }
+
+    // a vertex is in the cache if it was inserted less than cacheSize
+    // misses ago
+    std::vector<uint64_t> insertedAt(vertexCount, 0);
+    uint64_t misses = 0;
+    for (uint32_t index : indices)
+    {
+        if (insertedAt[index] == 0 || misses - insertedAt[index] >= cacheSize)
+        {
+            misses++;
+            insertedAt[index] = misses;
+        }
+    }
+
+    stats.acmr = float(misses) / float(indices.size() / 3);
+    stats.atvr = float(misses) / float(vertexCount);
+    return stats;
+}
+
+/// per vertex list of the triangles using it, CSR layout
+struct VertexTriangleAdjacency {
+    std::vector<uint32_t> offsets; /// vertexCount + 1
+    std::vector<uint32_t> triangles;
+
+    VertexTriangleAdjacency(const std::vector<uint32_t> &indices,
+                            size_t vertexCount)
+        : offsets(vertexCount + 1, 0), triangles(indices.size())
+    {
+        for (uint32_t index : indices)
+        {
+            offsets[index + 1]++;
+        }
+        std::partial_sum(offsets.begin(), offsets.end(), offsets.begin());
+
+        std::vector<uint32_t> fill(offsets.begin(), offsets.end() - 1);
+        for (size_t i = 0; i < indices.size(); i++)
+        {
+            triangles[fill[indices[i]]++] = static_cast<uint32_t>(i / 3);
+        }
+    }
+
+    uint32_t valence(uint32_t vertex) const
+    {
+        return offsets[vertex + 1] - offsets[vertex];
+    }
+};
+
+/**
+ * Tipsify: fans out from the current vertex, then continues with the best
+ * vertex of the last emitted triangles that is still in the cache. If none
+ * is left it falls back to the dead end stack and then to the next vertex
+ * in input order, these jumps are where the cache starts cold again and where
+ * clusterStarts gets a new entry (first triangle of the cluster).
+ * */
+static void
+optimizeVertexCache(std::vector<uint32_t> &indices,
+                    size_t vertexCount,
+                    std::vector<uint32_t> &clusterStarts,
+                    uint32_t cacheSize = VERTEX_CACHE_SIZE)
+{
+    clusterStarts.clear();
+    const size_t triangleCount = indices.size() / 3;
+    if (triangleCount == 0)
+    {
+        return;
+    }
+
+    VertexTriangleAdjacency adjacency(indices, vertexCount);
+
+    std::vector<uint32_t> liveTriangles(vertexCount);
+    for (size_t v = 0; v < vertexCount; v++)
+    {
+        liveTriangles[v] = adjacency.valence(static_cast<uint32_t>(v));
+    }
+    std::vector<uint32_t> cacheTime(vertexCount, 0);
+    std::vector<bool> emitted(triangleCount, false);
+    std::vector<uint32_t> deadEnd;
+    std::vector<uint32_t> candidates;
+
+    std::vector<uint32_t> result;
+    result.reserve(indices.size());
+
+    uint32_t time = cacheSize + 1;
+    size_t cursor = 0; /// next vertex in input order to check for live ones
+    int64_t current = 0;
+    clusterStarts.push_back(0);
+
+    while (current >= 0)
+    {
+        candidates.clear();
+        const uint32_t fanVertex = static_cast<uint32_t>(current);
+        for (uint32_t i = adjacency.offsets[fanVertex];
+             i < adjacency.offsets[fanVertex + 1];
+             i++)
+        {
+            uint32_t triangle = adjacency.triangles[i];
+            if (emitted[triangle])
+            {
+                continue;
+            }
+            emitted[triangle] = true;
+            for (int corner = 0; corner < 3; corner++)
+            {
+                uint32_t v = indices[3 * triangle + corner];
+                result.push_back(v);
+                deadEnd.push_back(v);
+                candidates.push_back(v);
+                liveTriangles[v]--;
+                if (time - cacheTime[v] > cacheSize)
+                {
+                    cacheTime[v] = time;
+                    time++;
+                }
+            }
+        }
+
+        // best candidate: still has triangles left and will still be in the
+        // cache after emitting them, the oldest one of these wins
+        current = -1;
+        int64_t bestPriority = -1;
+        for (uint32_t v : candidates)
+        {
+            if (liveTriangles[v] == 0)
+            {
+                continue;
+            }
+            int64_t priority = 0;
+            if (time - cacheTime[v] + 2 * liveTriangles[v] <= cacheSize)
+            {
+                priority = time - cacheTime[v];
+            }
+            if (priority > bestPriority)
+            {
+                bestPriority = priority;
+                current = v;
+            }
+        }
+        if (current >= 0)
+        {
+            continue;
+        }
+
+        if (result.size() < indices.size())
+        {
+            clusterStarts.push_back(static_cast<uint32_t>(result.size() / 3));
+        }
+        while (not deadEnd.empty())
+        {
+            uint32_t v = deadEnd.back();
+            deadEnd.pop_back();
+            if (liveTriangles[v] > 0)
+            {
+                current = v;
+                break;
+            }
+        }
+        while (current < 0 && cursor < vertexCount)
+        {
+            if (liveTriangles[cursor] > 0)
+            {
+                current = static_cast<int64_t>(cursor);
+            }
+            cursor++;
+        }
+    }
+
+    if (clusterStarts.back() * 3 == result.size())
+    {
+        clusterStarts.pop_back();
+    }
+    indices.swap(result);
+}
+
+/// clusters are cut as soon as their own ACMR (starting with a cold cache)
+/// drops to this value, smaller values mean bigger clusters and a better
+/// cache hit rate but less freedom for the overdraw sort
+const float OVERDRAW_CLUSTER_ACMR = 0.75f;
+
+/**
+ * Cuts the clusters of optimizeVertexCache() into smaller ones, a cluster
+ * ends as soon as it paid off its cold cache start (see
+ * OVERDRAW_CLUSTER_ACMR). Without this closed meshes like the planets are a
+ * single cluster.
+ * */
+static std::vector<uint32_t>
+splitClusters(const std::vector<uint32_t> &indices,
+              size_t vertexCount,
+              const std::vector<uint32_t> &clusterStarts,
+              uint32_t cacheSize = VERTEX_CACHE_SIZE)
+{
+    const uint32_t triangleCount = static_cast<uint32_t>(indices.size() / 3);
+    std::vector<uint32_t> result;
+    std::vector<uint64_t> insertedAt(vertexCount, 0);
+    uint64_t misses = 0;
+
+    for (size_t c = 0; c < clusterStarts.size(); c++)
+    {
+        uint32_t end = c + 1 < clusterStarts.size() ? clusterStarts[c + 1]
+                                                    : triangleCount;
+        uint32_t start = clusterStarts[c];
+        uint64_t startMisses = misses + cacheSize; /// cold cache
+        misses = startMisses;
+        result.push_back(start);
+
+        for (uint32_t t = start; t < end; t++)
+        {
+            for (int corner = 0; corner < 3; corner++)
+            {
+                uint32_t index = indices[3 * t + corner];
+                if (insertedAt[index] == 0
+                    || misses - insertedAt[index] >= cacheSize)
+                {
+                    misses++;
+                    insertedAt[index] = misses;
+                }
+            }
+            uint32_t clusterTriangles = t + 1 - start;
+            if (t + 1 < end
+                && float(misses - startMisses) / float(clusterTriangles)
+                       <= OVERDRAW_CLUSTER_ACMR)
+            {
+                start = t + 1;
+                startMisses = misses + cacheSize;
+                misses = startMisses;
+                result.push_back(start);
+            }
+        }
+    }
+    return result;
+}
+
+/**
+ * Sorts the clusters of optimizeVertexCache() so the ones that face away from
+ * the center of the mesh come first. They are likely in front of the rest for
+ * most view directions, on convex meshes like planets this is the ideal order.
+ * Cluster internal order and therefore most of the cache locality is kept.
+ * */
+static void
+optimizeOverdraw(std::vector<uint32_t> &indices,
+                 const std::vector<Vertex> &meshVertices,
+                 const std::vector<uint32_t> &tipsifyClusters)
+{
+    const size_t triangleCount = indices.size() / 3;
+    const std::vector<uint32_t> clusterStarts
+        = splitClusters(indices, meshVertices.size(), tipsifyClusters);
+    const size_t clusterCount = clusterStarts.size();
+    if (clusterCount < 2)
+    {
+        return;
+    }
+
+    struct Cluster {
+        uint32_t begin;
+        uint32_t end;
+        glm::vec3 centroid{0.0f};
+        glm::vec3 normal{0.0f};
+        float area = 0.0f;
+        float sortKey = 0.0f;
+    };
+    std::vector<Cluster> clusters(clusterCount);
+
+    glm::vec3 meshCentroid{0.0f};
+    float meshArea = 0.0f;
+    for (size_t c = 0; c < clusterCount; c++)
+    {
+        Cluster &cluster = clusters[c];
+        cluster.begin = clusterStarts[c];
+        cluster.end = c + 1 < clusterCount
+                          ? clusterStarts[c + 1]
+                          : static_cast<uint32_t>(triangleCount);
+
+        for (uint32_t t = cluster.begin; t < cluster.end; t++)
+        {
+            const glm::vec3 &p0 = meshVertices[indices[3 * t + 0]].pos;
+            const glm::vec3 &p1 = meshVertices[indices[3 * t + 1]].pos;
+            const glm::vec3 &p2 = meshVertices[indices[3 * t + 2]].pos;
+            glm::vec3 areaNormal = glm::cross(p1 - p0, p2 - p0);
+            float area = 0.5f * glm::length(areaNormal);
+
+            cluster.normal += areaNormal;
+            cluster.centroid += (p0 + p1 + p2) * (area / 3.0f);
+            cluster.area += area;
+        }
+        meshCentroid += cluster.centroid;
+        meshArea += cluster.area;
+        if (cluster.area > 0.0f)
+        {
+            cluster.centroid /= cluster.area;
+        }
+    }
+    if (meshArea > 0.0f)
+    {
+        meshCentroid /= meshArea;
+    }
+
+    for (auto &cluster : clusters)
+    {
+        float normalLength = glm::length(cluster.normal);
+        cluster.sortKey
+            = normalLength > 0.0f
+                  ? glm::dot(cluster.centroid - meshCentroid, cluster.normal)
+                        / normalLength
+                  : 0.0f;
+    }
+    std::stable_sort(clusters.begin(),
+                     clusters.end(),
+                     [](const Cluster &a, const Cluster &b) {
+                         return a.sortKey > b.sortKey;
+                     });
+
+    std::vector<uint32_t> result;
+    result.reserve(indices.size());
+    for (const auto &cluster : clusters)
+    {
+        result.insert(result.end(),
+                      indices.begin() + 3 * size_t(cluster.begin),
+                      indices.begin() + 3 * size_t(cluster.end));
+    }
+    indices.swap(result);
+}
+
+/**
+ * Renumbers the vertices in the order the index buffer first uses them, so
+ * the vertex fetch walks the vertex buffer mostly front to back. Vertices
+ * that are not referenced at all are dropped.
+ * */
+static void
+optimizeVertexFetch(std::vector<Vertex> &meshVertices,
+                    std::vector<uint32_t> &indices)
+{
+    const uint32_t unused = ~0u;
+    std::vector<uint32_t> remap(meshVertices.size(), unused);
+    std::vector<Vertex> result;
+    result.reserve(meshVertices.size());
+
+    for (uint32_t &index : indices)
+    {
+        if (remap[index] == unused)
+        {
+            remap[index] = static_cast<uint32_t>(result.size());
+            result.push_back(meshVertices[index]);
+        }
+        index = remap[index];
+    }
+    meshVertices.swap(result);
+}
+
+/**
+ * Runs all three passes and returns the cache statistics before and after,
+ * so the caller can report them.
+ * */
+static void
+optimizeMesh(std::vector<Vertex> &meshVertices,
+             std::vector<uint32_t> &indices,
+             VertexCacheStats &before,
+             VertexCacheStats &after)
+{
+    before = analyzeVertexCache(indices, meshVertices.size());
+
+    std::vector<uint32_t> clusterStarts;
+    optimizeVertexCache(indices, meshVertices.size(), clusterStarts);
+    optimizeOverdraw(indices, meshVertices, clusterStarts);
+    optimizeVertexFetch(meshVertices, indices);
+
+    after = analyzeVertexCache(indices, meshVertices.size());
+}
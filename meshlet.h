@@ -0,0 +1,323 @@
+#pragma once
+
+#include "data_types.h"
+#include "mesh_optimizer.h"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+/**
+ * Meshlets: small clusters of triangles with a bounding sphere and a normal
+ * cone, so whole clusters outside the view frustum or facing away from the
+ * camera can be skipped. They are culled by shaders/meshlet_cull.comp (or
+ * meshletVisible() on the CPU) and drawn through the regular index buffer,
+ * one indexed draw per surviving meshlet.
+ * */
+
+/// limits of a meshlet, the usual mesh shader sizes
+const uint32_t MESHLET_MAX_VERTICES = 64;
+const uint32_t MESHLET_MAX_TRIANGLES = 124;
+
+/// how much a triangle facing another way than the meshlet counts against
+/// it, relative to one new vertex
+const float MESHLET_CONE_WEIGHT = 0.5f;
+
+/// below this the normals of a meshlet spread too much for a useful cone
+const float MESHLET_MIN_CONE_DOT = 0.1f;
+
+/// push constants of meshlet_cull.comp, 128 bytes is the guaranteed minimum
+struct CullPushConstants {
+    std::array<glm::vec4, 6> frustum; /// model space, see frustumPlanes()
+    glm::vec4 eye;                    /// model space camera position
+    uint32_t firstMeshlet;
+    uint32_t meshletCount;
+    uint32_t counter; /// one per mesh
+    uint32_t padding;
+};
+
+static_assert(sizeof(CullPushConstants) == 128,
+              "CullPushConstants must fit the push constant minimum");
+
+struct Meshlet {
+    MeshletBounds bounds;
+    uint32_t firstIndex; /// relative to the start of the clustered range
+    uint32_t indexCount;
+    uint32_t padding[2]; /// keeps the arrays in the mesh cache 16 byte aligned
+};
+
+static inline glm::vec3
+triangleNormal(const Vertex *meshVertices, const uint32_t *triangle)
+{
+    const glm::vec3 &p0 = meshVertices[triangle[0]].pos;
+    glm::vec3 normal = glm::cross(meshVertices[triangle[1]].pos - p0,
+                                  meshVertices[triangle[2]].pos - p0);
+    float length = glm::length(normal);
+    return length > 0.0f ? normal / length : glm::vec3(0.0f);
+}
+
+/**
+ * Bounding sphere around the box of the vertices and the normal cone of the
+ * triangles. The cone is stored as the average normal and the sine of the
+ * angle to the normal furthest away from it, meshletVisible() explains the
+ * test.
+ * */
+static MeshletBounds
+computeMeshletBounds(const Vertex *meshVertices,
+                     const uint32_t *indices,
+                     uint32_t indexCount)
+{
+    glm::vec3 minPos = meshVertices[indices[0]].pos;
+    glm::vec3 maxPos = minPos;
+    glm::vec3 normalSum(0.0f);
+    for (uint32_t i = 0; i < indexCount; i += 3)
+    {
+        for (uint32_t c = 0; c < 3; c++)
+        {
+            minPos = glm::min(minPos, meshVertices[indices[i + c]].pos);
+            maxPos = glm::max(maxPos, meshVertices[indices[i + c]].pos);
+        }
+        normalSum += triangleNormal(meshVertices, indices + i);
+    }
+
+    glm::vec3 center = 0.5f * (minPos + maxPos);
+    float radius = 0.0f;
+    for (uint32_t i = 0; i < indexCount; i++)
+    {
+        radius = std::max(radius,
+                          glm::length(meshVertices[indices[i]].pos - center));
+    }
+
+    MeshletBounds bounds;
+    bounds.sphere = glm::vec4(center.x, center.y, center.z, radius);
+
+    float normalLength = glm::length(normalSum);
+    glm::vec3 axis
+        = normalLength > 0.0f ? normalSum / normalLength : glm::vec3(0.0f);
+    float minDot = normalLength > 0.0f ? 1.0f : -1.0f;
+    for (uint32_t i = 0; i < indexCount; i += 3)
+    {
+        minDot = std::min(
+            minDot, glm::dot(axis, triangleNormal(meshVertices, indices + i)));
+    }
+    // a cutoff of 1 can never pass the test, the meshlet is never back facing
+    float cutoff = minDot < MESHLET_MIN_CONE_DOT
+                       ? 1.0f
+                       : std::sqrt(1.0f - minDot * minDot);
+    bounds.cone = glm::vec4(axis.x, axis.y, axis.z, cutoff);
+    return bounds;
+}
+
+/**
+ * Splits the triangles in [firstIndex, firstIndex + indexCount) of indices
+ * into meshlets and reorders them meshlet by meshlet. A meshlet grows from a
+ * seed triangle by the neighbour that adds the fewest new vertices and bends
+ * the least away from the triangles already in it, until one of the limits is
+ * hit or there are no neighbours left.
+ * */
+static std::vector<Meshlet>
+buildMeshlets(const Vertex *meshVertices,
+              size_t vertexCount,
+              std::vector<uint32_t> &indices,
+              uint32_t firstIndex,
+              uint32_t indexCount)
+{
+    std::vector<Meshlet> meshlets;
+    if (indexCount == 0)
+    {
+        return meshlets;
+    }
+
+    std::vector<uint32_t> range(indices.begin() + firstIndex,
+                                indices.begin() + firstIndex + indexCount);
+    const uint32_t triangleCount = indexCount / 3;
+    VertexTriangleAdjacency adjacency(range, vertexCount);
+
+    std::vector<glm::vec3> normals(triangleCount);
+    for (uint32_t t = 0; t < triangleCount; t++)
+    {
+        normals[t] = triangleNormal(meshVertices, &range[3 * t]);
+    }
+
+    const uint32_t none = ~0u;
+    std::vector<bool> emitted(triangleCount, false);
+    std::vector<uint32_t> vertexMeshlet(vertexCount, none);
+    std::vector<uint32_t> meshletVertices;
+    std::vector<uint32_t> localIndices, localClusterStarts;
+    std::vector<uint32_t> result;
+    result.reserve(indexCount);
+    uint32_t seed = 0;
+
+    while (true)
+    {
+        while (seed < triangleCount && emitted[seed])
+        {
+            seed++;
+        }
+        if (seed == triangleCount)
+        {
+            break;
+        }
+
+        const uint32_t meshletIndex = static_cast<uint32_t>(meshlets.size());
+        const uint32_t meshletStart = static_cast<uint32_t>(result.size());
+        meshletVertices.clear();
+        glm::vec3 normalSum(0.0f);
+
+        auto newVertices = [&](uint32_t t) {
+            uint32_t count = 0;
+            for (uint32_t c = 0; c < 3; c++)
+            {
+                count += vertexMeshlet[range[3 * t + c]] != meshletIndex;
+            }
+            return count;
+        };
+        auto emit = [&](uint32_t t) {
+            emitted[t] = true;
+            for (uint32_t c = 0; c < 3; c++)
+            {
+                uint32_t v = range[3 * t + c];
+                if (vertexMeshlet[v] != meshletIndex)
+                {
+                    vertexMeshlet[v] = meshletIndex;
+                    meshletVertices.push_back(v);
+                }
+                result.push_back(v);
+            }
+            normalSum += normals[t];
+        };
+
+        emit(seed);
+        uint32_t meshletTriangles = 1;
+        while (meshletTriangles < MESHLET_MAX_TRIANGLES)
+        {
+            float normalLength = glm::length(normalSum);
+            glm::vec3 axis = normalLength > 0.0f ? normalSum / normalLength
+                                                 : glm::vec3(0.0f);
+
+            uint32_t best = none;
+            float bestScore = 0.0f;
+            for (uint32_t v : meshletVertices)
+            {
+                for (uint32_t k = adjacency.offsets[v];
+                     k < adjacency.offsets[v + 1];
+                     k++)
+                {
+                    uint32_t t = adjacency.triangles[k];
+                    if (emitted[t])
+                    {
+                        continue;
+                    }
+                    uint32_t extra = newVertices(t);
+                    if (meshletVertices.size() + extra > MESHLET_MAX_VERTICES)
+                    {
+                        continue;
+                    }
+                    float score
+                        = float(extra)
+                          + MESHLET_CONE_WEIGHT
+                                * (1.0f - glm::dot(axis, normals[t]));
+                    if (best == none || score < bestScore)
+                    {
+                        best = t;
+                        bestScore = score;
+                    }
+                }
+            }
+            if (best == none)
+            {
+                break;
+            }
+            emit(best);
+            meshletTriangles++;
+        }
+
+        // the greedy growth order is poor for the post transform cache, sort
+        // the triangles of the meshlet again on its local vertex numbers
+        localIndices.assign(result.begin() + meshletStart, result.end());
+        for (auto &index : localIndices)
+        {
+            index = static_cast<uint32_t>(
+                std::find(meshletVertices.begin(), meshletVertices.end(), index)
+                - meshletVertices.begin());
+        }
+        optimizeVertexCache(
+            localIndices, meshletVertices.size(), localClusterStarts);
+        for (size_t i = 0; i < localIndices.size(); i++)
+        {
+            result[meshletStart + i] = meshletVertices[localIndices[i]];
+        }
+
+        Meshlet meshlet{};
+        meshlet.firstIndex = meshletStart;
+        meshlet.indexCount
+            = static_cast<uint32_t>(result.size()) - meshletStart;
+        meshlet.bounds = computeMeshletBounds(
+            meshVertices, result.data() + meshletStart, meshlet.indexCount);
+        meshlets.push_back(meshlet);
+    }
+
+    std::copy(result.begin(), result.end(), indices.begin() + firstIndex);
+    return meshlets;
+}
+
+/**
+ * View frustum planes (xyz normal pointing inwards, w distance) in the space
+ * of the matrix' input, extracted from proj * view * model with a [0, 1]
+ * depth range (Gribb & Hartmann)
+ * */
+static std::array<glm::vec4, 6>
+frustumPlanes(const glm::mat4 &modelViewProjection)
+{
+    const glm::mat4 &m = modelViewProjection;
+    auto row = [&](int r) {
+        return glm::vec4(m[0][r], m[1][r], m[2][r], m[3][r]);
+    };
+    std::array<glm::vec4, 6> planes = {row(3) + row(0),
+                                       row(3) - row(0),
+                                       row(3) + row(1),
+                                       row(3) - row(1),
+                                       row(2),
+                                       row(3) - row(2)};
+    for (auto &plane : planes)
+    {
+        float length = glm::length(glm::vec3(plane.x, plane.y, plane.z));
+        if (length > 0.0f)
+        {
+            plane *= 1.0f / length;
+        }
+    }
+    return planes;
+}
+
+/**
+ * Same test as meshlet_cull.comp, everything in model space. A meshlet is
+ * back facing if the whole bounding sphere sees every triangle from behind:
+ * with the normals within asin(cutoff) of the axis, the direction to every
+ * point of the sphere has to be further than 90 degrees minus that from the
+ * axis.
+ * */
+static inline bool
+meshletVisible(const MeshletBounds &bounds,
+               const std::array<glm::vec4, 6> &frustum,
+               const glm::vec3 &eye)
+{
+    glm::vec3 center(bounds.sphere.x, bounds.sphere.y, bounds.sphere.z);
+    float radius = bounds.sphere.w;
+    for (const auto &plane : frustum)
+    {
+        if (glm::dot(glm::vec3(plane.x, plane.y, plane.z), center) + plane.w
+            < -radius)
+        {
+            return false;
+        }
+    }
+
+    glm::vec3 axis(bounds.cone.x, bounds.cone.y, bounds.cone.z);
+    float cutoff = bounds.cone.w;
+    glm::vec3 view = center - eye;
+    return glm::dot(view, axis)
+           < cutoff * glm::length(view) + radius * (1.0f + cutoff);
+}
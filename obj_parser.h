@@ -0,0 +1,634 @@
+#pragma once
+
+#include "mapped_file.h"
+#include "thread_pool.h"
+
+#include "includeLibs/tiny_obj_loader.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+/**
+ * Parallel replacement for tinyobj::LoadObj() for the big planet, asteroid
+ * and terrain meshes.
+ *
+ * The file is memory-mapped and cut into chunks at line boundaries. Every
+ * chunk parses its v/vt/vn/f records on a pool thread into its own arrays,
+ * indices that are relative to the end of the file so far (negative ones)
+ * are remembered and fixed up once the prefix sums over all chunks are
+ * known. A second parallel pass copies every chunk to its final offset in
+ * the merged attrib arrays and triangulates its faces.
+ *
+ * The result is the same attrib_t and index stream LoadObj() produces with
+ * triangulation enabled, with all groups/objects merged into a single shape
+ * (loadModel() concatenates the shapes anyway):
+ *  - quads are split along the shorter diagonal exactly like tinyobj does,
+ *    larger polygons are split as a fan instead of tinyobj's ear clipping
+ *  - materials, smoothing groups, lines, points and skin weights are skipped,
+ *    mesh.material_ids and mesh.smoothing_group_ids stay empty
+ *  - faces with an out of range vertex index are an error instead of being
+ *    dropped with a warning
+ * */
+
+/// everything one chunk of the file contributes, before merging
+struct ObjChunk {
+    const char *begin = nullptr;
+    const char *end = nullptr;
+
+    std::vector<float> positions; /// xyz
+    std::vector<float> weights;   /// w, 1.0 if missing
+    std::vector<float> colors;    /// rgb, 1.0 if missing
+    std::vector<float> normals;   /// xyz
+    std::vector<float> texcoords; /// uv
+
+    std::vector<int> corners;           /// v, vt, vn per face corner
+    std::vector<uint32_t> faceSizes;    /// corner count per face, >= 3
+    std::vector<uint32_t> relativeSlot; /// entries of corners that are chunk
+                                        /// relative, see resolveObjChunk()
+    size_t triangleCount = 0;
+
+    // offsets of this chunk in the merged arrays
+    size_t vertexBase = 0;
+    size_t normalBase = 0;
+    size_t texcoordBase = 0;
+    size_t triangleBase = 0;
+
+    const char *errorAt = nullptr;
+    std::string error;
+};
+
+static inline bool
+isObjSpace(char c)
+{
+    return c == ' ' || c == '\t';
+}
+
+static inline bool
+isObjTokenEnd(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+static inline const char *
+skipObjSpaces(const char *p, const char *lineEnd)
+{
+    while (p < lineEnd && isObjSpace(*p))
+    {
+        p++;
+    }
+    return p;
+}
+
+/**
+ * Parses a decimal number from [p, tokenEnd). The digits are collected in an
+ * integer and scaled by a single exact power of ten, which is correctly
+ * rounded for everything an exporter writes and a lot cheaper than scaling
+ * every digit on its own.
+ * */
+static bool
+parseObjDouble(const char *p, const char *tokenEnd, double &result)
+{
+    static const double powersOfTen[] = {
+        1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+
+    if (p >= tokenEnd)
+    {
+        return false;
+    }
+
+    bool negative = false;
+    if (*p == '+' || *p == '-')
+    {
+        negative = *p == '-';
+        p++;
+    }
+
+    uint64_t mantissa = 0;
+    int exponent = 0;
+    int significantDigits = 0;
+    bool anyDigits = false;
+
+    for (; p < tokenEnd && unsigned(*p - '0') < 10; p++)
+    {
+        anyDigits = true;
+        if (significantDigits < 19)
+        {
+            mantissa = mantissa * 10 + unsigned(*p - '0');
+            significantDigits += mantissa != 0;
+        } else
+        {
+            exponent++;
+        }
+    }
+    if (p < tokenEnd && *p == '.')
+    {
+        p++;
+        for (; p < tokenEnd && unsigned(*p - '0') < 10; p++)
+        {
+            anyDigits = true;
+            if (significantDigits < 19)
+            {
+                mantissa = mantissa * 10 + unsigned(*p - '0');
+                significantDigits += mantissa != 0;
+                exponent--;
+            }
+        }
+    }
+    if (not anyDigits)
+    {
+        return false;
+    }
+
+    if (p < tokenEnd && (*p == 'e' || *p == 'E'))
+    {
+        p++;
+        bool negativeExponent = false;
+        if (p < tokenEnd && (*p == '+' || *p == '-'))
+        {
+            negativeExponent = *p == '-';
+            p++;
+        }
+        if (p >= tokenEnd || unsigned(*p - '0') >= 10)
+        {
+            return false;
+        }
+        int explicitExponent = 0;
+        for (; p < tokenEnd && unsigned(*p - '0') < 10; p++)
+        {
+            if (explicitExponent < 100000)
+            {
+                explicitExponent = explicitExponent * 10 + (*p - '0');
+            }
+        }
+        exponent += negativeExponent ? -explicitExponent : explicitExponent;
+    }
+
+    double value = static_cast<double>(mantissa);
+    if (mantissa != 0 && exponent != 0)
+    {
+        if (mantissa < (uint64_t(1) << 53) && exponent >= -22 && exponent <= 22)
+        {
+            value = exponent < 0 ? value / powersOfTen[-exponent]
+                                 : value * powersOfTen[exponent];
+        } else
+        {
+            value *= std::pow(10.0, exponent);
+        }
+    }
+    result = negative ? -value : value;
+    return true;
+}
+
+/// same contract as tinyobj's parseReal(): consumes one token, false if the
+/// token is missing or not a number
+static inline bool
+parseObjReal(const char *&p, const char *lineEnd, float &out)
+{
+    p = skipObjSpaces(p, lineEnd);
+    const char *tokenEnd = p;
+    while (tokenEnd < lineEnd && not isObjTokenEnd(*tokenEnd))
+    {
+        tokenEnd++;
+    }
+
+    double value;
+    bool parsed = parseObjDouble(p, tokenEnd, value);
+    if (parsed)
+    {
+        out = static_cast<float>(value);
+    }
+    p = tokenEnd;
+    return parsed;
+}
+
+/// atoi() on a token that ends at '/' or white space
+static inline int
+parseObjInt(const char *&p, const char *lineEnd)
+{
+    bool negative = false;
+    if (p < lineEnd && (*p == '+' || *p == '-'))
+    {
+        negative = *p == '-';
+        p++;
+    }
+    int value = 0;
+    for (; p < lineEnd && unsigned(*p - '0') < 10; p++)
+    {
+        value = value * 10 + (*p - '0');
+    }
+    while (p < lineEnd && *p != '/' && not isObjTokenEnd(*p))
+    {
+        p++;
+    }
+    return negative ? -value : value;
+}
+
+/**
+ * tinyobj's fixIndex() for one corner entry. Positive indices are absolute,
+ * negative ones are relative to the number of elements defined so far, which
+ * we only know within the chunk at this point, so the slot gets flagged for
+ * resolveObjChunk().
+ * */
+static inline bool
+storeObjIndex(ObjChunk &chunk, int idx, size_t localCount, bool allowZero)
+{
+    if (idx > 0)
+    {
+        chunk.corners.push_back(idx - 1);
+        return true;
+    }
+    if (idx == 0)
+    {
+        chunk.corners.push_back(-1);
+        return allowZero;
+    }
+    chunk.relativeSlot.push_back(static_cast<uint32_t>(chunk.corners.size()));
+    chunk.corners.push_back(static_cast<int>(localCount) + idx);
+    return true;
+}
+
+static bool
+parseObjFace(ObjChunk &chunk, const char *p, const char *lineEnd)
+{
+    const size_t localVertices = chunk.positions.size() / 3;
+    const size_t localNormals = chunk.normals.size() / 3;
+    const size_t localTexcoords = chunk.texcoords.size() / 2;
+    const size_t firstCorner = chunk.corners.size();
+    const size_t firstSlot = chunk.relativeSlot.size();
+
+    uint32_t cornerCount = 0;
+    for (;;)
+    {
+        p = skipObjSpaces(p, lineEnd);
+        if (p >= lineEnd || *p == '\r')
+        {
+            break;
+        }
+
+        // i, i/j, i//k or i/j/k
+        int vertexIndex = parseObjInt(p, lineEnd);
+        int texcoordIndex = 0;
+        int normalIndex = 0;
+        bool hasTexcoord = false;
+        bool hasNormal = false;
+        if (p < lineEnd && *p == '/')
+        {
+            p++;
+            if (p < lineEnd && *p == '/')
+            {
+                p++;
+                normalIndex = parseObjInt(p, lineEnd);
+                hasNormal = true;
+            } else
+            {
+                texcoordIndex = parseObjInt(p, lineEnd);
+                hasTexcoord = true;
+                if (p < lineEnd && *p == '/')
+                {
+                    p++;
+                    normalIndex = parseObjInt(p, lineEnd);
+                    hasNormal = true;
+                }
+            }
+        }
+
+        if (not storeObjIndex(chunk, vertexIndex, localVertices, false))
+        {
+            return false;
+        }
+        if (hasTexcoord)
+        {
+            if (not storeObjIndex(chunk, texcoordIndex, localTexcoords, true))
+            {
+                return false;
+            }
+        } else
+        {
+            chunk.corners.push_back(-1);
+        }
+        if (hasNormal)
+        {
+            if (not storeObjIndex(chunk, normalIndex, localNormals, true))
+            {
+                return false;
+            }
+        } else
+        {
+            chunk.corners.push_back(-1);
+        }
+        cornerCount++;
+    }
+
+    if (cornerCount < 3)
+    {
+        // degenerated face, tinyobj skips it as well
+        chunk.corners.resize(firstCorner);
+        chunk.relativeSlot.resize(firstSlot);
+        return true;
+    }
+    chunk.faceSizes.push_back(cornerCount);
+    chunk.triangleCount += cornerCount - 2;
+    return true;
+}
+
+static void
+parseObjChunk(ObjChunk &chunk)
+{
+    const char *p = chunk.begin;
+    while (p < chunk.end)
+    {
+        const char *lineEnd = static_cast<const char *>(
+            memchr(p, '\n', static_cast<size_t>(chunk.end - p)));
+        if (lineEnd == nullptr)
+        {
+            lineEnd = chunk.end;
+        }
+
+        const char *token = skipObjSpaces(p, lineEnd);
+        const char *lineStart = p;
+        p = lineEnd + 1;
+
+        if (lineEnd - token < 2 || token[0] == '#')
+        {
+            continue;
+        }
+
+        if (token[0] == 'v' && isObjSpace(token[1]))
+        {
+            token += 2;
+            float x = 0.0f, y = 0.0f, z = 0.0f;
+            float r = 1.0f, g = 1.0f, b = 1.0f;
+            parseObjReal(token, lineEnd, x);
+            parseObjReal(token, lineEnd, y);
+            parseObjReal(token, lineEnd, z);
+            // x y z [w] or x y z r g b, the 4th value is w and r at once
+            if (parseObjReal(token, lineEnd, r)
+                && parseObjReal(token, lineEnd, g))
+            {
+                parseObjReal(token, lineEnd, b);
+            }
+            chunk.positions.insert(chunk.positions.end(), {x, y, z});
+            chunk.weights.push_back(r);
+            chunk.colors.insert(chunk.colors.end(), {r, g, b});
+        } else if (token[0] == 'v' && token[1] == 'n' && lineEnd - token > 2
+                   && isObjSpace(token[2]))
+        {
+            token += 3;
+            float x = 0.0f, y = 0.0f, z = 0.0f;
+            parseObjReal(token, lineEnd, x);
+            parseObjReal(token, lineEnd, y);
+            parseObjReal(token, lineEnd, z);
+            chunk.normals.insert(chunk.normals.end(), {x, y, z});
+        } else if (token[0] == 'v' && token[1] == 't' && lineEnd - token > 2
+                   && isObjSpace(token[2]))
+        {
+            token += 3;
+            float u = 0.0f, v = 0.0f;
+            parseObjReal(token, lineEnd, u);
+            parseObjReal(token, lineEnd, v);
+            chunk.texcoords.insert(chunk.texcoords.end(), {u, v});
+        } else if (token[0] == 'f' && isObjSpace(token[1]))
+        {
+            if (not parseObjFace(chunk, token + 2, lineEnd))
+            {
+                chunk.errorAt = lineStart;
+                chunk.error = "invalid face index";
+                return;
+            }
+        }
+    }
+}
+
+/// turns the chunk relative indices into absolute ones and checks the range
+static bool
+resolveObjChunk(ObjChunk &chunk,
+                size_t vertexCount,
+                size_t texcoordCount,
+                size_t normalCount)
+{
+    for (uint32_t slot : chunk.relativeSlot)
+    {
+        // corners are stored as v, vt, vn triplets
+        size_t base = slot % 3 == 0   ? chunk.vertexBase
+                      : slot % 3 == 1 ? chunk.texcoordBase
+                                      : chunk.normalBase;
+        chunk.corners[slot] += static_cast<int>(base);
+        if (chunk.corners[slot] < 0)
+        {
+            chunk.error = "invalid relative face index";
+            return false;
+        }
+    }
+
+    for (size_t i = 0; i < chunk.corners.size(); i += 3)
+    {
+        if (chunk.corners[i] < 0 || size_t(chunk.corners[i]) >= vertexCount
+            || chunk.corners[i + 1] >= static_cast<int64_t>(texcoordCount)
+            || chunk.corners[i + 2] >= static_cast<int64_t>(normalCount))
+        {
+            chunk.error = "face index out of range";
+            return false;
+        }
+    }
+    return true;
+}
+
+static inline tinyobj::index_t
+objCornerIndex(const int *corner)
+{
+    tinyobj::index_t index;
+    index.vertex_index = corner[0];
+    index.texcoord_index = corner[1];
+    index.normal_index = corner[2];
+    return index;
+}
+
+static void
+triangulateObjChunk(const ObjChunk &chunk,
+                    const std::vector<float> &positions,
+                    tinyobj::index_t *out)
+{
+    const int *corner = chunk.corners.data();
+    for (uint32_t faceSize : chunk.faceSizes)
+    {
+        if (faceSize == 4)
+        {
+            // split along the shorter diagonal, same choice as tinyobj
+            float sqr02 = 0.0f, sqr13 = 0.0f;
+            for (int c = 0; c < 3; c++)
+            {
+                float e02 = positions[3 * corner[6] + c]
+                            - positions[3 * corner[0] + c];
+                float e13 = positions[3 * corner[9] + c]
+                            - positions[3 * corner[3] + c];
+                sqr02 += e02 * e02;
+                sqr13 += e13 * e13;
+            }
+            static const int split02[] = {0, 1, 2, 0, 2, 3};
+            static const int split13[] = {0, 1, 3, 1, 2, 3};
+            const int *order = sqr02 < sqr13 ? split02 : split13;
+            for (int i = 0; i < 6; i++)
+            {
+                *out++ = objCornerIndex(corner + 3 * order[i]);
+            }
+        } else
+        {
+            for (uint32_t i = 1; i + 1 < faceSize; i++)
+            {
+                *out++ = objCornerIndex(corner);
+                *out++ = objCornerIndex(corner + 3 * i);
+                *out++ = objCornerIndex(corner + 3 * (i + 1));
+            }
+        }
+        corner += 3 * faceSize;
+    }
+}
+
+template <typename T>
+static void
+copyObjRange(std::vector<T> &dst, size_t offset, const std::vector<T> &src)
+{
+    if (not src.empty())
+    {
+        memcpy(dst.data() + offset, src.data(), src.size() * sizeof(T));
+    }
+}
+
+/**
+ * Drop-in for tinyobj::LoadObj(attrib, shapes, nullptr, warn, err, filename)
+ * with triangulation, see the comment at the top of this file for the
+ * differences.
+ * */
+static bool
+loadObjParallel(tinyobj::attrib_t *attrib,
+                std::vector<tinyobj::shape_t> *shapes,
+                std::string *warn,
+                std::string *err,
+                const char *filename,
+                ThreadPool &pool = sharedThreadPool())
+{
+    attrib->vertices.clear();
+    attrib->vertex_weights.clear();
+    attrib->normals.clear();
+    attrib->texcoords.clear();
+    attrib->texcoord_ws.clear();
+    attrib->colors.clear();
+    attrib->skin_weights.clear();
+    shapes->clear();
+    if (warn)
+    {
+        warn->clear();
+    }
+
+    MappedFile file;
+    if (not file.open(filename))
+    {
+        if (err)
+        {
+            *err = "Cannot open file [" + std::string(filename) + "]\n";
+        }
+        return false;
+    }
+
+    // a few chunks per thread so an unlucky chunk with all the faces doesn't
+    // keep the others waiting, but not so small that the bookkeeping shows up
+    const size_t minChunkSize = 256 * 1024;
+    const size_t chunkCount = std::max<size_t>(
+        1, std::min(pool.threadCount() * 4, file.size() / minChunkSize));
+
+    std::vector<ObjChunk> chunks(chunkCount);
+    const char *fileBegin = file.data();
+    const char *fileEnd = file.data() + file.size();
+    const char *chunkBegin = fileBegin;
+    for (size_t i = 0; i < chunkCount; i++)
+    {
+        const char *chunkEnd = fileEnd;
+        if (i + 1 < chunkCount)
+        {
+            chunkEnd = std::max(chunkBegin,
+                                fileBegin + file.size() * (i + 1) / chunkCount);
+            chunkEnd = static_cast<const char *>(memchr(
+                chunkEnd, '\n', static_cast<size_t>(fileEnd - chunkEnd)));
+            chunkEnd = chunkEnd ? chunkEnd + 1 : fileEnd;
+        }
+        chunks[i].begin = chunkBegin;
+        chunks[i].end = chunkEnd;
+        chunkBegin = chunkEnd;
+    }
+
+    pool.parallelFor(chunkCount, [&](size_t i) { parseObjChunk(chunks[i]); });
+
+    // prefix sums, chunk i starts where chunk i-1 ended
+    size_t vertexCount = 0, normalCount = 0, texcoordCount = 0;
+    size_t triangleCount = 0;
+    for (auto &chunk : chunks)
+    {
+        if (not chunk.error.empty())
+        {
+            if (err)
+            {
+                size_t line = 1 + std::count(fileBegin, chunk.errorAt, '\n');
+                *err = chunk.error + " in " + filename + " at line "
+                       + std::to_string(line) + "\n";
+            }
+            return false;
+        }
+        chunk.vertexBase = vertexCount;
+        chunk.normalBase = normalCount;
+        chunk.texcoordBase = texcoordCount;
+        chunk.triangleBase = triangleCount;
+        vertexCount += chunk.positions.size() / 3;
+        normalCount += chunk.normals.size() / 3;
+        texcoordCount += chunk.texcoords.size() / 2;
+        triangleCount += chunk.triangleCount;
+    }
+
+    attrib->vertices.resize(vertexCount * 3);
+    attrib->vertex_weights.resize(vertexCount);
+    attrib->colors.resize(vertexCount * 3);
+    attrib->normals.resize(normalCount * 3);
+    attrib->texcoords.resize(texcoordCount * 2);
+
+    shapes->resize(1);
+    tinyobj::mesh_t &mesh = shapes->front().mesh;
+    mesh.indices.resize(triangleCount * 3);
+    mesh.num_face_vertices.assign(triangleCount, 3);
+
+    pool.parallelFor(chunkCount, [&](size_t i) {
+        ObjChunk &chunk = chunks[i];
+        copyObjRange(attrib->vertices, 3 * chunk.vertexBase, chunk.positions);
+        copyObjRange(attrib->vertex_weights, chunk.vertexBase, chunk.weights);
+        copyObjRange(attrib->colors, 3 * chunk.vertexBase, chunk.colors);
+        copyObjRange(attrib->normals, 3 * chunk.normalBase, chunk.normals);
+        copyObjRange(
+            attrib->texcoords, 2 * chunk.texcoordBase, chunk.texcoords);
+        resolveObjChunk(chunk, vertexCount, texcoordCount, normalCount);
+    });
+
+    for (const auto &chunk : chunks)
+    {
+        if (not chunk.error.empty())
+        {
+            if (err)
+            {
+                *err = chunk.error + " in " + filename + "\n";
+            }
+            return false;
+        }
+    }
+
+    // quads need the merged positions, so this can only start once every
+    // chunk has been copied
+    pool.parallelFor(chunkCount, [&](size_t i) {
+        triangulateObjChunk(chunks[i],
+                            attrib->vertices,
+                            mesh.indices.data() + 3 * chunks[i].triangleBase);
+    });
+
+    return true;
+}
@@ -0,0 +1,253 @@
+#pragma once
+
+#include "data_types.h"
+#include "mesh_lod.h"
+#include "meshlet.h"
+#include "staging_ring.h"
+#include "vertex_compression.h"
+
+#include <array>
+#include <cstdint>
+#include <vector>
+
+/**
+ * Coarse to fine layout of a mesh with its levels of detail. The vertices
+ * are sorted by the coarsest level that uses them and the index ranges of the
+ * levels go from the coarsest one to the full mesh. Level k then only needs
+ * the vertices [0, lods[k].vertexCount), so the coarsest level is a tiny mesh
+ * on its own and every finer level is one batch (MeshBatch) that appends its
+ * new vertices and its indices to what is already in the device buffers.
+ * */
+struct ProgressiveMesh {
+    std::vector<Vertex> vertices;   /// coarse to fine
+    std::vector<glm::vec3> normals; /// of the vertices, area weighted
+    std::vector<uint32_t> indices;  /// the levels, coarsest first
+    std::vector<Meshlet> meshlets;  /// MeshLod::firstMeshlet points in here
+    std::array<MeshLod, MAX_MESH_LODS> lods{};
+    uint32_t lodCount = 0;
+    glm::vec3 boundsCenter{0.0f}; /// model space bounding sphere
+    float boundsRadius = 0.0f;
+    QuantizationBounds quantizationBounds;            /// of all vertices
+    VkFormat texCoordFormat = VK_FORMAT_R16G16_UNORM; /// compact layout
+};
+
+/// the vertices of all levels, the full mesh is the last one to add some
+static inline uint32_t
+progressiveVertexCount(const ProgressiveMesh &mesh)
+{
+    return mesh.lods[0].vertexCount;
+}
+
+/// the indices of all levels, the full mesh comes last
+static inline uint32_t
+progressiveIndexCount(const ProgressiveMesh &mesh)
+{
+    return mesh.lods[0].firstIndex + mesh.lods[0].indexCount;
+}
+
+/**
+ * Renumbers the vertices in the order the levels use them, from the coarsest
+ * to the full mesh, and moves the index ranges of the levels into the same
+ * order. The triangle order inside a level stays as it is, within every
+ * batch the vertices are still in the order of their first use.
+ * */
+static void
+reorderCoarseToFine(ProgressiveMesh &mesh)
+{
+    const uint32_t none = ~0u;
+    std::vector<uint32_t> remap(mesh.vertices.size(), none);
+    std::vector<uint32_t> indices;
+    indices.reserve(mesh.indices.size());
+    uint32_t nextVertex = 0;
+
+    for (uint32_t level = mesh.lodCount; level-- > 0;)
+    {
+        MeshLod &lod = mesh.lods[level];
+        const uint32_t firstIndex = static_cast<uint32_t>(indices.size());
+        for (uint32_t i = 0; i < lod.indexCount; i++)
+        {
+            uint32_t &vertex = remap[mesh.indices[lod.firstIndex + i]];
+            if (vertex == none)
+            {
+                vertex = nextVertex++;
+            }
+            indices.push_back(vertex);
+        }
+        lod.firstIndex = firstIndex;
+        lod.vertexCount = nextVertex;
+    }
+
+    // vertices no triangle uses go with the full mesh
+    for (auto &vertex : remap)
+    {
+        if (vertex == none)
+        {
+            vertex = nextVertex++;
+        }
+    }
+    mesh.lods[0].vertexCount = nextVertex;
+
+    std::vector<Vertex> vertices(mesh.vertices.size());
+    for (size_t i = 0; i < remap.size(); i++)
+    {
+        vertices[remap[i]] = mesh.vertices[i];
+    }
+    mesh.vertices.swap(vertices);
+    mesh.indices.swap(indices);
+}
+
+/**
+ * Builds the levels of detail (unless generateLods is false) and the meshlets
+ * of a welded mesh with model local indices and brings everything into the
+ * coarse to fine layout
+ * */
+static ProgressiveMesh
+buildProgressiveMesh(const Vertex *meshVertices,
+                     size_t vertexCount,
+                     const uint32_t *meshIndices,
+                     size_t indexCount,
+                     bool generateLods)
+{
+    ProgressiveMesh mesh;
+    computeBoundingSphere(
+        meshVertices, vertexCount, mesh.boundsCenter, mesh.boundsRadius);
+
+    // the levels of detail follow the full mesh in the index buffer
+    std::vector<uint32_t> lodIndices(meshIndices, meshIndices + indexCount);
+    MeshDraw draw{};
+    draw.boundsRadius = mesh.boundsRadius;
+    if (generateLods)
+    {
+        buildMeshLods(meshVertices, vertexCount, lodIndices, draw);
+    } else
+    {
+        draw.lods[0] = {0, static_cast<uint32_t>(indexCount), 0.0f};
+        draw.lodCount = 1;
+    }
+    mesh.lods = draw.lods;
+    mesh.lodCount = draw.lodCount;
+
+    // every level is split into meshlets on its own, the meshlets only point
+    // into their level and stay valid when the levels are moved
+    for (uint32_t i = 0; i < mesh.lodCount; i++)
+    {
+        MeshLod &lod = mesh.lods[i];
+        std::vector<Meshlet> meshlets = buildMeshlets(meshVertices,
+                                                      vertexCount,
+                                                      lodIndices,
+                                                      lod.firstIndex,
+                                                      lod.indexCount);
+        lod.firstMeshlet = static_cast<uint32_t>(mesh.meshlets.size());
+        lod.meshletCount = static_cast<uint32_t>(meshlets.size());
+        mesh.meshlets.insert(
+            mesh.meshlets.end(), meshlets.begin(), meshlets.end());
+    }
+
+    mesh.vertices.assign(meshVertices, meshVertices + vertexCount);
+    mesh.indices.swap(lodIndices);
+    reorderCoarseToFine(mesh);
+
+    // what the compact vertex layout needs of the whole mesh, the batches
+    // are packed one level at a time
+    const MeshLod &full = mesh.lods[0];
+    mesh.normals = computeVertexNormals(mesh.vertices.data(),
+                                        mesh.vertices.size(),
+                                        mesh.indices.data() + full.firstIndex,
+                                        full.indexCount);
+    mesh.quantizationBounds
+        = computeQuantizationBounds(mesh.vertices.data(), mesh.vertices.size());
+    mesh.texCoordFormat
+        = compactTexCoordFormat(mesh.vertices.data(), mesh.vertices.size());
+    return mesh;
+}
+
+/**
+ * What the batch of one level needs: the vertices it adds with their normals
+ * and its indices. Decoded from the mesh cache by the worker that prepares the
+ * batch, see MeshCache::decodeLevel().
+ * */
+struct MeshLevel {
+    std::vector<Vertex> vertices;
+    std::vector<glm::vec3> normals; /// empty if they weren't asked for
+    std::vector<uint32_t> indices;
+};
+
+/**
+ * A level of a mesh on its way into the device buffers: the vertices it adds
+ * and its indices, already in the layout of the vertex and index buffer,
+ * in a region of the staging ring
+ * */
+struct MeshBatch {
+    uint32_t mesh; /// into TriangleApp::meshDraws
+    uint32_t level;
+    StagingRegion staging;
+    VkBufferCopy vertexCopy; /// size 0 if the level adds no vertices
+    VkBufferCopy indexCopy;
+};
+
+/// the vertices [first, end) the batch of a level adds
+static inline void
+levelVertexRange(const std::array<MeshLod, MAX_MESH_LODS> &lods,
+                 uint32_t lodCount,
+                 uint32_t level,
+                 uint32_t &first,
+                 uint32_t &end)
+{
+    first = level + 1 < lodCount ? lods[level + 1].vertexCount : 0;
+    end = lods[level].vertexCount;
+}
+
+static inline void
+levelVertexRange(const MeshDraw &mesh,
+                 uint32_t level,
+                 uint32_t &first,
+                 uint32_t &end)
+{
+    levelVertexRange(mesh.lods, mesh.lodCount, level, first, end);
+}
+
+/**
+ * Copies a level out of the arrays of mesh, false if they don't hold it (a
+ * mesh loaded from the cache only has its coarsest level decoded)
+ * */
+static bool
+copyMeshLevel(const ProgressiveMesh &mesh,
+              uint32_t level,
+              bool withNormals,
+              MeshLevel &out)
+{
+    uint32_t first, end;
+    levelVertexRange(mesh.lods, mesh.lodCount, level, first, end);
+    const MeshLod &lod = mesh.lods[level];
+    if (mesh.vertices.size() < end
+        || (withNormals && mesh.normals.size() < end)
+        || mesh.indices.size() < size_t(lod.firstIndex) + lod.indexCount)
+    {
+        return false;
+    }
+
+    out.vertices.assign(mesh.vertices.begin() + first,
+                        mesh.vertices.begin() + end);
+    out.normals.clear();
+    if (withNormals)
+    {
+        out.normals.assign(mesh.normals.begin() + first,
+                           mesh.normals.begin() + end);
+    }
+    out.indices.assign(mesh.indices.begin() + lod.firstIndex,
+                       mesh.indices.begin() + lod.firstIndex + lod.indexCount);
+    return true;
+}
+
+/// finest level that is in the device buffers together with all coarser
+/// ones, lodCount if not even the coarsest one is
+static inline uint32_t
+residentLevel(uint32_t streamedLevels, uint32_t lodCount)
+{
+    uint32_t level = lodCount;
+    while (level > 0 && (streamedLevels >> (level - 1)) & 1)
+    {
+        level--;
+    }
+    return level;
+}
@@ -2,3 +2,10 @@
 
 glslc shader.vert -o vert.spv
 glslc shader.frag -o frag.spv
+glslc meshlet_cull.comp -o cull.spv
+glslc tile.vert -o tile_vert.spv
+glslc tile.frag -o tile_frag.spv
+glslc shader_cube.vert -o cube_vert.spv
+glslc shader_cube.frag -o cube_frag.spv
+glslc --target-env=vulkan1.2 shader_bindless.vert -o bindless_vert.spv
+glslc --target-env=vulkan1.2 shader_bindless.frag -o bindless_frag.spv
@@ -0,0 +1,18 @@
+#version 450
+
+#extension GL_EXT_nonuniform_qualifier : require
+
+layout(location = 0) in vec3 fragColor;
+layout(location = 1) in vec2 fragTexCoord;
+layout(location = 2) flat in uint fragTexture;
+
+layout(location = 0) out vec4 outColor;
+
+// the textures of all scene models, only the slots in use are written. The
+// index is the same for a whole draw, but the draws of one indirect call
+// don't count as dynamically uniform.
+layout(binding = 2) uniform sampler2D textures[];
+
+void main() {
+    outColor = texture(textures[nonuniformEXT(fragTexture)], fragTexCoord);
+}
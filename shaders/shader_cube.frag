@@ -0,0 +1,14 @@
+#version 450
+
+layout(location = 0) in vec3 fragColor;
+layout(location = 1) in vec3 fragDirection;
+
+layout(location = 0) out vec4 outColor;
+
+// the cube view of the texture, sampled by direction (no need to normalize
+// the interpolated one)
+layout(binding = 1) uniform samplerCube texSampler;
+
+void main() {
+    outColor = texture(texSampler, fragDirection);
+}
@@ -0,0 +1,33 @@
+#version 450
+
+// shader.vert for the cubemap textures of texture_cubemap.h: instead of the
+// texture coordinates the fragment shader gets the direction they stand for
+// on the sphere, u is the longitude (0.5 at +Z) and v the latitude from the
+// north pole. The seam vertices with u past 1 come out at the same direction
+// as their twins, the pole vertices at the pole whatever their u.
+
+layout(location = 0) in vec3 inPosition;
+layout(location = 1) in vec3 inColor;
+layout(location = 2) in vec2 inTexCoord;
+
+layout(location = 0) out vec3 fragColor;
+layout(location = 1) out vec3 fragDirection;
+
+layout (set = 0, binding = 0) uniform UniformBufferObject {
+    mat4 model;
+    mat4 view;
+    mat4 proj;
+} ubo;
+
+const float PI = 3.14159265358979;
+
+void main() {
+    gl_Position = ubo.proj * ubo.view * ubo.model * vec4(inPosition, 1.0);
+    fragColor = inColor;
+
+    float longitude = 2.0 * PI * (inTexCoord.x - 0.5);
+    float latitude = PI * (0.5 - inTexCoord.y);
+    fragDirection = vec3(cos(latitude) * sin(longitude),
+                         sin(latitude),
+                         cos(latitude) * cos(longitude));
+}
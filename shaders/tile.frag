@@ -0,0 +1,12 @@
+#version 450
+
+layout(location = 0) in vec3 fragTexCoord;
+
+layout(location = 0) out vec4 outColor;
+
+// the tile cache, a layer per tile
+layout(binding = 0) uniform sampler2DArray tileSampler;
+
+void main() {
+    outColor = texture(tileSampler, fragTexCoord);
+}
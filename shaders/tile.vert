@@ -0,0 +1,35 @@
+#version 450
+
+// patches of the tile streamed globe, see tile_streaming.h. There is no
+// vertex buffer: the vertices of the patch grid are numbered row by row from
+// the north west corner and put on the unit sphere from the map coordinates
+// u, v of the patch, like tileMapPosition() does it.
+
+layout(push_constant) uniform TileConstants {
+    mat4 modelViewProjection; // of the unit sphere
+    vec4 bounds;              // u0, v0, u1, v1 of the patch in the map
+    vec4 tileRect;            // xy offset, zw scale of the patch in its tile
+    uint layer;               // of the tile in the cache
+} tile;
+
+// TILE_PATCH_QUADS + 1
+const uint GRID_VERTICES = 17u;
+const float PI = 3.14159265358979;
+
+layout(location = 0) out vec3 fragTexCoord; // z is the layer
+
+void main() {
+    uint index = uint(gl_VertexIndex);
+    vec2 grid = vec2(index % GRID_VERTICES, index / GRID_VERTICES)
+                / float(GRID_VERTICES - 1u);
+    vec2 uv = mix(tile.bounds.xy, tile.bounds.zw, grid);
+
+    float longitude = 2.0 * PI * (uv.x - 0.5);
+    float latitude = PI * (0.5 - uv.y);
+    vec3 position = vec3(cos(latitude) * sin(longitude),
+                         sin(latitude),
+                         cos(latitude) * cos(longitude));
+    gl_Position = tile.modelViewProjection * vec4(position, 1.0);
+    fragTexCoord = vec3(tile.tileRect.xy + grid * tile.tileRect.zw,
+                        float(tile.layer));
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include "mapped_file.h"
+
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <string>
+#include <system_error>
+
+/**
+ * Size, mtime and content hash of the source file of a cache (mesh_cache.h,
+ * texture_mips.h), a cache is only used while all three still match.
+ * */
+struct SourceFileStamp {
+    uint64_t size = 0;
+    int64_t mtime = 0;
+    uint64_t hash = 0;
+};
+
+/**
+ * 64bit hash over the raw file content, processes 8 bytes per step so hashing
+ * the source file stays far below the cost of parsing it
+ * */
+static uint64_t
+hashBytes(const char *data, size_t size)
+{
+    const uint64_t prime = 0x9E3779B97F4A7C15ULL;
+    uint64_t hash = 0xCBF29CE484222325ULL ^ (size * prime);
+
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8)
+    {
+        uint64_t word;
+        memcpy(&word, data + i, sizeof(word));
+        hash = (hash ^ word) * prime;
+        hash ^= hash >> 29;
+    }
+
+    uint64_t tail = 0;
+    // data may be null for an empty file
+    if (size > i)
+    {
+        memcpy(&tail, data + i, size - i);
+    }
+    hash = (hash ^ tail) * prime;
+    hash ^= hash >> 32;
+
+    return hash;
+}
+
+/// size and mtime only, cheap enough to check on every start
+static bool
+statSourceFile(const std::string &filename, SourceFileStamp &stamp)
+{
+    std::error_code ec;
+    auto size = std::filesystem::file_size(filename, ec);
+    if (ec)
+    {
+        return false;
+    }
+    auto mtime = std::filesystem::last_write_time(filename, ec);
+    if (ec)
+    {
+        return false;
+    }
+
+    stamp.size = static_cast<uint64_t>(size);
+    stamp.mtime = static_cast<int64_t>(mtime.time_since_epoch().count());
+    return true;
+}
+
+static bool
+hashSourceFile(const std::string &filename, SourceFileStamp &stamp)
+{
+    MappedFile source;
+    if (not source.open(filename))
+    {
+        return false;
+    }
+    stamp.hash = hashBytes(source.data(), source.size());
+    return true;
+}
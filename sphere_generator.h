@@ -0,0 +1,316 @@
+#pragma once
+
+#include "data_types.h"
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+/**
+ * Procedural UV mapped spheres for the models flagged in sphereMap, they
+ * replace parsing and welding the planet OBJ files. The generated meshes are
+ * equirectangular mapped like the OBJ ones and come out welded, see
+ * generateSphere().
+ * */
+
+/// cube-sphere faces are 2^subdivisions quads wide, an icosphere has
+/// 20 * 4^subdivisions triangles
+const uint32_t MAX_SPHERE_SUBDIVISIONS = 10;
+
+/// unit sphere positions and triangles facing outwards, before the uvs
+struct SphereMesh {
+    std::vector<glm::vec3> positions;
+    std::vector<uint32_t> triangles;
+};
+
+/// flips the triangle at first if it doesn't face away from the center
+static void
+addSphereTriangle(SphereMesh &mesh, uint32_t a, uint32_t b, uint32_t c)
+{
+    const glm::vec3 &pa = mesh.positions[a];
+    glm::vec3 normal
+        = glm::cross(mesh.positions[b] - pa, mesh.positions[c] - pa);
+    if (glm::dot(normal, pa + mesh.positions[b] + mesh.positions[c]) < 0.0f)
+    {
+        std::swap(b, c);
+    }
+    mesh.triangles.insert(mesh.triangles.end(), {a, b, c});
+}
+
+static uint32_t
+icosphereMidpoint(SphereMesh &mesh,
+                  std::unordered_map<uint64_t, uint32_t> &midpoints,
+                  uint32_t a,
+                  uint32_t b)
+{
+    // both triangles of an edge have to end up with the same vertex
+    uint64_t edge = (uint64_t(std::min(a, b)) << 32) | std::max(a, b);
+    auto inserted = midpoints.emplace(
+        edge, static_cast<uint32_t>(mesh.positions.size()));
+    if (inserted.second)
+    {
+        mesh.positions.push_back(
+            glm::normalize(mesh.positions[a] + mesh.positions[b]));
+    }
+    return inserted.first->second;
+}
+
+/**
+ * Icosahedron with a vertex at each pole, every subdivision splits the
+ * triangles into four and pushes the new vertices onto the sphere. The
+ * triangles are evenly sized, but no edge follows the uv seam.
+ * */
+static SphereMesh
+makeIcosphere(uint32_t subdivisions)
+{
+    const double pi = 3.14159265358979323846;
+    const double ringLatitude = std::atan(0.5);
+
+    SphereMesh mesh;
+    mesh.positions.push_back({0.0f, 1.0f, 0.0f});
+    for (int ring = 0; ring < 2; ring++)
+    {
+        double y = ring == 0 ? std::sin(ringLatitude) : -std::sin(ringLatitude);
+        for (int i = 0; i < 5; i++)
+        {
+            // the lower ring sits between the vertices of the upper one
+            double longitude = 2.0 * pi * (i + 0.5 * ring) / 5.0;
+            double radius = std::cos(ringLatitude);
+            mesh.positions.push_back(
+                {static_cast<float>(radius * std::sin(longitude)),
+                 static_cast<float>(y),
+                 static_cast<float>(radius * std::cos(longitude))});
+        }
+    }
+    mesh.positions.push_back({0.0f, -1.0f, 0.0f});
+
+    const uint32_t top = 0, bottom = 11;
+    for (uint32_t i = 0; i < 5; i++)
+    {
+        uint32_t upper = 1 + i, nextUpper = 1 + (i + 1) % 5;
+        uint32_t lower = 6 + i, nextLower = 6 + (i + 1) % 5;
+        addSphereTriangle(mesh, top, upper, nextUpper);
+        addSphereTriangle(mesh, upper, lower, nextUpper);
+        addSphereTriangle(mesh, nextUpper, lower, nextLower);
+        addSphereTriangle(mesh, bottom, nextLower, lower);
+    }
+
+    for (uint32_t level = 0; level < subdivisions; level++)
+    {
+        std::unordered_map<uint64_t, uint32_t> midpoints;
+        midpoints.reserve(mesh.triangles.size() / 2);
+        std::vector<uint32_t> triangles;
+        triangles.swap(mesh.triangles);
+        mesh.triangles.reserve(triangles.size() * 4);
+
+        for (size_t i = 0; i < triangles.size(); i += 3)
+        {
+            uint32_t a = triangles[i], b = triangles[i + 1],
+                     c = triangles[i + 2];
+            uint32_t ab = icosphereMidpoint(mesh, midpoints, a, b);
+            uint32_t bc = icosphereMidpoint(mesh, midpoints, b, c);
+            uint32_t ca = icosphereMidpoint(mesh, midpoints, c, a);
+            // the winding is kept, no need to check it again
+            mesh.triangles.insert(
+                mesh.triangles.end(),
+                {a, ab, ca, ab, b, bc, ca, bc, c, ab, bc, ca});
+        }
+    }
+    return mesh;
+}
+
+/**
+ * Cube with a 2^subdivisions grid on each face, pushed onto the sphere with
+ * the equal angle (tangent) warp so the quads stay roughly the same size.
+ * Points are addressed by their integer grid coordinates, so the faces share
+ * the vertices of their edges. The vertical grid lines map onto meridians,
+ * the line through the middle of the -z face is where the uv seam goes.
+ * */
+static SphereMesh
+makeCubeSphere(uint32_t subdivisions)
+{
+    const double pi = 3.14159265358979323846;
+    const uint32_t gridSize = 1u << subdivisions;
+
+    std::vector<float> warp(gridSize + 1);
+    for (uint32_t i = 0; i <= gridSize; i++)
+    {
+        warp[i] = static_cast<float>(
+            std::tan((2.0 * i / gridSize - 1.0) * pi / 4.0));
+    }
+    // exact values for the edges and the middle, the poles and the seam rely
+    // on them (without subdivisions there is no middle and the seam goes
+    // through the faces)
+    warp[0] = -1.0f;
+    warp[gridSize] = 1.0f;
+    if (gridSize > 1)
+    {
+        warp[gridSize / 2] = 0.0f;
+    }
+
+    SphereMesh mesh;
+    std::unordered_map<uint64_t, uint32_t> gridVertices;
+    gridVertices.reserve(size_t(6) * gridSize * gridSize + 2);
+
+    auto gridVertex = [&](uint32_t x, uint32_t y, uint32_t z) {
+        uint64_t key = (uint64_t(x) << 40) | (uint64_t(y) << 20) | z;
+        auto inserted = gridVertices.emplace(
+            key, static_cast<uint32_t>(mesh.positions.size()));
+        if (inserted.second)
+        {
+            mesh.positions.push_back(
+                glm::normalize(glm::vec3(warp[x], warp[y], warp[z])));
+        }
+        return inserted.first->second;
+    };
+
+    mesh.triangles.reserve(size_t(36) * gridSize * gridSize);
+    for (uint32_t axis = 0; axis < 3; axis++)
+    {
+        for (uint32_t side : {0u, gridSize})
+        {
+            for (uint32_t a = 0; a < gridSize; a++)
+            {
+                for (uint32_t b = 0; b < gridSize; b++)
+                {
+                    uint32_t corners[4];
+                    const uint32_t quad[4][2]
+                        = {{a, b}, {a + 1, b}, {a + 1, b + 1}, {a, b + 1}};
+                    for (int i = 0; i < 4; i++)
+                    {
+                        uint32_t coords[3];
+                        coords[axis] = side;
+                        coords[(axis + 1) % 3] = quad[i][0];
+                        coords[(axis + 2) % 3] = quad[i][1];
+                        corners[i]
+                            = gridVertex(coords[0], coords[1], coords[2]);
+                    }
+                    addSphereTriangle(mesh, corners[0], corners[1], corners[2]);
+                    addSphereTriangle(mesh, corners[0], corners[2], corners[3]);
+                }
+            }
+        }
+    }
+    return mesh;
+}
+
+/// equirectangular u of a point on the unit sphere, the -z axis is the seam
+static inline float
+sphereLongitudeU(const glm::vec3 &position)
+{
+    const float pi = 3.14159265358979f;
+    return std::atan2(position.x, position.z) / (2.0f * pi) + 0.5f;
+}
+
+/**
+ * Turns the sphere into mesh vertices and indices, welded and in the order
+ * the triangles were generated (see optimizeMesh() for the cache order).
+ *
+ * The texture coordinates follow the planet OBJ files: u goes around the y
+ * axis, v from pole to pole and both are flipped like objCornerVertex() does.
+ * Triangles across the seam get their own vertices with u continued past it,
+ * so they don't stretch over the whole texture, and every triangle touching a
+ * pole gets a pole vertex with the u of its other two corners. The sphere is
+ * turned around the y axis afterwards to put the texture where the OBJ has it.
+ * */
+static void
+generateSphere(const SphereParams &params,
+               std::vector<Vertex> &meshVertices,
+               std::vector<uint32_t> &meshIndices)
+{
+    if (params.subdivisions > MAX_SPHERE_SUBDIVISIONS)
+    {
+        throw std::runtime_error("sphere subdivisions "
+                                 + std::to_string(params.subdivisions)
+                                 + " exceed the maximum of "
+                                 + std::to_string(MAX_SPHERE_SUBDIVISIONS));
+    }
+
+    const float pi = 3.14159265358979f;
+    SphereMesh mesh = params.type == SphereType::Icosphere
+                          ? makeIcosphere(params.subdivisions)
+                          : makeCubeSphere(params.subdivisions);
+
+    // a vertex is a position and its u, v only depends on the position
+    std::unordered_map<uint64_t, uint32_t> uniqueVertices;
+    uniqueVertices.reserve(mesh.positions.size() * 5 / 4);
+    meshVertices.clear();
+    meshVertices.reserve(mesh.positions.size() * 5 / 4);
+    meshIndices.clear();
+    meshIndices.reserve(mesh.triangles.size());
+
+    const float rotation = 2.0f * pi * (0.5f - params.texCoordOffset);
+    const float cosRotation = std::cos(rotation);
+    const float sinRotation = std::sin(rotation);
+
+    for (size_t i = 0; i < mesh.triangles.size(); i += 3)
+    {
+        const uint32_t *triangle = &mesh.triangles[i];
+        const glm::vec3 centroid = mesh.positions[triangle[0]]
+                                   + mesh.positions[triangle[1]]
+                                   + mesh.positions[triangle[2]];
+        const float centroidU = sphereLongitudeU(centroid);
+
+        float u[3];
+        bool pole[3];
+        float uSum = 0.0f, uMax = 0.0f;
+        int uCount = 0;
+        for (int corner = 0; corner < 3; corner++)
+        {
+            const glm::vec3 &position = mesh.positions[triangle[corner]];
+            pole[corner] = position.x == 0.0f && position.z == 0.0f;
+            if (pole[corner])
+            {
+                continue;
+            }
+            u[corner] = sphereLongitudeU(position);
+            if (u[corner] - centroidU > 0.5f)
+            {
+                u[corner] -= 1.0f;
+            } else if (u[corner] - centroidU < -0.5f)
+            {
+                u[corner] += 1.0f;
+            }
+            uSum += u[corner];
+            uMax = uCount == 0 ? u[corner] : std::max(uMax, u[corner]);
+            uCount++;
+        }
+        // past the seam on the right side, keep the triangle in [-1, 1]
+        const float shift = uMax > 1.0f ? -1.0f : 0.0f;
+
+        for (int corner = 0; corner < 3; corner++)
+        {
+            float cornerU = pole[corner] ? uSum / uCount : u[corner];
+            cornerU += shift;
+
+            uint32_t uBits;
+            memcpy(&uBits, &cornerU, sizeof(uBits));
+            uint64_t key = (uint64_t(triangle[corner]) << 32) | uBits;
+            auto inserted = uniqueVertices.emplace(
+                key, static_cast<uint32_t>(meshVertices.size()));
+            if (inserted.second)
+            {
+                const glm::vec3 &position = mesh.positions[triangle[corner]];
+                float latitude
+                    = std::asin(std::min(std::max(position.y, -1.0f), 1.0f));
+
+                Vertex vertex{};
+                vertex.pos = params.radius
+                             * glm::vec3(position.x * cosRotation
+                                             + position.z * sinRotation,
+                                         position.y,
+                                         position.z * cosRotation
+                                             - position.x * sinRotation);
+                vertex.color = {1.0f, 1.0f, 1.0f};
+                vertex.texCoord = {cornerU, 0.5f - latitude / pi};
+                meshVertices.push_back(vertex);
+            }
+            meshIndices.push_back(inserted.first->second);
+        }
+    }
+}
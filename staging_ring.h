@@ -0,0 +1,260 @@
+#pragma once
+
+#include "device_memory.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+#include <vulkan/vulkan_core.h>
+
+/**
+ * One staging buffer for all uploads, created once and mapped for good.
+ * Producers reserve a region of it, write the data through region.mapped,
+ * record copies from region.buffer at region.offset and release the region
+ * with the fence of the submission that reads it. The regions are handed
+ * out one after the other around the ring, and reclaim() frees them in the
+ * same order once their fences have signaled, so the space comes back as
+ * the GPU retires the frames that copied from it.
+ *
+ * A region that doesn't fit in the free space (or in the whole ring) gets a
+ * buffer of its own instead, freed the same way, so reserve() never waits.
+ * A region that is reserved but not released yet (a worker still fills it)
+ * holds back the space of the ones after it.
+ *
+ * The regions are reserved on the pool workers as well, the ring is locked.
+ * The queues of more than one family copy from the ring when the uploads
+ * use a transfer queue, its buffers are shared between them then.
+ * */
+const VkDeviceSize STAGING_RING_SIZE = 64ull << 20;
+
+/// staging memory a producer writes an upload to
+struct StagingRegion {
+    VkBuffer buffer = VK_NULL_HANDLE; /// the ring, or a buffer of its own
+    VkDeviceSize offset = 0;          /// of the region in buffer
+    VkDeviceSize size = 0;
+    uint8_t *mapped = nullptr; /// the region, not the buffer
+    uint64_t id = 0;           /// of a ring region, 0 for a buffer of its own
+    MemoryAllocation memory;   /// of a buffer of its own
+};
+
+struct StagingStats {
+    VkDeviceSize ringBytes = 0;
+    VkDeviceSize usedBytes = 0;     /// in the ring, padding included
+    VkDeviceSize peakBytes = 0;     /// most used at once
+    VkDeviceSize overflowBytes = 0; /// in buffers of their own right now
+    uint64_t overflows = 0;         /// regions that didn't fit, ever
+};
+
+class StagingRing {
+  public:
+    /// properties of the memory, host visible and coherent, queueFamilies
+    /// that copy from it, callbacks of the Vulkan calls (may be null)
+    void init(VkDevice device,
+              DeviceMemoryAllocator &memory,
+              VkMemoryPropertyFlags properties,
+              const std::vector<uint32_t> &queueFamilies,
+              const VkAllocationCallbacks *callbacks,
+              VkDeviceSize size = STAGING_RING_SIZE)
+    {
+        m_device = device;
+        m_callbacks = callbacks;
+        m_allocator = &memory;
+        m_properties = properties;
+        m_queueFamilies = queueFamilies;
+        m_stats.ringBytes = size;
+        createBuffer(size, m_buffer, m_memory);
+    }
+
+    /// size bytes at an offset that is a multiple of alignment
+    StagingRegion reserve(VkDeviceSize size, VkDeviceSize alignment)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        StagingRegion region;
+        if (not takeRange(size, alignment, region))
+        {
+            reclaimRegions();
+            if (not takeRange(size, alignment, region))
+            {
+                createBuffer(size, region.buffer, region.memory);
+                region.size = size;
+                region.mapped = region.memory.mapped;
+                m_stats.overflowBytes += region.memory.size;
+                m_stats.overflows++;
+            }
+        }
+        return region;
+    }
+
+    /**
+     * The copies from region are submitted with fence, its space can be
+     * reused once the fence signals. VK_NULL_HANDLE if they are done already
+     * or were never made, an empty region is ignored.
+     * */
+    void release(const StagingRegion &region, VkFence fence)
+    {
+        if (region.buffer == VK_NULL_HANDLE)
+        {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (region.id == 0)
+        {
+            m_overflows.push_back({region.buffer, region.memory, fence});
+        } else
+        {
+            Region &ringRegion = m_regions[region.id - m_firstId];
+            ringRegion.fence = fence;
+            ringRegion.released = true;
+        }
+        reclaimRegions();
+    }
+
+    /// frees the regions whose copies have finished
+    void reclaim()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        reclaimRegions();
+    }
+
+    StagingStats stats() const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_stats;
+    }
+
+    /// every copy must have finished by now
+    void destroy()
+    {
+        for (const auto &overflow : m_overflows)
+        {
+            vkDestroyBuffer(m_device, overflow.buffer, m_callbacks);
+            m_allocator->free(overflow.memory);
+        }
+        m_overflows.clear();
+        vkDestroyBuffer(m_device, m_buffer, m_callbacks);
+        m_allocator->free(m_memory);
+    }
+
+  private:
+    /// a region of the ring, from the end of the one before it
+    struct Region {
+        VkDeviceSize bytes; /// with the padding and skipped end of the ring
+        VkFence fence;
+        bool released;
+    };
+
+    struct Overflow {
+        VkBuffer buffer;
+        MemoryAllocation memory;
+        VkFence fence;
+    };
+
+    void createBuffer(VkDeviceSize size,
+                      VkBuffer &buffer,
+                      MemoryAllocation &memory)
+    {
+        VkBufferCreateInfo bufferInfo{};
+        bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+        bufferInfo.size = size;
+        bufferInfo.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
+        bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+        if (m_queueFamilies.size() > 1)
+        {
+            bufferInfo.sharingMode = VK_SHARING_MODE_CONCURRENT;
+            bufferInfo.queueFamilyIndexCount
+                = static_cast<uint32_t>(m_queueFamilies.size());
+            bufferInfo.pQueueFamilyIndices = m_queueFamilies.data();
+        }
+        if (vkCreateBuffer(m_device, &bufferInfo, m_callbacks, &buffer)
+            != VK_SUCCESS)
+        {
+            throw std::runtime_error("failed to create staging buffer!");
+        }
+        VkMemoryRequirements memRequirements;
+        vkGetBufferMemoryRequirements(m_device, buffer, &memRequirements);
+        memory = m_allocator->allocate(memRequirements, m_properties, true);
+        vkBindBufferMemory(m_device, buffer, memory.memory, memory.offset);
+    }
+
+    /// the free space starts at m_head and wraps around to the oldest region
+    bool takeRange(VkDeviceSize size,
+                   VkDeviceSize alignment,
+                   StagingRegion &region)
+    {
+        const VkDeviceSize ringSize = m_stats.ringBytes;
+        if (m_regions.empty())
+        {
+            m_head = 0;
+        }
+        VkDeviceSize offset = alignMemoryOffset(m_head, alignment);
+        if (offset + size > ringSize)
+        {
+            offset = 0;
+        }
+        const VkDeviceSize end = offset + size;
+        const VkDeviceSize bytes
+            = offset >= m_head ? end - m_head : ringSize - m_head + end;
+        if (size > ringSize || m_stats.usedBytes + bytes > ringSize)
+        {
+            return false;
+        }
+
+        m_regions.push_back({bytes, VK_NULL_HANDLE, false});
+        m_head = end;
+        m_stats.usedBytes += bytes;
+        m_stats.peakBytes = std::max(m_stats.peakBytes, m_stats.usedBytes);
+        region.buffer = m_buffer;
+        region.offset = offset;
+        region.size = size;
+        region.mapped = m_memory.mapped + offset;
+        region.id = m_firstId + m_regions.size() - 1;
+        return true;
+    }
+
+    bool signaled(VkFence fence) const
+    {
+        return fence == VK_NULL_HANDLE
+               || vkGetFenceStatus(m_device, fence) == VK_SUCCESS;
+    }
+
+    void reclaimRegions()
+    {
+        while (not m_regions.empty() && m_regions.front().released
+               && signaled(m_regions.front().fence))
+        {
+            m_stats.usedBytes -= m_regions.front().bytes;
+            m_regions.pop_front();
+            m_firstId++;
+        }
+
+        auto retired = std::partition(m_overflows.begin(),
+                                      m_overflows.end(),
+                                      [this](const Overflow &overflow) {
+                                          return not signaled(overflow.fence);
+                                      });
+        for (auto it = retired; it != m_overflows.end(); it++)
+        {
+            vkDestroyBuffer(m_device, it->buffer, m_callbacks);
+            m_allocator->free(it->memory);
+            m_stats.overflowBytes -= it->memory.size;
+        }
+        m_overflows.erase(retired, m_overflows.end());
+    }
+
+    VkDevice m_device = VK_NULL_HANDLE;
+    const VkAllocationCallbacks *m_callbacks = nullptr;
+    DeviceMemoryAllocator *m_allocator = nullptr;
+    VkMemoryPropertyFlags m_properties = 0;
+    std::vector<uint32_t> m_queueFamilies;
+    VkBuffer m_buffer = VK_NULL_HANDLE;
+    MemoryAllocation m_memory;
+    VkDeviceSize m_head = 0;
+    std::deque<Region> m_regions; /// oldest first
+    uint64_t m_firstId = 1;       /// of m_regions.front()
+    std::vector<Overflow> m_overflows;
+    StagingStats m_stats;
+    mutable std::mutex m_mutex;
+};
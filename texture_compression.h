@@ -0,0 +1,664 @@
+#pragma once
+
+#include "texture_mips.h"
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <vulkan/vulkan_core.h>
+
+/**
+ * Block compression of the RGBA8 sRGB mip chains. Every 4x4 block of texels
+ * becomes 8 bytes (BC1, opaque color, 1/8 of RGBA8) or 16 bytes (BC7, with
+ * alpha, 1/4 of RGBA8) that the GPU samples directly.
+ *
+ * Both encoders fit one line through the colors of a block: the endpoints
+ * are the extremes of the colors projected onto their principal axis, every
+ * texel picks the nearest of the interpolated colors on that line and a least
+ * squares fit of the endpoints to those picks is kept if it lowers the error.
+ * BC7 only uses mode 6 (one subset, 7777.1 endpoints, 4 bit indices), that
+ * is the mode for smooth color and alpha, partitions would need a search
+ * over the 64 shapes per block.
+ * */
+
+/// bytes per 4x4 block, 0 for formats that are not block compressed
+static uint32_t
+blockBytes(VkFormat format)
+{
+    switch (format)
+    {
+    case VK_FORMAT_BC1_RGB_SRGB_BLOCK:
+    case VK_FORMAT_BC1_RGB_UNORM_BLOCK:
+        return 8;
+    case VK_FORMAT_BC7_SRGB_BLOCK:
+    case VK_FORMAT_BC7_UNORM_BLOCK:
+        return 16;
+    default:
+        return 0;
+    }
+}
+
+/// bytes per texel of the uncompressed formats, RGBA8 and the data formats
+/// of texture_data.h
+static uint32_t
+texelBytes(VkFormat format)
+{
+    switch (format)
+    {
+    case VK_FORMAT_R16_UNORM:
+    case VK_FORMAT_R16_SFLOAT:
+        return 2;
+    case VK_FORMAT_R16G16B16A16_UNORM:
+    case VK_FORMAT_R16G16B16A16_SFLOAT:
+    case VK_FORMAT_R32G32_SFLOAT:
+        return 8;
+    case VK_FORMAT_R32G32B32A32_SFLOAT:
+        return 16;
+    default:
+        return MIP_BYTES_PER_TEXEL; // RGBA8, R16G16, R32
+    }
+}
+
+/// the bufferOffset of a copy region has to be a multiple of this
+static uint32_t
+copyAlignment(VkFormat format)
+{
+    return std::max(4u,
+                    blockBytes(format) != 0 ? blockBytes(format)
+                                            : texelBytes(format));
+}
+
+/// bytes of a compressed level, partial blocks at the edges count as whole
+static size_t
+compressedLevelSize(uint32_t width,
+                    uint32_t height,
+                    uint32_t level,
+                    uint32_t bytesPerBlock)
+{
+    return size_t((mipExtent(width, level) + 3) / 4)
+           * ((mipExtent(height, level) + 3) / 4) * bytesPerBlock;
+}
+
+/// bytes of one face of a level in format, uncompressed or block compressed
+static size_t
+textureLevelSize(VkFormat format,
+                 uint32_t width,
+                 uint32_t height,
+                 uint32_t level)
+{
+    if (blockBytes(format) == 0)
+    {
+        return size_t(mipExtent(width, level)) * mipExtent(height, level)
+               * texelBytes(format);
+    }
+    return compressedLevelSize(width, height, level, blockBytes(format));
+}
+
+/**
+ * mip chain as blocks, levels packed largest first like MipChain. The
+ * cubemaps of texture_cubemap.h have the six faces of a level one after the
+ * other and may be RGBA8 as well, the data textures of texture_data.h are
+ * uncompressed.
+ * */
+struct CompressedTexture {
+    VkFormat format = VK_FORMAT_UNDEFINED;
+    uint32_t width = 0;
+    uint32_t height = 0;
+    uint32_t levelCount = 0;
+    uint32_t faceCount = 1;
+    std::vector<size_t> levelOffsets; /// into data
+    std::vector<uint8_t> data;
+};
+
+/// one region per face and level of texture, the faces are the array layers
+static std::vector<VkBufferImageCopy>
+textureCopyRegions(const CompressedTexture &texture)
+{
+    std::vector<VkBufferImageCopy> regions;
+    for (uint32_t level = 0; level < texture.levelCount; level++)
+    {
+        const size_t faceSize = textureLevelSize(
+            texture.format, texture.width, texture.height, level);
+        for (uint32_t face = 0; face < texture.faceCount; face++)
+        {
+            VkBufferImageCopy region{};
+            region.bufferOffset = texture.levelOffsets[level] + face * faceSize;
+            region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+            region.imageSubresource.mipLevel = level;
+            region.imageSubresource.baseArrayLayer = face;
+            region.imageSubresource.layerCount = 1;
+            region.imageOffset = {0, 0, 0};
+            region.imageExtent = {mipExtent(texture.width, level),
+                                  mipExtent(texture.height, level),
+                                  1};
+            regions.push_back(region);
+        }
+    }
+    return regions;
+}
+
+/// BC1 can't store alpha, every texel of level 0 has to be opaque
+static bool
+texelsOpaque(const uint8_t *texels, uint32_t width, uint32_t height)
+{
+    for (size_t i = 0; i < size_t(width) * height; i++)
+    {
+        if (texels[4 * i + 3] != 255)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+/// 4x4 texels from (x, y), the edge texels repeat into partial blocks
+static void
+fetchBlock(const uint8_t *texels,
+           uint32_t width,
+           uint32_t height,
+           uint32_t x,
+           uint32_t y,
+           float block[16][4])
+{
+    for (uint32_t i = 0; i < 16; i++)
+    {
+        const uint32_t tx = std::min(x + i % 4, width - 1);
+        const uint32_t ty = std::min(y + i / 4, height - 1);
+        const uint8_t *texel = texels + (size_t(ty) * width + tx) * 4;
+        for (uint32_t c = 0; c < 4; c++)
+        {
+            block[i][c] = texel[c];
+        }
+    }
+}
+
+/**
+ * Mean and principal axis of the first channels of the block (power
+ * iteration on the covariance matrix). The axis is zero for a block of one
+ * color.
+ * */
+template <uint32_t channels>
+static void
+principalAxis(const float block[16][4], float mean[4], float axis[4])
+{
+    for (uint32_t c = 0; c < channels; c++)
+    {
+        mean[c] = 0.0f;
+        for (uint32_t i = 0; i < 16; i++)
+        {
+            mean[c] += block[i][c];
+        }
+        mean[c] /= 16.0f;
+    }
+
+    float covariance[channels][channels] = {};
+    for (uint32_t i = 0; i < 16; i++)
+    {
+        for (uint32_t a = 0; a < channels; a++)
+        {
+            for (uint32_t b = 0; b < channels; b++)
+            {
+                covariance[a][b]
+                    += (block[i][a] - mean[a]) * (block[i][b] - mean[b]);
+            }
+        }
+    }
+
+    for (uint32_t c = 0; c < channels; c++)
+    {
+        axis[c] = 1.0f;
+    }
+    for (uint32_t iteration = 0; iteration < 8; iteration++)
+    {
+        float next[channels] = {};
+        float length = 0.0f;
+        for (uint32_t a = 0; a < channels; a++)
+        {
+            for (uint32_t b = 0; b < channels; b++)
+            {
+                next[a] += covariance[a][b] * axis[b];
+            }
+            length = std::max(length, std::fabs(next[a]));
+        }
+        for (uint32_t c = 0; c < channels; c++)
+        {
+            axis[c] = length > 0.0f ? next[c] / length : 0.0f;
+        }
+    }
+}
+
+/// endpoints at the extremes of the block along the axis
+template <uint32_t channels>
+static void
+axisEndpoints(const float block[16][4],
+              const float mean[4],
+              const float axis[4],
+              float endpoint0[4],
+              float endpoint1[4])
+{
+    float minT = 0.0f, maxT = 0.0f, axisLength = 0.0f;
+    for (uint32_t c = 0; c < channels; c++)
+    {
+        axisLength += axis[c] * axis[c];
+    }
+    for (uint32_t i = 0; axisLength > 0.0f && i < 16; i++)
+    {
+        float t = 0.0f;
+        for (uint32_t c = 0; c < channels; c++)
+        {
+            t += (block[i][c] - mean[c]) * axis[c];
+        }
+        minT = std::min(minT, t / axisLength);
+        maxT = std::max(maxT, t / axisLength);
+    }
+    for (uint32_t c = 0; c < channels; c++)
+    {
+        endpoint0[c] = std::clamp(mean[c] + axis[c] * maxT, 0.0f, 255.0f);
+        endpoint1[c] = std::clamp(mean[c] + axis[c] * minT, 0.0f, 255.0f);
+    }
+}
+
+/**
+ * Least squares endpoints for fixed picks: texel i is weights[i] of the way
+ * from endpoint0 to endpoint1. Returns false if the picks don't span a line
+ * (all texels on one weight).
+ * */
+template <uint32_t channels>
+static bool
+fitEndpoints(const float block[16][4],
+             const float weights[16],
+             float endpoint0[4],
+             float endpoint1[4])
+{
+    float aa = 0.0f, ab = 0.0f, bb = 0.0f;
+    float ax[4] = {}, bx[4] = {};
+    for (uint32_t i = 0; i < 16; i++)
+    {
+        const float b = weights[i];
+        const float a = 1.0f - b;
+        aa += a * a;
+        ab += a * b;
+        bb += b * b;
+        for (uint32_t c = 0; c < channels; c++)
+        {
+            ax[c] += a * block[i][c];
+            bx[c] += b * block[i][c];
+        }
+    }
+    const float determinant = aa * bb - ab * ab;
+    if (std::fabs(determinant) < 1e-6f)
+    {
+        return false;
+    }
+    for (uint32_t c = 0; c < channels; c++)
+    {
+        endpoint0[c] = std::clamp(
+            (bb * ax[c] - ab * bx[c]) / determinant, 0.0f, 255.0f);
+        endpoint1[c] = std::clamp(
+            (aa * bx[c] - ab * ax[c]) / determinant, 0.0f, 255.0f);
+    }
+    return true;
+}
+
+static inline uint16_t
+packRgb565(const float color[4])
+{
+    uint32_t r = static_cast<uint32_t>(color[0] * 31.0f / 255.0f + 0.5f);
+    uint32_t g = static_cast<uint32_t>(color[1] * 63.0f / 255.0f + 0.5f);
+    uint32_t b = static_cast<uint32_t>(color[2] * 31.0f / 255.0f + 0.5f);
+    return static_cast<uint16_t>((r << 11) | (g << 5) | b);
+}
+
+static inline void
+unpackRgb565(uint16_t packed, int color[3])
+{
+    const int r = (packed >> 11) & 31;
+    const int g = (packed >> 5) & 63;
+    const int b = packed & 31;
+    color[0] = (r << 3) | (r >> 2);
+    color[1] = (g << 2) | (g >> 4);
+    color[2] = (b << 3) | (b >> 2);
+}
+
+/// squared error of the best index of every texel for BC1 endpoints in the
+/// four color mode, the indices go to indices
+static float
+bc1Indices(const float block[16][4],
+           uint16_t color0,
+           uint16_t color1,
+           uint32_t &indices)
+{
+    int palette[4][3];
+    unpackRgb565(color0, palette[0]);
+    unpackRgb565(color1, palette[1]);
+    for (uint32_t c = 0; c < 3; c++)
+    {
+        palette[2][c] = (2 * palette[0][c] + palette[1][c]) / 3;
+        palette[3][c] = (palette[0][c] + 2 * palette[1][c]) / 3;
+    }
+
+    float error = 0.0f;
+    indices = 0;
+    for (uint32_t i = 0; i < 16; i++)
+    {
+        uint32_t best = 0;
+        float bestError = 0.0f;
+        for (uint32_t p = 0; p < 4; p++)
+        {
+            float e = 0.0f;
+            for (uint32_t c = 0; c < 3; c++)
+            {
+                float d = block[i][c] - palette[p][c];
+                e += d * d;
+            }
+            if (p == 0 || e < bestError)
+            {
+                best = p;
+                bestError = e;
+            }
+        }
+        indices |= best << (2 * i);
+        error += bestError;
+    }
+    return error;
+}
+
+static void
+encodeBc1Block(const float block[16][4], uint8_t out[8])
+{
+    float mean[4], axis[4], endpoint0[4], endpoint1[4];
+    principalAxis<3>(block, mean, axis);
+    axisEndpoints<3>(block, mean, axis, endpoint0, endpoint1);
+
+    uint16_t color0 = packRgb565(endpoint0);
+    uint16_t color1 = packRgb565(endpoint1);
+    uint32_t indices;
+    float error = bc1Indices(block, color0, color1, indices);
+
+    // palette position of the indices: 0, 1, 1/3, 2/3 towards color1
+    const float positions[4] = {0.0f, 1.0f, 1.0f / 3.0f, 2.0f / 3.0f};
+    float weights[16];
+    for (uint32_t i = 0; i < 16; i++)
+    {
+        weights[i] = positions[(indices >> (2 * i)) & 3];
+    }
+    if (fitEndpoints<3>(block, weights, endpoint0, endpoint1))
+    {
+        uint16_t fitted0 = packRgb565(endpoint0);
+        uint16_t fitted1 = packRgb565(endpoint1);
+        uint32_t fittedIndices;
+        float fittedError
+            = bc1Indices(block, fitted0, fitted1, fittedIndices);
+        if (fittedError < error)
+        {
+            color0 = fitted0;
+            color1 = fitted1;
+            indices = fittedIndices;
+        }
+    }
+
+    // color0 > color1 selects the four color mode, swapping the endpoints
+    // swaps indices 0 <-> 1 and 2 <-> 3. Equal endpoints would select the
+    // three color mode with black at index 3, there index 0 does it all.
+    if (color0 < color1)
+    {
+        std::swap(color0, color1);
+        indices ^= 0x55555555;
+    } else if (color0 == color1)
+    {
+        indices = 0;
+    }
+
+    out[0] = static_cast<uint8_t>(color0);
+    out[1] = static_cast<uint8_t>(color0 >> 8);
+    out[2] = static_cast<uint8_t>(color1);
+    out[3] = static_cast<uint8_t>(color1 >> 8);
+    memcpy(out + 4, &indices, sizeof(indices));
+}
+
+/// interpolation weights of 4 bit BC7 indices, out of 64
+const int BC7_WEIGHTS4[16]
+    = {0, 4, 9, 13, 17, 21, 26, 30, 34, 38, 43, 47, 51, 55, 60, 64};
+
+/**
+ * Mode 6 endpoint: 7 bits per channel and one p bit shared by the channels
+ * as the lowest bit, the p bit with the smaller error wins
+ * */
+static void
+quantizeBc7Endpoint(const float endpoint[4], int quantized[4], int &pbit)
+{
+    float bestError = 0.0f;
+    for (int p = 0; p < 2; p++)
+    {
+        int candidate[4];
+        float error = 0.0f;
+        for (uint32_t c = 0; c < 4; c++)
+        {
+            candidate[c] = std::clamp(
+                static_cast<int>(std::lround((endpoint[c] - p) / 2.0f)),
+                0,
+                127);
+            float d = endpoint[c] - float(candidate[c] * 2 + p);
+            error += d * d;
+        }
+        if (p == 0 || error < bestError)
+        {
+            bestError = error;
+            pbit = p;
+            std::copy(candidate, candidate + 4, quantized);
+        }
+    }
+}
+
+/// squared error of the best 4 bit index of every texel
+static float
+bc7Indices(const float block[16][4],
+           const int quantized0[4],
+           int pbit0,
+           const int quantized1[4],
+           int pbit1,
+           uint8_t indices[16])
+{
+    int palette[16][4];
+    for (uint32_t c = 0; c < 4; c++)
+    {
+        const int e0 = quantized0[c] * 2 + pbit0;
+        const int e1 = quantized1[c] * 2 + pbit1;
+        for (uint32_t w = 0; w < 16; w++)
+        {
+            palette[w][c]
+                = ((64 - BC7_WEIGHTS4[w]) * e0 + BC7_WEIGHTS4[w] * e1 + 32)
+                  >> 6;
+        }
+    }
+
+    float error = 0.0f;
+    for (uint32_t i = 0; i < 16; i++)
+    {
+        uint32_t best = 0;
+        float bestError = 0.0f;
+        for (uint32_t w = 0; w < 16; w++)
+        {
+            float e = 0.0f;
+            for (uint32_t c = 0; c < 4; c++)
+            {
+                float d = block[i][c] - palette[w][c];
+                e += d * d;
+            }
+            if (w == 0 || e < bestError)
+            {
+                best = w;
+                bestError = e;
+            }
+        }
+        indices[i] = static_cast<uint8_t>(best);
+        error += bestError;
+    }
+    return error;
+}
+
+/// little endian bit stream of a 128 bit BC7 block
+class BlockBitWriter {
+  public:
+    explicit BlockBitWriter(uint8_t *out) : m_out(out)
+    {
+        memset(m_out, 0, 16);
+    }
+
+    void write(uint32_t value, uint32_t bits)
+    {
+        for (uint32_t i = 0; i < bits; i++, m_bit++)
+        {
+            m_out[m_bit / 8] |= static_cast<uint8_t>(((value >> i) & 1)
+                                                     << (m_bit % 8));
+        }
+    }
+
+  private:
+    uint8_t *m_out;
+    uint32_t m_bit = 0;
+};
+
+static void
+encodeBc7Block(const float block[16][4], uint8_t out[16])
+{
+    float mean[4], axis[4], endpoint0[4], endpoint1[4];
+    principalAxis<4>(block, mean, axis);
+    axisEndpoints<4>(block, mean, axis, endpoint0, endpoint1);
+
+    int quantized0[4], quantized1[4], pbit0, pbit1;
+    quantizeBc7Endpoint(endpoint0, quantized0, pbit0);
+    quantizeBc7Endpoint(endpoint1, quantized1, pbit1);
+    uint8_t indices[16];
+    float error = bc7Indices(
+        block, quantized0, pbit0, quantized1, pbit1, indices);
+
+    float weights[16];
+    for (uint32_t i = 0; i < 16; i++)
+    {
+        weights[i] = BC7_WEIGHTS4[indices[i]] / 64.0f;
+    }
+    if (fitEndpoints<4>(block, weights, endpoint0, endpoint1))
+    {
+        int fitted0[4], fitted1[4], fittedPbit0, fittedPbit1;
+        quantizeBc7Endpoint(endpoint0, fitted0, fittedPbit0);
+        quantizeBc7Endpoint(endpoint1, fitted1, fittedPbit1);
+        uint8_t fittedIndices[16];
+        float fittedError = bc7Indices(
+            block, fitted0, fittedPbit0, fitted1, fittedPbit1, fittedIndices);
+        if (fittedError < error)
+        {
+            std::copy(fitted0, fitted0 + 4, quantized0);
+            std::copy(fitted1, fitted1 + 4, quantized1);
+            pbit0 = fittedPbit0;
+            pbit1 = fittedPbit1;
+            std::copy(fittedIndices, fittedIndices + 16, indices);
+        }
+    }
+
+    // the highest bit of the first index is implied zero
+    if (indices[0] & 8)
+    {
+        std::swap(quantized0, quantized1);
+        std::swap(pbit0, pbit1);
+        for (auto &index : indices)
+        {
+            index = static_cast<uint8_t>(15 - index);
+        }
+    }
+
+    BlockBitWriter writer(out);
+    writer.write(1u << 6, 7); // mode 6
+    for (uint32_t c = 0; c < 4; c++)
+    {
+        writer.write(static_cast<uint32_t>(quantized0[c]), 7);
+        writer.write(static_cast<uint32_t>(quantized1[c]), 7);
+    }
+    writer.write(static_cast<uint32_t>(pbit0), 1);
+    writer.write(static_cast<uint32_t>(pbit1), 1);
+    writer.write(indices[0], 3);
+    for (uint32_t i = 1; i < 16; i++)
+    {
+        writer.write(indices[i], 4);
+    }
+}
+
+/**
+ * Compresses all levels of a packed RGBA8 chain (see MipChain) to format,
+ * VK_FORMAT_BC1_RGB_SRGB_BLOCK or VK_FORMAT_BC7_SRGB_BLOCK. The block rows of
+ * all levels are spread over the thread pool.
+ * */
+static CompressedTexture
+compressMipChain(const uint8_t *texels,
+                 uint32_t width,
+                 uint32_t height,
+                 uint32_t levelCount,
+                 VkFormat format,
+                 ThreadPool &pool = sharedThreadPool())
+{
+    CompressedTexture texture;
+    texture.format = format;
+    texture.width = width;
+    texture.height = height;
+    texture.levelCount = levelCount;
+    const uint32_t bytesPerBlock = blockBytes(format);
+
+    struct BlockRows {
+        uint32_t level;
+        uint32_t firstRow;
+        uint32_t endRow;
+    };
+    const uint32_t rowsPerTask = 4;
+    std::vector<BlockRows> tasks;
+    size_t size = 0;
+    for (uint32_t level = 0; level < levelCount; level++)
+    {
+        texture.levelOffsets.push_back(size);
+        size += compressedLevelSize(width, height, level, bytesPerBlock);
+        const uint32_t rows = (mipExtent(height, level) + 3) / 4;
+        for (uint32_t row = 0; row < rows; row += rowsPerTask)
+        {
+            tasks.push_back({level, row, std::min(row + rowsPerTask, rows)});
+        }
+    }
+    texture.data.resize(size);
+
+    pool.parallelFor(tasks.size(), [&](size_t task) {
+        const BlockRows &rows = tasks[task];
+        const uint32_t levelWidth = mipExtent(width, rows.level);
+        const uint32_t levelHeight = mipExtent(height, rows.level);
+        const uint32_t blocksPerRow = (levelWidth + 3) / 4;
+        const uint8_t *levelTexels
+            = texels + mipLevelOffset(width, height, rows.level);
+        uint8_t *levelBlocks
+            = texture.data.data() + texture.levelOffsets[rows.level];
+
+        float block[16][4];
+        for (uint32_t row = rows.firstRow; row < rows.endRow; row++)
+        {
+            for (uint32_t column = 0; column < blocksPerRow; column++)
+            {
+                fetchBlock(levelTexels,
+                           levelWidth,
+                           levelHeight,
+                           4 * column,
+                           4 * row,
+                           block);
+                uint8_t *out = levelBlocks
+                               + (size_t(row) * blocksPerRow + column)
+                                     * bytesPerBlock;
+                if (bytesPerBlock == 8)
+                {
+                    encodeBc1Block(block, out);
+                } else
+                {
+                    encodeBc7Block(block, out);
+                }
+            }
+        }
+    });
+    return texture;
+}
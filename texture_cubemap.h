@@ -0,0 +1,269 @@
+#pragma once
+
+#include "texture_compression.h"
+#include "texture_mips.h"
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <vulkan/vulkan_core.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/**
+ * Equirectangular body textures resampled into cubemaps. An equirectangular
+ * image spends as many texels on the rows at the poles as on the equator, a
+ * cube face of a quarter of the image width keeps the texel density of the
+ * equator (4 faces around it) and drops the rest: the six faces of a
+ * 5400x2700 image are 1350x1350 each, 25% fewer texels at the same
+ * resolution where it counts. Sampled by direction the texels are no longer
+ * squeezed together towards the poles either, which is where the
+ * equirectangular image thrashed the texture cache.
+ *
+ * The faces are in the layer order Vulkan samples them in (+X, -X, +Y, -Y,
+ * +Z, -Z) and cover the directions of generateSphere(): u = 0.5 at +Z, u
+ * growing towards +X, v = 0 at +Y. The cubemap is cached as KTX2 next to the
+ * image (textures/x.jpg -> textures/x.jpg.cube.ktx2, see ktx2_file.h).
+ * */
+const uint32_t CUBE_FACE_COUNT = 6;
+
+/// edge of the faces, a quarter of the equator
+static uint32_t
+cubemapFaceSize(uint32_t equirectWidth)
+{
+    return std::max(1u, equirectWidth / 4);
+}
+
+/// direction through (s, t) in [-1, 1] on face, the major axis is 1
+static void
+cubeFaceDirection(uint32_t face, float s, float t, float direction[3])
+{
+    const float faces[CUBE_FACE_COUNT][3] = {{1.0f, -t, -s},
+                                             {-1.0f, -t, s},
+                                             {s, 1.0f, t},
+                                             {s, -1.0f, -t},
+                                             {s, -t, 1.0f},
+                                             {-s, -t, -1.0f}};
+    memcpy(direction, faces[face], sizeof(faces[face]));
+}
+
+/// texture coordinates of direction in the equirectangular image, the inverse
+/// of the mapping in shaders/shader_cube.vert
+static void
+equirectCoordinates(const float direction[3], float &u, float &v)
+{
+    const float pi = 3.14159265358979f;
+    const float longitude = std::atan2(direction[0], direction[2]);
+    const float latitude = std::atan2(
+        direction[1],
+        std::sqrt(direction[0] * direction[0] + direction[2] * direction[2]));
+    u = longitude / (2.0f * pi) + 0.5f;
+    v = 0.5f - latitude / pi;
+}
+
+/**
+ * Bilinear sample of the RGBA8 image at (u, v), u wraps around the seam and
+ * v is clamped at the poles. The weights are 8 bit fixed point and the rows
+ * are blended after the columns, the SIMD path blends all four channels of
+ * both rows at once with the same rounding.
+ * */
+static inline void
+sampleEquirect(const uint8_t *texels,
+               uint32_t width,
+               uint32_t height,
+               float u,
+               float v,
+               uint8_t out[4],
+               bool simd = true)
+{
+    const float x = u * width - 0.5f;
+    const float y = v * height - 0.5f;
+    const float left = std::floor(x);
+    const float top = std::floor(y);
+    const int32_t column = static_cast<int32_t>(left);
+    const int32_t row = static_cast<int32_t>(top);
+    const int32_t columns = static_cast<int32_t>(width);
+    const uint32_t x0 = static_cast<uint32_t>((column % columns + columns)
+                                              % columns);
+    const uint32_t x1 = x0 + 1 == width ? 0 : x0 + 1;
+    const uint32_t y0 = static_cast<uint32_t>(
+        std::clamp<int32_t>(row, 0, int32_t(height) - 1));
+    const uint32_t y1 = static_cast<uint32_t>(
+        std::clamp<int32_t>(row + 1, 0, int32_t(height) - 1));
+    const uint32_t weightX = static_cast<uint32_t>((x - left) * 256.0f + 0.5f);
+    const uint32_t weightY = static_cast<uint32_t>((y - top) * 256.0f + 0.5f);
+
+    const uint8_t *row0 = texels + size_t(y0) * width * 4;
+    const uint8_t *row1 = texels + size_t(y1) * width * 4;
+
+#ifdef __SSE2__
+    if (simd)
+    {
+        // 16 bit lanes: the left texels of both rows in the low half, the
+        // right ones in the high half. A weighted pair is at most 255 * 256,
+        // the sum of the halves can't overflow.
+        int32_t t00, t01, t10, t11;
+        memcpy(&t00, row0 + 4 * x0, 4);
+        memcpy(&t01, row0 + 4 * x1, 4);
+        memcpy(&t10, row1 + 4 * x0, 4);
+        memcpy(&t11, row1 + 4 * x1, 4);
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i rounding = _mm_set1_epi16(128);
+        const __m128i leftTexels
+            = _mm_unpacklo_epi8(_mm_set_epi32(0, 0, t10, t00), zero);
+        const __m128i rightTexels
+            = _mm_unpacklo_epi8(_mm_set_epi32(0, 0, t11, t01), zero);
+        const __m128i columnWeight
+            = _mm_set1_epi16(static_cast<int16_t>(weightX));
+        __m128i rows = _mm_add_epi16(
+            _mm_mullo_epi16(leftTexels,
+                            _mm_sub_epi16(_mm_set1_epi16(256), columnWeight)),
+            _mm_mullo_epi16(rightTexels, columnWeight));
+        rows = _mm_srli_epi16(_mm_add_epi16(rows, rounding), 8);
+
+        // row 0 in the low half, row 1 in the high half
+        const __m128i rowWeights = _mm_set_epi16(weightY,
+                                                 weightY,
+                                                 weightY,
+                                                 weightY,
+                                                 256 - weightY,
+                                                 256 - weightY,
+                                                 256 - weightY,
+                                                 256 - weightY);
+        __m128i blend = _mm_mullo_epi16(rows, rowWeights);
+        blend = _mm_add_epi16(blend, _mm_srli_si128(blend, 8));
+        blend = _mm_srli_epi16(_mm_add_epi16(blend, rounding), 8);
+        const int32_t texel = _mm_cvtsi128_si32(_mm_packus_epi16(blend, zero));
+        memcpy(out, &texel, 4);
+        return;
+    }
+#endif
+
+    for (uint32_t c = 0; c < 4; c++)
+    {
+        const uint32_t blend0
+            = (row0[4 * x0 + c] * (256 - weightX) + row0[4 * x1 + c] * weightX
+               + 128)
+              >> 8;
+        const uint32_t blend1
+            = (row1[4 * x0 + c] * (256 - weightX) + row1[4 * x1 + c] * weightX
+               + 128)
+              >> 8;
+        out[c] = static_cast<uint8_t>(
+            (blend0 * (256 - weightY) + blend1 * weightY + 128) >> 8);
+    }
+}
+
+/**
+ * Resamples the RGBA8 sRGB equirectangular texels into the six faces of a
+ * cubemap and builds the mip chain of each face. The rows of the faces are
+ * spread over the thread pool, simd = false forces the scalar filter.
+ * */
+static std::vector<MipChain>
+resampleCubemap(const uint8_t *texels,
+                uint32_t width,
+                uint32_t height,
+                ThreadPool &pool = sharedThreadPool(),
+                bool simd = true)
+{
+    const uint32_t size = cubemapFaceSize(width);
+    std::vector<MipChain> faces(CUBE_FACE_COUNT);
+    for (MipChain &face : faces)
+    {
+        face.width = size;
+        face.height = size;
+        face.levelCount = mipLevelCount(size, size);
+        face.texels.resize(mipLevelOffset(size, size, face.levelCount));
+    }
+
+    const uint32_t rowsPerBand = 16;
+    const uint32_t bands = (size + rowsPerBand - 1) / rowsPerBand;
+    pool.parallelFor(CUBE_FACE_COUNT * bands, [&](size_t task) {
+        const uint32_t face = static_cast<uint32_t>(task / bands);
+        const uint32_t firstRow
+            = static_cast<uint32_t>(task % bands) * rowsPerBand;
+        const uint32_t endRow = std::min(firstRow + rowsPerBand, size);
+        uint8_t *faceTexels = faces[face].texels.data();
+        for (uint32_t y = firstRow; y < endRow; y++)
+        {
+            const float t = 2.0f * (y + 0.5f) / size - 1.0f;
+            for (uint32_t x = 0; x < size; x++)
+            {
+                const float s = 2.0f * (x + 0.5f) / size - 1.0f;
+                float direction[3], u, v;
+                cubeFaceDirection(face, s, t, direction);
+                equirectCoordinates(direction, u, v);
+                sampleEquirect(texels,
+                               width,
+                               height,
+                               u,
+                               v,
+                               faceTexels + (size_t(y) * size + x) * 4,
+                               simd);
+            }
+        }
+    });
+
+    for (MipChain &face : faces)
+    {
+        buildMipLevels(face.texels.data(), size, size, pool, simd);
+    }
+    return faces;
+}
+
+/**
+ * Packs the face chains in format (RGBA8 or compressed with
+ * compressMipChain()) in the order of a KTX2 cubemap and of the copy
+ * regions, the six faces of a level after each other
+ * */
+static CompressedTexture
+packCubemap(const std::vector<MipChain> &faces,
+            VkFormat format,
+            ThreadPool &pool = sharedThreadPool())
+{
+    CompressedTexture texture;
+    texture.format = format;
+    texture.width = faces.front().width;
+    texture.height = faces.front().height;
+    texture.levelCount = faces.front().levelCount;
+    texture.faceCount = CUBE_FACE_COUNT;
+
+    std::vector<CompressedTexture> compressed;
+    if (blockBytes(format) != 0)
+    {
+        for (const MipChain &face : faces)
+        {
+            compressed.push_back(compressMipChain(face.texels.data(),
+                                                  face.width,
+                                                  face.height,
+                                                  face.levelCount,
+                                                  format,
+                                                  pool));
+        }
+    }
+
+    for (uint32_t level = 0; level < texture.levelCount; level++)
+    {
+        texture.levelOffsets.push_back(texture.data.size());
+        const size_t faceSize
+            = textureLevelSize(format, texture.width, texture.height, level);
+        for (uint32_t face = 0; face < CUBE_FACE_COUNT; face++)
+        {
+            const uint8_t *levelData
+                = compressed.empty()
+                      ? faces[face].texels.data()
+                            + mipLevelOffset(
+                                texture.width, texture.height, level)
+                      : compressed[face].data.data()
+                            + compressed[face].levelOffsets[level];
+            texture.data.insert(
+                texture.data.end(), levelData, levelData + faceSize);
+        }
+    }
+    return texture;
+}
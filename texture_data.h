@@ -0,0 +1,529 @@
+#pragma once
+
+#include "texture_compression.h"
+#include "texture_mips.h"
+#include "thread_pool.h"
+#include "vertex_compression.h"
+
+#include "includeLibs/stb_image.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <vulkan/vulkan_core.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/**
+ * Data textures: images with more than 8 bits per channel (16 bit PNGs like
+ * elevation models, Radiance HDR float grids) are imported at their own
+ * precision and channel count instead of as RGBA8 sRGB. 16 bit integers go
+ * to R16_UNORM, floats to R16_SFLOAT (HDR files only have an 8 bit mantissa,
+ * half floats keep it), with R32_SFLOAT where the device can't filter those.
+ * Gray RGB images collapse to one channel, a one channel heightmap takes a
+ * quarter of the memory of RGBA16 and an eighth of forced RGBA32F.
+ *
+ * The decoded texels are widened to float once, the mips are averaged in
+ * float and every level is narrowed to the upload format as it is built.
+ * The conversions have SSE2 paths that round exactly like the scalar ones.
+ * Data textures aren't block compressed or cached, they are linear values:
+ * the view swizzles a single channel to gray (see dataTextureComponents()).
+ * */
+
+/// texels of a data image widened to float, 16 bit integers to [0, 1]
+struct DataImage {
+    uint32_t width = 0;
+    uint32_t height = 0;
+    uint32_t channels = 0; /// 1, 2 or 4, RGB gets an opaque alpha
+    bool unorm16 = false;  /// decoded from 16 bit integers, else float
+    std::vector<float> texels;
+};
+
+/// whether the image at path has more than 8 bits per channel
+static bool
+isDataImage(const std::string &path)
+{
+    return stbi_is_16_bit(path.c_str()) || stbi_is_hdr(path.c_str());
+}
+
+/// count floats to half floats
+static void
+floatsToHalves(const float *in, size_t count, uint16_t *out, bool simd = true)
+{
+    size_t i = 0;
+
+#ifdef __SSE2__
+    // floatToHalf() of vertex_compression.h for four floats at once: the
+    // infinite, subnormal and normal results are computed and picked per lane
+    auto halves = [](__m128 value) {
+        const __m128i bits0 = _mm_castps_si128(value);
+        const __m128i sign
+            = _mm_and_si128(bits0, _mm_set1_epi32(int32_t(0x80000000u)));
+        const __m128i bits = _mm_xor_si128(bits0, sign);
+
+        const __m128i infinite
+            = _mm_cmpgt_epi32(bits, _mm_set1_epi32(0x477FFFFF));
+        const __m128i infiniteHalf = _mm_or_si128(
+            _mm_set1_epi32(0x7C00),
+            _mm_and_si128(_mm_cmpgt_epi32(bits, _mm_set1_epi32(0x7F800000)),
+                          _mm_set1_epi32(0x0200)));
+        const __m128i subnormal
+            = _mm_cmplt_epi32(bits, _mm_set1_epi32(0x38800000));
+        const __m128i subnormalHalf = _mm_sub_epi32(
+            _mm_castps_si128(
+                _mm_add_ps(_mm_castsi128_ps(bits), _mm_set1_ps(0.5f))),
+            _mm_set1_epi32(0x3F000000));
+        const __m128i odd = _mm_and_si128(_mm_srli_epi32(bits, 13),
+                                          _mm_set1_epi32(1));
+        const __m128i normalHalf = _mm_srli_epi32(
+            _mm_add_epi32(_mm_add_epi32(bits,
+                                        _mm_set1_epi32(int32_t(0xC8000FFFu))),
+                          odd),
+            13);
+
+        __m128i half = _mm_or_si128(
+            _mm_and_si128(infinite, infiniteHalf),
+            _mm_or_si128(_mm_and_si128(subnormal, subnormalHalf),
+                         _mm_andnot_si128(_mm_or_si128(infinite, subnormal),
+                                          normalHalf)));
+        half = _mm_or_si128(half, _mm_srli_epi32(sign, 16));
+        // sign extended, so the saturating pack keeps the 16 bits as they are
+        return _mm_srai_epi32(_mm_slli_epi32(half, 16), 16);
+    };
+    for (; simd && i + 8 <= count; i += 8)
+    {
+        const __m128i low = halves(_mm_loadu_ps(in + i));
+        const __m128i high = halves(_mm_loadu_ps(in + i + 4));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i),
+                         _mm_packs_epi32(low, high));
+    }
+#endif
+
+    for (; i < count; i++)
+    {
+        out[i] = floatToHalf(in[i]);
+    }
+}
+
+/// count floats clamped to [0, 1] (NaN to 0) to 16 bit unsigned normalized
+static void
+floatsToUnorm16(const float *in, size_t count, uint16_t *out, bool simd = true)
+{
+    size_t i = 0;
+
+#ifdef __SSE2__
+    // there is no unsigned 32 -> 16 bit pack before SSE4.1, the values are
+    // moved into the signed range and back
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128 scale = _mm_set1_ps(65535.0f);
+    const __m128 rounding = _mm_set1_ps(0.5f);
+    const __m128i bias = _mm_set1_epi32(32768);
+    auto unorms = [&](__m128 value) {
+        value = _mm_min_ps(_mm_max_ps(value, zero), one);
+        const __m128i unorm = _mm_cvttps_epi32(
+            _mm_add_ps(_mm_mul_ps(value, scale), rounding));
+        return _mm_sub_epi32(unorm, bias);
+    };
+    for (; simd && i + 8 <= count; i += 8)
+    {
+        const __m128i low = unorms(_mm_loadu_ps(in + i));
+        const __m128i high = unorms(_mm_loadu_ps(in + i + 4));
+        const __m128i packed = _mm_packs_epi32(low, high);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i),
+                         _mm_xor_si128(packed, _mm_set1_epi16(-32768)));
+    }
+#endif
+
+    for (; i < count; i++)
+    {
+        // the operand order of maxps / minps, a NaN becomes 0
+        float value = in[i] > 0.0f ? in[i] : 0.0f;
+        value = value < 1.0f ? value : 1.0f;
+        out[i] = static_cast<uint16_t>(value * 65535.0f + 0.5f);
+    }
+}
+
+/// count 16 bit unsigned normalized values to floats in [0, 1]
+static void
+unorm16ToFloats(const uint16_t *in, size_t count, float *out, bool simd = true)
+{
+    const float scale = 1.0f / 65535.0f;
+    size_t i = 0;
+
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    const __m128 scales = _mm_set1_ps(scale);
+    for (; simd && i + 8 <= count; i += 8)
+    {
+        const __m128i unorms
+            = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in + i));
+        _mm_storeu_ps(out + i,
+                      _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(unorms,
+                                                                    zero)),
+                                 scales));
+        _mm_storeu_ps(out + i + 4,
+                      _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(unorms,
+                                                                    zero)),
+                                 scales));
+    }
+#endif
+
+    for (; i < count; i++)
+    {
+        out[i] = in[i] * scale;
+    }
+}
+
+static void
+widenTexels(const uint16_t *in, size_t count, float *out, bool simd)
+{
+    unorm16ToFloats(in, count, out, simd);
+}
+
+static void
+widenTexels(const float *in, size_t count, float *out, bool)
+{
+    memcpy(out, in, count * sizeof(float));
+}
+
+/**
+ * Widens the decoded texels (channels of T per texel, opaque is the alpha
+ * of an opaque texel) into image. Gray RGB(A) keeps one channel (two with
+ * alpha), RGB gets an alpha channel as three channel formats can rarely be
+ * sampled. The rows are spread over the pool.
+ * */
+template <typename T>
+static void
+importTexels(const T *pixels,
+             uint32_t width,
+             uint32_t height,
+             uint32_t channels,
+             T opaque,
+             DataImage &image,
+             ThreadPool &pool,
+             bool simd)
+{
+    const size_t texelCount = size_t(width) * height;
+    bool gray = channels >= 3;
+    bool opaqueAlpha = true;
+    for (size_t i = 0; gray && i < texelCount; i++)
+    {
+        const T *texel = pixels + i * channels;
+        gray = texel[0] == texel[1] && texel[0] == texel[2];
+        opaqueAlpha = opaqueAlpha && (channels == 3 || texel[3] == opaque);
+    }
+
+    // source channel of each channel of the image, -1 for an opaque alpha
+    std::vector<int> sources;
+    if (gray)
+    {
+        sources = opaqueAlpha ? std::vector<int>{0} : std::vector<int>{0, 3};
+    } else if (channels == 3)
+    {
+        sources = {0, 1, 2, -1};
+    } else
+    {
+        for (uint32_t c = 0; c < channels; c++)
+        {
+            sources.push_back(static_cast<int>(c));
+        }
+    }
+    image.width = width;
+    image.height = height;
+    image.channels = static_cast<uint32_t>(sources.size());
+    image.texels.resize(texelCount * image.channels);
+
+    const uint32_t rowsPerBand = 32;
+    const uint32_t bands = (height + rowsPerBand - 1) / rowsPerBand;
+    pool.parallelFor(bands, [&](size_t band) {
+        const uint32_t firstRow = static_cast<uint32_t>(band) * rowsPerBand;
+        const uint32_t endRow = std::min(firstRow + rowsPerBand, height);
+        std::vector<T> row(size_t(width) * image.channels);
+        for (uint32_t y = firstRow; y < endRow; y++)
+        {
+            const T *source = pixels + size_t(y) * width * channels;
+            float *out = image.texels.data() + size_t(y) * row.size();
+            if (image.channels == channels)
+            {
+                widenTexels(source, row.size(), out, simd);
+                continue;
+            }
+            for (uint32_t x = 0; x < width; x++)
+            {
+                for (uint32_t c = 0; c < image.channels; c++)
+                {
+                    row[x * image.channels + c]
+                        = sources[c] < 0 ? opaque
+                                         : source[x * channels + sources[c]];
+                }
+            }
+            widenTexels(row.data(), row.size(), out, simd);
+        }
+    });
+}
+
+/**
+ * Decodes the 16 bit or float image at path at its own channel count, see
+ * importTexels(). False if it can't be decoded.
+ * */
+static bool
+decodeDataImage(const std::string &path,
+                DataImage &image,
+                ThreadPool &pool = sharedThreadPool(),
+                bool simd = true)
+{
+    int width, height, channels;
+    if (stbi_is_16_bit(path.c_str()))
+    {
+        stbi_us *pixels
+            = stbi_load_16(path.c_str(), &width, &height, &channels, 0);
+        if (not pixels)
+        {
+            return false;
+        }
+        importTexels<uint16_t>(pixels,
+                               width,
+                               height,
+                               channels,
+                               65535,
+                               image,
+                               pool,
+                               simd);
+        stbi_image_free(pixels);
+        image.unorm16 = true;
+        return true;
+    }
+
+    float *pixels = stbi_loadf(path.c_str(), &width, &height, &channels, 0);
+    if (not pixels)
+    {
+        return false;
+    }
+    importTexels<float>(
+        pixels, width, height, channels, 1.0f, image, pool, simd);
+    stbi_image_free(pixels);
+    image.unorm16 = false;
+    return true;
+}
+
+/// the formats image can be uploaded in, best first
+static std::vector<VkFormat>
+dataTextureFormats(const DataImage &image)
+{
+    const VkFormat unorm16[] = {VK_FORMAT_R16_UNORM,
+                                VK_FORMAT_R16G16_UNORM,
+                                VK_FORMAT_UNDEFINED,
+                                VK_FORMAT_R16G16B16A16_UNORM};
+    const VkFormat half[] = {VK_FORMAT_R16_SFLOAT,
+                             VK_FORMAT_R16G16_SFLOAT,
+                             VK_FORMAT_UNDEFINED,
+                             VK_FORMAT_R16G16B16A16_SFLOAT};
+    const VkFormat single[] = {VK_FORMAT_R32_SFLOAT,
+                               VK_FORMAT_R32G32_SFLOAT,
+                               VK_FORMAT_UNDEFINED,
+                               VK_FORMAT_R32G32B32A32_SFLOAT};
+    const uint32_t c = image.channels - 1;
+    // half floats would round 16 bit integers
+    if (image.unorm16)
+    {
+        return {unorm16[c], single[c], half[c]};
+    }
+    return {half[c], single[c]};
+}
+
+/// channels of the data formats
+static uint32_t
+dataFormatChannels(VkFormat format)
+{
+    switch (format)
+    {
+    case VK_FORMAT_R16_UNORM:
+    case VK_FORMAT_R16_SFLOAT:
+    case VK_FORMAT_R32_SFLOAT:
+        return 1;
+    case VK_FORMAT_R16G16_UNORM:
+    case VK_FORMAT_R16G16_SFLOAT:
+    case VK_FORMAT_R32G32_SFLOAT:
+        return 2;
+    default:
+        return 4;
+    }
+}
+
+/// one channel is shown as gray, two as gray and alpha
+static VkComponentMapping
+dataTextureComponents(VkFormat format)
+{
+    VkComponentMapping components{};
+    if (dataFormatChannels(format) < 4)
+    {
+        components.r = VK_COMPONENT_SWIZZLE_R;
+        components.g = VK_COMPONENT_SWIZZLE_R;
+        components.b = VK_COMPONENT_SWIZZLE_R;
+        components.a = dataFormatChannels(format) == 1
+                           ? VK_COMPONENT_SWIZZLE_ONE
+                           : VK_COMPONENT_SWIZZLE_G;
+    }
+    return components;
+}
+
+/// narrows count floats to the components of format
+static void
+storeDataTexels(VkFormat format,
+                const float *texels,
+                size_t count,
+                uint8_t *out,
+                bool simd)
+{
+    switch (format)
+    {
+    case VK_FORMAT_R16_UNORM:
+    case VK_FORMAT_R16G16_UNORM:
+    case VK_FORMAT_R16G16B16A16_UNORM:
+        floatsToUnorm16(texels, count, reinterpret_cast<uint16_t *>(out), simd);
+        break;
+    case VK_FORMAT_R16_SFLOAT:
+    case VK_FORMAT_R16G16_SFLOAT:
+    case VK_FORMAT_R16G16B16A16_SFLOAT:
+        floatsToHalves(texels, count, reinterpret_cast<uint16_t *>(out), simd);
+        break;
+    default:
+        memcpy(out, texels, count * sizeof(float));
+    }
+}
+
+/**
+ * The full mip chain of image in format (one of dataTextureFormats()),
+ * levels packed largest first at the offsets a copy region can start at.
+ * Every level is a 2x2 box of the float level above, odd last rows and
+ * columns are dropped like in buildMipLevels().
+ * */
+static CompressedTexture
+buildDataTexture(const DataImage &image,
+                 VkFormat format,
+                 ThreadPool &pool = sharedThreadPool(),
+                 bool simd = true)
+{
+    CompressedTexture texture;
+    texture.format = format;
+    texture.width = image.width;
+    texture.height = image.height;
+    texture.levelCount = mipLevelCount(image.width, image.height);
+    size_t size = 0;
+    for (uint32_t level = 0; level < texture.levelCount; level++)
+    {
+        const size_t alignment = copyAlignment(format);
+        size = (size + alignment - 1) / alignment * alignment;
+        texture.levelOffsets.push_back(size);
+        size += textureLevelSize(format, image.width, image.height, level);
+    }
+    texture.data.resize(size);
+
+    const uint32_t channels = image.channels;
+    const uint32_t rowsPerBand = 32;
+    std::vector<float> source, target;
+    const float *sourceTexels = image.texels.data();
+    for (uint32_t level = 0; level < texture.levelCount; level++)
+    {
+        // the level above, level 0 is image itself
+        const uint32_t sourceLevel = level > 0 ? level - 1 : 0;
+        const uint32_t sourceWidth = mipExtent(image.width, sourceLevel);
+        const uint32_t sourceHeight = mipExtent(image.height, sourceLevel);
+        const uint32_t levelWidth = mipExtent(image.width, level);
+        const uint32_t levelHeight = mipExtent(image.height, level);
+        const size_t rowSize = size_t(levelWidth) * channels;
+        uint8_t *levelData = texture.data.data() + texture.levelOffsets[level];
+        const uint32_t texelSize = texelBytes(format) / channels;
+        if (level > 0)
+        {
+            target.resize(rowSize * levelHeight);
+        }
+
+        const uint32_t bands = (levelHeight + rowsPerBand - 1) / rowsPerBand;
+        pool.parallelFor(bands, [&](size_t band) {
+            const uint32_t firstRow = static_cast<uint32_t>(band) * rowsPerBand;
+            const uint32_t endRow
+                = std::min(firstRow + rowsPerBand, levelHeight);
+            for (uint32_t y = firstRow; y < endRow; y++)
+            {
+                const float *row = sourceTexels + y * rowSize;
+                if (level > 0)
+                {
+                    const size_t sourceRowSize = size_t(sourceWidth) * channels;
+                    const float *row0 = sourceTexels + 2 * y * sourceRowSize;
+                    const float *row1
+                        = sourceTexels
+                          + std::min(2 * y + 1, sourceHeight - 1)
+                                * sourceRowSize;
+                    float *out = target.data() + y * rowSize;
+                    for (uint32_t x = 0; x < levelWidth; x++)
+                    {
+                        const uint32_t x0 = 2 * x * channels;
+                        const uint32_t x1
+                            = std::min(2 * x + 1, sourceWidth - 1) * channels;
+                        for (uint32_t c = 0; c < channels; c++)
+                        {
+                            out[x * channels + c] = (row0[x0 + c] + row0[x1 + c]
+                                                     + row1[x0 + c]
+                                                     + row1[x1 + c])
+                                                    * 0.25f;
+                        }
+                    }
+                    row = out;
+                }
+                storeDataTexels(format,
+                                row,
+                                rowSize,
+                                levelData + y * rowSize * texelSize,
+                                simd);
+            }
+        });
+
+        if (level > 0)
+        {
+            source.swap(target);
+            sourceTexels = source.data();
+        }
+    }
+    return texture;
+}
+
+/// short name of the texture formats for the log
+static const char *
+textureFormatName(VkFormat format)
+{
+    switch (format)
+    {
+    case VK_FORMAT_R8G8B8A8_SRGB:
+        return "RGBA8";
+    case VK_FORMAT_BC1_RGB_SRGB_BLOCK:
+        return "BC1";
+    case VK_FORMAT_BC7_SRGB_BLOCK:
+        return "BC7";
+    case VK_FORMAT_R16_UNORM:
+        return "R16";
+    case VK_FORMAT_R16G16_UNORM:
+        return "RG16";
+    case VK_FORMAT_R16G16B16A16_UNORM:
+        return "RGBA16";
+    case VK_FORMAT_R16_SFLOAT:
+        return "R16F";
+    case VK_FORMAT_R16G16_SFLOAT:
+        return "RG16F";
+    case VK_FORMAT_R16G16B16A16_SFLOAT:
+        return "RGBA16F";
+    case VK_FORMAT_R32_SFLOAT:
+        return "R32F";
+    case VK_FORMAT_R32G32_SFLOAT:
+        return "RG32F";
+    case VK_FORMAT_R32G32B32A32_SFLOAT:
+        return "RGBA32F";
+    default:
+        return "?";
+    }
+}
@@ -0,0 +1,535 @@
+#pragma once
+
+#include "mapped_file.h"
+#include "thread_pool.h"
+
+#include "includeLibs/stb_image.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <numeric>
+#include <string>
+#include <vector>
+
+/**
+ * Image decoding on the thread pool. TextureDecoder decodes every texture it
+ * is given at once and hands them back in the order they finish, so the
+ * caller can build the mips of the first one while the others are still
+ * decoding.
+ *
+ * A single large baseline JPEG with restart markers is also split into
+ * strips of whole restart intervals that are decoded in parallel: the
+ * entropy coded data of an interval doesn't depend on the ones before it, so
+ * the header with a patched height plus the data of some intervals is a
+ * standalone JPEG of those rows.
+ *
+ * The texels can be decoded straight into the caller's memory, e.g. a
+ * mapped staging buffer, see stbiMalloc().
+ * */
+
+/// strips smaller than this aren't worth a task of their own
+const uint32_t JPEG_MIN_STRIP_PIXELS = 256 * 1024;
+
+struct DecodedImage {
+    DecodedImage() = default;
+    DecodedImage(DecodedImage &&) = default;
+    DecodedImage &operator=(DecodedImage &&) = default;
+    DecodedImage(const DecodedImage &) = delete;
+    DecodedImage &operator=(const DecodedImage &) = delete;
+
+    std::string path;
+    uint32_t width = 0;
+    uint32_t height = 0;
+    uint8_t *texels = nullptr; /// RGBA8, nullptr if decoding failed
+    std::vector<uint8_t> storage; /// of texels if no destination was given
+    uint32_t strips = 0; /// decoded in parallel, see decodeJpegStrips()
+    float milliseconds = 0.0f;
+};
+
+/**
+ * stb_image allocates the images it returns itself. While decodeImage() has
+ * set stbiOutput on this thread, the allocation of the RGBA8 result (the
+ * size of the texels, the JPEG decoder asks for one byte more) is served
+ * from the caller's memory instead, so stb_image's color conversion,
+ * including the RGB to RGBA expansion, writes straight into it. main.cpp
+ * routes STBI_MALLOC, STBI_REALLOC and STBI_FREE here where it compiles
+ * stb_image, without that decodeImage() copies the result over.
+ * */
+struct StbiOutput {
+    uint8_t *memory = nullptr;
+    size_t size = 0;     /// of the texels
+    size_t capacity = 0; /// of memory
+    bool taken = false;
+};
+
+static thread_local StbiOutput stbiOutput;
+
+static void *
+stbiMalloc(size_t size)
+{
+    StbiOutput &output = stbiOutput;
+    if (output.memory && not output.taken && size >= output.size
+        && size <= std::min(output.size + 1, output.capacity))
+    {
+        output.taken = true;
+        return output.memory;
+    }
+    return malloc(size);
+}
+
+static void *
+stbiRealloc(void *pointer, size_t size)
+{
+    // only buffers of unknown size grow, if one of those got the output
+    // memory it moves to the heap
+    if (pointer != nullptr && pointer == stbiOutput.memory)
+    {
+        void *moved = malloc(size);
+        if (moved)
+        {
+            memcpy(moved, pointer, std::min(size, stbiOutput.size));
+        }
+        return moved;
+    }
+    return realloc(pointer, size);
+}
+
+static void
+stbiFree(void *pointer)
+{
+    if (pointer != stbiOutput.memory)
+    {
+        free(pointer);
+    }
+}
+
+/// where the restart intervals of a baseline JPEG start and end
+struct JpegRestartLayout {
+    size_t scanStart = 0;    /// first byte after the SOS segment
+    size_t heightOffset = 0; /// of the big endian height in the SOF segment
+    uint32_t width = 0;
+    uint32_t height = 0;
+    uint32_t mcuHeight = 0; /// in pixels
+    uint32_t mcusPerRow = 0;
+    uint32_t mcuRows = 0;
+    uint32_t restartInterval = 0; /// in MCUs
+    bool verticalSubsampling = false;
+    /// start of the data of every interval and one past the EOI marker, an
+    /// interval ends 2 bytes (its RSTn or the EOI) before the next one starts
+    std::vector<size_t> intervals;
+};
+
+static inline uint32_t
+readBigEndian16(const uint8_t *bytes)
+{
+    return uint32_t(bytes[0]) << 8 | bytes[1];
+}
+
+/**
+ * Finds the restart intervals of a JPEG with one huffman coded sequential
+ * scan over all components. Returns false for anything else (progressive,
+ * arithmetic coded, several scans, no restart markers, ...).
+ * */
+static bool
+jpegRestartLayout(const uint8_t *data, size_t size, JpegRestartLayout &layout)
+{
+    layout = JpegRestartLayout();
+    if (size < 4 || data[0] != 0xFF || data[1] != 0xD8)
+    {
+        return false;
+    }
+
+    uint32_t components = 0, hMax = 1, vMax = 1, vMin = 4;
+    size_t pos = 2;
+    while (layout.scanStart == 0)
+    {
+        if (pos + 4 > size || data[pos] != 0xFF)
+        {
+            return false;
+        }
+        uint8_t marker = data[pos + 1];
+        if (marker == 0xFF)
+        {
+            pos++; // fill byte
+            continue;
+        }
+        size_t length = readBigEndian16(data + pos + 2);
+        const uint8_t *segment = data + pos + 4;
+        if (length < 2 || pos + 2 + length > size)
+        {
+            return false;
+        }
+
+        if (marker == 0xC0 || marker == 0xC1)
+        {
+            components = length >= 8 ? segment[5] : 0;
+            if (components == 0 || length < 8 + 3 * components)
+            {
+                return false;
+            }
+            layout.heightOffset = pos + 5;
+            layout.height = readBigEndian16(segment + 1);
+            layout.width = readBigEndian16(segment + 3);
+            for (uint32_t c = 0; c < components; c++)
+            {
+                uint8_t sampling = segment[6 + 3 * c + 1];
+                hMax = std::max<uint32_t>(hMax, sampling >> 4);
+                vMax = std::max<uint32_t>(vMax, sampling & 15);
+                vMin = std::min<uint32_t>(vMin, sampling & 15);
+            }
+        } else if (marker >= 0xC2 && marker <= 0xCF && marker != 0xC4
+                   && marker != 0xC8 && marker != 0xCC)
+        {
+            return false; // progressive, lossless or arithmetic coded
+        } else if (marker == 0xDD && length >= 4)
+        {
+            layout.restartInterval = readBigEndian16(segment);
+        } else if (marker == 0xDA)
+        {
+            if (components == 0 || length < 3 || segment[0] != components)
+            {
+                return false;
+            }
+            layout.scanStart = pos + 2 + length;
+        }
+        pos += 2 + length;
+    }
+    if (layout.restartInterval == 0 || layout.width == 0
+        || layout.height == 0)
+    {
+        return false;
+    }
+
+    // a scan of one component is not interleaved, its MCUs are single blocks
+    if (components == 1)
+    {
+        hMax = vMax = vMin = 1;
+    }
+    layout.mcuHeight = 8 * vMax;
+    layout.mcusPerRow = (layout.width + 8 * hMax - 1) / (8 * hMax);
+    layout.mcuRows = (layout.height + layout.mcuHeight - 1) / layout.mcuHeight;
+    layout.verticalSubsampling = vMin < vMax;
+
+    layout.intervals.push_back(layout.scanStart);
+    pos = layout.scanStart;
+    for (;;)
+    {
+        const void *next = memchr(data + pos, 0xFF, size - pos);
+        if (not next)
+        {
+            return false;
+        }
+        pos = static_cast<const uint8_t *>(next) - data;
+        if (pos + 1 >= size)
+        {
+            return false;
+        }
+        uint8_t marker = data[pos + 1];
+        if (marker == 0x00)
+        {
+            pos += 2; // stuffed 0xFF data byte
+        } else if (marker == 0xFF)
+        {
+            pos++;
+        } else if (marker >= 0xD0 && marker <= 0xD7)
+        {
+            pos += 2;
+            layout.intervals.push_back(pos);
+        } else if (marker == 0xD9)
+        {
+            layout.intervals.push_back(pos + 2);
+            break;
+        } else
+        {
+            return false; // another scan, a DNL, ...
+        }
+    }
+
+    uint64_t mcus = uint64_t(layout.mcusPerRow) * layout.mcuRows;
+    return layout.intervals.size() - 1
+           == (mcus + layout.restartInterval - 1) / layout.restartInterval;
+}
+
+/**
+ * Decodes the JPEG described by layout as strips on the pool. Strips start
+ * at MCU rows that are also the start of an interval. With vertically
+ * subsampled chroma the upsampling blends in the neighbouring rows, so those
+ * strips are decoded with one step of rows overlap on each side that is
+ * thrown away again. Returns the number of strips written to texels, 0 if
+ * the image is too small to split or a strip fails, the caller then decodes
+ * the image in one piece.
+ * */
+static uint32_t
+decodeJpegStrips(const uint8_t *data,
+                 const JpegRestartLayout &layout,
+                 ThreadPool &pool,
+                 uint8_t *texels)
+{
+    // strips have to start at a row that is also the start of an interval
+    const uint32_t rowStep
+        = layout.restartInterval
+          / std::gcd(layout.mcusPerRow, layout.restartInterval);
+    const uint32_t pixelsPerRow = layout.width * layout.mcuHeight;
+    uint32_t stripRows = std::max<uint32_t>(
+        (layout.mcuRows + 2 * pool.threadCount() - 1)
+            / (2 * pool.threadCount()),
+        (JPEG_MIN_STRIP_PIXELS + pixelsPerRow - 1) / pixelsPerRow);
+    stripRows = (stripRows + rowStep - 1) / rowStep * rowStep;
+    const uint32_t stripCount = (layout.mcuRows + stripRows - 1) / stripRows;
+    if (stripCount < 2)
+    {
+        return 0;
+    }
+    const uint32_t overlap = layout.verticalSubsampling ? rowStep : 0;
+
+    auto intervalOfRow = [&](uint32_t row) {
+        return row == layout.mcuRows
+                   ? layout.intervals.size() - 1
+                   : size_t(row) * layout.mcusPerRow / layout.restartInterval;
+    };
+
+    std::atomic<bool> failed{false};
+
+    pool.parallelFor(stripCount, [&](size_t strip) {
+        uint32_t firstRow = static_cast<uint32_t>(strip) * stripRows;
+        uint32_t endRow = std::min(firstRow + stripRows, layout.mcuRows);
+        uint32_t decodeFirst = firstRow > overlap ? firstRow - overlap : 0;
+        uint32_t decodeEnd = std::min(endRow + overlap, layout.mcuRows);
+        uint32_t decodeTop = decodeFirst * layout.mcuHeight;
+        uint32_t decodeBottom
+            = std::min(decodeEnd * layout.mcuHeight, layout.height);
+
+        size_t dataStart = layout.intervals[intervalOfRow(decodeFirst)];
+        size_t dataEnd = layout.intervals[intervalOfRow(decodeEnd)] - 2;
+        std::vector<uint8_t> jpeg(layout.scanStart + dataEnd - dataStart + 2);
+        memcpy(jpeg.data(), data, layout.scanStart);
+        memcpy(jpeg.data() + layout.scanStart,
+               data + dataStart,
+               dataEnd - dataStart);
+        jpeg[layout.heightOffset] = uint8_t((decodeBottom - decodeTop) >> 8);
+        jpeg[layout.heightOffset + 1] = uint8_t(decodeBottom - decodeTop);
+        jpeg[jpeg.size() - 2] = 0xFF;
+        jpeg[jpeg.size() - 1] = 0xD9;
+
+        int width, height, channels;
+        stbi_uc *pixels = stbi_load_from_memory(jpeg.data(),
+                                                static_cast<int>(jpeg.size()),
+                                                &width,
+                                                &height,
+                                                &channels,
+                                                STBI_rgb_alpha);
+        if (not pixels || uint32_t(width) != layout.width
+            || uint32_t(height) != decodeBottom - decodeTop)
+        {
+            failed = true;
+            stbi_image_free(pixels);
+            return;
+        }
+        uint32_t top = firstRow * layout.mcuHeight;
+        uint32_t bottom = std::min(endRow * layout.mcuHeight, layout.height);
+        size_t rowBytes = size_t(layout.width) * 4;
+        memcpy(texels + top * rowBytes,
+               pixels + (top - decodeTop) * rowBytes,
+               (bottom - top) * rowBytes);
+        stbi_image_free(pixels);
+    });
+
+    return failed ? 0 : stripCount;
+}
+
+/// size of the image at path from its header, without decoding it
+static bool
+readImageExtent(const std::string &path, uint32_t &width, uint32_t &height)
+{
+    int imageWidth, imageHeight, channels;
+    if (not stbi_info(path.c_str(), &imageWidth, &imageHeight, &channels))
+    {
+        return false;
+    }
+    width = static_cast<uint32_t>(imageWidth);
+    height = static_cast<uint32_t>(imageHeight);
+    return true;
+}
+
+/**
+ * Decodes the image at path to RGBA8, JPEGs with restart markers as strips
+ * on the pool if it has more than one thread. With a destination the texels
+ * go there, capacity is its size and has to hold the texels of the image
+ * (see readImageExtent()), otherwise into the storage of the result.
+ * */
+static DecodedImage
+decodeImage(const std::string &path,
+            ThreadPool &pool = sharedThreadPool(),
+            uint8_t *destination = nullptr,
+            size_t capacity = 0)
+{
+    auto start = std::chrono::high_resolution_clock::now();
+    DecodedImage image;
+    image.path = path;
+
+    MappedFile file;
+    if (not file.open(path))
+    {
+        return image;
+    }
+    const auto *data = reinterpret_cast<const uint8_t *>(file.data());
+    const int dataSize = static_cast<int>(file.size());
+
+    int width, height, channels;
+    if (not stbi_info_from_memory(data, dataSize, &width, &height, &channels))
+    {
+        return image;
+    }
+    const size_t size = size_t(width) * height * 4;
+    if (not destination)
+    {
+        // with the spare byte the JPEG decoder asks for
+        image.storage.resize(size + 1);
+        destination = image.storage.data();
+        capacity = image.storage.size();
+    } else if (capacity < size)
+    {
+        return image;
+    }
+
+    JpegRestartLayout layout;
+    if (pool.threadCount() > 1 && jpegRestartLayout(data, file.size(), layout))
+    {
+        image.strips = decodeJpegStrips(data, layout, pool, destination);
+    }
+    if (image.strips == 0)
+    {
+        stbiOutput = {destination, size, capacity, false};
+        int decodedWidth, decodedHeight;
+        stbi_uc *pixels = stbi_load_from_memory(data,
+                                                dataSize,
+                                                &decodedWidth,
+                                                &decodedHeight,
+                                                &channels,
+                                                STBI_rgb_alpha);
+        stbiOutput = StbiOutput();
+        if (not pixels || decodedWidth != width || decodedHeight != height)
+        {
+            if (pixels != destination)
+            {
+                stbi_image_free(pixels);
+            }
+            image.storage.clear();
+            return image;
+        }
+        if (pixels != destination)
+        {
+            memcpy(destination, pixels, size);
+            stbi_image_free(pixels);
+        }
+        image.strips = 1;
+    }
+
+    image.width = static_cast<uint32_t>(width);
+    image.height = static_cast<uint32_t>(height);
+    image.texels = destination;
+    image.milliseconds = std::chrono::duration<float, std::milli>(
+                             std::chrono::high_resolution_clock::now() - start)
+                             .count();
+    return image;
+}
+
+/**
+ * Decodes images on the pool, all of them at once. next() returns them in
+ * the order they finish.
+ * */
+class TextureDecoder {
+  public:
+    explicit TextureDecoder(ThreadPool &pool = sharedThreadPool())
+        : m_pool(pool)
+    {
+    }
+
+    ~TextureDecoder()
+    {
+        // the tasks still running reference this
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_condition.wait(lock, [this] { return m_running == 0; });
+    }
+
+    TextureDecoder(const TextureDecoder &) = delete;
+    TextureDecoder &operator=(const TextureDecoder &) = delete;
+
+    /**
+     * Starts decoding the image at path, next() returns it when done. The
+     * texels go to destination if there is one, see decodeImage().
+     * */
+    void decode(const std::string &path,
+                uint8_t *destination = nullptr,
+                size_t capacity = 0)
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_pending++;
+            m_running++;
+        }
+        if (m_pool.threadCount() == 0)
+        {
+            run(path, destination, capacity);
+        } else
+        {
+            m_pool.submit([this, path, destination, capacity] {
+                run(path, destination, capacity);
+            });
+        }
+    }
+
+    /**
+     * Waits for the next image to finish, failed ones have no texels.
+     * Returns false once every image passed to decode() was returned.
+     * */
+    bool next(DecodedImage &image)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        if (m_pending == 0)
+        {
+            return false;
+        }
+        m_condition.wait(lock, [this] { return not m_finished.empty(); });
+        image = std::move(m_finished.front());
+        m_finished.pop_front();
+        m_pending--;
+        return true;
+    }
+
+  private:
+    void run(const std::string &path, uint8_t *destination, size_t capacity)
+    {
+        DecodedImage image;
+        try
+        {
+            image = decodeImage(path, m_pool, destination, capacity);
+        } catch (const std::exception &)
+        {
+            image = DecodedImage();
+            image.path = path;
+        }
+
+        // notify under the lock, the destructor may run as soon as it's
+        // released
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_finished.push_back(std::move(image));
+        m_running--;
+        m_condition.notify_all();
+    }
+
+    ThreadPool &m_pool;
+    std::mutex m_mutex;
+    std::condition_variable m_condition;
+    std::deque<DecodedImage> m_finished;
+    size_t m_pending = 0; /// decoded or decoding, not returned by next() yet
+    size_t m_running = 0;
+};
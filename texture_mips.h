@@ -0,0 +1,470 @@
+#pragma once
+
+#include "mapped_file.h"
+#include "source_stamp.h"
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <system_error>
+#include <vector>
+#include <vulkan/vulkan_core.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/**
+ * Full mip chains for the RGBA8 sRGB textures. Averaging the sRGB bytes
+ * directly darkens every level (the mean of black and white would come out at
+ * 50% brightness instead of 73%), so each 2x2 box is averaged in linear light:
+ * level 0 is decoded once into 16 bit linear values, every level is averaged
+ * from the linear values of the one above and only encoded back to sRGB for
+ * the upload. Alpha is averaged as it is.
+ *
+ * The chain is cached next to the image (textures/x.jpg ->
+ * textures/x.jpg.mipcache) with all levels tightly packed in the order
+ * vkCmdCopyBufferToImage takes them, so a warm start copies the mapping into
+ * the staging buffer and uploads all levels with one copy.
+ *
+ * Layout: MipCacheHeader | RGBA8 level 0 | level 1 | ... | 1x1 level
+ * */
+const uint32_t MIP_CACHE_MAGIC = 0x50494D53; /// "SMIP"
+const uint32_t MIP_CACHE_VERSION = 1;
+const uint32_t MIP_BYTES_PER_TEXEL = 4;
+
+struct MipCacheHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t width;
+    uint32_t height;
+    uint32_t levelCount;
+    uint32_t bytesPerTexel;
+    uint64_t sourceSize;
+    int64_t sourceMtime;
+    uint64_t sourceHash;
+};
+
+/// RGBA8 sRGB texels of all levels, largest first
+struct MipChain {
+    uint32_t width = 0;
+    uint32_t height = 0;
+    uint32_t levelCount = 0;
+    std::vector<uint8_t> texels;
+};
+
+/// down to 1x1, floor(log2(max(width, height))) + 1
+static uint32_t
+mipLevelCount(uint32_t width, uint32_t height)
+{
+    uint32_t levels = 1;
+    while (std::max(width, height) >> levels)
+    {
+        levels++;
+    }
+    return levels;
+}
+
+static inline uint32_t
+mipExtent(uint32_t extent, uint32_t level)
+{
+    return std::max(1u, extent >> level);
+}
+
+/// byte offset of level in the packed chain, the offset of levelCount is
+/// the size of the whole chain
+static size_t
+mipLevelOffset(uint32_t width, uint32_t height, uint32_t level)
+{
+    size_t offset = 0;
+    for (uint32_t i = 0; i < level; i++)
+    {
+        offset += size_t(mipExtent(width, i)) * mipExtent(height, i)
+                  * MIP_BYTES_PER_TEXEL;
+    }
+    return offset;
+}
+
+/// one region per level of a packed chain, for a single
+/// vkCmdCopyBufferToImage
+static std::vector<VkBufferImageCopy>
+mipCopyRegions(uint32_t width, uint32_t height, uint32_t levelCount)
+{
+    std::vector<VkBufferImageCopy> regions(levelCount);
+    for (uint32_t level = 0; level < levelCount; level++)
+    {
+        VkBufferImageCopy &region = regions[level];
+        region = {};
+        region.bufferOffset = mipLevelOffset(width, height, level);
+        region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+        region.imageSubresource.mipLevel = level;
+        region.imageSubresource.baseArrayLayer = 0;
+        region.imageSubresource.layerCount = 1;
+        region.imageOffset = {0, 0, 0};
+        region.imageExtent
+            = {mipExtent(width, level), mipExtent(height, level), 1};
+    }
+    return regions;
+}
+
+/// sRGB byte -> linear light in [0, 65535]
+static const uint16_t *
+srgbToLinearTable()
+{
+    static const std::vector<uint16_t> table = [] {
+        std::vector<uint16_t> table(256);
+        for (uint32_t i = 0; i < 256; i++)
+        {
+            float srgb = i / 255.0f;
+            float linear = srgb <= 0.04045f
+                               ? srgb / 12.92f
+                               : std::pow((srgb + 0.055f) / 1.055f, 2.4f);
+            table[i] = static_cast<uint16_t>(linear * 65535.0f + 0.5f);
+        }
+        return table;
+    }();
+    return table.data();
+}
+
+/// linear light in [0, 65535] -> sRGB byte, 16 bits are enough to tell the
+/// darkest sRGB steps apart
+static const uint8_t *
+linearToSrgbTable()
+{
+    static const std::vector<uint8_t> table = [] {
+        std::vector<uint8_t> table(65536);
+        for (uint32_t i = 0; i < 65536; i++)
+        {
+            float linear = i / 65535.0f;
+            float srgb = linear <= 0.0031308f
+                             ? linear * 12.92f
+                             : 1.055f * std::pow(linear, 1.0f / 2.4f) - 0.055f;
+            table[i] = static_cast<uint8_t>(srgb * 255.0f + 0.5f);
+        }
+        return table;
+    }();
+    return table.data();
+}
+
+static void
+decodeSrgbRow(const uint8_t *texels, uint32_t width, uint16_t *linear)
+{
+    const uint16_t *table = srgbToLinearTable();
+    for (uint32_t x = 0; x < width; x++)
+    {
+        linear[4 * x + 0] = table[texels[4 * x + 0]];
+        linear[4 * x + 1] = table[texels[4 * x + 1]];
+        linear[4 * x + 2] = table[texels[4 * x + 2]];
+        linear[4 * x + 3] = static_cast<uint16_t>(texels[4 * x + 3] * 257);
+    }
+}
+
+static void
+encodeSrgbRow(const uint16_t *linear, uint32_t width, uint8_t *texels)
+{
+    const uint8_t *table = linearToSrgbTable();
+    for (uint32_t x = 0; x < width; x++)
+    {
+        texels[4 * x + 0] = table[linear[4 * x + 0]];
+        texels[4 * x + 1] = table[linear[4 * x + 1]];
+        texels[4 * x + 2] = table[linear[4 * x + 2]];
+        texels[4 * x + 3]
+            = static_cast<uint8_t>((linear[4 * x + 3] + 128) / 257);
+    }
+}
+
+/**
+ * 2x2 box of two linear source rows into one row of the next level. An odd
+ * last column is dropped like the rows, a source of width 1 averages only
+ * vertically.
+ * */
+static void
+downsampleLinearRow(const uint16_t *row0,
+                    const uint16_t *row1,
+                    uint32_t sourceWidth,
+                    uint16_t *out,
+                    bool simd = true)
+{
+    const uint32_t width = mipExtent(sourceWidth, 1);
+    const uint32_t pairs = sourceWidth / 2;
+    uint32_t x = 0;
+
+#ifdef __SSE2__
+    // two output texels per step: average the rows, then the neighbouring
+    // texels of the rows, 4 x 16 bit per texel. pavgw rounds up, which is
+    // less than a 16 bit step per level and far below what sRGB bytes show.
+    for (; simd && x + 2 <= pairs; x += 2)
+    {
+        const __m128i *source0 = reinterpret_cast<const __m128i *>(row0);
+        const __m128i *source1 = reinterpret_cast<const __m128i *>(row1);
+        __m128i left = _mm_avg_epu16(_mm_loadu_si128(source0 + x),
+                                     _mm_loadu_si128(source1 + x));
+        __m128i right = _mm_avg_epu16(_mm_loadu_si128(source0 + x + 1),
+                                      _mm_loadu_si128(source1 + x + 1));
+        __m128i even = _mm_unpacklo_epi64(left, right);
+        __m128i odd = _mm_unpackhi_epi64(left, right);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out + 4 * x),
+                         _mm_avg_epu16(even, odd));
+    }
+#endif
+
+    for (; x < width; x++)
+    {
+        const uint32_t x0 = 2 * x;
+        const uint32_t x1 = std::min(x0 + 1, sourceWidth - 1);
+        for (uint32_t c = 0; c < 4; c++)
+        {
+            uint32_t sum = row0[4 * x0 + c] + row0[4 * x1 + c]
+                           + row1[4 * x0 + c] + row1[4 * x1 + c];
+            out[4 * x + c] = static_cast<uint16_t>((sum + 2) >> 2);
+        }
+    }
+}
+
+/**
+ * Builds all levels below the RGBA8 sRGB texels of level 0 in place: texels
+ * holds level 0 and has room for the whole chain (mipLevelOffset() of
+ * mipLevelCount() levels). The rows of a level are spread over the thread
+ * pool in bands, simd = false forces the scalar filter (for the benchmark).
+ * */
+static void
+buildMipLevels(uint8_t *texels,
+               uint32_t width,
+               uint32_t height,
+               ThreadPool &pool = sharedThreadPool(),
+               bool simd = true)
+{
+    const uint32_t levelCount = mipLevelCount(width, height);
+    const uint32_t rowsPerBand = 32;
+    std::vector<uint16_t> source, target;
+    for (uint32_t level = 1; level < levelCount; level++)
+    {
+        const uint32_t sourceWidth = mipExtent(width, level - 1);
+        const uint32_t sourceHeight = mipExtent(height, level - 1);
+        const uint32_t levelWidth = mipExtent(width, level);
+        const uint32_t levelHeight = mipExtent(height, level);
+        const uint8_t *sourceTexels
+            = texels + mipLevelOffset(width, height, level - 1);
+        uint8_t *levelTexels = texels + mipLevelOffset(width, height, level);
+        target.resize(size_t(levelWidth) * levelHeight * 4);
+
+        const uint32_t bands = (levelHeight + rowsPerBand - 1) / rowsPerBand;
+        pool.parallelFor(bands, [&](size_t band) {
+            // level 0 is only decoded a row pair at a time, the finer levels
+            // read the linear values of the level above
+            std::vector<uint16_t> decoded(level == 1 ? 8 * sourceWidth : 0);
+            const uint32_t firstRow = static_cast<uint32_t>(band) * rowsPerBand;
+            const uint32_t endRow
+                = std::min(firstRow + rowsPerBand, levelHeight);
+            for (uint32_t y = firstRow; y < endRow; y++)
+            {
+                const uint32_t y0 = 2 * y;
+                const uint32_t y1 = std::min(y0 + 1, sourceHeight - 1);
+                const uint16_t *row0, *row1;
+                if (level == 1)
+                {
+                    const size_t rowBytes = size_t(sourceWidth) * 4;
+                    decodeSrgbRow(sourceTexels + y0 * rowBytes,
+                                  sourceWidth,
+                                  decoded.data());
+                    decodeSrgbRow(sourceTexels + y1 * rowBytes,
+                                  sourceWidth,
+                                  decoded.data() + 4 * sourceWidth);
+                    row0 = decoded.data();
+                    row1 = decoded.data() + 4 * sourceWidth;
+                } else
+                {
+                    row0 = source.data() + size_t(y0) * sourceWidth * 4;
+                    row1 = source.data() + size_t(y1) * sourceWidth * 4;
+                }
+
+                uint16_t *linear = target.data() + size_t(y) * levelWidth * 4;
+                downsampleLinearRow(row0, row1, sourceWidth, linear, simd);
+                encodeSrgbRow(linear,
+                              levelWidth,
+                              levelTexels + size_t(y) * levelWidth * 4);
+            }
+        });
+        source.swap(target);
+    }
+}
+
+/// copies level 0 into a new chain and builds the other levels below it
+static MipChain
+buildMipChain(const uint8_t *texels,
+              uint32_t width,
+              uint32_t height,
+              ThreadPool &pool = sharedThreadPool(),
+              bool simd = true)
+{
+    MipChain chain;
+    chain.width = width;
+    chain.height = height;
+    chain.levelCount = mipLevelCount(width, height);
+    chain.texels.resize(mipLevelOffset(width, height, chain.levelCount));
+    std::copy(texels,
+              texels + size_t(width) * height * MIP_BYTES_PER_TEXEL,
+              chain.texels.begin());
+    buildMipLevels(chain.texels.data(), width, height, pool, simd);
+    return chain;
+}
+
+static std::string
+mipCachePath(const std::string &texturePath)
+{
+    return texturePath + ".mipcache";
+}
+
+/**
+ * A validated, memory-mapped mip cache, texels() points into the mapping and
+ * stays valid as long as the object lives
+ * */
+class MipCache {
+  public:
+    /// returns false if there is no cache or if it is stale
+    bool open(const std::string &texturePath)
+    {
+        SourceFileStamp current;
+        if (not statSourceFile(texturePath, current))
+        {
+            return false;
+        }
+
+        if (not m_file.open(mipCachePath(texturePath))
+            || m_file.size() < sizeof(MipCacheHeader))
+        {
+            m_file.close();
+            return false;
+        }
+
+        m_header = reinterpret_cast<const MipCacheHeader *>(m_file.data());
+        if (m_header->magic != MIP_CACHE_MAGIC
+            || m_header->version != MIP_CACHE_VERSION
+            || m_header->bytesPerTexel != MIP_BYTES_PER_TEXEL
+            || m_header->width == 0 || m_header->height == 0
+            || m_header->levelCount
+                   != mipLevelCount(m_header->width, m_header->height)
+            || m_file.size() != sizeof(MipCacheHeader) + size()
+            || m_header->sourceSize != current.size
+            || m_header->sourceMtime != current.mtime)
+        {
+            invalidate();
+            return false;
+        }
+
+        if (not hashSourceFile(texturePath, current)
+            || m_header->sourceHash != current.hash)
+        {
+            invalidate();
+            return false;
+        }
+        return true;
+    }
+
+    uint32_t width() const { return m_header->width; }
+    uint32_t height() const { return m_header->height; }
+    uint32_t levelCount() const { return m_header->levelCount; }
+
+    /// bytes of all levels
+    size_t size() const
+    {
+        return mipLevelOffset(
+            m_header->width, m_header->height, m_header->levelCount);
+    }
+
+    const uint8_t *texels() const
+    {
+        return reinterpret_cast<const uint8_t *>(m_file.data()
+                                                 + sizeof(MipCacheHeader));
+    }
+
+  private:
+    void invalidate()
+    {
+        m_file.close();
+        m_header = nullptr;
+    }
+
+    MappedFile m_file;
+    const MipCacheHeader *m_header = nullptr;
+};
+
+/**
+ * Writes the packed chain of all levels in texels to the cache file of
+ * texturePath through a temporary file like writeMeshCache(), failing is not
+ * fatal
+ * */
+static bool
+writeMipCache(const std::string &texturePath,
+              uint32_t width,
+              uint32_t height,
+              const uint8_t *texels)
+{
+    const uint32_t levelCount = mipLevelCount(width, height);
+    SourceFileStamp stamp;
+    if (not statSourceFile(texturePath, stamp)
+        || not hashSourceFile(texturePath, stamp))
+    {
+        return false;
+    }
+
+    MipCacheHeader header{};
+    header.magic = MIP_CACHE_MAGIC;
+    header.version = MIP_CACHE_VERSION;
+    header.width = width;
+    header.height = height;
+    header.levelCount = levelCount;
+    header.bytesPerTexel = MIP_BYTES_PER_TEXEL;
+    header.sourceSize = stamp.size;
+    header.sourceMtime = stamp.mtime;
+    header.sourceHash = stamp.hash;
+
+    const std::string cachePath = mipCachePath(texturePath);
+    const std::string tmpPath = cachePath + ".tmp";
+    {
+        std::ofstream file(tmpPath, std::ios::binary | std::ios::trunc);
+        if (not file.is_open())
+        {
+            std::cerr << "failed to write mip cache " << cachePath
+                      << std::endl;
+            return false;
+        }
+
+        file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        file.write(reinterpret_cast<const char *>(texels),
+                   mipLevelOffset(width, height, levelCount));
+
+        if (not file.good())
+        {
+            file.close();
+            std::remove(tmpPath.c_str());
+            std::cerr << "failed to write mip cache " << cachePath
+                      << std::endl;
+            return false;
+        }
+    }
+
+    std::error_code ec;
+    std::filesystem::rename(tmpPath, cachePath, ec);
+    if (ec)
+    {
+        std::remove(tmpPath.c_str());
+        std::cerr << "failed to write mip cache " << cachePath << ": "
+                  << ec.message() << std::endl;
+        return false;
+    }
+    return true;
+}
+
+static bool
+writeMipCache(const std::string &texturePath, const MipChain &chain)
+{
+    return writeMipCache(
+        texturePath, chain.width, chain.height, chain.texels.data());
+}
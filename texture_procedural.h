@@ -0,0 +1,665 @@
+#pragma once
+
+#include "texture_mips.h"
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/**
+ * Procedural surfaces for the bodies without imagery: a texture path
+ * "procedural:<seed>" in textureMap stands for an equirectangular RGBA8 sRGB
+ * texture that is synthesized instead of loaded. Everything about a surface
+ * (palette, roughness, the craters) follows from the seed, so the same seed
+ * always gives the same body and two bodies never need an image file.
+ *
+ * The height field is multi-octave value noise sampled at the direction of
+ * every texel (no seam at u = 0 and no pinching at the poles) plus craters
+ * stamped on the sphere, shaded with a fixed light from the north-west and
+ * tinted by the low octaves. Each mip level is generated directly at its
+ * own size with only the octaves and craters it can resolve, so a level
+ * costs what its texels cost and the residency manager (see
+ * texture_residency.h) only ever asks for the levels on screen. The noise
+ * runs four texels at a time with SSE2, the rows are spread over the thread
+ * pool. Generated levels are kept in a SurfaceCache keyed by the seed.
+ * */
+const char PROCEDURAL_TEXTURE_PREFIX[] = "procedural:";
+const uint32_t SURFACE_WIDTH = 4096; /// level 0, the height is half of it
+const uint32_t SURFACE_OCTAVES = 8;
+const uint32_t SURFACE_ALBEDO_OCTAVES = 3; /// the octaves that tint the surface
+const float SURFACE_RELIEF = 0.04f;        /// height per octave over frequency
+const float SURFACE_SHADING = 1.5f;        /// brightness change per slope
+const float CRATER_REACH = 1.5f;           /// the rim ends at 1.5 radii
+const uint64_t SURFACE_CACHE_MEGABYTES = 256;
+
+static bool
+isProceduralTexture(const std::string &path)
+{
+    return path.compare(0,
+                        sizeof(PROCEDURAL_TEXTURE_PREFIX) - 1,
+                        PROCEDURAL_TEXTURE_PREFIX)
+           == 0;
+}
+
+static uint32_t
+proceduralSeed(const std::string &path)
+{
+    return static_cast<uint32_t>(strtoul(
+        path.c_str() + sizeof(PROCEDURAL_TEXTURE_PREFIX) - 1, nullptr, 10));
+}
+
+/// a crater on the unit sphere, angles in radians
+struct Crater {
+    float direction[3];
+    float latitude;
+    float longitude;
+    float radius;
+    float chordRadius;    /// straight distance from the centre to the rim
+    float longitudeReach; /// half the longitudes the rim spans, pi at a pole
+    float depth;
+};
+
+/// everything describeSurface() derives from a seed
+struct Surface {
+    uint32_t seed = 0;
+    uint32_t width = 0;
+    uint32_t height = 0;
+    float baseFrequency = 1.0f; /// lattice cells per unit of direction
+    float color[3] = {};        /// linear
+    std::vector<Crater> craters;
+};
+
+/// 32 bit hash of a lattice point, the seed picks the noise
+static inline uint32_t
+latticeHash(int32_t x, int32_t y, int32_t z, uint32_t seed)
+{
+    uint32_t hash = seed ^ (static_cast<uint32_t>(x) * 0x8DA6B343u)
+                    ^ (static_cast<uint32_t>(y) * 0xD8163841u)
+                    ^ (static_cast<uint32_t>(z) * 0xCB1AB31Fu);
+    hash = (hash ^ (hash >> 16)) * 0x7FEB352Du;
+    hash = (hash ^ (hash >> 15)) * 0x846CA68Bu;
+    return hash ^ (hash >> 16);
+}
+
+/// the top 24 bits of a hash in [0, 1)
+static inline float
+hashUnit(uint32_t hash)
+{
+    return static_cast<float>(hash >> 8) * (1.0f / 16777216.0f);
+}
+
+static inline float
+smoothWeight(float t)
+{
+    return t * t * (3.0f - 2.0f * t);
+}
+
+/// value noise in [0, 1): the lattice values blended with smoothstep weights
+static float
+valueNoise(float x, float y, float z, uint32_t seed)
+{
+    const float floorX = std::floor(x);
+    const float floorY = std::floor(y);
+    const float floorZ = std::floor(z);
+    const int32_t ix = static_cast<int32_t>(floorX);
+    const int32_t iy = static_cast<int32_t>(floorY);
+    const int32_t iz = static_cast<int32_t>(floorZ);
+    const float tx = smoothWeight(x - floorX);
+    const float ty = smoothWeight(y - floorY);
+    const float tz = smoothWeight(z - floorZ);
+
+    float planes[2];
+    for (int32_t dz = 0; dz < 2; dz++)
+    {
+        float rows[2];
+        for (int32_t dy = 0; dy < 2; dy++)
+        {
+            const float left
+                = hashUnit(latticeHash(ix, iy + dy, iz + dz, seed));
+            const float right
+                = hashUnit(latticeHash(ix + 1, iy + dy, iz + dz, seed));
+            rows[dy] = left + (right - left) * tx;
+        }
+        planes[dz] = rows[0] + (rows[1] - rows[0]) * ty;
+    }
+    return planes[0] + (planes[1] - planes[0]) * tz;
+}
+
+#ifdef __SSE2__
+/// 32 bit multiply of every lane, SSE2 only multiplies the even ones
+static inline __m128i
+multiplyLanes(__m128i a, __m128i b)
+{
+    const __m128i even = _mm_mul_epu32(a, b);
+    const __m128i odd
+        = _mm_mul_epu32(_mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32));
+    return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)),
+                              _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+}
+
+/**
+ * latticeHash() of four lattice points from the products of their
+ * coordinates with the hash constants. (x + 1) * c is x * c + c modulo 2^32,
+ * so the eight corners of a cell only need the products of one corner.
+ * */
+static inline __m128i
+latticeHash4(__m128i x, __m128i y, __m128i z, __m128i seed)
+{
+    __m128i hash = _mm_xor_si128(seed, _mm_xor_si128(x, _mm_xor_si128(y, z)));
+    hash = multiplyLanes(_mm_xor_si128(hash, _mm_srli_epi32(hash, 16)),
+                         _mm_set1_epi32(0x7FEB352D));
+    hash = multiplyLanes(_mm_xor_si128(hash, _mm_srli_epi32(hash, 15)),
+                         _mm_set1_epi32(int32_t(0x846CA68Bu)));
+    return _mm_xor_si128(hash, _mm_srli_epi32(hash, 16));
+}
+
+static inline __m128
+hashUnit4(__m128i hash)
+{
+    return _mm_mul_ps(_mm_cvtepi32_ps(_mm_srli_epi32(hash, 8)),
+                      _mm_set1_ps(1.0f / 16777216.0f));
+}
+
+/// std::floor() of four floats in the range of int32_t
+static inline __m128
+floor4(__m128 value)
+{
+    const __m128 truncated = _mm_cvtepi32_ps(_mm_cvttps_epi32(value));
+    return _mm_sub_ps(
+        truncated,
+        _mm_and_ps(_mm_cmpgt_ps(truncated, value), _mm_set1_ps(1.0f)));
+}
+
+static inline __m128
+lerp4(__m128 a, __m128 b, __m128 t)
+{
+    return _mm_add_ps(a, _mm_mul_ps(_mm_sub_ps(b, a), t));
+}
+
+/// valueNoise() at four points, the same operations in the same order
+static inline __m128
+valueNoise4(__m128 x, __m128 y, __m128 z, __m128i seed)
+{
+    const __m128 floorX = floor4(x);
+    const __m128 floorY = floor4(y);
+    const __m128 floorZ = floor4(z);
+    const __m128i constantX = _mm_set1_epi32(int32_t(0x8DA6B343u));
+    const __m128i constantY = _mm_set1_epi32(int32_t(0xD8163841u));
+    const __m128i constantZ = _mm_set1_epi32(int32_t(0xCB1AB31Fu));
+    const __m128i x0 = multiplyLanes(_mm_cvttps_epi32(floorX), constantX);
+    const __m128i y0 = multiplyLanes(_mm_cvttps_epi32(floorY), constantY);
+    const __m128i z0 = multiplyLanes(_mm_cvttps_epi32(floorZ), constantZ);
+    auto weight = [](__m128 t) {
+        return _mm_mul_ps(
+            _mm_mul_ps(t, t),
+            _mm_sub_ps(_mm_set1_ps(3.0f), _mm_mul_ps(_mm_set1_ps(2.0f), t)));
+    };
+    const __m128 tx = weight(_mm_sub_ps(x, floorX));
+    const __m128 ty = weight(_mm_sub_ps(y, floorY));
+    const __m128 tz = weight(_mm_sub_ps(z, floorZ));
+
+    const __m128i x1 = _mm_add_epi32(x0, constantX);
+    __m128 planes[2];
+    for (int32_t dz = 0; dz < 2; dz++)
+    {
+        const __m128i pz = dz == 0 ? z0 : _mm_add_epi32(z0, constantZ);
+        __m128 rows[2];
+        for (int32_t dy = 0; dy < 2; dy++)
+        {
+            const __m128i py = dy == 0 ? y0 : _mm_add_epi32(y0, constantY);
+            rows[dy] = lerp4(hashUnit4(latticeHash4(x0, py, pz, seed)),
+                             hashUnit4(latticeHash4(x1, py, pz, seed)),
+                             tx);
+        }
+        planes[dz] = lerp4(rows[0], rows[1], ty);
+    }
+    return lerp4(planes[0], planes[1], tz);
+}
+#endif
+
+/// small generator for the parameters of a surface, the same per seed
+struct SurfaceRandom {
+    uint32_t state;
+
+    float next()
+    {
+        state = latticeHash(static_cast<int32_t>(state), 0x51ED, 0x2705, 0);
+        return hashUnit(state);
+    }
+};
+
+/// the surface of seed, with a level 0 of width x width / 2 texels
+static Surface
+describeSurface(uint32_t seed, uint32_t width = SURFACE_WIDTH)
+{
+    const float pi = 3.14159265358979f;
+    // linear albedos, brightened a bit over the real ones to stay visible:
+    // carbonaceous, rocky, reddish and icy bodies
+    const float palettes[4][3] = {{0.16f, 0.14f, 0.12f},
+                                  {0.32f, 0.31f, 0.30f},
+                                  {0.40f, 0.27f, 0.20f},
+                                  {0.72f, 0.74f, 0.78f}};
+
+    Surface surface;
+    surface.seed = seed;
+    surface.width = width;
+    surface.height = std::max(1u, width / 2);
+    SurfaceRandom random{seed};
+    const float *palette = palettes[static_cast<uint32_t>(random.next() * 4)];
+    const float tint = 0.85f + 0.3f * random.next();
+    for (uint32_t c = 0; c < 3; c++)
+    {
+        surface.color[c] = palette[c] * tint;
+    }
+    surface.baseFrequency = 1.0f + 2.0f * random.next();
+
+    // a few large basins and many small craters, log-uniform radii skewed
+    // towards the small end
+    const uint32_t craterCount
+        = 200 + static_cast<uint32_t>(400 * random.next());
+    const float minRadius = 0.004f;
+    const float maxRadius = 0.3f;
+    for (uint32_t i = 0; i < craterCount; i++)
+    {
+        Crater crater;
+        const float z = 2.0f * random.next() - 1.0f;
+        const float longitude = 2.0f * pi * random.next() - pi;
+        const float ring = std::sqrt(std::max(0.0f, 1.0f - z * z));
+        const float scale = random.next();
+        crater.direction[0] = ring * std::sin(longitude);
+        crater.direction[1] = z;
+        crater.direction[2] = ring * std::cos(longitude);
+        crater.latitude = std::asin(z);
+        crater.longitude = longitude;
+        crater.radius
+            = minRadius * std::pow(maxRadius / minRadius, scale * scale);
+        crater.chordRadius = 2.0f * std::sin(0.5f * crater.radius);
+        const float reach = CRATER_REACH * crater.radius;
+        crater.longitudeReach
+            = std::abs(crater.latitude) + reach < 0.5f * pi
+                  ? std::asin(std::sin(reach) / std::cos(crater.latitude))
+                  : pi;
+        // about a fifth of the diameter deep, old large ones are flatter
+        crater.depth = 0.4f * crater.radius * (1.0f - 0.6f * scale);
+        surface.craters.push_back(crater);
+    }
+    return surface;
+}
+
+/// octaves of the noise a level levelWidth texels around can resolve, the
+/// finest lattice cell still spans about four texels
+static uint32_t
+surfaceOctaves(const Surface &surface, uint32_t levelWidth)
+{
+    const float pi = 3.14159265358979f;
+    uint32_t octaves = 1;
+    float frequency = surface.baseFrequency * 2.0f;
+    while (octaves < SURFACE_OCTAVES
+           && 2.0f * pi * frequency * 4.0f <= levelWidth)
+    {
+        octaves++;
+        frequency *= 2.0f;
+    }
+    return octaves;
+}
+
+/**
+ * Noise of one row at the directions (cosLatitude sinLongitude, sinLatitude,
+ * cosLatitude cosLongitude): the height from all octaves, each weighted by
+ * its wavelength so every octave adds the same slopes, and the albedo
+ * variation in [-0.5, 0.5] from the low ones
+ * */
+static void
+surfaceNoiseRow(const Surface &surface,
+                uint32_t octaves,
+                float sinLatitude,
+                float cosLatitude,
+                const float *sinLongitude,
+                const float *cosLongitude,
+                uint32_t width,
+                float *heights,
+                float *albedos,
+                bool simd = true)
+{
+    float frequencies[SURFACE_OCTAVES];
+    float heightWeights[SURFACE_OCTAVES];
+    float albedoWeights[SURFACE_OCTAVES];
+    uint32_t seeds[SURFACE_OCTAVES];
+    float albedoTotal = 0.0f;
+    for (uint32_t k = 0; k < octaves; k++)
+    {
+        frequencies[k] = surface.baseFrequency * float(1u << k);
+        heightWeights[k] = SURFACE_RELIEF / frequencies[k];
+        albedoWeights[k] = k < SURFACE_ALBEDO_OCTAVES ? 1.0f / (1u << k) : 0.0f;
+        albedoTotal += albedoWeights[k];
+        seeds[k] = surface.seed + k * 0x9E3779B9u;
+    }
+    for (uint32_t k = 0; k < octaves; k++)
+    {
+        albedoWeights[k] /= albedoTotal;
+    }
+
+    uint32_t x = 0;
+#ifdef __SSE2__
+    const __m128 half = _mm_set1_ps(0.5f);
+    const __m128 y = _mm_set1_ps(sinLatitude);
+    const __m128 ring = _mm_set1_ps(cosLatitude);
+    for (; simd && x + 4 <= width; x += 4)
+    {
+        const __m128 dx = _mm_mul_ps(ring, _mm_loadu_ps(sinLongitude + x));
+        const __m128 dz = _mm_mul_ps(ring, _mm_loadu_ps(cosLongitude + x));
+        __m128 height = _mm_setzero_ps();
+        __m128 albedo = _mm_setzero_ps();
+        for (uint32_t k = 0; k < octaves; k++)
+        {
+            const __m128 frequency = _mm_set1_ps(frequencies[k]);
+            const __m128 noise = _mm_sub_ps(
+                valueNoise4(_mm_mul_ps(dx, frequency),
+                            _mm_mul_ps(y, frequency),
+                            _mm_mul_ps(dz, frequency),
+                            _mm_set1_epi32(int32_t(seeds[k]))),
+                half);
+            height = _mm_add_ps(
+                height, _mm_mul_ps(noise, _mm_set1_ps(heightWeights[k])));
+            albedo = _mm_add_ps(
+                albedo, _mm_mul_ps(noise, _mm_set1_ps(albedoWeights[k])));
+        }
+        _mm_storeu_ps(heights + x, height);
+        _mm_storeu_ps(albedos + x, albedo);
+    }
+#endif
+
+    for (; x < width; x++)
+    {
+        const float dx = cosLatitude * sinLongitude[x];
+        const float dz = cosLatitude * cosLongitude[x];
+        float height = 0.0f;
+        float albedo = 0.0f;
+        for (uint32_t k = 0; k < octaves; k++)
+        {
+            const float frequency = frequencies[k];
+            const float noise = valueNoise(dx * frequency,
+                                           sinLatitude * frequency,
+                                           dz * frequency,
+                                           seeds[k])
+                                - 0.5f;
+            height = height + noise * heightWeights[k];
+            albedo = albedo + noise * albedoWeights[k];
+        }
+        heights[x] = height;
+        albedos[x] = albedo;
+    }
+}
+
+/// height of a crater at t radii from its centre: a bowl and a raised rim
+static inline float
+craterProfile(float t)
+{
+    const float bowl = t < 1.0f ? t * t - 1.0f : 0.0f;
+    const float s = 2.0f * (t - 1.0f);
+    const float rim
+        = std::abs(s) < 1.0f ? 0.35f * (1.0f - s * s) * (1.0f - s * s) : 0.0f;
+    return bowl + rim;
+}
+
+/// adds the craters at least a texel wide to the heights of one row
+static void
+stampCraterRow(const Surface &surface,
+               float latitude,
+               float sinLatitude,
+               float cosLatitude,
+               const float *sinLongitude,
+               const float *cosLongitude,
+               uint32_t width,
+               float *heights)
+{
+    const float pi = 3.14159265358979f;
+    const float texelAngle = 2.0f * pi / width;
+    const int32_t columns = static_cast<int32_t>(width);
+    for (const Crater &crater : surface.craters)
+    {
+        if (crater.radius < texelAngle
+            || std::abs(latitude - crater.latitude)
+                   > CRATER_REACH * crater.radius)
+        {
+            continue;
+        }
+        // the columns within its longitudes, around the seam if need be
+        int32_t first = 0;
+        int32_t count = columns;
+        if (crater.longitudeReach < pi)
+        {
+            const float columnsPerRadian = width / (2.0f * pi);
+            first = static_cast<int32_t>(std::floor(
+                        (crater.longitude - crater.longitudeReach + pi)
+                            * columnsPerRadian
+                        - 0.5f))
+                    - 1;
+            count = std::min(
+                columns,
+                static_cast<int32_t>(std::ceil(2.0f * crater.longitudeReach
+                                               * columnsPerRadian))
+                    + 3);
+        }
+        for (int32_t i = 0; i < count; i++)
+        {
+            const uint32_t x
+                = static_cast<uint32_t>(((first + i) % columns + columns)
+                                        % columns);
+            const float dx
+                = cosLatitude * sinLongitude[x] - crater.direction[0];
+            const float dy = sinLatitude - crater.direction[1];
+            const float dz
+                = cosLatitude * cosLongitude[x] - crater.direction[2];
+            const float t
+                = std::sqrt(dx * dx + dy * dy + dz * dz) / crater.chordRadius;
+            if (t < CRATER_REACH)
+            {
+                heights[x] += crater.depth * craterProfile(t);
+            }
+        }
+    }
+}
+
+/**
+ * RGBA8 sRGB texels of level of the surface, generated at the size of the
+ * level. The rows are generated in bands on the thread pool, each with a
+ * row above and below it for the slopes of the shading. simd = false forces
+ * the scalar noise.
+ * */
+static std::vector<uint8_t>
+generateSurfaceLevel(const Surface &surface,
+                     uint32_t level,
+                     ThreadPool &pool = sharedThreadPool(),
+                     bool simd = true)
+{
+    const float pi = 3.14159265358979f;
+    const uint32_t width = mipExtent(surface.width, level);
+    const uint32_t height = mipExtent(surface.height, level);
+    const uint32_t octaves = surfaceOctaves(surface, width);
+
+    // u = 0.5 at +z like the equirectangular images, see texture_cubemap.h
+    std::vector<float> sinLongitude(width), cosLongitude(width);
+    for (uint32_t x = 0; x < width; x++)
+    {
+        const float longitude = ((x + 0.5f) / width - 0.5f) * 2.0f * pi;
+        sinLongitude[x] = std::sin(longitude);
+        cosLongitude[x] = std::cos(longitude);
+    }
+
+    std::vector<uint8_t> texels(size_t(width) * height * MIP_BYTES_PER_TEXEL);
+    const uint32_t rowsPerBand = 16;
+    const uint32_t bands = (height + rowsPerBand - 1) / rowsPerBand;
+    pool.parallelFor(bands, [&](size_t band) {
+        const uint32_t firstRow = static_cast<uint32_t>(band) * rowsPerBand;
+        const uint32_t endRow = std::min(firstRow + rowsPerBand, height);
+        const uint32_t top = firstRow > 0 ? firstRow - 1 : 0;
+        const uint32_t bottom = std::min(endRow + 1, height);
+
+        std::vector<float> heights(size_t(bottom - top) * width);
+        std::vector<float> albedos(heights.size());
+        for (uint32_t y = top; y < bottom; y++)
+        {
+            const float latitude = (0.5f - (y + 0.5f) / height) * pi;
+            const float sinLatitude = std::sin(latitude);
+            const float cosLatitude = std::cos(latitude);
+            float *rowHeights = heights.data() + size_t(y - top) * width;
+            surfaceNoiseRow(surface,
+                            octaves,
+                            sinLatitude,
+                            cosLatitude,
+                            sinLongitude.data(),
+                            cosLongitude.data(),
+                            width,
+                            rowHeights,
+                            albedos.data() + size_t(y - top) * width,
+                            simd);
+            stampCraterRow(surface,
+                           latitude,
+                           sinLatitude,
+                           cosLatitude,
+                           sinLongitude.data(),
+                           cosLongitude.data(),
+                           width,
+                           rowHeights);
+        }
+
+        // slopes per radian across and along the rows, lit from the
+        // north-west
+        std::vector<uint16_t> linear(size_t(width) * 4);
+        const float rowAngle = pi / height;
+        for (uint32_t y = firstRow; y < endRow; y++)
+        {
+            const float latitude = (0.5f - (y + 0.5f) / height) * pi;
+            const float columnAngle
+                = 2.0f * pi / width * std::max(std::cos(latitude), 0.05f);
+            const float *row = heights.data() + size_t(y - top) * width;
+            const float *above
+                = heights.data() + size_t(y > top ? y - 1 - top : 0) * width;
+            const float *below = heights.data()
+                                 + size_t(std::min(y + 1, bottom - 1) - top)
+                                       * width;
+            const float *albedo = albedos.data() + size_t(y - top) * width;
+            for (uint32_t x = 0; x < width; x++)
+            {
+                const float east = row[x + 1 == width ? 0 : x + 1];
+                const float west = row[x == 0 ? width - 1 : x - 1];
+                const float slopeX = (east - west) / (2.0f * columnAngle);
+                const float slopeY = (below[x] - above[x]) / (2.0f * rowAngle);
+                const float shade = std::clamp(
+                    1.0f + SURFACE_SHADING * 0.7071f * (slopeX + slopeY),
+                    0.15f,
+                    2.0f);
+                const float brightness = (1.0f + albedo[x]) * shade;
+                for (uint32_t c = 0; c < 3; c++)
+                {
+                    linear[4 * x + c] = static_cast<uint16_t>(
+                        std::min(surface.color[c] * brightness, 1.0f) * 65535.0f
+                        + 0.5f);
+                }
+                linear[4 * x + 3] = 65535;
+            }
+            encodeSrgbRow(linear.data(),
+                          width,
+                          texels.data()
+                              + size_t(y) * width * MIP_BYTES_PER_TEXEL);
+        }
+    });
+    return texels;
+}
+
+/**
+ * Generated levels by seed, surface width and level, shared between the
+ * callers. The least recently used levels go when the cache grows beyond
+ * its budget, a caller still holding one keeps it alive. Levels are
+ * generated outside the lock, two threads asking for the same missing level
+ * at once both generate it.
+ * */
+class SurfaceCache {
+  public:
+    explicit SurfaceCache(uint64_t budgetBytes = SURFACE_CACHE_MEGABYTES << 20)
+        : m_budget(budgetBytes)
+    {
+    }
+
+    std::shared_ptr<const std::vector<uint8_t>> level(const Surface &surface,
+                                                      uint32_t level)
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            for (Entry &entry : m_entries)
+            {
+                if (entry.seed == surface.seed && entry.width == surface.width
+                    && entry.level == level)
+                {
+                    entry.lastUse = ++m_uses;
+                    m_hits++;
+                    return entry.texels;
+                }
+            }
+            m_misses++;
+        }
+
+        auto texels = std::make_shared<const std::vector<uint8_t>>(
+            generateSurfaceLevel(surface, level));
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_entries.push_back(
+            {surface.seed, surface.width, level, ++m_uses, texels});
+        m_bytes += texels->size();
+        while (m_bytes > m_budget && m_entries.size() > 1)
+        {
+            auto oldest = std::min_element(m_entries.begin(),
+                                           m_entries.end(),
+                                           [](const Entry &a, const Entry &b) {
+                                               return a.lastUse < b.lastUse;
+                                           });
+            m_bytes -= oldest->texels->size();
+            m_entries.erase(oldest);
+        }
+        return texels;
+    }
+
+    uint64_t bytes() const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_bytes;
+    }
+    uint64_t hits() const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_hits;
+    }
+    uint64_t misses() const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_misses;
+    }
+
+  private:
+    struct Entry {
+        uint32_t seed;
+        uint32_t width;
+        uint32_t level;
+        uint64_t lastUse;
+        std::shared_ptr<const std::vector<uint8_t>> texels;
+    };
+
+    mutable std::mutex m_mutex;
+    std::vector<Entry> m_entries;
+    uint64_t m_budget;
+    uint64_t m_bytes = 0;
+    uint64_t m_uses = 0;
+    uint64_t m_hits = 0;
+    uint64_t m_misses = 0;
+};
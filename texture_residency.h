@@ -0,0 +1,410 @@
+#pragma once
+
+#include "device_memory.h"
+#include "staging_ring.h"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <deque>
+#include <limits>
+#include <vector>
+#include <vulkan/vulkan_core.h>
+
+#define GLM_FORCE_RADIANS
+#include <glm/glm.hpp>
+
+/**
+ * Keeps only the mip levels of the textures resident that their models need
+ * on screen, within a budget of device memory. Every frame a model asks for
+ * the level whose texels are about a pixel at its current size (request()),
+ * update() then streams in the finer levels a texture is missing and, when
+ * the budget doesn't allow them, evicts the least recently used levels of
+ * the other textures first. Levels are only evicted under pressure, a
+ * texture keeps what it has as long as there is room.
+ *
+ * Vulkan 1.0 has no way to leave out levels of an image without sparse
+ * residency, so a texture's image holds the levels from its finest resident
+ * one down to 1x1 and a change of that level replaces the image (see
+ * TriangleApp::updateTextureResidency()). Levels no larger than
+ * RESIDENCY_TAIL_EXTENT always stay, every texture can be drawn.
+ *
+ * This is just the bookkeeping, the bytes of a level are the ones of its
+ * packed data (all faces), not the device's memory requirements.
+ * */
+const uint64_t TEXTURE_BUDGET_MEGABYTES = 512;
+const uint32_t RESIDENCY_TAIL_EXTENT = 128;
+const float RESIDENCY_TEXEL_PIXELS = 1.0f;
+
+/**
+ * Diameter in pixels of a bounding sphere on screen, 0 if it is outside the
+ * frustum. All in model space: the frustum of proj * view * model and the
+ * eye moved there, the scale of the model cancels out.
+ * */
+static float
+screenCoverage(const glm::vec3 &center,
+               float radius,
+               const std::array<glm::vec4, 6> &frustum,
+               const glm::vec3 &eye,
+               float fieldOfView,
+               float viewportHeight)
+{
+    for (const auto &plane : frustum)
+    {
+        if (glm::dot(glm::vec3(plane.x, plane.y, plane.z), center) + plane.w
+            < -radius)
+        {
+            return 0.0f;
+        }
+    }
+    const float distance = glm::length(center - eye) - radius;
+    if (distance <= 0.0f)
+    {
+        return std::numeric_limits<float>::max();
+    }
+    return radius * viewportHeight
+           / (std::tan(glm::radians(fieldOfView) * 0.5f) * distance);
+}
+
+/**
+ * Finest level a model covering coverage pixels needs: the texture wraps
+ * around the model with texelsAround texels at level 0 (the width of an
+ * equirectangular image, four faces of a cubemap), that is pi times the
+ * diameter, and a texel should cover about texelPixels pixels where the
+ * surface faces the camera
+ * */
+static uint32_t
+wantedMipLevel(float coverage,
+               uint32_t texelsAround,
+               uint32_t levelCount,
+               float texelPixels = RESIDENCY_TEXEL_PIXELS)
+{
+    const float pi = 3.14159265358979f;
+    const float texelsPerPixelTexel
+        = texelsAround * texelPixels / (pi * coverage);
+    if (not(texelsPerPixelTexel > 1.0f))
+    {
+        return 0;
+    }
+    return std::min(
+        levelCount - 1,
+        static_cast<uint32_t>(std::floor(std::log2(texelsPerPixelTexel))));
+}
+
+/// first level that is no larger than RESIDENCY_TAIL_EXTENT
+static uint32_t
+residencyTailLevel(uint32_t width, uint32_t height, uint32_t levelCount)
+{
+    uint32_t level = 0;
+    while (level + 1 < levelCount
+           && std::max(width >> level, height >> level) > RESIDENCY_TAIL_EXTENT)
+    {
+        level++;
+    }
+    return level;
+}
+
+/**
+ * The regions of the levels in [firstLevel, endLevel) for an image whose
+ * level 0 is baseLevel of the texture, at their offsets in the source
+ * */
+static std::vector<VkBufferImageCopy>
+levelRegions(const std::vector<VkBufferImageCopy> &regions,
+             uint32_t firstLevel,
+             uint32_t endLevel,
+             uint32_t baseLevel)
+{
+    std::vector<VkBufferImageCopy> levels;
+    for (VkBufferImageCopy region : regions)
+    {
+        if (region.imageSubresource.mipLevel >= firstLevel
+            && region.imageSubresource.mipLevel < endLevel)
+        {
+            region.imageSubresource.mipLevel -= baseLevel;
+            levels.push_back(region);
+        }
+    }
+    return levels;
+}
+
+/**
+ * Replaces the image of the sampled texture by one whose level 0 is
+ * baseLevel of the texture. The levels both images have are copied on the
+ * device, the finer ones come from the staging region (empty for an
+ * eviction).
+ * */
+struct TextureSwap {
+    uint32_t baseLevel = 0;
+    StagingRegion staging;
+    std::vector<VkBufferImageCopy> regions; /// from the staging region
+    // set by TriangleApp::beginTextureSwap()
+    VkImage oldImage = VK_NULL_HANDLE;
+    MemoryAllocation oldImageMemory;
+    VkImageView oldImageView = VK_NULL_HANDLE;
+    uint32_t oldBaseLevel = 0;
+    VkImage image = VK_NULL_HANDLE; /// the new one
+    uint32_t frame = 0; /// in flight when the swap was recorded
+    // set by TriangleApp::transferTextureSwap() when the staging region is
+    // copied on the transfer queue, before the swap begins
+    MemoryAllocation imageMemory;
+    VkSemaphore transferred = VK_NULL_HANDLE; /// signaled by the copy
+    uint64_t transferBatch = 0;
+    double transferStart = 0.0; /// seconds
+};
+
+/// new finest resident level of a texture, finer ones have to be streamed in
+struct ResidencyChange {
+    uint32_t texture;
+    uint32_t baseLevel;
+    uint32_t previousLevel;
+};
+
+struct ResidencyStats {
+    uint64_t residentBytes = 0; /// streaming levels included
+    uint64_t budgetBytes = 0;
+    uint32_t streaming = 0;
+    uint64_t evictions = 0; /// levels, since the start
+    uint64_t streamIns = 0;
+    float evictionsPerSecond = 0.0f; /// over the last second
+    float lastLatency = 0.0f;        /// ms from the decision to resident
+    float averageLatency = 0.0f;
+};
+
+class TextureResidency {
+  public:
+    void setBudget(uint64_t bytes) { m_budget = bytes; }
+
+    /**
+     * Registers a texture with the bytes of each of its levels, the ones no
+     * larger than RESIDENCY_TAIL_EXTENT start at tailLevel. Only the tail
+     * is resident at first, the finer levels follow once a model asks for
+     * them.
+     * */
+    uint32_t add(const std::vector<uint64_t> &levelBytes, uint32_t tailLevel)
+    {
+        Texture texture;
+        texture.levelBytes = levelBytes;
+        texture.lastUsed.assign(levelBytes.size(), 0);
+        texture.tailLevel
+            = std::min<uint32_t>(tailLevel, uint32_t(levelBytes.size()) - 1);
+        texture.residentLevel = texture.tailLevel;
+        m_residentBytes += bytesFrom(texture, texture.tailLevel);
+        texture.wantedLevel = texture.residentLevel;
+        texture.targetLevel = texture.residentLevel;
+        m_textures.push_back(texture);
+        return static_cast<uint32_t>(m_textures.size() - 1);
+    }
+
+    /// the model of texture needs level and the coarser ones this frame
+    void request(uint32_t id, uint32_t level, uint64_t frame)
+    {
+        Texture &texture = m_textures[id];
+        texture.wantedLevel = std::min(level, texture.tailLevel);
+        texture.requested = frame;
+        for (uint32_t i = texture.wantedLevel; i < texture.lastUsed.size(); i++)
+        {
+            texture.lastUsed[i] = frame;
+        }
+    }
+
+    /**
+     * Decides the changes of this frame: evictions are final right away,
+     * a stream-in is resident once finishStreamIn() is called for it. A
+     * texture has at most one stream-in at a time and isn't evicted from
+     * while it streams.
+     * */
+    std::vector<ResidencyChange> update(uint64_t frame, double seconds)
+    {
+        m_lastUpdate = seconds;
+        std::vector<uint32_t> previous(m_textures.size());
+        for (size_t i = 0; i < m_textures.size(); i++)
+        {
+            previous[i] = m_textures[i].residentLevel;
+        }
+
+        // a lower budget than before
+        while (m_residentBytes > m_budget && evictOne(frame, UINT32_MAX))
+        {
+        }
+
+        std::vector<ResidencyChange> changes;
+        for (uint32_t id = 0; id < m_textures.size(); id++)
+        {
+            Texture &texture = m_textures[id];
+            if (texture.streaming || texture.requested != frame
+                || texture.wantedLevel >= texture.residentLevel)
+            {
+                continue;
+            }
+            // as fine as the budget allows, other textures make room first
+            uint32_t target = texture.wantedLevel;
+            while (target < texture.residentLevel
+                   && m_residentBytes
+                              + bytesBetween(
+                                  texture, target, texture.residentLevel)
+                          > m_budget)
+            {
+                if (not evictOne(frame, id))
+                {
+                    target++;
+                }
+            }
+            if (target == texture.residentLevel)
+            {
+                continue;
+            }
+            m_residentBytes
+                += bytesBetween(texture, target, texture.residentLevel);
+            texture.streaming = true;
+            texture.targetLevel = target;
+            texture.streamStart = seconds;
+            changes.push_back({id, target, previous[id]});
+        }
+
+        for (uint32_t id = 0; id < m_textures.size(); id++)
+        {
+            const Texture &texture = m_textures[id];
+            if (not texture.streaming
+                && texture.residentLevel != previous[id])
+            {
+                changes.push_back({id, texture.residentLevel, previous[id]});
+            }
+        }
+
+        while (not m_evictionTimes.empty()
+               && m_evictionTimes.front() < seconds - 1.0)
+        {
+            m_evictionTimes.pop_front();
+        }
+        return changes;
+    }
+
+    /// the levels of the stream-in of texture are in its image now
+    void finishStreamIn(uint32_t id, double seconds)
+    {
+        Texture &texture = m_textures[id];
+        texture.streaming = false;
+        texture.residentLevel = texture.targetLevel;
+        m_lastLatency = static_cast<float>((seconds - texture.streamStart)
+                                           * 1000.0);
+        m_latencySum += m_lastLatency;
+        m_streamIns++;
+    }
+
+    /// a stream-in that failed, the bytes it reserved are free again
+    void cancelStreamIn(uint32_t id)
+    {
+        Texture &texture = m_textures[id];
+        m_residentBytes -= bytesBetween(
+            texture, texture.targetLevel, texture.residentLevel);
+        texture.streaming = false;
+        texture.targetLevel = texture.residentLevel;
+    }
+
+    uint32_t residentLevel(uint32_t id) const
+    {
+        return m_textures[id].residentLevel;
+    }
+    uint32_t wantedLevel(uint32_t id) const
+    {
+        return m_textures[id].wantedLevel;
+    }
+    bool streaming(uint32_t id) const { return m_textures[id].streaming; }
+
+    ResidencyStats stats() const
+    {
+        ResidencyStats stats;
+        stats.residentBytes = m_residentBytes;
+        stats.budgetBytes = m_budget;
+        for (const auto &texture : m_textures)
+        {
+            stats.streaming += texture.streaming ? 1 : 0;
+        }
+        stats.evictions = m_evictions;
+        stats.streamIns = m_streamIns;
+        stats.evictionsPerSecond = static_cast<float>(m_evictionTimes.size());
+        stats.lastLatency = m_lastLatency;
+        stats.averageLatency
+            = m_streamIns > 0 ? static_cast<float>(m_latencySum / m_streamIns)
+                              : 0.0f;
+        return stats;
+    }
+
+  private:
+    struct Texture {
+        std::vector<uint64_t> levelBytes;
+        std::vector<uint64_t> lastUsed; /// frame each level was last needed
+        uint32_t tailLevel = 0;
+        uint32_t residentLevel = 0;
+        uint32_t wantedLevel = 0;
+        uint32_t targetLevel = 0; /// residentLevel unless streaming
+        uint64_t requested = 0;   /// frame of the last request()
+        bool streaming = false;
+        double streamStart = 0.0;
+    };
+
+    static uint64_t bytesBetween(const Texture &texture,
+                                 uint32_t first,
+                                 uint32_t end)
+    {
+        uint64_t bytes = 0;
+        for (uint32_t level = first; level < end; level++)
+        {
+            bytes += texture.levelBytes[level];
+        }
+        return bytes;
+    }
+
+    static uint64_t bytesFrom(const Texture &texture, uint32_t first)
+    {
+        return bytesBetween(
+            texture, first, static_cast<uint32_t>(texture.levelBytes.size()));
+    }
+
+    /**
+     * Drops the finest level of the texture (other than keep) whose finest
+     * level was used the longest ago, levels needed this frame, the tails
+     * and streaming textures are left alone. false if there is none.
+     * */
+    bool evictOne(uint64_t frame, uint32_t keep)
+    {
+        Texture *oldest = nullptr;
+        for (uint32_t id = 0; id < m_textures.size(); id++)
+        {
+            Texture &texture = m_textures[id];
+            if (id == keep || texture.streaming
+                || texture.residentLevel >= texture.tailLevel
+                || texture.lastUsed[texture.residentLevel] >= frame)
+            {
+                continue;
+            }
+            if (not oldest
+                || texture.lastUsed[texture.residentLevel]
+                       < oldest->lastUsed[oldest->residentLevel])
+            {
+                oldest = &texture;
+            }
+        }
+        if (not oldest)
+        {
+            return false;
+        }
+        m_residentBytes -= oldest->levelBytes[oldest->residentLevel];
+        oldest->residentLevel++;
+        oldest->targetLevel = oldest->residentLevel;
+        m_evictions++;
+        m_evictionTimes.push_back(m_lastUpdate);
+        return true;
+    }
+
+    std::vector<Texture> m_textures;
+    uint64_t m_budget = TEXTURE_BUDGET_MEGABYTES << 20;
+    uint64_t m_residentBytes = 0;
+    uint64_t m_evictions = 0;
+    uint64_t m_streamIns = 0;
+    std::deque<double> m_evictionTimes; /// of the last second
+    double m_lastUpdate = 0.0;
+    float m_lastLatency = 0.0f;
+    double m_latencySum = 0.0;
+};
@@ -0,0 +1,105 @@
+#pragma once
+
+#include "device_memory.h"
+
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <vulkan/vulkan_core.h>
+
+/**
+ * Bindless textures: instead of one combined image sampler per descriptor
+ * set, the textures of all scene models sit in one array of samplers
+ * (binding 2 of the scene descriptor set). The set is bound once per frame
+ * and every draw picks its texture by index, passed as its firstInstance,
+ * so the indirect draws of the meshlet culling carry it without a
+ * descriptor set or push constant per draw. shaders/shader_bindless.vert
+ * hands gl_InstanceIndex on to the fragment shader, which indexes the array.
+ *
+ * The array is allocated once at its full size and only the slots in use
+ * are written (descriptorBindingPartiallyBound). A texture that streams in
+ * or out (see texture_residency.h) gets a new image view, its slot is
+ * rewritten in each descriptor set when the frame of that set isn't in
+ * flight any more.
+ * */
+const uint32_t BINDLESS_TEXTURE_CAPACITY = 256;
+
+/// a texture of the bindless array that is uploaded whole
+struct SceneTexture {
+    VkImage image;
+    MemoryAllocation memory;
+    VkImageView view;
+};
+
+/**
+ * The slots of the bindless texture array: the texture path in each and the
+ * image view it is sampled through now, and which views the descriptor set
+ * of every frame in flight holds
+ * */
+class TextureTable {
+  public:
+    explicit TextureTable(uint32_t frameCount) : m_written(frameCount) {}
+
+    /// slot of the texture at path, the next free one for a new path
+    uint32_t add(const std::string &path)
+    {
+        uint32_t slot;
+        if (find(path, slot))
+        {
+            return slot;
+        }
+        if (m_paths.size() == BINDLESS_TEXTURE_CAPACITY)
+        {
+            throw std::runtime_error("bindless texture array is full!");
+        }
+        m_paths.push_back(path);
+        m_views.push_back(VK_NULL_HANDLE);
+        return static_cast<uint32_t>(m_paths.size() - 1);
+    }
+
+    bool find(const std::string &path, uint32_t &slot) const
+    {
+        for (size_t i = 0; i < m_paths.size(); i++)
+        {
+            if (m_paths[i] == path)
+            {
+                slot = static_cast<uint32_t>(i);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /// the texture in slot is sampled through view from now on
+    void setView(uint32_t slot, VkImageView view) { m_views[slot] = view; }
+
+    /**
+     * The slots whose view isn't in the descriptor set of frame yet, which
+     * count as written from now on
+     * */
+    std::vector<uint32_t> takeStaleSlots(uint32_t frame)
+    {
+        std::vector<VkImageView> &written = m_written[frame];
+        written.resize(m_views.size(), VK_NULL_HANDLE);
+        std::vector<uint32_t> slots;
+        for (uint32_t slot = 0; slot < m_views.size(); slot++)
+        {
+            if (m_views[slot] != VK_NULL_HANDLE
+                && written[slot] != m_views[slot])
+            {
+                written[slot] = m_views[slot];
+                slots.push_back(slot);
+            }
+        }
+        return slots;
+    }
+
+    VkImageView view(uint32_t slot) const { return m_views[slot]; }
+    uint32_t size() const { return static_cast<uint32_t>(m_paths.size()); }
+
+  private:
+    std::vector<std::string> m_paths;
+    std::vector<VkImageView> m_views;
+    std::vector<std::vector<VkImageView>> m_written; /// per frame in flight
+};
@@ -0,0 +1,178 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+/**
+ * Small fixed size thread pool for the CPU heavy parts of asset loading
+ * (parsing, welding, texture decoding, ...). Tasks are plain closures in a
+ * FIFO queue, there is no work stealing.
+ * */
+class ThreadPool {
+  public:
+    explicit ThreadPool(
+        size_t threadCount = std::max(1u, std::thread::hardware_concurrency()))
+    {
+        m_workers.reserve(threadCount);
+        for (size_t i = 0; i < threadCount; i++)
+        {
+            m_workers.emplace_back([this] { workerLoop(); });
+        }
+    }
+
+    ~ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stopping = true;
+        }
+        m_condition.notify_all();
+        for (auto &worker : m_workers)
+        {
+            worker.join();
+        }
+    }
+
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    size_t threadCount() const { return m_workers.size(); }
+
+    /// queue a task, the returned future also transports exceptions
+    template <typename F>
+    auto submit(F &&task) -> std::future<std::invoke_result_t<F>>
+    {
+        using Result = std::invoke_result_t<F>;
+        auto packaged = std::make_shared<std::packaged_task<Result()>>(
+            std::forward<F>(task));
+        std::future<Result> future = packaged->get_future();
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_tasks.emplace([packaged] { (*packaged)(); });
+        }
+        m_condition.notify_one();
+        return future;
+    }
+
+    /**
+     * Runs body(i) for every i in [0, count) and returns when all of them are
+     * done. The calling thread takes part in the work, so a parallelFor()
+     * issued from inside a pool task can't dead lock even if every worker is
+     * busy. The first exception thrown by body is rethrown here.
+     * */
+    template <typename F> void parallelFor(size_t count, F &&body)
+    {
+        if (count == 0)
+        {
+            return;
+        }
+        if (count == 1 || m_workers.empty())
+        {
+            for (size_t i = 0; i < count; i++)
+            {
+                body(i);
+            }
+            return;
+        }
+
+        struct State {
+            std::atomic<size_t> next{0};
+            std::atomic<size_t> done{0};
+            std::mutex mutex;
+            std::condition_variable finished;
+            std::exception_ptr error;
+        };
+        auto state = std::make_shared<State>();
+        auto *bodyPtr = &body;
+
+        // helpers that start after all items were taken never touch body,
+        // so it's fine that it only lives on the callers stack
+        auto work = [state, bodyPtr, count] {
+            size_t i;
+            while ((i = state->next.fetch_add(1)) < count)
+            {
+                try
+                {
+                    (*bodyPtr)(i);
+                } catch (...)
+                {
+                    std::lock_guard<std::mutex> lock(state->mutex);
+                    if (not state->error)
+                    {
+                        state->error = std::current_exception();
+                    }
+                }
+                if (state->done.fetch_add(1) + 1 == count)
+                {
+                    std::lock_guard<std::mutex> lock(state->mutex);
+                    state->finished.notify_all();
+                }
+            }
+        };
+
+        size_t helpers = std::min(count - 1, m_workers.size());
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            for (size_t i = 0; i < helpers; i++)
+            {
+                m_tasks.emplace(work);
+            }
+        }
+        m_condition.notify_all();
+
+        work();
+
+        std::unique_lock<std::mutex> lock(state->mutex);
+        state->finished.wait(lock, [&] { return state->done.load() == count; });
+        if (state->error)
+        {
+            std::rethrow_exception(state->error);
+        }
+    }
+
+  private:
+    void workerLoop()
+    {
+        for (;;)
+        {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_condition.wait(
+                    lock, [this] { return m_stopping || not m_tasks.empty(); });
+                if (m_stopping && m_tasks.empty())
+                {
+                    return;
+                }
+                task = std::move(m_tasks.front());
+                m_tasks.pop();
+            }
+            task();
+        }
+    }
+
+    std::vector<std::thread> m_workers;
+    std::queue<std::function<void()>> m_tasks;
+    std::mutex m_mutex;
+    std::condition_variable m_condition;
+    bool m_stopping = false;
+};
+
+/// process wide pool used by the asset loaders, created on first use
+static ThreadPool &
+sharedThreadPool()
+{
+    static ThreadPool pool;
+    return pool;
+}
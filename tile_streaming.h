@@ -0,0 +1,593 @@
+#pragma once
+
+#include "data_types.h"
+#include "meshlet.h"
+#include "staging_ring.h"
+#include "texture_decoder.h"
+
+#include <algorithm>
+#include <array>
+#include <cctype>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <filesystem>
+#include <string>
+#include <system_error>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * Imagery streaming from a local tile pyramid (root/z/x/y.jpg, .jpeg or
+ * .png, as written by gdal2tiles or mirrored from NASA GIBS) for imagery far
+ * larger than a single texture, e.g. Blue Marble at 500 m per pixel.
+ *
+ * The tiles are in geographic (plate carree) tiling like the EPSG:4326 GIBS
+ * layers: the coarsest level in the directory has rootColumns x rootRows
+ * tiles, every level below doubles both, x goes east from 180 degrees west
+ * and y south from the north pole. The map coordinates u, v of a point are
+ * the same as the texture coordinates of the equirectangular sphere textures
+ * (see generateSphere()), so a tile covers [x, x + 1] / columns by
+ * [y, y + 1] / rows of them. Web Mercator pyramids are not reprojected.
+ *
+ * Every frame the quadtree below the root tiles is refined where a texel of
+ * a tile covers more than a given number of pixels and the patches in the
+ * view frustum facing the camera are drawn (selectTiles()). Each patch
+ * samples the finest of its own tile and its ancestors that is resident in
+ * the tile cache, a texture array with one tile and its mips per layer, and
+ * missing tiles are requested coarse to fine. TileCache is the page table of
+ * that array and evicts the least recently drawn tiles; the root tiles stay
+ * resident so there is always something to draw.
+ * */
+
+/// patches are split at least until they span this many degrees of
+/// longitude, so the globe is round before any imagery asks for it
+const float TILE_MAX_PATCH_DEGREES = 45.0f;
+
+/// quads per side of the grid every patch is drawn with (tile.vert)
+const uint32_t TILE_PATCH_QUADS = 16;
+
+/// tiles decoded at the same time, the rest are requested again next frame
+const uint32_t TILE_MAX_REQUESTS = 8;
+
+/// a finer tile is requested where a texel covers more pixels than this
+const float TILE_TEXEL_PIXELS = 1.0f;
+
+struct TileId {
+    uint32_t level; /// z, absolute as in the directory
+    uint32_t x;
+    uint32_t y;
+};
+
+static inline uint64_t
+tileKey(const TileId &tile)
+{
+    return (uint64_t(tile.level) << 56) | (uint64_t(tile.x) << 28) | tile.y;
+}
+
+static inline bool
+parseTileNumber(const std::string &name, uint32_t &number)
+{
+    if (name.empty() || name.size() > 9
+        || not std::all_of(name.begin(), name.end(), [](char c) {
+               return c >= '0' && c <= '9';
+           }))
+    {
+        return false;
+    }
+    number = static_cast<uint32_t>(std::strtoul(name.c_str(), nullptr, 10));
+    return true;
+}
+
+/// the tiles found in the directory, see scanTilePyramid()
+struct TilePyramid {
+    std::string root;
+    uint32_t firstLevel = 0; /// coarsest level in the directory
+    uint32_t lastLevel = 0;
+    uint32_t rootColumns = 0; /// tiles of the first level
+    uint32_t rootRows = 0;
+    uint32_t tileWidth = 0; /// all tiles have the size of the first one
+    uint32_t tileHeight = 0;
+    std::unordered_map<uint64_t, std::string> tiles; /// key -> image path
+
+    uint32_t columns(uint32_t level) const
+    {
+        return rootColumns << (level - firstLevel);
+    }
+
+    uint32_t rows(uint32_t level) const
+    {
+        return rootRows << (level - firstLevel);
+    }
+
+    bool contains(const TileId &tile) const
+    {
+        return tiles.count(tileKey(tile)) != 0;
+    }
+};
+
+/**
+ * Collects the z/x/y images below root. Fails without any tiles or if the
+ * first level isn't complete, its tiles are what is drawn before anything
+ * finer arrives.
+ * */
+static bool
+scanTilePyramid(const std::string &root, TilePyramid &pyramid)
+{
+    namespace fs = std::filesystem;
+    pyramid = TilePyramid{};
+    pyramid.root = root;
+
+    std::error_code error;
+    bool first = true;
+    for (const auto &levelEntry : fs::directory_iterator(root, error))
+    {
+        uint32_t level;
+        if (not levelEntry.is_directory()
+            || not parseTileNumber(levelEntry.path().filename().string(),
+                                   level))
+        {
+            continue;
+        }
+        for (const auto &columnEntry :
+             fs::directory_iterator(levelEntry.path(), error))
+        {
+            uint32_t x;
+            if (not columnEntry.is_directory()
+                || not parseTileNumber(columnEntry.path().filename().string(),
+                                       x))
+            {
+                continue;
+            }
+            for (const auto &tileEntry :
+                 fs::directory_iterator(columnEntry.path(), error))
+            {
+                std::string extension = tileEntry.path().extension().string();
+                std::transform(extension.begin(),
+                               extension.end(),
+                               extension.begin(),
+                               [](unsigned char c) { return std::tolower(c); });
+                uint32_t y;
+                if (not tileEntry.is_regular_file()
+                    || (extension != ".jpg" && extension != ".jpeg"
+                        && extension != ".png")
+                    || not parseTileNumber(tileEntry.path().stem().string(),
+                                           y))
+                {
+                    continue;
+                }
+                pyramid.tiles[tileKey({level, x, y})]
+                    = tileEntry.path().string();
+                pyramid.firstLevel
+                    = first ? level : std::min(pyramid.firstLevel, level);
+                pyramid.lastLevel
+                    = first ? level : std::max(pyramid.lastLevel, level);
+                first = false;
+            }
+        }
+    }
+    if (pyramid.tiles.empty())
+    {
+        return false;
+    }
+
+    for (const auto &tile : pyramid.tiles)
+    {
+        if ((tile.first >> 56) == pyramid.firstLevel)
+        {
+            const uint32_t x = (tile.first >> 28) & 0xFFFFFFF;
+            const uint32_t y = tile.first & 0xFFFFFFF;
+            pyramid.rootColumns = std::max(pyramid.rootColumns, x + 1);
+            pyramid.rootRows = std::max(pyramid.rootRows, y + 1);
+        }
+    }
+    // the shifts of columns() and rows() have to stay in the key
+    if (pyramid.lastLevel - pyramid.firstLevel > 20)
+    {
+        return false;
+    }
+    for (uint32_t y = 0; y < pyramid.rootRows; y++)
+    {
+        for (uint32_t x = 0; x < pyramid.rootColumns; x++)
+        {
+            if (not pyramid.contains({pyramid.firstLevel, x, y}))
+            {
+                return false;
+            }
+        }
+    }
+    const std::string &firstTile
+        = pyramid.tiles.at(tileKey({pyramid.firstLevel, 0, 0}));
+    return readImageExtent(firstTile, pyramid.tileWidth, pyramid.tileHeight);
+}
+
+/// u, v of the north west and south east corner of tile in the map
+static inline glm::vec4
+tileMapRect(const TilePyramid &pyramid, const TileId &tile)
+{
+    const double columns = pyramid.columns(tile.level);
+    const double rows = pyramid.rows(tile.level);
+    return glm::vec4(static_cast<float>(tile.x / columns),
+                     static_cast<float>(tile.y / rows),
+                     static_cast<float>((tile.x + 1) / columns),
+                     static_cast<float>((tile.y + 1) / rows));
+}
+
+/// the unit sphere point at map coordinates u, v, before the sphere is
+/// turned like the model (see generateSphere()); tile.vert does the same
+static inline glm::vec3
+tileMapPosition(float u, float v)
+{
+    const float pi = 3.14159265358979f;
+    const float longitude = 2.0f * pi * (u - 0.5f);
+    const float latitude = pi * (0.5f - v);
+    return glm::vec3(std::cos(latitude) * std::sin(longitude),
+                     std::sin(latitude),
+                     std::cos(latitude) * std::cos(longitude));
+}
+
+/**
+ * Bounding sphere and normal cone of the patch of tile, from a 5x5 grid of
+ * its points (the normals of a unit sphere are the points), for
+ * meshletVisible()
+ * */
+static MeshletBounds
+tilePatchBounds(const TilePyramid &pyramid, const TileId &tile)
+{
+    const glm::vec4 rect = tileMapRect(pyramid, tile);
+    std::array<glm::vec3, 25> points;
+    glm::vec3 minPos(2.0f), maxPos(-2.0f);
+    for (uint32_t j = 0; j < 5; j++)
+    {
+        for (uint32_t i = 0; i < 5; i++)
+        {
+            glm::vec3 point
+                = tileMapPosition(rect.x + (rect.z - rect.x) * i * 0.25f,
+                                  rect.y + (rect.w - rect.y) * j * 0.25f);
+            points[j * 5 + i] = point;
+            minPos = glm::min(minPos, point);
+            maxPos = glm::max(maxPos, point);
+        }
+    }
+
+    const glm::vec3 center = 0.5f * (minPos + maxPos);
+    const glm::vec3 axis = points[12];
+    float radius = 0.0f;
+    float minDot = 1.0f;
+    for (const auto &point : points)
+    {
+        radius = std::max(radius, glm::length(point - center));
+        minDot = std::min(minDot, glm::dot(axis, point));
+    }
+
+    MeshletBounds bounds;
+    bounds.sphere = glm::vec4(center.x, center.y, center.z, radius);
+    float cutoff = minDot < MESHLET_MIN_CONE_DOT
+                       ? 1.0f
+                       : std::sqrt(1.0f - minDot * minDot);
+    bounds.cone = glm::vec4(axis.x, axis.y, axis.z, cutoff);
+    return bounds;
+}
+
+/**
+ * Whether some point of the patch could be in front of the horizon, seen
+ * from eye. On the unit sphere the visible points p have dot(p, eye) > 1, the
+ * closest the patch comes to the direction of the eye is the angle to its
+ * axis minus the angle of its cone. The cone test of meshletVisible() only
+ * sees whole patches facing away, which lets most of the far side through.
+ * */
+static inline bool
+tileAboveHorizon(const MeshletBounds &bounds, const glm::vec3 &eye)
+{
+    const float distance = glm::length(eye);
+    const float cutoff = bounds.cone.w;
+    if (distance <= 1.0f || cutoff >= 1.0f)
+    {
+        return true;
+    }
+    const glm::vec3 axis(bounds.cone.x, bounds.cone.y, bounds.cone.z);
+    const float eyeAngle = std::acos(
+        std::min(std::max(glm::dot(axis, eye) / distance, -1.0f), 1.0f));
+    const float angle = eyeAngle - std::asin(cutoff);
+    return angle <= 0.0f || distance * std::cos(angle) > 1.0f;
+}
+
+/**
+ * Page table of the tile cache: which tile is in which layer of the texture
+ * array. A layer is reserved when its tile is requested and becomes
+ * resident once the tile is uploaded; the layer of the least recently drawn
+ * unpinned tile is taken over when none is free.
+ * */
+class TileCache {
+  public:
+    void reset(uint32_t layerCount)
+    {
+        m_layers.assign(layerCount, Layer{});
+        m_pageTable.clear();
+        m_freeLayers.clear();
+        for (uint32_t layer = layerCount; layer-- > 0;)
+        {
+            m_freeLayers.push_back(layer);
+        }
+        m_residentCount = 0;
+    }
+
+    uint32_t layerCount() const
+    {
+        return static_cast<uint32_t>(m_layers.size());
+    }
+
+    uint32_t residentCount() const { return m_residentCount; }
+
+    /// requested or resident
+    bool contains(uint64_t key) const { return m_pageTable.count(key) != 0; }
+
+    /// layer of a resident tile, which counts as drawn in frame, or -1
+    int32_t use(uint64_t key, uint64_t frame)
+    {
+        auto it = m_pageTable.find(key);
+        if (it == m_pageTable.end() || not m_layers[it->second].resident)
+        {
+            return -1;
+        }
+        m_layers[it->second].lastUsed = frame;
+        return static_cast<int32_t>(it->second);
+    }
+
+    /// layer for the tile, -1 if every layer is drawn in frame, pinned or
+    /// still waiting for its tile
+    int32_t reserve(uint64_t key, uint64_t frame, bool pinned = false)
+    {
+        uint32_t layer;
+        if (not m_freeLayers.empty())
+        {
+            layer = m_freeLayers.back();
+            m_freeLayers.pop_back();
+        } else
+        {
+            int32_t oldest = -1;
+            for (uint32_t i = 0; i < m_layers.size(); i++)
+            {
+                const Layer &candidate = m_layers[i];
+                if (candidate.resident && not candidate.pinned
+                    && candidate.lastUsed < frame
+                    && (oldest < 0
+                        || candidate.lastUsed < m_layers[oldest].lastUsed))
+                {
+                    oldest = static_cast<int32_t>(i);
+                }
+            }
+            if (oldest < 0)
+            {
+                return -1;
+            }
+            layer = static_cast<uint32_t>(oldest);
+            m_pageTable.erase(m_layers[layer].key);
+            m_residentCount--;
+        }
+        m_layers[layer] = Layer{key, frame, false, pinned};
+        m_pageTable[key] = layer;
+        return static_cast<int32_t>(layer);
+    }
+
+    void markResident(uint64_t key)
+    {
+        Layer &layer = m_layers[m_pageTable.at(key)];
+        if (not layer.resident)
+        {
+            layer.resident = true;
+            m_residentCount++;
+        }
+    }
+
+    /// gives up a reserved layer whose tile failed to load
+    void release(uint64_t key)
+    {
+        auto it = m_pageTable.find(key);
+        if (it == m_pageTable.end())
+        {
+            return;
+        }
+        if (m_layers[it->second].resident)
+        {
+            m_residentCount--;
+        }
+        m_layers[it->second] = Layer{};
+        m_freeLayers.push_back(it->second);
+        m_pageTable.erase(it);
+    }
+
+  private:
+    struct Layer {
+        uint64_t key = 0;
+        uint64_t lastUsed = 0; /// frame it was last drawn in
+        bool resident = false;
+        bool pinned = false;
+    };
+
+    std::vector<Layer> m_layers;
+    std::unordered_map<uint64_t, uint32_t> m_pageTable; /// key -> layer
+    std::vector<uint32_t> m_freeLayers;
+    uint32_t m_residentCount = 0;
+};
+
+/**
+ * A tile and its mips, decoded into a staging region, on its way into its
+ * layer of the tile cache
+ * */
+struct TileBatch {
+    TileId tile;
+    uint32_t layer;
+    StagingRegion staging; /// empty if the tile failed to load
+};
+
+/// push constants of tile.vert, one patch per draw
+struct TilePushConstants {
+    glm::mat4 modelViewProjection; /// of the unit sphere
+    glm::vec4 bounds;   /// u0, v0, u1, v1 of the patch in the map
+    glm::vec4 tileRect; /// xy offset, zw scale of the patch in its tile
+    uint32_t layer;     /// of the tile in the cache
+    uint32_t padding[3];
+};
+
+static_assert(sizeof(TilePushConstants) <= 128,
+              "TilePushConstants must fit the push constant minimum");
+
+struct TilePatch {
+    glm::vec4 bounds;
+    glm::vec4 tileRect;
+    uint32_t layer;
+};
+
+/// what selectTiles() found for a frame
+struct TileSelection {
+    std::vector<TilePatch> patches;
+    std::vector<TileId> requests; /// missing tiles, coarse to fine
+};
+
+/// the view of a frame, everything in the space of the unit sphere
+struct TileView {
+    std::array<glm::vec4, 6> frustum; /// see frustumPlanes()
+    glm::vec3 eye;
+    float pixelsPerUnit; /// at distance 1, viewport height / 2 tan(fov / 2)
+    float texelPixels;   /// see TILE_TEXEL_PIXELS
+    uint64_t frame;
+};
+
+/// where the patch of tile lies in source, one of its ancestors or itself
+static glm::vec4
+tileSourceRect(const TileId &tile, const TileId &source)
+{
+    const uint32_t shift = tile.level - source.level;
+    const double scale = 1.0 / double(1u << shift);
+    return glm::vec4(
+        static_cast<float>((tile.x - (source.x << shift)) * scale),
+        static_cast<float>((tile.y - (source.y << shift)) * scale),
+        static_cast<float>(scale),
+        static_cast<float>(scale));
+}
+
+static void
+selectTile(const TilePyramid &pyramid,
+           TileCache &cache,
+           const TileView &view,
+           const TileId &tile,
+           TileId source,
+           int32_t sourceLayer,
+           TileSelection &selection)
+{
+    const MeshletBounds bounds = tilePatchBounds(pyramid, tile);
+    if (not meshletVisible(bounds, view.frustum, view.eye)
+        || not tileAboveHorizon(bounds, view.eye))
+    {
+        return;
+    }
+
+    const uint64_t key = tileKey(tile);
+    const int32_t layer = cache.use(key, view.frame);
+    if (layer >= 0)
+    {
+        source = tile;
+        sourceLayer = layer;
+    } else if (not cache.contains(key) && pyramid.contains(tile))
+    {
+        selection.requests.push_back(tile);
+    }
+
+    const float pi = 3.14159265358979f;
+    const uint32_t columns = pyramid.columns(tile.level);
+    const uint32_t rows = pyramid.rows(tile.level);
+    const float texelSize
+        = std::max(2.0f * pi / (columns * pyramid.tileWidth),
+                   pi / (rows * pyramid.tileHeight));
+    const glm::vec3 center(bounds.sphere);
+    const float distance
+        = std::max(glm::length(center - view.eye) - bounds.sphere.w, 1e-4f);
+    const bool refine
+        = 360.0f / columns > TILE_MAX_PATCH_DEGREES
+          || (tile.level < pyramid.lastLevel
+              && texelSize * view.pixelsPerUnit / distance > view.texelPixels);
+    if (refine)
+    {
+        for (uint32_t child = 0; child < 4; child++)
+        {
+            selectTile(pyramid,
+                       cache,
+                       view,
+                       {tile.level + 1,
+                        2 * tile.x + (child & 1),
+                        2 * tile.y + (child >> 1)},
+                       source,
+                       sourceLayer,
+                       selection);
+        }
+        return;
+    }
+
+    // nothing resident above a patch of a root tile still loading
+    if (sourceLayer < 0)
+    {
+        return;
+    }
+    TilePatch patch;
+    patch.bounds = tileMapRect(pyramid, tile);
+    patch.tileRect = tileSourceRect(tile, source);
+    patch.layer = static_cast<uint32_t>(sourceLayer);
+    selection.patches.push_back(patch);
+}
+
+/**
+ * Walks the quadtree from the root tiles: the patches to draw with the
+ * resident tile each samples, and the tiles on the way that are missing
+ * from the cache
+ * */
+static void
+selectTiles(const TilePyramid &pyramid,
+            TileCache &cache,
+            const TileView &view,
+            TileSelection &selection)
+{
+    selection.patches.clear();
+    selection.requests.clear();
+    for (uint32_t y = 0; y < pyramid.rootRows; y++)
+    {
+        for (uint32_t x = 0; x < pyramid.rootColumns; x++)
+        {
+            const TileId root{pyramid.firstLevel, x, y};
+            selectTile(pyramid, cache, view, root, root, -1, selection);
+        }
+    }
+    std::stable_sort(selection.requests.begin(),
+                     selection.requests.end(),
+                     [](const TileId &a, const TileId &b) {
+                         return a.level < b.level;
+                     });
+}
+
+/// indices of the TILE_PATCH_QUADS^2 grid, its vertices row by row from the
+/// north west corner, counter clockwise seen from outside the sphere
+static std::vector<uint16_t>
+tilePatchIndices()
+{
+    const uint32_t row = TILE_PATCH_QUADS + 1;
+    std::vector<uint16_t> patchIndices;
+    patchIndices.reserve(TILE_PATCH_QUADS * TILE_PATCH_QUADS * 6);
+    for (uint32_t j = 0; j < TILE_PATCH_QUADS; j++)
+    {
+        for (uint32_t i = 0; i < TILE_PATCH_QUADS; i++)
+        {
+            const uint16_t northWest = static_cast<uint16_t>(j * row + i);
+            const uint16_t northEast = northWest + 1;
+            const uint16_t southWest = static_cast<uint16_t>(northWest + row);
+            const uint16_t southEast = southWest + 1;
+            patchIndices.insert(patchIndices.end(),
+                                {northWest,
+                                 southWest,
+                                 northEast,
+                                 northEast,
+                                 southWest,
+                                 southEast});
+        }
+    }
+    return patchIndices;
+}
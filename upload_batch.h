@@ -0,0 +1,248 @@
+#pragma once
+
+#include <cstdint>
+#include <stdexcept>
+#include <vector>
+#include <vulkan/vulkan_core.h>
+
+/**
+ * Uploads outside of the frames (the initialization) recorded one after the
+ * other into one command buffer and submitted at once, instead of a submit
+ * and a vkQueueWaitIdle per copy and layout transition. submit() hands out
+ * an increasing value for the batch, done() polls whether the batch of a
+ * value has finished and wait() blocks until it has. Nothing has to wait
+ * for the uploads before drawing: the frames are submitted to the same
+ * queue after them, and a barrier at the end of every batch makes its
+ * writes visible to everything that comes later.
+ *
+ * fence() is the fence of the open batch, for the staging regions its
+ * copies read (see staging_ring.h). It signals once the batch has been
+ * submitted and executed, every batch that was begun has to be submitted.
+ * The command buffers and fences of finished batches are reused.
+ *
+ * A batch on another queue than the one that draws (a transfer queue)
+ * signals a semaphore as well, the frame that uses its results waits for it.
+ * */
+class UploadBatch {
+  public:
+    /// callbacks for the host memory of the Vulkan calls, may be null
+    void init(VkDevice device,
+              VkQueue queue,
+              uint32_t queueFamily,
+              const VkAllocationCallbacks *callbacks)
+    {
+        m_device = device;
+        m_queue = queue;
+        m_callbacks = callbacks;
+        VkCommandPoolCreateInfo poolInfo{};
+        poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+        poolInfo.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT
+                         | VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+        poolInfo.queueFamilyIndex = queueFamily;
+        if (vkCreateCommandPool(
+                m_device, &poolInfo, m_callbacks, &m_commandPool)
+            != VK_SUCCESS)
+        {
+            throw std::runtime_error("failed to create upload command pool!");
+        }
+    }
+
+    /// the command buffer of the open batch, begins one if there is none
+    VkCommandBuffer commands()
+    {
+        if (m_open == NO_BATCH)
+        {
+            begin();
+        }
+        return m_batches[m_open].commandBuffer;
+    }
+
+    /// fence the open batch signals, begins one if there is none
+    VkFence fence()
+    {
+        if (m_open == NO_BATCH)
+        {
+            begin();
+        }
+        return m_batches[m_open].fence;
+    }
+
+    /**
+     * Submits the open batch, the value returned stands for it. The value of
+     * the batch before if none was begun since. signal is signaled along
+     * with the fence, if given.
+     * */
+    uint64_t submit(VkSemaphore signal = VK_NULL_HANDLE)
+    {
+        if (m_open == NO_BATCH)
+        {
+            return m_submitted;
+        }
+        Batch &batch = m_batches[m_open];
+        // the copies are read by the vertex input, the shaders and the
+        // indirect draws of the frames
+        VkMemoryBarrier barrier{};
+        barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+        barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        barrier.dstAccessMask = VK_ACCESS_MEMORY_READ_BIT;
+        vkCmdPipelineBarrier(batch.commandBuffer,
+                             VK_PIPELINE_STAGE_TRANSFER_BIT,
+                             VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
+                             0,
+                             1,
+                             &barrier,
+                             0,
+                             nullptr,
+                             0,
+                             nullptr);
+        vkEndCommandBuffer(batch.commandBuffer);
+
+        VkSubmitInfo submitInfo{};
+        submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+        submitInfo.commandBufferCount = 1;
+        submitInfo.pCommandBuffers = &batch.commandBuffer;
+        if (signal != VK_NULL_HANDLE)
+        {
+            submitInfo.signalSemaphoreCount = 1;
+            submitInfo.pSignalSemaphores = &signal;
+        }
+        if (vkQueueSubmit(m_queue, 1, &submitInfo, batch.fence) != VK_SUCCESS)
+        {
+            throw std::runtime_error("failed to submit upload batch!");
+        }
+        batch.value = ++m_submitted;
+        m_open = NO_BATCH;
+        return batch.value;
+    }
+
+    /// whether the batch of value (and every one before) has finished
+    bool done(uint64_t value)
+    {
+        for (const auto &batch : m_batches)
+        {
+            if (batch.value != 0 && batch.value <= value
+                && vkGetFenceStatus(m_device, batch.fence) != VK_SUCCESS)
+            {
+                return false;
+            }
+        }
+        return value <= m_submitted;
+    }
+
+    /// blocks until the batch of value has finished
+    void wait(uint64_t value)
+    {
+        for (const auto &batch : m_batches)
+        {
+            if (batch.value != 0 && batch.value <= value)
+            {
+                vkWaitForFences(
+                    m_device, 1, &batch.fence, VK_TRUE, UINT64_MAX);
+            }
+        }
+    }
+
+    /// every batch must have finished by now
+    void destroy()
+    {
+        for (const auto &batch : m_batches)
+        {
+            vkDestroyFence(m_device, batch.fence, m_callbacks);
+        }
+        m_batches.clear();
+        vkDestroyCommandPool(m_device, m_commandPool, m_callbacks);
+    }
+
+  private:
+    static constexpr size_t NO_BATCH = SIZE_MAX;
+
+    struct Batch {
+        VkCommandBuffer commandBuffer;
+        VkFence fence;
+        uint64_t value; /// 0 until it's submitted
+    };
+
+    /// takes a finished batch or makes a new one
+    void begin()
+    {
+        m_open = m_batches.size();
+        for (size_t i = 0; i < m_batches.size(); i++)
+        {
+            if (m_batches[i].value != 0
+                && vkGetFenceStatus(m_device, m_batches[i].fence)
+                       == VK_SUCCESS)
+            {
+                m_open = i;
+                break;
+            }
+        }
+        if (m_open == m_batches.size())
+        {
+            Batch batch{};
+            VkCommandBufferAllocateInfo allocInfo{};
+            allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+            allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+            allocInfo.commandPool = m_commandPool;
+            allocInfo.commandBufferCount = 1;
+            VkFenceCreateInfo fenceInfo{};
+            fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+            vkAllocateCommandBuffers(
+                m_device, &allocInfo, &batch.commandBuffer);
+            if (vkCreateFence(
+                    m_device, &fenceInfo, m_callbacks, &batch.fence)
+                != VK_SUCCESS)
+            {
+                throw std::runtime_error("failed to create upload fence!");
+            }
+            m_batches.push_back(batch);
+        } else
+        {
+            // holders of the fence see the batch unfinished until this one is
+            vkResetFences(m_device, 1, &m_batches[m_open].fence);
+            vkResetCommandBuffer(m_batches[m_open].commandBuffer, 0);
+            m_batches[m_open].value = 0;
+        }
+
+        VkCommandBufferBeginInfo beginInfo{};
+        beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+        beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+        vkBeginCommandBuffer(m_batches[m_open].commandBuffer, &beginInfo);
+    }
+
+    VkDevice m_device = VK_NULL_HANDLE;
+    VkQueue m_queue = VK_NULL_HANDLE;
+    const VkAllocationCallbacks *m_callbacks = nullptr;
+    VkCommandPool m_commandPool = VK_NULL_HANDLE;
+    std::vector<Batch> m_batches;
+    size_t m_open = NO_BATCH; /// into m_batches
+    uint64_t m_submitted = 0; /// value of the last batch submitted
+};
+
+/**
+ * Frame times while a batch of another queue is in flight and while none
+ * is. The transfers overlap with the frames if both stay about the same,
+ * a copy that takes time from the frames shows as slower busy frames.
+ * */
+struct TransferOverlap {
+    uint64_t transfers = 0;
+    float lastTransfer = 0.0f; /// ms from submit until it was seen done
+    uint64_t busyFrames = 0;
+    double busySeconds = 0.0;
+    uint64_t idleFrames = 0;
+    double idleSeconds = 0.0;
+
+    void addFrame(double seconds, bool busy)
+    {
+        (busy ? busyFrames : idleFrames)++;
+        (busy ? busySeconds : idleSeconds) += seconds;
+    }
+
+    /// average frame time in ms while busy (or not)
+    double frameTime(bool busy) const
+    {
+        const uint64_t frames = busy ? busyFrames : idleFrames;
+        return frames == 0
+                   ? 0.0
+                   : (busy ? busySeconds : idleSeconds) * 1000.0 / frames;
+    }
+};
@@ -0,0 +1,296 @@
+#pragma once
+
+#include "data_types.h"
+#include "vertex_weld.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+/**
+ * Packing of the loaded Vertex array into CompactVertex for
+ * VertexLayout::Compact, see CompactVertex in data_types.h for the formats.
+ * */
+
+/// the box the unorm16 positions are relative to
+struct QuantizationBounds {
+    glm::vec3 min{0.0f};
+    glm::vec3 extent{1.0f};
+};
+
+static QuantizationBounds
+computeQuantizationBounds(const Vertex *meshVertices, size_t vertexCount)
+{
+    QuantizationBounds bounds;
+    if (vertexCount == 0)
+    {
+        return bounds;
+    }
+
+    glm::vec3 minPos = meshVertices[0].pos;
+    glm::vec3 maxPos = meshVertices[0].pos;
+    for (size_t i = 0; i < vertexCount; i++)
+    {
+        minPos = glm::min(minPos, meshVertices[i].pos);
+        maxPos = glm::max(maxPos, meshVertices[i].pos);
+    }
+
+    bounds.min = minPos;
+    // flat meshes still need a non zero scale to divide by
+    bounds.extent = glm::max(maxPos - minPos, glm::vec3(1e-6f));
+    return bounds;
+}
+
+/// the box around both, for meshes that share one vertex buffer
+static QuantizationBounds
+combineQuantizationBounds(const QuantizationBounds &a,
+                          const QuantizationBounds &b)
+{
+    QuantizationBounds bounds;
+    bounds.min = glm::min(a.min, b.min);
+    bounds.extent
+        = glm::max(a.min + a.extent, b.min + b.extent) - bounds.min;
+    return bounds;
+}
+
+/// maps the [0, 1] positions the vertex shader reads back into model space,
+/// goes to the right of the model matrix
+static glm::mat4
+dequantizationMatrix(const QuantizationBounds &bounds)
+{
+    glm::mat4 matrix = glm::translate(glm::mat4(1.0f), bounds.min);
+    return glm::scale(matrix, bounds.extent);
+}
+
+static inline uint16_t
+quantizeUnorm16(float value)
+{
+    value = std::min(std::max(value, 0.0f), 1.0f);
+    return static_cast<uint16_t>(value * 65535.0f + 0.5f);
+}
+
+static inline int16_t
+quantizeSnorm16(float value)
+{
+    value = std::min(std::max(value, -1.0f), 1.0f);
+    return static_cast<int16_t>(std::round(value * 32767.0f));
+}
+
+/// IEEE 754 binary16, round to nearest even
+static uint16_t
+floatToHalf(float value)
+{
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+
+    uint32_t sign = (bits >> 16) & 0x8000;
+    uint32_t exponent = (bits >> 23) & 0xFF;
+    uint32_t mantissa = bits & 0x7FFFFF;
+
+    if (exponent == 0xFF)
+    {
+        // inf stays inf, nan stays a (quiet) nan
+        return static_cast<uint16_t>(sign | 0x7C00 | (mantissa ? 0x200 : 0));
+    }
+
+    int halfExponent = int(exponent) - 127 + 15;
+    if (halfExponent >= 0x1F)
+    {
+        return static_cast<uint16_t>(sign | 0x7C00);
+    }
+    if (halfExponent <= 0)
+    {
+        // subnormal half or zero
+        if (halfExponent < -10)
+        {
+            return static_cast<uint16_t>(sign);
+        }
+        mantissa |= 0x800000;
+        uint32_t shift = static_cast<uint32_t>(14 - halfExponent);
+        uint32_t half = mantissa >> shift;
+        uint32_t rest = mantissa & ((1u << shift) - 1);
+        uint32_t halfway = 1u << (shift - 1);
+        if (rest > halfway || (rest == halfway && (half & 1)))
+        {
+            half++;
+        }
+        return static_cast<uint16_t>(sign | half);
+    }
+
+    uint32_t half = (uint32_t(halfExponent) << 10) | (mantissa >> 13);
+    uint32_t rest = mantissa & 0x1FFF;
+    if (rest > 0x1000 || (rest == 0x1000 && (half & 1)))
+    {
+        half++; // may carry into the exponent, which is still correct
+    }
+    return static_cast<uint16_t>(sign | half);
+}
+
+/**
+ * Octahedral normal encoding: the unit sphere is projected onto the
+ * octahedron |x| + |y| + |z| = 1 and the lower half is folded over the upper
+ * one, two snorm16 values keep the angular error far below what shading can
+ * show.
+ * */
+static void
+encodeOctahedral(glm::vec3 normal, int16_t out[2])
+{
+    float l1 = std::fabs(normal.x) + std::fabs(normal.y) + std::fabs(normal.z);
+    if (l1 == 0.0f)
+    {
+        out[0] = out[1] = 0;
+        return;
+    }
+    float x = normal.x / l1;
+    float y = normal.y / l1;
+    if (normal.z < 0.0f)
+    {
+        float foldedX = (1.0f - std::fabs(y)) * (x >= 0.0f ? 1.0f : -1.0f);
+        float foldedY = (1.0f - std::fabs(x)) * (y >= 0.0f ? 1.0f : -1.0f);
+        x = foldedX;
+        y = foldedY;
+    }
+    out[0] = quantizeSnorm16(x);
+    out[1] = quantizeSnorm16(y);
+}
+
+/**
+ * Area weighted vertex normals of one mesh from the triangles of its full
+ * level, the coarser levels use the same vertices. Vertices that only differ
+ * by their uv (the seam of the planet textures) get the normal of the shared
+ * position, so the seam doesn't show up in the shading.
+ * */
+static std::vector<glm::vec3>
+computeVertexNormals(const Vertex *meshVertices,
+                     size_t vertexCount,
+                     const uint32_t *meshIndices,
+                     size_t indexCount)
+{
+    std::vector<float> positions(vertexCount * 3);
+    for (size_t i = 0; i < vertexCount; i++)
+    {
+        positions[3 * i + 0] = meshVertices[i].pos.x;
+        positions[3 * i + 1] = meshVertices[i].pos.y;
+        positions[3 * i + 2] = meshVertices[i].pos.z;
+    }
+    std::vector<uint32_t> positionIds = equalValueIds(
+        positions.data(), vertexCount, 3, sharedThreadPool());
+
+    std::vector<glm::vec3> positionNormals(vertexCount, glm::vec3(0.0f));
+    for (size_t i = 0; i + 2 < indexCount; i += 3)
+    {
+        uint32_t v0 = meshIndices[i];
+        uint32_t v1 = meshIndices[i + 1];
+        uint32_t v2 = meshIndices[i + 2];
+        // the length of the cross product is twice the triangle area
+        glm::vec3 areaNormal
+            = glm::cross(meshVertices[v1].pos - meshVertices[v0].pos,
+                         meshVertices[v2].pos - meshVertices[v0].pos);
+        positionNormals[positionIds[v0]] += areaNormal;
+        positionNormals[positionIds[v1]] += areaNormal;
+        positionNormals[positionIds[v2]] += areaNormal;
+    }
+
+    std::vector<glm::vec3> normals(vertexCount);
+    for (size_t i = 0; i < vertexCount; i++)
+    {
+        glm::vec3 normal = positionNormals[positionIds[i]];
+        float length = glm::length(normal);
+        normals[i] = length > 0.0f ? normal / length : glm::vec3(0.0f);
+    }
+    return normals;
+}
+
+/// unorm16 covers the uvs exactly if they are all in [0, 1], snorm16 with
+/// half the precision if they are in [-1, 1] (generated spheres continue u
+/// past the seam)
+static VkFormat
+compactTexCoordFormat(const Vertex *meshVertices, size_t vertexCount)
+{
+    glm::vec2 minTexCoord(0.0f), maxTexCoord(1.0f);
+    for (size_t i = 0; i < vertexCount; i++)
+    {
+        minTexCoord = glm::min(minTexCoord, meshVertices[i].texCoord);
+        maxTexCoord = glm::max(maxTexCoord, meshVertices[i].texCoord);
+    }
+
+    if (minTexCoord.x >= 0.0f && minTexCoord.y >= 0.0f
+        && maxTexCoord.x <= 1.0f && maxTexCoord.y <= 1.0f)
+    {
+        return VK_FORMAT_R16G16_UNORM;
+    }
+    if (minTexCoord.x >= -1.0f && minTexCoord.y >= -1.0f
+        && maxTexCoord.x <= 1.0f && maxTexCoord.y <= 1.0f)
+    {
+        return VK_FORMAT_R16G16_SNORM;
+    }
+    return VK_FORMAT_R16G16_SFLOAT;
+}
+
+/// the format that covers the uvs of both, unorm16 < snorm16 < half
+static VkFormat
+combineTexCoordFormats(VkFormat a, VkFormat b)
+{
+    if (a == VK_FORMAT_R16G16_SFLOAT || b == VK_FORMAT_R16G16_SFLOAT)
+    {
+        return VK_FORMAT_R16G16_SFLOAT;
+    }
+    if (a == VK_FORMAT_R16G16_SNORM || b == VK_FORMAT_R16G16_SNORM)
+    {
+        return VK_FORMAT_R16G16_SNORM;
+    }
+    return VK_FORMAT_R16G16_UNORM;
+}
+
+/// packs count vertices into packed, which can be mapped memory as it is
+/// only written
+static void
+packCompactVertices(const Vertex *meshVertices,
+                    const glm::vec3 *normals,
+                    size_t count,
+                    const QuantizationBounds &bounds,
+                    VkFormat texCoordFormat,
+                    CompactVertex *packed)
+{
+    const glm::vec3 invExtent = 1.0f / bounds.extent;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        const Vertex &vertex = meshVertices[i];
+        CompactVertex out;
+
+        glm::vec3 relative = (vertex.pos - bounds.min) * invExtent;
+        out.pos[0] = quantizeUnorm16(relative.x);
+        out.pos[1] = quantizeUnorm16(relative.y);
+        out.pos[2] = quantizeUnorm16(relative.z);
+        out.pos[3] = 0;
+
+        encodeOctahedral(normals[i], out.normal);
+
+        if (texCoordFormat == VK_FORMAT_R16G16_UNORM)
+        {
+            out.texCoord[0] = quantizeUnorm16(vertex.texCoord.x);
+            out.texCoord[1] = quantizeUnorm16(vertex.texCoord.y);
+        } else if (texCoordFormat == VK_FORMAT_R16G16_SNORM)
+        {
+            int16_t u = quantizeSnorm16(vertex.texCoord.x);
+            int16_t v = quantizeSnorm16(vertex.texCoord.y);
+            memcpy(&out.texCoord[0], &u, sizeof(u));
+            memcpy(&out.texCoord[1], &v, sizeof(v));
+        } else
+        {
+            out.texCoord[0] = floatToHalf(vertex.texCoord.x);
+            out.texCoord[1] = floatToHalf(vertex.texCoord.y);
+        }
+        packed[i] = out;
+    }
+}
+
+/// 16 bit indices reach every vertex of meshes up to this size
+static inline bool
+fitsUint16Indices(uint32_t vertexCount)
+{
+    return vertexCount <= 65536;
+}
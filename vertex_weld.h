@@ -0,0 +1,403 @@
+#pragma once
+
+#include "data_types.h"
+#include "thread_pool.h"
+
+#include "includeLibs/tiny_obj_loader.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * Vertex deduplication ("welding") of the triangulated OBJ corners into the
+ * Vertex/index arrays we upload.
+ *
+ * weldVerticesSorted() builds a 64bit key per corner, radix sorts the keys on
+ * the thread pool and emits vertices and indices from the sorted runs. It
+ * produces exactly the same arrays as the old unordered_map path
+ * (weldVerticesHashMap(), kept for the --bench-weld comparison): vertices are
+ * numbered in the order they are first referenced and two corners share a
+ * vertex iff their Vertex values compare equal.
+ * */
+
+/**
+ * Stable LSD radix sort of keys with values carried along, 11 bits per pass.
+ * Only the bits up to the highest bit set in any key are sorted and passes
+ * where all keys have the same digit are skipped, so small keys only pay for
+ * the bits they actually use. Every pass counts digits per block in parallel
+ * and scatters per block in parallel, the blocks keep their order which makes
+ * the sort stable.
+ * */
+static void
+radixSortPairs(std::vector<uint64_t> &keys,
+               std::vector<uint32_t> &values,
+               ThreadPool &pool = sharedThreadPool())
+{
+    const size_t count = keys.size();
+    if (count < 2)
+    {
+        return;
+    }
+
+    const size_t minBlockSize = 64 * 1024;
+    const size_t blockCount = std::max<size_t>(
+        1, std::min(pool.threadCount() * 2, count / minBlockSize));
+    auto blockBegin = [&](size_t block) { return count * block / blockCount; };
+
+    // 2048 buckets still fit into L1 and need a pass less than 8 bit digits
+    // for the 40-48 bit keys the welding produces
+    const int digitBits = 11;
+    const size_t digitCount = size_t(1) << digitBits;
+    const uint64_t digitMask = digitCount - 1;
+
+    std::vector<uint64_t> blockBits(blockCount, 0);
+    pool.parallelFor(blockCount, [&](size_t block) {
+        for (size_t i = blockBegin(block); i < blockBegin(block + 1); i++)
+        {
+            blockBits[block] |= keys[i];
+        }
+    });
+    uint64_t usedBits = 0;
+    for (uint64_t bits : blockBits)
+    {
+        usedBits |= bits;
+    }
+
+    std::vector<uint64_t> keysTmp(count);
+    std::vector<uint32_t> valuesTmp(count);
+    std::vector<std::vector<size_t>> histograms(
+        blockCount, std::vector<size_t>(digitCount));
+
+    for (int shift = 0; shift < 64 && (usedBits >> shift) != 0;
+         shift += digitBits)
+    {
+        pool.parallelFor(blockCount, [&](size_t block) {
+            auto &histogram = histograms[block];
+            std::fill(histogram.begin(), histogram.end(), 0);
+            for (size_t i = blockBegin(block); i < blockBegin(block + 1); i++)
+            {
+                histogram[(keys[i] >> shift) & digitMask]++;
+            }
+        });
+
+        // offsets ordered by digit first and block second
+        size_t offset = 0;
+        bool trivialPass = false;
+        for (size_t digit = 0; digit < digitCount; digit++)
+        {
+            size_t total = 0;
+            for (size_t block = 0; block < blockCount; block++)
+            {
+                size_t blockDigitCount = histograms[block][digit];
+                histograms[block][digit] = offset;
+                offset += blockDigitCount;
+                total += blockDigitCount;
+            }
+            if (total == count)
+            {
+                trivialPass = true;
+                break;
+            }
+        }
+        if (trivialPass)
+        {
+            continue;
+        }
+
+        pool.parallelFor(blockCount, [&](size_t block) {
+            auto &offsets = histograms[block];
+            for (size_t i = blockBegin(block); i < blockBegin(block + 1); i++)
+            {
+                size_t dst = offsets[(keys[i] >> shift) & digitMask]++;
+                keysTmp[dst] = keys[i];
+                valuesTmp[dst] = values[i];
+            }
+        });
+        keys.swap(keysTmp);
+        values.swap(valuesTmp);
+    }
+}
+
+/// float bits for equality keys, +0 and -0 compare equal so they get one key
+static inline uint64_t
+floatKey(float value)
+{
+    if (value == 0.0f)
+    {
+        return 0;
+    }
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return bits;
+}
+
+/**
+ * Gives every element an id so that two elements get the same id iff all of
+ * their components are equal. Sorts the element indices by their component
+ * bits, components are 32bit so they are sorted pairwise, least significant
+ * pair first.
+ * */
+static std::vector<uint32_t>
+equalValueIds(const float *data,
+              size_t elementCount,
+              size_t components,
+              ThreadPool &pool)
+{
+    std::vector<uint64_t> keys(elementCount);
+    std::vector<uint32_t> order(elementCount);
+    for (size_t i = 0; i < elementCount; i++)
+    {
+        order[i] = static_cast<uint32_t>(i);
+    }
+
+    // least significant components first, for xyz: sort by z, then by x, y
+    for (size_t first = components % 2 == 0 ? components - 2 : components - 1;
+         first < components;
+         first -= 2)
+    {
+        bool pair = first + 1 < components;
+        for (size_t i = 0; i < elementCount; i++)
+        {
+            const float *element = data + components * order[i];
+            keys[i] = pair ? floatKey(element[first]) << 32
+                                 | floatKey(element[first + 1])
+                           : floatKey(element[first]);
+        }
+        radixSortPairs(keys, order, pool);
+    }
+
+    std::vector<uint32_t> ids(elementCount);
+    uint32_t id = 0;
+    for (size_t i = 0; i < elementCount; i++)
+    {
+        if (i > 0)
+        {
+            const float *a = data + components * order[i - 1];
+            const float *b = data + components * order[i];
+            for (size_t c = 0; c < components; c++)
+            {
+                if (floatKey(a[c]) != floatKey(b[c]))
+                {
+                    id++;
+                    break;
+                }
+            }
+        }
+        ids[order[i]] = id;
+    }
+    return ids;
+}
+
+static inline Vertex
+objCornerVertex(const tinyobj::attrib_t &attrib, const tinyobj::index_t &index)
+{
+    Vertex vertex{};
+    vertex.pos = {attrib.vertices[3 * index.vertex_index + 0],
+                  attrib.vertices[3 * index.vertex_index + 1],
+                  attrib.vertices[3 * index.vertex_index + 2]};
+
+    // The OBJ format assumes a coordinate system where a vertical coordinate
+    // of 0 means the bottom of the image, however we’ve uploaded our image
+    // into Vulkan in a top to bottom orientation where 0 means the top of the
+    // image
+    if (index.texcoord_index >= 0)
+    {
+        const float *uv = &attrib.texcoords[2 * index.texcoord_index];
+        vertex.texCoord = {uv[0], 1.0f - uv[1]};
+    } else
+    {
+        vertex.texCoord = {0.0f, 1.0f};
+    }
+    vertex.color = {1.0f, 1.0f, 1.0f};
+    return vertex;
+}
+
+/// the triangulated corners of all shapes, only copies if there is more than
+/// one shape
+static const std::vector<tinyobj::index_t> &
+objCorners(const std::vector<tinyobj::shape_t> &shapes,
+           std::vector<tinyobj::index_t> &storage)
+{
+    if (shapes.size() == 1)
+    {
+        return shapes.front().mesh.indices;
+    }
+    for (const auto &shape : shapes)
+    {
+        storage.insert(storage.end(),
+                       shape.mesh.indices.begin(),
+                       shape.mesh.indices.end());
+    }
+    return storage;
+}
+
+/**
+ * The original welding loop of loadModel(): one unordered_map lookup per
+ * corner. Only used as reference for the benchmark.
+ * */
+static void
+weldVerticesHashMap(const tinyobj::attrib_t &attrib,
+                    const std::vector<tinyobj::shape_t> &shapes,
+                    std::vector<Vertex> &meshVertices,
+                    std::vector<uint32_t> &meshIndices)
+{
+    // there are many duplicated verticies in the model
+    std::unordered_map<Vertex, uint32_t> uniqueVertices{};
+
+    // combine all faces in the file into a single model
+    for (const auto &shape : shapes)
+    {
+        for (const auto &index : shape.mesh.indices)
+        {
+            Vertex vertex = objCornerVertex(attrib, index);
+
+            if (uniqueVertices.count(vertex) == 0)
+            {
+                uniqueVertices[vertex]
+                    = static_cast<uint32_t>(meshVertices.size());
+                meshVertices.push_back(vertex);
+            }
+
+            meshIndices.push_back(uniqueVertices[vertex]);
+        }
+    }
+}
+
+/**
+ * Sort based welding, see the comment at the top of the file.
+ *
+ * Corners can only be equal if their positions and (flipped) uvs are equal,
+ * the color is the same for all of them. Positions and uvs are first mapped
+ * to ids of equal values, so the key of a corner fits into 64bit:
+ * positionId << uvBits | uvId, with uvBits just wide enough for the uv ids.
+ * After the stable sort the first corner of every run of equal keys is the
+ * one that is referenced first, a prefix sum over these "first" flags in
+ * corner order numbers the vertices the same way the hash map did.
+ * */
+static void
+weldVerticesSorted(const tinyobj::attrib_t &attrib,
+                   const std::vector<tinyobj::shape_t> &shapes,
+                   std::vector<Vertex> &meshVertices,
+                   std::vector<uint32_t> &meshIndices,
+                   ThreadPool &pool = sharedThreadPool())
+{
+    std::vector<tinyobj::index_t> cornerStorage;
+    const auto &corners = objCorners(shapes, cornerStorage);
+    const size_t cornerCount = corners.size();
+    meshVertices.clear();
+    meshIndices.clear();
+    if (cornerCount == 0)
+    {
+        return;
+    }
+
+    const size_t minBlockSize = 64 * 1024;
+    const size_t blockCount = std::max<size_t>(
+        1, std::min(pool.threadCount() * 2, cornerCount / minBlockSize));
+    auto blockBegin = [&](size_t block) {
+        return cornerCount * block / blockCount;
+    };
+
+    std::vector<uint32_t> positionIds
+        = equalValueIds(attrib.vertices.data(),
+                        attrib.vertices.size() / 3,
+                        3,
+                        pool);
+
+    // compare the uvs the way they end up in the vertex
+    std::vector<float> flippedTexcoords(attrib.texcoords.size());
+    for (size_t i = 0; i < flippedTexcoords.size(); i += 2)
+    {
+        flippedTexcoords[i] = attrib.texcoords[i];
+        flippedTexcoords[i + 1] = 1.0f - attrib.texcoords[i + 1];
+    }
+    std::vector<uint32_t> texcoordIds = equalValueIds(
+        flippedTexcoords.data(), flippedTexcoords.size() / 2, 2, pool);
+    const uint32_t noTexcoordId = static_cast<uint32_t>(texcoordIds.size());
+    int texcoordBits = 1;
+    while ((uint64_t(noTexcoordId) >> texcoordBits) != 0)
+    {
+        texcoordBits++;
+    }
+
+    std::vector<uint64_t> keys(cornerCount);
+    std::vector<uint32_t> order(cornerCount);
+    pool.parallelFor(blockCount, [&](size_t block) {
+        for (size_t i = blockBegin(block); i < blockBegin(block + 1); i++)
+        {
+            const auto &index = corners[i];
+            uint32_t texcoordId = index.texcoord_index >= 0
+                                      ? texcoordIds[index.texcoord_index]
+                                      : noTexcoordId;
+            keys[i] = uint64_t(positionIds[index.vertex_index]) << texcoordBits
+                      | texcoordId;
+            order[i] = static_cast<uint32_t>(i);
+        }
+    });
+
+    radixSortPairs(keys, order, pool);
+
+    // every corner points to the first corner with the same key
+    std::vector<uint32_t> firstCorner(cornerCount);
+    std::vector<uint8_t> isFirst(cornerCount, 0);
+    pool.parallelFor(blockCount, [&](size_t block) {
+        size_t i = blockBegin(block);
+        size_t end = blockBegin(block + 1);
+        // a run that started in the previous block belongs to that block
+        while (i > 0 && i < end && keys[i] == keys[i - 1])
+        {
+            i++;
+        }
+        while (i < end)
+        {
+            uint32_t first = order[i];
+            isFirst[first] = 1;
+            uint64_t key = keys[i];
+            for (; i < cornerCount && keys[i] == key; i++)
+            {
+                firstCorner[order[i]] = first;
+            }
+        }
+    });
+
+    // vertex number of the first corners, in corner order
+    std::vector<uint32_t> blockVertexCount(blockCount + 1, 0);
+    pool.parallelFor(blockCount, [&](size_t block) {
+        uint32_t vertexCount = 0;
+        for (size_t i = blockBegin(block); i < blockBegin(block + 1); i++)
+        {
+            vertexCount += isFirst[i];
+        }
+        blockVertexCount[block + 1] = vertexCount;
+    });
+    for (size_t block = 0; block < blockCount; block++)
+    {
+        blockVertexCount[block + 1] += blockVertexCount[block];
+    }
+
+    // keys and order aren't needed anymore, reuse order for the numbering
+    std::vector<uint32_t> &vertexId = order;
+    meshVertices.resize(blockVertexCount[blockCount]);
+    meshIndices.resize(cornerCount);
+    pool.parallelFor(blockCount, [&](size_t block) {
+        uint32_t next = blockVertexCount[block];
+        for (size_t i = blockBegin(block); i < blockBegin(block + 1); i++)
+        {
+            if (isFirst[i])
+            {
+                vertexId[i] = next;
+                meshVertices[next] = objCornerVertex(attrib, corners[i]);
+                next++;
+            }
+        }
+    });
+    pool.parallelFor(blockCount, [&](size_t block) {
+        for (size_t i = blockBegin(block); i < blockBegin(block + 1); i++)
+        {
+            meshIndices[i] = vertexId[firstCorner[i]];
+        }
+    });
+}